@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // For memmem() and REG_STARTEND used by grep_scan.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,28 +10,328 @@
 #include <sys/stat.h>
 #include <libgen.h>  // For handling file paths
 #include <unistd.h>  // For directory operations
+#include <fcntl.h>   // For openat() and O_DIRECTORY
+#include <errno.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include "delta.h"   // Block signatures for delta uploads
+#include "grep_scan.h"  // Parallel content search for the grep command
+#include "trigram_index.h"  // Persistent index for the search command
+#include "frame.h"   // CRC32C-checked framing for file transfers
+#include "sched.h"   // Fair-share scheduling of outgoing transfers
+#include "transport.h"  // Unix-domain sockets and descriptor passing to co-located sub-servers
+#include "admission.h"  // Admission control and load shedding
+#include "trace.h"   // Sampled request tracing in Chrome trace format
+#include "command.h"  // Request line parsing and opcodes
+#include "log.h"     // Asynchronous logging off the transfer path
+#include "pack.h"    // Segment store for small .c files
+#include "tar_stream.h"  // In-process tar archives for dtar .c
+#include "watch_feed.h"  // Change feed for the watch command
+#include "deadline.h"  // Header, idle and throughput deadlines for client connections
+#include "upload_session.h"  // Resumable chunked uploads for udeclare and uchunk
+#include "seekable.h"  // Compressed storage of .c files, sent as stored or decoded
+#include "single_flight.h"  // One shared reply for identical concurrent downloads
+#include "meta_snapshot.h"  // Metadata snapshot of the .c tree for display and dtar
 
 // Define constants for server communication
 #define PORT 50501
 #define BUFFER_SIZE 1024
 #define STEXT_IP "127.0.0.1"
 #define STEXT_PORT 50502
+#define STEXT_SOCKET_PATH "/tmp/stext.sock"  // Tried before TCP when Stext runs on this host
 #define SPDF_IP "127.0.0.1"
 #define SPDF_PORT 50503
+#define SPDF_SOCKET_PATH "/tmp/spdf.sock"
+#define DIR_CACHE_SIZE 16  // Number of open destination directories kept around
+#define WATCH_MAX_SUBSCRIBERS 64   // watch connections served at once
+#define WATCH_READY_WAIT_MS 1000   // How long the first watch waits for the sub-servers to subscribe
+#define WATCH_RECONNECT_MS 1000    // Pause before subscribing to a sub-server again
+#define WATCH_CLIENT_PATH "/home/{{user}}/smain/"  // Prefix of the paths in watch events
+
+// An open directory descriptor remembered by its absolute path
+struct dir_cache_entry {
+    char path[BUFFER_SIZE];
+    int fd;                    // -1 when the slot is unused
+    unsigned long last_used;   // Tick of the most recent lookup, for LRU eviction
+};
+
+static struct dir_cache_entry dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_cache_clock;
+static pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Outcome counters for checksummed transfers, reported by the stats command
+struct transfer_stats {
+    unsigned long long uploads_verified;
+    unsigned long long downloads_sent;
+    unsigned long long relays_verified;
+    unsigned long long descriptors_passed;
+    unsigned long long bytes_verified;
+    unsigned long long crc_mismatches;
+    unsigned long long truncated;
+    unsigned long long remote_errors;
+    unsigned long long not_modified;
+    unsigned long long sent_encoded;
+    unsigned long long upload_chunks;
+    unsigned long long upload_sessions;
+};
+
+static struct transfer_stats transfer_stats;
+#define TRANSFER_STAT_ADD(field, n) __atomic_fetch_add(&transfer_stats.field, (n), __ATOMIC_RELAXED)
+
+// Shared by every connection thread to divide outgoing bandwidth fairly
+static struct transfer_sched *transfer_sched;
+
+// Bounds the work in progress; shared by every connection thread
+static struct admission admission;
+
+// Reaps client connections that stall, so their threads go back to real work
+static struct deadline_wheel deadlines;
+
+// Small .c files kept in segment files instead of the tree (off unless built with PACK_MAX_FILE_SIZE)
+static struct pack_store pack;
+
+// Relative cost of each command for admission control, indexed by opcode. Commands whose reply
+// is a framed body report being busy with an error frame, the others with a text line. Commands
+// that change a tree stop requests from joining replies that were started before them.
+struct command_cost {
+    const char *name;
+    int cost;
+    int framed_reply;
+    int changes_tree;
+};
+
+static const struct command_cost command_costs[OP_COUNT] = {
+    [OP_UNKNOWN] = { "unknown command", 1, 0, 0 },
+    [OP_RMFILE] = { "rmfile", 1, 0, 1 },
+    [OP_STATS] = { "stats", 1, 0, 0 },
+    [OP_DFILE] = { "dfile", 2, 1, 0 },
+    [OP_UFILE] = { "ufile", 2, 0, 1 },
+    [OP_UDECLARE] = { "udeclare", 1, 0, 0 },
+    [OP_UCHUNK] = { "uchunk", 2, 0, 1 },
+    [OP_UDELTA] = { "udelta", 3, 0, 1 },
+    [OP_SEARCH] = { "search", 3, 0, 0 },
+    [OP_GREP] = { "grep", 4, 0, 0 },
+    [OP_DISPLAY] = { "display", 4, 0, 0 },
+    [OP_DTAR] = { "dtar", 8, 1, 0 },
+    [OP_UTAR] = { "utar", 8, 0, 1 },
+};
+
+// Identical dfile, dtar and display requests that are in progress at once share one reply
+static struct flight_table flights;
+
+// A request that may share its reply, as copied into its flight
+struct coalesced_request {
+    enum opcode op;
+    int accept_encoded;
+    int conditional;                          // dfile with if_none_match
+    char if_none_match[FRAME_VALIDATOR_MAX];
+    char argument[BUFFER_SIZE];               // The file, file type or path named
+};
+
+// The sub-servers that store .txt and .pdf files. Uploads of those files are relayed to them,
+// and their changes go into the watch feed over one NOTIFY connection each.
+struct sub_server {
+    const char *label;
+    const char *extension;
+    const char *socket_path;
+    const char *server_ip;
+    int server_port;
+};
+
+static const struct sub_server sub_servers[] = {
+    { "Stext", ".txt", STEXT_SOCKET_PATH, STEXT_IP, STEXT_PORT },
+    { "Spdf", ".pdf", SPDF_SOCKET_PATH, SPDF_IP, SPDF_PORT },
+};
+
+// Change feed for watch subscribers. It is started by the first watch request and then runs for
+// the life of the server, so that a subscriber that reconnects can pick up where it left off.
+static struct watch_feed watch_feed;
+static pthread_once_t watch_feed_once = PTHREAD_ONCE_INIT;
+static int watch_feed_started;
+static int watch_subscribers;     // Protected by watch_feed.lock
+static int watch_sources_ready;   // Sub-servers that have answered their first subscription, likewise
+
+
+#define INGEST_LANES 3           // utar writers: smain/, stext/ and spdf/
+#define INGEST_QUEUE_CHUNKS 32   // Chunks of an archive a utar lane can have waiting to be written
+
+// A member of a utar archive, from its header until its lane has stored it or given up on it
+struct ingest_member {
+    char *name;                  // As given in the archive
+    const char *path;            // Where it goes below the destination (points into name)
+    uint64_t size;
+    int stored;
+    uint32_t crc;
+    const char *error;           // Why it was not stored
+};
+
+enum ingest_chunk_kind { INGEST_DATA, INGEST_END, INGEST_ABORT };
+
+struct ingest_chunk {
+    struct ingest_member *member;
+    enum ingest_chunk_kind kind;
+    char *data;
+    size_t len;
+    const char *reason;          // Why an INGEST_ABORT member was given up
+};
+
+// The writer for one of smain/, stext/ and spdf/ during a utar request. Each lane has its own
+// thread, so members for different trees are written at the same time while the archive is
+// still arriving. The stext/ and spdf/ lanes hand their members to the sub-server, one PUT after
+// another over a connection they keep for the whole archive.
+struct ingest_lane {
+    const char *destination_path;
+    const struct sub_server *server;  // NULL for smain/, which is written here
+    int server_socket;           // -1 until the first member, or after the connection failed
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct ingest_chunk queue[INGEST_QUEUE_CHUNKS];
+    unsigned long head, tail;    // Chunks queued and taken
+    int closed;                  // Nothing more will be queued
+    pthread_t thread;
+    int started;
+};
+
+// The member a lane is writing
+struct ingest_file {
+    struct ingest_member *member;
+    const char *filename;
+    int dir_fd;
+    int file_fd;
+    char final_destination[BUFFER_SIZE];
+    char full_path[BUFFER_SIZE * 2];  // Below stext/ or spdf/ for a member handed to a sub-server
+    char temp_name[BUFFER_SIZE];
+    char pack_key[BUFFER_SIZE * 2];
+    int packable;
+    char *packed;                // Gathered for the pack store instead of written to a file
+    size_t packed_len;
+    struct frame_writer writer;  // Sends the member to the lane's sub-server instead
+    int relayed;
+    uint32_t crc;
+    const char *error;
+};
+
+// Where the utar parser is in the archive
+struct ingest_parser {
+    struct ingest_lane lanes[INGEST_LANES];
+    char header[TAR_BLOCK];
+    size_t header_len;
+    uint64_t data_left;          // Data of the current entry still to come
+    size_t pad_left;             // Then the padding to its last block
+    struct ingest_member *member;  // Member whose data is being routed, or NULL to skip it
+    struct ingest_lane *lane;
+    char meta_type;              // 'L' or 'x' while reading a long name or pax header
+    char meta[8192];
+    size_t meta_len;
+    char long_name[TAR_NAME_MAX];  // Name for the next member, from the entry before it
+    int ended;                   // End-of-archive block seen
+    struct ingest_member **members;
+    size_t count, cap;
+};
+
+// One sub-server's part of a dtar * archive
+struct member_source {
+    const char *name;
+    const char *filetype;
+    const char *socket_path;
+    const char *server_ip;
+    int server_port;
+    char request[64];           // Built by the requesting thread, which holds the trace tag
+    struct tar_stream *stream;  // Shared archive, with its lock set
+    pthread_t thread;
+    int started;
+    unsigned long long members;
+    char error[BUFFER_SIZE];    // Why this source failed, for the client
+};
+
+// A connection handed from the accept loop to its thread
+struct client_connection {
+    int sock;
+    struct sockaddr_in address;
+};
 
 // Function declarations for handling different commands
-void process_upload_file(const char *filename, const char *destination_path, int client_socket);
-void process_download_file(const char *filename, int client_socket);
+void process_upload_file(const char *filename, const char *destination_path, int client_socket, const char *received, size_t received_len);
+void relay_upload_to_sub_server(const struct sub_server *server, const char *filename, const char *destination_path,
+                                int client_socket, const char *received, size_t received_len);
+const struct sub_server *upload_sub_server(const char *filename);
+void upload_relative_path(const char *destination_path, const char *filename, char *relative, size_t relative_size);
+int send_put_request(int server_socket, const char *relative_path);
+int recv_reply_line(int sock, char *line, size_t line_size);
+void process_delta_upload(const char *filename, const char *destination_path, int client_socket);
+int fetch_delta_basis(const struct sub_server *server, const char *relative_path, off_t *size);
+void relay_delta_upload_to_sub_server(const struct sub_server *server, const char *filename, const char *destination_path, int client_socket);
+void process_archive_upload(const char *destination_path, int client_socket, const char *received, size_t received_len);
+void process_upload_declare(const char *filename, const char *destination_path, const char *size_text,
+                            const char *chunk_size_text, const char *crc_text, int client_socket);
+void process_upload_chunk(const char *id, const char *index_text, int client_socket, const char *received, size_t received_len);
+void commit_upload_session(struct upload_session *session, char *reply, size_t reply_size);
+void process_download_file(const char *filename, const char *if_none_match, int accept_encoded, int client_socket);
+int answer_conditional_download(const char *if_none_match, off_t size, const struct timespec *mtime, int client_socket);
 void process_remove_file(const char *filename, int client_socket);
+void remove_file_on_sub_server(const struct sub_server *server, const char *relative_path, int client_socket);
 void process_archive_request(const char *filetype, int client_socket);
-void transmit_file_to_client(const char *filepath, int client_socket);
-void fetch_file_from_sub_server(const char *filename, const char *server_ip, int server_port, int client_socket, const char *operation);
-void fetch_archive_from_sub_server(const char *filetype, const char *server_ip, int server_port, int client_socket);
+void process_full_archive_request(int client_socket);
+void *merge_sub_server_members(void *arg);
+int add_stored_c_files(struct tar_stream *stream);
+int transmit_open_file_to_client(int fd, off_t offset, off_t size, enum seekable_mode mode, const char *label, int client_socket, int sched_class);
+void fetch_file_from_sub_server(const char *filename, const char *if_none_match, int accept_encoded, const char *socket_path, const char *server_ip, int server_port, int client_socket, const char *operation);
+void fetch_archive_from_sub_server(const char *filetype, const char *socket_path, const char *server_ip, int server_port, int client_socket);
+int relay_verified_frames(int server_socket, int client_socket, int sched_class);
+int send_passed_descriptor(int server_socket, const char *label, const char *if_none_match, enum seekable_mode mode, int client_socket, int sched_class);
+void record_transfer_failure(const struct frame_reader *reader);
+void process_stats_request(int client_socket);
 void process_display_request(const char *pathname, int client_socket);
-void retrieve_and_combine_file_lists(const char *filetype, const char *server_ip, int server_port, int output_fd);
-void combine_and_send_file_list(const char *pathname, int client_socket);
+void retrieve_and_combine_file_lists(const char *filetype, const char *socket_path, const char *server_ip, int server_port, int output_fd);
+void combine_and_send_file_list(const char *pathname, int output_fd);
+void process_search_request(const char *command, const char *pattern_text, int client_socket);
+void note_index_change(const char *full_path, char op);
+void note_snapshot_change(const char *full_path, char op, int have_crc, uint32_t crc);
+void *reconcile_metadata(void *arg);
+void note_watch_change(const char *full_path, char op);
+void start_watch_feed(void);
+void *flush_watch_feed(void *arg);
+void *follow_sub_server_changes(void *arg);
+void process_watch_request(const char *since, int client_socket);
+void relative_to_tree(const char *full_path, size_t root_len, char *relative, size_t relative_size);
+int pack_path_for(const char *full_path, char *relative, size_t relative_size);
+size_t scan_packed_files(const struct grep_pattern *pattern, int client_socket, pthread_mutex_t *output_lock);
+void *handle_client_connection(void *arg);
+void dispatch_client_command(const struct command *command, int client_sock, const char *body, size_t body_len);
+int coalescing_key(const struct command *command, char *key, size_t key_size);
+void serve_coalesced_request(struct coalesced_request *request, const struct command *command, int client_sock);
+void run_coalesced_request(void *request, int sock);
+void reply_server_busy(int client_socket, int framed_reply, int retry_after_ms);
 
 int initialize_server_socket(int port);
+int path_has_parent_reference(const char *path);
+int open_directory_cached(const char *path);
+const char *resolve_upload_destination(const char *filename, const char *destination_path, char *final_destination, size_t final_destination_size);
+int open_upload_directory(const char *filename, const char *destination_path, int client_socket, char *final_destination, size_t final_destination_size);
+int commit_upload(int dir_fd, const char *temp_name, const char *filename, const char *full_path, const char *pack_key,
+                  const char *packed, size_t packed_len, uint32_t crc);
+int stored_file_exists(int dir_fd, const char *filename, const char *pack_key);
+int ingest_lane_for(const char *name, const char **error);
+const char *ingest_member_path(const char *name);
+int ingest_lane_push(struct ingest_lane *lane, struct ingest_member *member, enum ingest_chunk_kind kind,
+                     const char *data, size_t len, const char *reason);
+void ingest_file_begin(struct ingest_lane *lane, struct ingest_file *file, struct ingest_member *member);
+void ingest_file_write(struct ingest_file *file, const char *data, size_t len);
+void ingest_file_end(struct ingest_lane *lane, struct ingest_file *file, const char *reason);
+void ingest_relay_begin(struct ingest_lane *lane, struct ingest_file *file, const char *destination);
+int ingest_relay_end(struct ingest_lane *lane, struct ingest_file *file, const char **reason);
+void *ingest_lane_worker(void *arg);
+int ingest_feed(struct ingest_parser *parser, const char *data, size_t len);
+int open_in_upload_directory(int *dir_fd, const char *final_destination, const char *name, int flags);
+int write_all(int fd, const void *buf, size_t len);
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset);
+unsigned long next_temp_id(void);
+uint32_t peer_address(int sock);
+int send_block_signatures(int client_socket, const unsigned char *basis, uint32_t block_size, uint32_t block_count);
+int apply_delta_stream(int client_socket, int out_fd, const unsigned char *basis, uint32_t block_size, uint32_t block_count,
+                       uint64_t *literal_bytes, uint64_t *copied_blocks);
 
 // Set up a server socket and listen for incoming connections
 int initialize_server_socket(int port) {
@@ -39,7 +340,7 @@ int initialize_server_socket(int port) {
 
     // Create a socket file descriptor
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("Socket creation failed");
+        LOG_ERROR("Socket creation failed: %m\n");
         exit(EXIT_FAILURE);
     }
 
@@ -53,450 +354,2942 @@ int initialize_server_socket(int port) {
 
     // Bind the socket to the address and port
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Socket binding failed");
+        LOG_ERROR("Socket binding failed: %m\n");
         exit(EXIT_FAILURE);
     }
 
-    // Start listening for incoming connections
-    if (listen(server_fd, 10) < 0) {
-        perror("Socket listen failed");
+    // Start listening; overload is handled by admission control, so let bursts queue rather than drop
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        LOG_ERROR("Socket listen failed: %m\n");
         exit(EXIT_FAILURE);
     }
 
-    printf("Server initialized and listening on port %d\n", port);
+    LOG_INFO("Server initialized and listening on port %d\n", port);
     return server_fd;
 }
 
-// Handle the uploading of a file to the server
-void process_upload_file(const char *filename, const char *destination_path, int client_socket) {
-    char base_dir[BUFFER_SIZE];
-    
-    // Get the current working directory
-    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
-        perror("Failed to get current directory");
-        return;
+// Look up a directory in the cache, returning its slot index or -1
+static int dir_cache_find(const char *path) {
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].fd >= 0 && strcmp(dir_cache[i].path, path) == 0) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    printf("Processing upload: filename=%s, destination=%s\n", filename, destination_path);
-
-    char *ext = strrchr(filename, '.');
-    char target_dir[BUFFER_SIZE];
+// Drop a cached directory, e.g. after it was removed behind our back
+static void dir_cache_evict(int slot) {
+    close(dir_cache[slot].fd);
+    dir_cache[slot].fd = -1;
+    dir_cache[slot].path[0] = '\0';
+}
 
-    // Determine the appropriate target directory based on file extension
-    if (ext) {
-        if (strcmp(ext, ".txt") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/stext", base_dir);
-        } else if (strcmp(ext, ".pdf") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/spdf", base_dir);
-        } else if (strcmp(ext, ".c") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/smain", base_dir);
-        } else {
-            const char *error_message = "Unsupported file type.\n";
-            send(client_socket, error_message, strlen(error_message), 0);
-            fprintf(stderr, "Unsupported file type\n");
-            return;
+// Drop a cached directory and everything cached below it, which went away with it
+static void dir_cache_evict_tree(const char *path, size_t len) {
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].fd >= 0 && strncmp(dir_cache[i].path, path, len) == 0 &&
+            (dir_cache[i].path[len] == '\0' || dir_cache[i].path[len] == '/')) {
+            dir_cache_evict(i);
         }
-    } else {
-        const char *error_message = "File has no extension.\n";
-        send(client_socket, error_message, strlen(error_message), 0);
-        fprintf(stderr, "File has no extension\n");
-        return;
     }
+}
 
-    // Extract relative sub-directory from destination path
-    const char *sub_dir = destination_path + strlen("/home/{{user}}/smain");
-    if (*sub_dir == '/') sub_dir++;
-
-    // Create the final path for the file
-    char final_destination[BUFFER_SIZE];
-    snprintf(final_destination, sizeof(final_destination), "%s/%s", target_dir, sub_dir);
-
-    // Ensure the necessary directories exist
-    char command[512];
-    snprintf(command, sizeof(command), "mkdir -p %s", final_destination);
-    system(command);
+// Remember an open directory, closing the least recently used one if the cache is full
+static void dir_cache_insert(const char *path, int fd) {
+    int victim = 0;
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].fd < 0) {
+            victim = i;
+            break;
+        }
+        if (dir_cache[i].last_used < dir_cache[victim].last_used) {
+            victim = i;
+        }
+    }
+    if (dir_cache[victim].fd >= 0) {
+        dir_cache_evict(victim);
+    }
 
-    // Construct the full file path for storage
-    char full_path[512];
-    snprintf(full_path, sizeof(full_path), "%s/%s", final_destination, filename);
+    snprintf(dir_cache[victim].path, sizeof(dir_cache[victim].path), "%s", path);
+    dir_cache[victim].fd = fd;
+    dir_cache[victim].last_used = ++dir_cache_clock;
+}
 
-    // Open the file for writing
-    FILE *file = fopen(full_path, "wb");
-    if (!file) {
-        perror("Failed to open file for writing");
-        return;
+// Check whether a path has a ".." component
+int path_has_parent_reference(const char *path) {
+    for (const char *p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) return 1;
     }
+    return 0;
+}
 
-    // Receive the file content from the client and save it
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    while ((bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, file);
+// Open (creating as needed) the directory at an absolute path. Repeat lookups of the same path
+// are served from the cache; misses resume the walk from the deepest cached ancestor with
+// mkdirat()/openat(). Returns a descriptor of the caller's own (a dup of the cached one), which
+// the caller closes, so that another connection evicting the entry cannot pull it away.
+// Paths with ".." are refused: the cache is keyed by the path as written, so one would both
+// escape the tree and be cached under a name that is not where it points.
+int open_directory_cached(const char *path) {
+    static int initialized = 0;
+    if (path_has_parent_reference(path)) {
+        LOG_WARN("Refusing directory path with '..': %s\n", path);
+        errno = EINVAL;
+        return -1;
     }
 
-    fclose(file);
-    printf("File '%s' successfully saved at '%s'\n", filename, full_path);
-}
+    pthread_mutex_lock(&dir_cache_lock);
+    if (!initialized) {
+        for (int i = 0; i < DIR_CACHE_SIZE; i++) dir_cache[i].fd = -1;
+        initialized = 1;
+    }
 
-// Handle downloading a file from the server
-void process_download_file(const char *filename, int client_socket) {
-    char base_dir[BUFFER_SIZE];
-    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
-        perror("Failed to get current directory");
-        return;
+    int slot = dir_cache_find(path);
+    if (slot >= 0) {
+        dir_cache[slot].last_used = ++dir_cache_clock;
+        int fd = dup(dir_cache[slot].fd);
+        pthread_mutex_unlock(&dir_cache_lock);
+        return fd;
     }
 
-    char *ext = strrchr(filename, '.');
-    char target_dir[BUFFER_SIZE];
-    char filepath[BUFFER_SIZE];
+    // Walk from the deepest cached ancestor. If that ancestor was removed since it was cached,
+    // its descriptor still points at the dead directory and the walk fails with ENOENT (ESTALE
+    // on NFS): drop it and walk again from the next cached ancestor up, or from "/".
+    int current_fd = -1;
+    for (;;) {
+        size_t start_len = 0;
+        int start_fd = -1;
+        for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+            size_t len = strlen(dir_cache[i].path);
+            if (dir_cache[i].fd >= 0 && len > start_len && strncmp(dir_cache[i].path, path, len) == 0 && path[len] == '/') {
+                start_len = len;
+                start_fd = dir_cache[i].fd;
+            }
+        }
 
-    // Determine the appropriate directory based on file extension
-    if (ext) {
-        if (strcmp(ext, ".c") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/smain", base_dir);
-        } else if (strcmp(ext, ".txt") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/stext", base_dir);
-        } else if (strcmp(ext, ".pdf") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/spdf", base_dir);
+        if (start_fd >= 0) {
+            current_fd = dup(start_fd);
         } else {
-            const char *error_message = "Unsupported file type.\n";
-            send(client_socket, error_message, strlen(error_message), 0);
-            fprintf(stderr, "Unsupported file type\n");
-            return;
+            current_fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        pthread_mutex_unlock(&dir_cache_lock);
+        if (current_fd < 0) {
+            LOG_ERROR("Failed to open starting directory: %m\n");
+            return -1;
         }
 
-        // Extract the relative path and construct the full file path
-        const char *relative_path = filename + strlen("/home/{{user}}/smain");
-        if (*relative_path == '/') relative_path++;
-        snprintf(filepath, sizeof(filepath), "%s/%s", target_dir, relative_path);
+        // Create and descend into each remaining path component
+        char remaining[BUFFER_SIZE];
+        snprintf(remaining, sizeof(remaining), "%s", path + start_len);
+        char *saveptr;
+        const char *failed = NULL;
+        for (char *component = strtok_r(remaining, "/", &saveptr); component; component = strtok_r(NULL, "/", &saveptr)) {
+            if (strcmp(component, ".") == 0) continue;
+
+            if (mkdirat(current_fd, component, 0755) < 0 && errno != EEXIST) {
+                failed = "create";
+                break;
+            }
 
-        // Check if the file exists before attempting to send
-        if (access(filepath, F_OK) != 0) {
-            const char *error_message = "File not found.\n";
-            send(client_socket, error_message, strlen(error_message), 0);
-            fprintf(stderr, "File not found at '%s'\n", filepath);
-            return;
+            int next_fd = openat(current_fd, component, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (next_fd < 0) {
+                failed = "open";
+                break;
+            }
+            close(current_fd);
+            current_fd = next_fd;
         }
+        if (!failed) break;
+
+        int error = errno;
+        close(current_fd);
+        if (start_len == 0 || (error != ENOENT && error != ESTALE)) {
+            errno = error;
+            LOG_ERROR("Failed to %s directory: %m\n", failed);
+            return -1;
+        }
+        pthread_mutex_lock(&dir_cache_lock);
+        dir_cache_evict_tree(path, start_len);
+    }
 
-        // Send the file to the client
-        printf("Sending file: %s\n", filepath);
-        transmit_file_to_client(filepath, client_socket);
-        printf("File transfer completed for '%s'\n", filepath);
-    } else {
-        const char *error_message = "File has no extension.\n";
-        send(client_socket, error_message, strlen(error_message), 0);
-        fprintf(stderr, "File has no extension\n");
+    pthread_mutex_lock(&dir_cache_lock);
+    if (dir_cache_find(path) < 0) {
+        int cached_fd = dup(current_fd);
+        if (cached_fd >= 0) dir_cache_insert(path, cached_fd);
     }
+    pthread_mutex_unlock(&dir_cache_lock);
+    return current_fd;
 }
 
-// Handle file deletion on the server
-void process_remove_file(const char *filename, int client_socket) {
+// Work out the storage directory for an upload from the file extension and destination path.
+// Returns NULL on success, or the reason the file cannot be stored.
+const char *resolve_upload_destination(const char *filename, const char *destination_path, char *final_destination, size_t final_destination_size) {
     char base_dir[BUFFER_SIZE];
+    
+    // Get the current working directory
     if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
-        perror("Failed to get current directory");
-        return;
+        LOG_ERROR("Failed to get current directory: %m\n");
+        return "Server error.";
     }
 
-    char target_dir[BUFFER_SIZE];
-    char filepath[BUFFER_SIZE];
-
     char *ext = strrchr(filename, '.');
-    if (ext) {
-        if (strcmp(ext, ".c") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/smain", base_dir);
-        } else if (strcmp(ext, ".txt") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/stext", base_dir);
-        } else if (strcmp(ext, ".pdf") == 0) {
-            snprintf(target_dir, sizeof(target_dir), "%s/spdf", base_dir);
-        } else {
-            const char *error_message = "Unsupported file type.\n";
-            send(client_socket, error_message, strlen(error_message), 0);
-            fprintf(stderr, "Unsupported file type\n");
-            return;
-        }
-
-        // Extract the relative path and construct the full file path
-        const char *relative_path = filename + strlen("/home/{{user}}/smain");
-        if (*relative_path == '/') relative_path++;
-        snprintf(filepath, sizeof(filepath), "%s/%s", target_dir, relative_path);
+    char target_dir[BUFFER_SIZE + 8];
 
-        // Attempt to delete the file
-        if (remove(filepath) == 0) {
-            const char *success_message = "File deleted successfully.\n";
-            send(client_socket, success_message, strlen(success_message), 0);
-            printf("File '%s' deleted successfully\n", filepath);
-        } else {
-            perror("Failed to delete file");
-            const char *error_message = "Failed to delete file.\n";
-            send(client_socket, error_message, strlen(error_message), 0);
-        }
+    // Determine the appropriate target directory based on file extension
+    if (!ext) {
+        return "File has no extension.";
+    } else if (strcmp(ext, ".txt") == 0) {
+        snprintf(target_dir, sizeof(target_dir), "%s/stext", base_dir);
+    } else if (strcmp(ext, ".pdf") == 0) {
+        snprintf(target_dir, sizeof(target_dir), "%s/spdf", base_dir);
+    } else if (strcmp(ext, ".c") == 0) {
+        snprintf(target_dir, sizeof(target_dir), "%s/smain", base_dir);
     } else {
-        const char *error_message = "File has no extension.\n";
-        send(client_socket, error_message, strlen(error_message), 0);
-        fprintf(stderr, "File has no extension\n");
+        return "Unsupported file type.";
     }
-}
 
-// Handle requests to create and transmit tar files of specified file types
-void process_archive_request(const char *filetype, int client_socket) {
-    char base_dir[BUFFER_SIZE];
-    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
-        perror("Failed to get current directory");
-        return;
+    // Extract relative sub-directory from destination path
+    const char *sub_dir = destination_path + strlen("/home/{{user}}/smain");
+    if (*sub_dir == '/') sub_dir++;
+    if (path_has_parent_reference(sub_dir)) {
+        return "Invalid destination path.";
     }
 
-    char tar_path[BUFFER_SIZE];
-    char command[BUFFER_SIZE];
+    // Create the final path for the file
+    snprintf(final_destination, final_destination_size, "%s/%s", target_dir, sub_dir);
+    return NULL;
+}
 
-    // Create tar file based on the specified file type
-    if (strcmp(filetype, ".txt") == 0) {
-        snprintf(tar_path, sizeof(tar_path), "%s/stext/textfiles.tar", base_dir);
-        snprintf(command, sizeof(command), "find %s/stext -type f -name '*.txt' -print0 | tar --null -cvf %s --files-from=-", base_dir, tar_path);
-    } else if (strcmp(filetype, ".pdf") == 0) {
-        snprintf(tar_path, sizeof(tar_path), "%s/spdf/pdffiles.tar", base_dir);
-        snprintf(command, sizeof(command), "find %s/spdf -type f -name '*.pdf' -print0 | tar --null -cvf %s --files-from=-", base_dir, tar_path);
-    } else if (strcmp(filetype, ".c") == 0) {
-        snprintf(tar_path, sizeof(tar_path), "%s/smain/cfiles.tar", base_dir);
-        snprintf(command, sizeof(command), "find %s/smain -type f -name '*.c' -print0 | tar --null -cvf %s --files-from=-", base_dir, tar_path);
-    } else {
-        const char *error_message = "Unsupported file type for archive creation.\n";
-        send(client_socket, error_message, strlen(error_message), 0);
-        fprintf(stderr, "Unsupported file type for archive creation\n");
-        return;
+// Resolve the storage directory for an upload from the file extension and destination path.
+// Returns a directory fd for the caller to close, or -1 after reporting the error to the client.
+int open_upload_directory(const char *filename, const char *destination_path, int client_socket, char *final_destination, size_t final_destination_size) {
+    const char *error = resolve_upload_destination(filename, destination_path, final_destination, final_destination_size);
+    if (error) {
+        char message[BUFFER_SIZE];
+        snprintf(message, sizeof(message), "%s\n", error);
+        send(client_socket, message, strlen(message), 0);
+        LOG_WARN("%s", message);
+        return -1;
     }
 
-    printf("Running command: %s\n", command);
-    int result = system(command);
+    // Ensure the necessary directories exist
+    return open_directory_cached(final_destination);
+}
 
-    // Check if the tar file was successfully created and send it
-    if (result == 0 && access(tar_path, F_OK) == 0) {
-        transmit_file_to_client(tar_path, client_socket);
-        sleep(1);  // Ensure the file is not in use before deleting
-        if (remove(tar_path) == 0) {
-            printf("Successfully removed tar file '%s'\n", tar_path);
-        } else {
-            perror("Failed to remove tar file");
+// Open a file inside a cached upload directory, re-resolving the directory once if it
+// was removed since it was cached
+int open_in_upload_directory(int *dir_fd, const char *final_destination, const char *name, int flags) {
+    int file_fd = openat(*dir_fd, name, flags | O_CLOEXEC, 0644);
+    if (file_fd < 0 && (errno == ENOENT || errno == ESTALE)) {
+        pthread_mutex_lock(&dir_cache_lock);
+        int slot = dir_cache_find(final_destination);
+        if (slot >= 0) dir_cache_evict(slot);
+        pthread_mutex_unlock(&dir_cache_lock);
+        close(*dir_fd);
+        *dir_fd = open_directory_cached(final_destination);
+        if (*dir_fd >= 0) {
+            file_fd = openat(*dir_fd, name, flags | O_CLOEXEC, 0644);
         }
-        printf("Successfully created and sent tar file for %s files\n", filetype);
-    } else {
-        perror("Failed to create tar file");
-        const char *error_message = "Failed to create tar file.\n";
-        send(client_socket, error_message, strlen(error_message), 0);
     }
+    return file_fd;
 }
 
-// Send a file to the client over the socket
-void transmit_file_to_client(const char *filepath, int client_socket) {
-    FILE *file = fopen(filepath, "rb");
-    if (!file) {
-        perror("Failed to open file for reading");
-        return;
+// Write a whole buffer to a file descriptor
+int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
     }
+    return 0;
+}
 
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        send(client_socket, buffer, bytes_read, 0);
+// Write a whole buffer to a file descriptor at an offset
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
     }
+    return 0;
+}
 
-    fclose(file);
-    printf("File '%s' successfully transmitted\n", filepath);
+// Unique suffix for temporary files, as several connections may upload the same file at once
+unsigned long next_temp_id(void) {
+    static unsigned long temp_id;
+    return __atomic_add_fetch(&temp_id, 1, __ATOMIC_RELAXED);
 }
 
-// Retrieve and send a file from a sub-server
-void fetch_file_from_sub_server(const char *filename, const char *server_ip, int server_port, int client_socket, const char *operation) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in serv_addr = { .sin_family = AF_INET, .sin_port = htons(server_port) };
-    inet_pton(AF_INET, server_ip, &serv_addr.sin_addr);
+// IPv4 address of the connected peer in network order, used to key per-client rate limits
+uint32_t peer_address(int sock) {
+    struct sockaddr_in address;
+    socklen_t len = sizeof(address);
+    if (getpeername(tls_channel_network_fd(sock), (struct sockaddr *)&address, &len) != 0 || address.sin_family != AF_INET) {
+        return 0;
+    }
+    return address.sin_addr.s_addr;
+}
 
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Failed to connect to sub-server");
-        close(sock);
-        return;
+// Count a failed checksummed transfer by what went wrong
+void record_transfer_failure(const struct frame_reader *reader) {
+    if (reader->status == FRAME_CRC_MISMATCH || reader->status == FRAME_PROTOCOL_ERROR) {
+        TRANSFER_STAT_ADD(crc_mismatches, 1);
+    } else if (reader->status == FRAME_REMOTE_ERROR) {
+        TRANSFER_STAT_ADD(remote_errors, 1);
+    } else {
+        TRANSFER_STAT_ADD(truncated, 1);
     }
+}
 
-    char message[BUFFER_SIZE];
-    snprintf(message, sizeof(message), "%s %s", operation, basename((char *)filename));
-    send(sock, message, strlen(message), 0);
+// Handle the uploading of a file to the server. The body arrives as CRC32C-checked frames
+// (starting with any bytes that were read along with the command line) and is written under
+// a temporary name, which only replaces the target once the whole-file digest has matched.
+void process_upload_file(const char *filename, const char *destination_path, int client_socket, const char *received, size_t received_len) {
+    LOG_INFO("Processing upload: filename=%s, destination=%s\n", filename, destination_path);
 
-    char buffer[BUFFER_SIZE];
-    int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
-    if (bytes_received > 0) {
-        send(client_socket, buffer, bytes_received, 0);
+    // .txt and .pdf files are stored by their sub-servers
+    const struct sub_server *server = upload_sub_server(filename);
+    if (server) {
+        relay_upload_to_sub_server(server, filename, destination_path, client_socket, received, received_len);
+        return;
     }
 
-    close(sock);
-}
+    char final_destination[BUFFER_SIZE];
+    int dir_fd = open_upload_directory(filename, destination_path, client_socket, final_destination, sizeof(final_destination));
+    if (dir_fd < 0) {
+        return;
+    }
 
-// Retrieve and send an archive file from a sub-server
-void fetch_archive_from_sub_server(const char *filetype, const char *server_ip, int server_port, int client_socket) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in serv_addr = { .sin_family = AF_INET, .sin_port = htons(server_port) };
-    inet_pton(AF_INET, server_ip, &serv_addr.sin_addr);
+    // Construct the full file path for storage
+    char full_path[BUFFER_SIZE * 2];
+    snprintf(full_path, sizeof(full_path), "%s/%s", final_destination, filename);
 
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Failed to connect to sub-server");
-        close(sock);
+    // Small .c files are gathered in memory for the pack store; the temporary file is only
+    // created if the upload turns out to be too big to pack
+    char pack_key[BUFFER_SIZE * 2];
+    int packable = pack_path_for(full_path, pack_key, sizeof(pack_key));
+    int packing = packable;
+    char *packed = packing ? malloc(PACK_MAX_FILE_SIZE) : NULL;
+    size_t packed_len = 0;
+
+    // Otherwise receive into a temporary file next to the target
+    char temp_name[BUFFER_SIZE];
+    snprintf(temp_name, sizeof(temp_name), "%s.ufile.%d.%lu", filename, (int)getpid(), next_temp_id());
+    int file_fd = packing ? -1 : open_in_upload_directory(&dir_fd, final_destination, temp_name, O_WRONLY | O_CREAT | O_TRUNC);
+    char *buffer = malloc(FRAME_MAX_PAYLOAD);
+    if ((packing ? !packed : file_fd < 0) || !buffer) {
+        LOG_ERROR("Failed to open file for writing: %m\n");
+        const char *error_message = "Failed to store file.\n";
+        send(client_socket, error_message, strlen(error_message), MSG_NOSIGNAL);
+        if (file_fd >= 0) {
+            close(file_fd);
+            unlinkat(dir_fd, temp_name, 0);
+        }
+        if (dir_fd >= 0) close(dir_fd);
+        free(buffer);
+        free(packed);
         return;
     }
 
-    char message[BUFFER_SIZE];
-    snprintf(message, sizeof(message), "dtar %s", filetype);
-    send(sock, message, strlen(message), 0);
-
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        send(client_socket, buffer, bytes_received, 0);
+    // Receive the verified file content from the client and save it
+    struct frame_reader reader;
+    frame_reader_init(&reader, client_socket, received, received_len);
+    ssize_t bytes_received;
+    int write_failed = 0;
+    while ((bytes_received = frame_read(&reader, buffer)) > 0) {
+        if (packing && packed_len + bytes_received <= PACK_MAX_FILE_SIZE) {
+            memcpy(packed + packed_len, buffer, bytes_received);
+            packed_len += bytes_received;
+            continue;
+        }
+        if (packing) {
+            packing = 0;
+            file_fd = open_in_upload_directory(&dir_fd, final_destination, temp_name, O_WRONLY | O_CREAT | O_TRUNC);
+            if (file_fd < 0 || write_all(file_fd, packed, packed_len) < 0) {
+                LOG_ERROR("Failed to write file: %m\n");
+                write_failed = 1;
+            }
+        }
+        if (!write_failed && write_all(file_fd, buffer, bytes_received) < 0) {
+            LOG_ERROR("Failed to write file: %m\n");
+            write_failed = 1;
+        }
     }
+    if (file_fd >= 0) close(file_fd);
+    free(buffer);
 
-    close(sock);
+    int stored = 0;
+    if (bytes_received == 0 && !write_failed) {
+        stored = commit_upload(dir_fd, temp_name, filename, full_path, packable ? pack_key : NULL,
+                               packing ? packed : NULL, packed_len, reader.crc);
+    }
+    free(packed);
+
+    char reply[BUFFER_SIZE];
+    if (stored) {
+        TRANSFER_STAT_ADD(uploads_verified, 1);
+        TRANSFER_STAT_ADD(bytes_verified, reader.total);
+        snprintf(reply, sizeof(reply), "File uploaded and verified: %llu bytes, CRC32C %08x.\n",
+                 (unsigned long long)reader.total, reader.crc);
+        LOG_INFO("File '%s' successfully %s '%s' (CRC32C %08x)\n", filename, packing ? "packed as" : "saved at",
+                 full_path, reader.crc);
+    } else {
+        unlinkat(dir_fd, temp_name, 0);
+        if (bytes_received < 0) {
+            record_transfer_failure(&reader);
+            snprintf(reply, sizeof(reply), "Upload failed: %s.\n", frame_status_text(&reader));
+        } else {
+            snprintf(reply, sizeof(reply), "Upload failed: could not store file.\n");
+        }
+        LOG_ERROR("Upload of '%s' discarded: %s", filename, reply);
+    }
+    close(dir_fd);
+    send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
 }
 
-// Handle file list display requests by combining file lists from multiple servers
-void process_display_request(const char *pathname, int client_socket) {
-    FILE *temp_file = fopen("/tmp/file_list.txt", "w");
-    if (!temp_file) {
-        perror("Failed to create temporary file for file list");
+// Handle udeclare: open the resumable upload session for a file, creating it the first time the
+// file is declared, and tell the client which chunks it has yet to send. Declaring the file again
+// is how a client that lost its connection finds out what the server already holds. A session
+// that holds every chunk is committed there and then.
+void process_upload_declare(const char *filename, const char *destination_path, const char *size_text,
+                            const char *chunk_size_text, const char *crc_text, int client_socket) {
+    char reply[BUFFER_SIZE];
+    char *size_end, *chunk_end, *crc_end;
+    unsigned long long size = strtoull(size_text, &size_end, 10);
+    unsigned long chunk_size = strtoul(chunk_size_text, &chunk_end, 10);
+    unsigned long crc = strtoul(crc_text, &crc_end, 16);
+    const char *error;
+    if (*size_end || *chunk_end || *crc_end || chunk_size > UINT32_MAX || crc > UINT32_MAX) {
+        error = "malformed declaration";
+    } else {
+        error = upload_session_check(filename, destination_path, size, chunk_size);
+    }
+    if (error) {
+        snprintf(reply, sizeof(reply), "Upload failed: %s.\n", error);
+        send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
+        LOG_WARN("Upload session for '%s' refused: %s", filename, reply + strlen("Upload failed: "));
+        return;
+    }
+    char final_destination[BUFFER_SIZE];
+    if ((error = resolve_upload_destination(filename, destination_path, final_destination, sizeof(final_destination))) != NULL) {
+        snprintf(reply, sizeof(reply), "%s\n", error);
+        send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
+        LOG_WARN("%s", reply);
         return;
     }
 
-    combine_and_send_file_list(pathname, fileno(temp_file));
-
-    fclose(temp_file);
-
-    temp_file = fopen("/tmp/file_list.txt", "r");
-    if (!temp_file) {
-        perror("Failed to open temporary file for reading");
+    upload_session_sweep();
+    struct upload_session session;
+    if (upload_session_declare(&session, filename, destination_path, size, chunk_size, crc) < 0) {
+        LOG_ERROR("Failed to open upload session for '%s': %m\n", filename);
+        const char *error_message = "Upload failed: could not open upload session.\n";
+        send(client_socket, error_message, strlen(error_message), MSG_NOSIGNAL);
         return;
     }
+    uint32_t held = upload_session_held(&session), chunks = session.header->chunks;
+    if (held == chunks && upload_session_claim(&session)) {
+        commit_upload_session(&session, reply, sizeof(reply));
+    } else {
+        char missing[BUFFER_SIZE / 2];
+        upload_session_missing(&session, missing, sizeof(missing));
+        snprintf(reply, sizeof(reply), "Upload session %s: %u of %u chunks held; missing %s.\n", session.id, held, chunks, missing);
+        LOG_INFO("Upload session %s for '%s' in %s: %u of %u chunks held\n", session.id, filename, destination_path, held, chunks);
+    }
+    upload_session_close(&session);
+    send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
+}
 
-    char line[BUFFER_SIZE];
-    while (fgets(line, sizeof(line), temp_file)) {
-        send(client_socket, line, strlen(line), 0);
+// Handle uchunk: receive one chunk of a resumable upload, as CRC32C-checked frames, into its place
+// in the session's data file. A chunk the session already holds is read but not written again.
+// The chunk that completes the session commits it, and its reply is then the whole upload's.
+void process_upload_chunk(const char *id, const char *index_text, int client_socket, const char *received, size_t received_len) {
+    char reply[BUFFER_SIZE];
+    struct upload_session session;
+    if (!upload_session_valid_id(id) || upload_session_open(&session, id) < 0) {
+        const char *error_message = "Upload failed: no such upload session.\n";
+        send(client_socket, error_message, strlen(error_message), MSG_NOSIGNAL);
+        return;
+    }
+    char *end;
+    unsigned long index = strtoul(index_text, &end, 10);
+    char *buffer = malloc(FRAME_MAX_PAYLOAD);
+    if (*end || index >= session.header->chunks || !buffer) {
+        snprintf(reply, sizeof(reply), "Chunk %s failed: %s.\n", index_text, buffer ? "no such chunk" : "server error");
+        send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
+        upload_session_close(&session);
+        free(buffer);
+        return;
     }
 
-    fclose(temp_file);
-    remove("/tmp/file_list.txt");
-    printf("File list successfully sent\n");
+    // Frames past the end of the chunk are still read, so the connection stays in step
+    uint32_t length = upload_session_chunk_length(&session, index);
+    off_t offset = (off_t)index * session.header->chunk_size;
+    int duplicate = upload_session_has(&session, index);
+    struct frame_reader reader;
+    frame_reader_init(&reader, client_socket, received, received_len);
+    ssize_t bytes_received;
+    int write_failed = 0;
+    while ((bytes_received = frame_read(&reader, buffer)) > 0) {
+        if (duplicate || write_failed || reader.total > length) continue;
+        if (pwrite_all(session.data_fd, buffer, bytes_received, offset + (off_t)(reader.total - bytes_received)) < 0) {
+            LOG_ERROR("Failed to write chunk %lu of upload session %s: %m\n", index, id);
+            write_failed = 1;
+        }
+    }
+    free(buffer);
+
+    int complete = 0;
+    if (bytes_received < 0) {
+        record_transfer_failure(&reader);
+        snprintf(reply, sizeof(reply), "Chunk %lu failed: %s.\n", index, frame_status_text(&reader));
+    } else if (reader.total != length) {
+        snprintf(reply, sizeof(reply), "Chunk %lu failed: expected %u bytes.\n", index, length);
+    } else if (write_failed || (!duplicate && (complete = upload_session_mark(&session, index, reader.crc)) < 0)) {
+        snprintf(reply, sizeof(reply), "Chunk %lu failed: could not store chunk.\n", index);
+    } else {
+        TRANSFER_STAT_ADD(upload_chunks, 1);
+        TRANSFER_STAT_ADD(bytes_verified, reader.total);
+        if (complete && upload_session_claim(&session)) {
+            commit_upload_session(&session, reply, sizeof(reply));
+        } else {
+            snprintf(reply, sizeof(reply), "Chunk %lu stored: %u of %u chunks held.\n", index,
+                     upload_session_held(&session), session.header->chunks);
+        }
+    }
+    upload_session_close(&session);
+    send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
 }
 
-// Fetch file lists from sub-servers and combine them into a single list
-void retrieve_and_combine_file_lists(const char *filetype, const char *server_ip, int server_port, int output_fd) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in serv_addr = {.sin_family = AF_INET, .sin_port = htons(server_port)};
-    inet_pton(AF_INET, server_ip, &serv_addr.sin_addr);
-
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Failed to connect to sub-server");
-        close(sock);
+// Move the data file of a session holding every chunk into place as ufile would have stored it:
+// a .c file into the tree here, a .txt or .pdf file to its sub-server with PUT. The session is
+// then removed, unless the sub-server could not be reached; declaring the file again retries the
+// commit. The caller must hold the session's claim. The client's reply is left in reply.
+void commit_upload_session(struct upload_session *session, char *reply, size_t reply_size) {
+    const struct upload_session_header *header = session->header;
+    if (!upload_session_verify(session)) {
+        TRANSFER_STAT_ADD(crc_mismatches, 1);
+        snprintf(reply, reply_size, "Upload failed: %s.\n", "CRC32C checksum mismatch");
+        LOG_ERROR("Upload session %s for '%s' discarded: chunks do not match the declared CRC32C\n", session->id, header->filename);
+        upload_session_remove(session->id);
         return;
     }
 
-    char message[BUFFER_SIZE];
-    snprintf(message, sizeof(message), "display %s", filetype);
-    send(sock, message, strlen(message), 0);
-
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        write(output_fd, buffer, bytes_received);
+    int stored = 0;
+    const struct sub_server *server = upload_sub_server(header->filename);
+    if (server) {
+        char relative_path[BUFFER_SIZE * 2];
+        upload_relative_path(header->destination, header->filename, relative_path, sizeof(relative_path));
+        int is_local;
+        int sock = transport_connect(server->socket_path, server->server_ip, server->server_port, &is_local);
+        struct frame_writer writer;
+        frame_writer_init(&writer, sock);
+        if (sock < 0 || send_put_request(sock, relative_path) < 0 || frame_write_file(&writer, session->data_fd, header->size) < 0 ||
+            frame_finish(&writer) < 0 || recv_reply_line(sock, reply, reply_size) < 0) {
+            LOG_ERROR("Failed to hand upload session %s to %s: %m\n", session->id, server->label);
+            snprintf(reply, reply_size, "Upload failed: sub-server unavailable.\n");
+            if (sock >= 0) close(sock);
+            upload_session_release(session);
+            return;
+        }
+        close(sock);
+        stored = strncmp(reply, "File uploaded", strlen("File uploaded")) == 0;
+    } else {
+        char final_destination[BUFFER_SIZE], data_path[BUFFER_SIZE], temp_name[BUFFER_SIZE];
+        char full_path[BUFFER_SIZE * 2], pack_key[BUFFER_SIZE * 2];
+        const char *error = resolve_upload_destination(header->filename, header->destination, final_destination, sizeof(final_destination));
+        int dir_fd = error ? -1 : open_directory_cached(final_destination);
+        snprintf(full_path, sizeof(full_path), "%s/%s", final_destination, header->filename);
+        snprintf(temp_name, sizeof(temp_name), "%s.upload.%s", header->filename, session->id);
+        upload_session_data_path(session->id, data_path, sizeof(data_path));
+        int packable = pack_path_for(full_path, pack_key, sizeof(pack_key));
+        if (dir_fd >= 0 && renameat(AT_FDCWD, data_path, dir_fd, temp_name) == 0) {
+            stored = commit_upload(dir_fd, temp_name, header->filename, full_path, packable ? pack_key : NULL, NULL, 0, header->crc);
+            if (!stored) unlinkat(dir_fd, temp_name, 0);
+        }
+        if (dir_fd >= 0) close(dir_fd);
+        if (stored) {
+            snprintf(reply, reply_size, "File uploaded and verified: %llu bytes, CRC32C %08x.\n",
+                     (unsigned long long)header->size, header->crc);
+        } else {
+            snprintf(reply, reply_size, "Upload failed: could not store file.\n");
+        }
     }
 
-    close(sock);
+    if (stored) {
+        TRANSFER_STAT_ADD(uploads_verified, 1);
+        TRANSFER_STAT_ADD(upload_sessions, 1);
+        LOG_INFO("Upload session %s committed: '%s' in %s (%llu bytes, CRC32C %08x)\n", session->id, header->filename,
+                 header->destination, (unsigned long long)header->size, header->crc);
+    } else {
+        LOG_ERROR("Upload session %s for '%s' discarded: %s", session->id, header->filename, reply);
+    }
+    upload_session_remove(session->id);
 }
 
-// Combine file lists from different servers and send them to the client
-void combine_and_send_file_list(const char *pathname, int client_socket) {
-    char command[BUFFER_SIZE];
-    FILE *temp_file = fopen("/tmp/file_list.txt", "w+");
-
-    if (!temp_file) {
-        perror("Failed to create temporary file for file list");
+// Stream a .txt or .pdf upload through to the sub-server that stores it. Each frame is checked
+// on its way past and forwarded as soon as it has arrived, so nothing is staged here; the reply
+// the client gets is the sub-server's own, sent once it has verified and committed the file.
+void relay_upload_to_sub_server(const struct sub_server *server, const char *filename, const char *destination_path,
+                                int client_socket, const char *received, size_t received_len) {
+    char relative_path[BUFFER_SIZE * 2];
+    upload_relative_path(destination_path, filename, relative_path, sizeof(relative_path));
+
+    int is_local;
+    uint64_t connect_started = trace_now_us();
+    int sock = transport_connect(server->socket_path, server->server_ip, server->server_port, &is_local);
+    trace_span("connect to sub-server", connect_started);
+    unsigned char *raw = sock >= 0 ? malloc(FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD) : NULL;
+    if (!raw || send_put_request(sock, relative_path) < 0) {
+        LOG_ERROR("Failed to hand upload of '%s' to %s: %m\n", relative_path, server->label);
+        const char *error_message = "Upload failed: sub-server unavailable.\n";
+        send(client_socket, error_message, strlen(error_message), MSG_NOSIGNAL);
+        if (sock >= 0) close(sock);
+        free(raw);
         return;
     }
 
-    // List .c files and append to the temp file
-    snprintf(command, sizeof(command), "find %s -type f -name '*.c' -exec basename {} \\;", pathname);
-    FILE *pipe = popen(command, "r");
-    if (!pipe) {
-        perror("Failed to list .c files");
-        fclose(temp_file);
-        return;
+    struct frame_reader reader;
+    frame_reader_init(&reader, client_socket, received, received_len);
+    ssize_t result;
+    size_t raw_len = 0;
+    int forward_failed = 0;
+    uint64_t relay_started = trace_now_us();
+    do {
+        result = frame_read_raw(&reader, NULL, raw, &raw_len);
+        if (result < 0) break;
+        struct iovec iov = { raw, raw_len };
+        forward_failed = frame_sendv(sock, &iov, 1) < 0;
+    } while (result > 0 && !forward_failed);
+    trace_span("relay to sub-server", relay_started);
+    free(raw);
+
+    char reply[BUFFER_SIZE];
+    if (result < 0) {
+        // Have the sub-server discard what it has received of the file
+        frame_write_error(sock, "Upload abandoned.");
+        record_transfer_failure(&reader);
+        snprintf(reply, sizeof(reply), "Upload failed: %s.\n", frame_status_text(&reader));
+    } else if (forward_failed || recv_reply_line(sock, reply, sizeof(reply)) < 0) {
+        snprintf(reply, sizeof(reply), "Upload failed: sub-server unavailable.\n");
     }
+    close(sock);
 
-    char line[BUFFER_SIZE];
-    while (fgets(line, sizeof(line), pipe)) {
-        fprintf(temp_file, "%s", line);
+    if (strncmp(reply, "File uploaded", strlen("File uploaded")) == 0) {
+        TRANSFER_STAT_ADD(uploads_verified, 1);
+        TRANSFER_STAT_ADD(bytes_verified, reader.total);
+        LOG_INFO("File '%s' stored by %s (CRC32C %08x)\n", relative_path, server->label, reader.crc);
+    } else {
+        LOG_ERROR("Upload of '%s' to %s discarded: %s", relative_path, server->label, reply);
+    }
+    send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
+}
+
+// The sub-server that stores a file, from its extension, or NULL if Smain stores it itself
+const struct sub_server *upload_sub_server(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    for (size_t i = 0; ext && i < sizeof(sub_servers) / sizeof(sub_servers[0]); i++) {
+        if (strcmp(ext, sub_servers[i].extension) == 0) return &sub_servers[i];
     }
-    pclose(pipe);
+    return NULL;
+}
 
-    // Append .pdf and .txt file lists from sub-servers
-    fseek(temp_file, 0, SEEK_END);
-    retrieve_and_combine_file_lists("pdf", SPDF_IP, SPDF_PORT, fileno(temp_file));
-    fseek(temp_file, 0, SEEK_END);
-    retrieve_and_combine_file_lists("txt", STEXT_IP, STEXT_PORT, fileno(temp_file));
+// Path of an upload below its sub-server's storage directory, as resolve_upload_destination()
+// would place it below stext/ or spdf/
+void upload_relative_path(const char *destination_path, const char *filename, char *relative, size_t relative_size) {
+    const char *sub_dir = destination_path + strlen("/home/{{user}}/smain");
+    if (*sub_dir == '/') sub_dir++;
+    snprintf(relative, relative_size, "%s%s%s", sub_dir, *sub_dir ? "/" : "", filename);
+}
 
-    // Send the combined list to the client
-    rewind(temp_file);
-    while (fgets(line, sizeof(line), temp_file)) {
-        if (send(client_socket, line, strlen(line), 0) == -1) {
-            break;
+// Ask a sub-server to store the framed file that follows
+int send_put_request(int server_socket, const char *relative_path) {
+    char message[BUFFER_SIZE * 3];
+    int len = snprintf(message, sizeof(message), "PUT %s%s\n", relative_path, trace_tag());
+    if (len >= (int)sizeof(message)) return -1;
+    struct iovec iov = { message, len };
+    return frame_sendv(server_socket, &iov, 1);
+}
+
+// Receive a sub-server's one-line reply, newline included. Returns -1 if the connection closed
+// before the line was complete.
+int recv_reply_line(int sock, char *line, size_t line_size) {
+    size_t len = 0;
+    while (len + 1 < line_size) {
+        ssize_t n = recv(sock, line + len, line_size - 1 - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len += n;
+        if (memchr(line + len - n, '\n', n)) break;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+// Make a fully received upload visible. A packed upload (packed non-NULL) replaces any loose
+// copy; otherwise the temporary file is compressed if it is large enough (see seekable.h),
+// renamed into place and replaces any packed copy of a packable file (pack_key non-NULL). Returns 1 if the file was stored.
+int commit_upload(int dir_fd, const char *temp_name, const char *filename, const char *full_path, const char *pack_key,
+                  const char *packed, size_t packed_len, uint32_t crc) {
+    // Replacing a stored file is a modification to watch subscribers, and nobody else asks
+    int existed = __atomic_load_n(&watch_feed_started, __ATOMIC_ACQUIRE) && stored_file_exists(dir_fd, filename, pack_key);
+    if (packed) {
+        if (pack_put(&pack, pack_key, packed, packed_len, crc) != 0) return 0;
+        if (unlinkat(dir_fd, filename, 0) == 0) {
+            note_index_change(full_path, '-');
+            note_snapshot_change(full_path, '-', 0, 0);
         }
+        note_watch_change(full_path, existed ? '~' : '+');
+        return 1;
     }
+    seekable_compress_at(dir_fd, temp_name);
+    if (renameat(dir_fd, temp_name, dir_fd, filename) != 0) return 0;
+    if (pack_key) pack_remove(&pack, pack_key);
+    note_index_change(full_path, '+');
+    note_snapshot_change(full_path, '+', 1, crc);
+    note_watch_change(full_path, existed ? '~' : '+');
+    return 1;
+}
 
-    fclose(temp_file);
-    printf("File list sent to client. Closing connection.\n");
-    close(client_socket);
+// Whether filename is already stored in dir_fd, loose or (for a packable file) packed
+int stored_file_exists(int dir_fd, const char *filename, const char *pack_key) {
+    if (faccessat(dir_fd, filename, F_OK, AT_SYMLINK_NOFOLLOW) == 0) return 1;
+    struct pack_location location;
+    if (!pack_key || pack_lookup(&pack, pack_key, &location) != 0) return 0;
+    close(location.fd);
+    return 1;
 }
 
-// Main function to run the server
-int main() {
-    int server_fd = initialize_server_socket(PORT);
+// Work out which utar lane stores a member, from its extension: 0 for .c, 1 for .txt, 2 for
+// .pdf, the same split as ufile. Returns -1 with the reason if it cannot be stored.
+int ingest_lane_for(const char *name, const char **error) {
+    const char *slash = strrchr(name, '/');
+    const char *ext = strrchr(slash ? slash + 1 : name, '.');
+    if (!ext) {
+        *error = "File has no extension.";
+        return -1;
+    }
+    if (strcmp(ext, ".c") == 0) return 0;
+    if (strcmp(ext, ".txt") == 0) return 1;
+    if (strcmp(ext, ".pdf") == 0) return 2;
+    *error = "Unsupported file type.";
+    return -1;
+}
 
-    while (1) {
-        struct sockaddr_in address;
-        int addrlen = sizeof(address);
-        int client_sock = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-        if (client_sock < 0) {
-            perror("Failed to accept connection");
-            continue;
+// The path below the destination for an archive member name. A leading "smain/", "stext/" or
+// "spdf/", as written by dtar *, is dropped so that such an archive restores the same layout.
+// Returns NULL for names that would leave the destination.
+const char *ingest_member_path(const char *name) {
+    while (strncmp(name, "./", 2) == 0) name += 2;
+    static const char *const trees[] = { "smain/", "stext/", "spdf/" };
+    for (size_t i = 0; i < sizeof(trees) / sizeof(trees[0]); i++) {
+        if (strncmp(name, trees[i], strlen(trees[i])) == 0) {
+            name += strlen(trees[i]);
+            break;
         }
+    }
+    if (*name == '\0' || *name == '/' || strlen(name) >= BUFFER_SIZE) return NULL;
+    if (path_has_parent_reference(name)) return NULL;
+    return name;
+}
 
-        char buffer[BUFFER_SIZE];
-        int bytes_read = recv(client_sock, buffer, BUFFER_SIZE, 0);
-        if (bytes_read > 0) {
-            buffer[bytes_read] = '\0';
-            char command[16], filename[BUFFER_SIZE], destination_path[BUFFER_SIZE];
-            printf("Received command: %s\n", buffer);
-
-            // Parse the command and execute the appropriate handler
-            if (sscanf(buffer, "%15s %1023s %1023s", command, filename, destination_path) == 3) {
-                if (strcmp(command, "ufile") == 0) {
-                    process_upload_file(filename, destination_path, client_sock);
-                } else {
-                    printf("Unsupported command: %s\n", command);
-                }
-            } else if (sscanf(buffer, "%15s %1023s", command, filename) == 2) {
-                if (strcmp(command, "dfile") == 0) {
-                    process_download_file(filename, client_sock);
-                } else if (strcmp(command, "rmfile") == 0) {
-                    process_remove_file(filename, client_sock);
-                } else if (strcmp(command, "dtar") == 0) {
-                    process_archive_request(filename, client_sock);
-                } else if (strcmp(command, "display") == 0) {
-                    process_display_request(filename, client_sock);
-                } else {
-                    printf("Unsupported command: %s\n", command);
+// Queue a chunk for a lane, waiting while the lane is INGEST_QUEUE_CHUNKS behind. data is copied.
+// Returns -1 if there was no memory for the copy.
+int ingest_lane_push(struct ingest_lane *lane, struct ingest_member *member, enum ingest_chunk_kind kind,
+                     const char *data, size_t len, const char *reason) {
+    char *copy = NULL;
+    if (len > 0) {
+        copy = malloc(len);
+        if (!copy) return -1;
+        memcpy(copy, data, len);
+    }
+    pthread_mutex_lock(&lane->lock);
+    while (lane->head - lane->tail == INGEST_QUEUE_CHUNKS) pthread_cond_wait(&lane->changed, &lane->lock);
+    lane->queue[lane->head % INGEST_QUEUE_CHUNKS] = (struct ingest_chunk){ member, kind, copy, len, reason };
+    lane->head++;
+    pthread_cond_broadcast(&lane->changed);
+    pthread_mutex_unlock(&lane->lock);
+    return 0;
+}
+
+// Start writing a member: into memory if it will be packed, otherwise into a temporary file
+// next to its target
+void ingest_file_begin(struct ingest_lane *lane, struct ingest_file *file, struct ingest_member *member) {
+    memset(file, 0, sizeof(*file));
+    file->member = member;
+    file->dir_fd = -1;
+    file->file_fd = -1;
+
+    const char *slash = strrchr(member->path, '/');
+    file->filename = slash ? slash + 1 : member->path;
+    char destination[BUFFER_SIZE * 2];
+    if (slash) snprintf(destination, sizeof(destination), "%s/%.*s", lane->destination_path, (int)(slash - member->path), member->path);
+    else snprintf(destination, sizeof(destination), "%s", lane->destination_path);
+    if (lane->server) {
+        ingest_relay_begin(lane, file, destination);
+        return;
+    }
+    file->error = resolve_upload_destination(file->filename, destination, file->final_destination, sizeof(file->final_destination));
+    if (file->error) return;
+    file->dir_fd = open_directory_cached(file->final_destination);
+    if (file->dir_fd < 0) {
+        file->error = "Could not create directory.";
+        return;
+    }
+
+    snprintf(file->full_path, sizeof(file->full_path), "%s/%s", file->final_destination, file->filename);
+    file->packable = pack_path_for(file->full_path, file->pack_key, sizeof(file->pack_key));
+    if (file->packable && member->size <= PACK_MAX_FILE_SIZE) {
+        file->packed = malloc(member->size ? member->size : 1);
+        if (!file->packed) file->error = "Server error.";
+        return;
+    }
+    snprintf(file->temp_name, sizeof(file->temp_name), "%s.utar.%d.%lu", file->filename, (int)getpid(), next_temp_id());
+    file->file_fd = open_in_upload_directory(&file->dir_fd, file->final_destination, file->temp_name, O_WRONLY | O_CREAT | O_TRUNC);
+    if (file->file_fd < 0) {
+        LOG_ERROR("Failed to open file for writing: %m\n");
+        file->error = "Failed to store file.";
+    }
+}
+
+void ingest_file_write(struct ingest_file *file, const char *data, size_t len) {
+    if (file->error) return;
+    file->crc = crc32c_update(file->crc, data, len);
+    if (file->relayed) {
+        if (frame_write(&file->writer, data, len) < 0) file->error = "Sub-server unavailable.";
+    } else if (file->packed) {
+        memcpy(file->packed + file->packed_len, data, len);
+        file->packed_len += len;
+    } else if (write_all(file->file_fd, data, len) < 0) {
+        LOG_ERROR("Failed to write file: %m\n");
+        file->error = "Failed to store file.";
+    }
+}
+
+// Finish a member: commit it if it arrived whole, otherwise drop what was written. reason is
+// NULL when the whole member arrived.
+void ingest_file_end(struct ingest_lane *lane, struct ingest_file *file, const char *reason) {
+    struct ingest_member *member = file->member;
+    if (file->file_fd >= 0) close(file->file_fd);
+    if (!reason) reason = file->error;
+    int stored = 0;
+    if (file->relayed) {
+        stored = ingest_relay_end(lane, file, &reason);
+    } else if (!reason) {
+        stored = commit_upload(file->dir_fd, file->temp_name, file->filename, file->full_path,
+                               file->packable ? file->pack_key : NULL, file->packed, file->packed_len, file->crc);
+        if (!stored) reason = "Failed to store file.";
+    }
+    if (!stored && file->dir_fd >= 0 && file->temp_name[0]) unlinkat(file->dir_fd, file->temp_name, 0);
+    if (file->dir_fd >= 0) close(file->dir_fd);
+    free(file->packed);
+
+    member->stored = stored;
+    member->crc = file->crc;
+    member->error = reason;
+    if (stored) {
+        LOG_DEBUG("Member '%s' %s '%s' (CRC32C %08x)\n", member->name, file->relayed ? "handed to sub-server as" : file->packed ? "packed as" : "saved at",
+                  file->full_path, file->crc);
+    } else {
+        LOG_WARN("Member '%s' not stored: %s\n", member->name, reason);
+    }
+    file->member = NULL;
+}
+
+// Start handing a member to the lane's sub-server, connecting for the first member and again
+// after a connection was given up
+void ingest_relay_begin(struct ingest_lane *lane, struct ingest_file *file, const char *destination) {
+    file->relayed = 1;
+    upload_relative_path(destination, file->filename, file->full_path, sizeof(file->full_path));
+    if (lane->server_socket < 0) {
+        int is_local;
+        lane->server_socket = transport_connect(lane->server->socket_path, lane->server->server_ip, lane->server->server_port, &is_local);
+    }
+    if (lane->server_socket < 0 || send_put_request(lane->server_socket, file->full_path) < 0) {
+        LOG_ERROR("Failed to hand member to %s: %m\n", lane->server->label);
+        file->error = "Sub-server unavailable.";
+        if (lane->server_socket >= 0) close(lane->server_socket);
+        lane->server_socket = -1;
+        return;
+    }
+    frame_writer_init(&file->writer, lane->server_socket);
+}
+
+// Finish a member handed to the sub-server: close its body and wait for the sub-server to commit
+// it, or make it discard an incomplete one. A connection left out of step is closed, for the
+// next member to open another. Returns 1 if the sub-server stored the member.
+int ingest_relay_end(struct ingest_lane *lane, struct ingest_file *file, const char **reason) {
+    if (lane->server_socket < 0) return 0;
+    char reply[BUFFER_SIZE];
+    if (!*reason && frame_finish(&file->writer) == 0 && recv_reply_line(lane->server_socket, reply, sizeof(reply)) == 0) {
+        if (strncmp(reply, "File uploaded", strlen("File uploaded")) == 0) return 1;
+        LOG_WARN("%s could not store '%s': %s", lane->server->label, file->full_path, reply);
+        *reason = "Failed to store file.";
+        return 0;
+    }
+    if (*reason) frame_write_error(lane->server_socket, "Upload abandoned.");
+    else *reason = "Sub-server unavailable.";
+    close(lane->server_socket);
+    lane->server_socket = -1;
+    return 0;
+}
+
+// Thread writing the members routed to one lane, in the order they arrive
+void *ingest_lane_worker(void *arg) {
+    struct ingest_lane *lane = arg;
+    struct ingest_file file = { .member = NULL };
+    while (1) {
+        pthread_mutex_lock(&lane->lock);
+        while (lane->head == lane->tail && !lane->closed) pthread_cond_wait(&lane->changed, &lane->lock);
+        if (lane->head == lane->tail) {
+            pthread_mutex_unlock(&lane->lock);
+            break;
+        }
+        struct ingest_chunk chunk = lane->queue[lane->tail % INGEST_QUEUE_CHUNKS];
+        lane->tail++;
+        pthread_cond_broadcast(&lane->changed);
+        pthread_mutex_unlock(&lane->lock);
+
+        if (file.member != chunk.member) ingest_file_begin(lane, &file, chunk.member);
+        if (chunk.kind == INGEST_DATA) {
+            ingest_file_write(&file, chunk.data, chunk.len);
+        } else {
+            ingest_file_end(lane, &file, chunk.kind == INGEST_ABORT ? chunk.reason : NULL);
+        }
+        free(chunk.data);
+    }
+    if (lane->server_socket >= 0) close(lane->server_socket);
+    return NULL;
+}
+
+// Hand the bytes of a parsed member's data to its lane
+static int ingest_route(struct ingest_parser *parser, enum ingest_chunk_kind kind, const char *data, size_t len, const char *reason) {
+    if (!parser->member) return 0;
+    if (ingest_lane_push(parser->lane, parser->member, kind, data, len, reason) < 0) {
+        ingest_lane_push(parser->lane, parser->member, INGEST_ABORT, NULL, 0, "Server error.");
+        parser->member = NULL;
+        return -1;
+    }
+    if (kind != INGEST_DATA) parser->member = NULL;
+    return 0;
+}
+
+// A new member header: record the member and pick its lane, or note why it is skipped
+static int ingest_start_member(struct ingest_parser *parser, const char *header, uint64_t size) {
+    if (parser->count == parser->cap) {
+        size_t cap = parser->cap ? parser->cap * 2 : 64;
+        struct ingest_member **grown = realloc(parser->members, cap * sizeof(*grown));
+        if (!grown) return -1;
+        parser->members = grown;
+        parser->cap = cap;
+    }
+    struct ingest_member *member = calloc(1, sizeof(*member));
+    if (!member) return -1;
+    parser->members[parser->count++] = member;
+
+    char name[TAR_NAME_MAX];
+    if (parser->long_name[0]) snprintf(name, sizeof(name), "%s", parser->long_name);
+    else tar_header_name(header, name, sizeof(name));
+    parser->long_name[0] = '\0';
+    member->name = strdup(name);
+    member->size = size;
+    if (!member->name) return -1;
+
+    char type = header[156];
+    int lane = -1;
+    if (type != '0' && type != '\0' && type != '7') {
+        member->error = "Not a regular file.";
+    } else if ((member->path = ingest_member_path(member->name)) == NULL) {
+        member->error = "Unsafe path.";
+    } else {
+        lane = ingest_lane_for(member->path, &member->error);
+    }
+    if (lane < 0) return 0;
+    if (!parser->lanes[lane].started) {
+        member->error = "Server error.";
+        return 0;
+    }
+    parser->member = member;
+    parser->lane = &parser->lanes[lane];
+    return size == 0 ? ingest_route(parser, INGEST_END, NULL, 0, NULL) : 0;
+}
+
+// Feed the next bytes of the archive. Returns -1 if it is not a tar archive or memory ran out.
+int ingest_feed(struct ingest_parser *parser, const char *data, size_t len) {
+    while (len > 0 && !parser->ended) {
+        if (parser->data_left > 0) {
+            size_t take = len < parser->data_left ? len : parser->data_left;
+            if (parser->member) {
+                if (ingest_route(parser, INGEST_DATA, data, take, NULL) < 0) return -1;
+            } else if (parser->meta_type) {
+                size_t room = sizeof(parser->meta) - 1 - parser->meta_len;
+                size_t keep = take < room ? take : room;
+                memcpy(parser->meta + parser->meta_len, data, keep);
+                parser->meta_len += keep;
+            }
+            data += take;
+            len -= take;
+            parser->data_left -= take;
+            if (parser->data_left > 0) continue;
+
+            if (parser->member && ingest_route(parser, INGEST_END, NULL, 0, NULL) < 0) return -1;
+            if (parser->meta_type == 'L') {
+                // A name longer than long_name is cut short here, and refused by ingest_member_path()
+                size_t name_len = parser->meta_len < sizeof(parser->long_name) - 1 ? parser->meta_len : sizeof(parser->long_name) - 1;
+                memcpy(parser->long_name, parser->meta, name_len);
+                parser->long_name[name_len] = '\0';
+            } else if (parser->meta_type == 'x') {
+                parser->meta[parser->meta_len] = '\0';
+                tar_pax_path(parser->meta, parser->meta_len, parser->long_name, sizeof(parser->long_name));
+            }
+            parser->meta_type = 0;
+            continue;
+        }
+        if (parser->pad_left > 0) {
+            size_t take = len < parser->pad_left ? len : parser->pad_left;
+            data += take;
+            len -= take;
+            parser->pad_left -= take;
+            continue;
+        }
+
+        size_t take = TAR_BLOCK - parser->header_len;
+        if (take > len) take = len;
+        memcpy(parser->header + parser->header_len, data, take);
+        parser->header_len += take;
+        data += take;
+        len -= take;
+        if (parser->header_len < TAR_BLOCK) break;
+        parser->header_len = 0;
+
+        // The first all-zero block ends the archive; anything after it is ignored
+        int zero = 1;
+        for (int i = 0; i < TAR_BLOCK && zero; i++) zero = parser->header[i] == '\0';
+        if (zero) {
+            parser->ended = 1;
+            break;
+        }
+        int64_t size = tar_header_size(parser->header);
+        if (!tar_header_valid(parser->header) || size < 0) return -1;
+        parser->data_left = size;
+        parser->pad_left = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+        char type = parser->header[156];
+        if (type == 'L' || type == 'x') {
+            parser->meta_type = type;
+            parser->meta_len = 0;
+        } else if (type == '5' || type == 'g' || type == 'K') {
+            // Directories are created as their files need them
+            if (type == '5') parser->long_name[0] = '\0';
+        } else if (ingest_start_member(parser, parser->header, size) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Handle a utar request: unpack the framed tar archive that follows as it arrives, storing each
+// member as ufile would under destination_path. Members are committed as each completes, every
+// byte of them having passed its frame's CRC32C check; one left incomplete by a failed transfer
+// is discarded. The client gets one summary with a line per member.
+void process_archive_upload(const char *destination_path, int client_socket, const char *received, size_t received_len) {
+    LOG_INFO("Processing archive upload to %s\n", destination_path);
+    uint64_t ingest_started = trace_now_us();
+    struct ingest_parser *parser = calloc(1, sizeof(*parser));
+    char *payload = malloc(FRAME_MAX_PAYLOAD);
+    if (!parser || !payload) {
+        LOG_ERROR("Failed to allocate archive upload: %m\n");
+        const char *error_message = "Upload failed: server error.\n";
+        send(client_socket, error_message, strlen(error_message), MSG_NOSIGNAL);
+        free(parser);
+        free(payload);
+        return;
+    }
+    for (size_t i = 0; i < INGEST_LANES; i++) {
+        struct ingest_lane *lane = &parser->lanes[i];
+        lane->destination_path = destination_path;
+        lane->server = i > 0 ? &sub_servers[i - 1] : NULL;  // Lanes 1 and 2 are stext/ and spdf/
+        lane->server_socket = -1;
+        pthread_mutex_init(&lane->lock, NULL);
+        pthread_cond_init(&lane->changed, NULL);
+        lane->started = pthread_create(&lane->thread, NULL, ingest_lane_worker, lane) == 0;
+        if (!lane->started) LOG_ERROR("Failed to start archive upload lane\n");
+    }
+
+    // Parse frames as they arrive; the lanes write the members meanwhile
+    struct frame_reader reader;
+    frame_reader_init(&reader, client_socket, received, received_len);
+    ssize_t result;
+    int malformed = 0;
+    while (!malformed && (result = frame_read(&reader, payload)) > 0) {
+        malformed = ingest_feed(parser, payload, result) < 0;
+    }
+    const char *failure = NULL;
+    if (malformed) failure = "not a tar archive";
+    else if (result < 0) failure = frame_status_text(&reader);
+    else if (!parser->ended && (parser->member || parser->data_left > 0 || parser->header_len > 0)) failure = "archive ends part way through a member";
+    if (parser->member) ingest_route(parser, INGEST_ABORT, NULL, 0, "Archive ended part way through the member.");
+
+    for (size_t i = 0; i < INGEST_LANES; i++) {
+        struct ingest_lane *lane = &parser->lanes[i];
+        pthread_mutex_lock(&lane->lock);
+        lane->closed = 1;
+        pthread_cond_broadcast(&lane->changed);
+        pthread_mutex_unlock(&lane->lock);
+        if (lane->started) pthread_join(lane->thread, NULL);
+        pthread_mutex_destroy(&lane->lock);
+        pthread_cond_destroy(&lane->changed);
+    }
+    trace_span("ingest archive", ingest_started);
+
+    // One summary: a line per member, then the totals
+    size_t summary_cap = (parser->count + 2) * 160, summary_len = 0;
+    char *summary = malloc(summary_cap);
+    size_t stored = 0;
+    unsigned long long stored_bytes = 0;
+    for (size_t i = 0; i < parser->count; i++) {
+        struct ingest_member *member = parser->members[i];
+        if (member->stored) {
+            stored++;
+            stored_bytes += member->size;
+        }
+        if (summary && summary_len < summary_cap) {
+            if (member->stored) {
+                summary_len += snprintf(summary + summary_len, summary_cap - summary_len, "Stored %.100s: %llu bytes, CRC32C %08x.\n",
+                                        member->name, (unsigned long long)member->size, member->crc);
+            } else {
+                summary_len += snprintf(summary + summary_len, summary_cap - summary_len, "Skipped %.100s: %s\n",
+                                        member->name, member->error ? member->error : "Transfer failed.");
+            }
+        }
+        free(member->name);
+        free(member);
+    }
+    if (summary && summary_len < summary_cap) {
+        if (failure) {
+            summary_len += snprintf(summary + summary_len, summary_cap - summary_len, "Upload failed: %s; %zu of %zu members stored.\n",
+                                    failure, stored, parser->count);
+        } else {
+            summary_len += snprintf(summary + summary_len, summary_cap - summary_len, "Archive uploaded: %zu of %zu members stored, %llu bytes.\n",
+                                    stored, parser->count, stored_bytes);
+        }
+    }
+    if (summary) send(client_socket, summary, summary_len < summary_cap ? summary_len : summary_cap - 1, MSG_NOSIGNAL);
+
+    TRANSFER_STAT_ADD(uploads_verified, stored);
+    TRANSFER_STAT_ADD(bytes_verified, stored_bytes);
+    if (result < 0) record_transfer_failure(&reader);
+    if (failure) {
+        LOG_ERROR("Archive upload to %s failed after %zu members: %s\n", destination_path, stored, failure);
+    } else {
+        LOG_INFO("Archive upload to %s stored %zu of %zu members (%llu bytes, CRC32C %08x)\n", destination_path, stored, parser->count,
+                 stored_bytes, reader.crc);
+    }
+    free(summary);
+    free(parser->members);
+    free(parser);
+    free(payload);
+}
+
+// Send the signature header followed by one weak/strong entry per full block of the basis file
+int send_block_signatures(int client_socket, const unsigned char *basis, uint32_t block_size, uint32_t block_count) {
+    unsigned char header[12];
+    memcpy(header, DELTA_SIG_MAGIC, 4);
+    delta_put_u32(header + 4, block_size);
+    delta_put_u32(header + 8, block_count);
+
+    unsigned char *signatures = malloc((size_t)block_count * DELTA_SIG_ENTRY_SIZE + 1);
+    if (!signatures) {
+        LOG_ERROR("Failed to allocate block signatures: %m\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < block_count; i++) {
+        const unsigned char *block = basis + (size_t)i * block_size;
+        uint32_t a, b;
+        delta_weak_sums(block, block_size, &a, &b);
+        delta_put_u32(signatures + (size_t)i * DELTA_SIG_ENTRY_SIZE, delta_weak_combine(a, b));
+        delta_put_u64(signatures + (size_t)i * DELTA_SIG_ENTRY_SIZE + 4, delta_strong_hash(block, block_size));
+    }
+
+    int result = 0;
+    if (delta_send_all(client_socket, header, sizeof(header)) < 0 ||
+        delta_send_all(client_socket, signatures, (size_t)block_count * DELTA_SIG_ENTRY_SIZE) < 0) {
+        LOG_ERROR("Failed to send block signatures: %m\n");
+        result = -1;
+    }
+    free(signatures);
+    return result;
+}
+
+// Apply the client's literal and copy instructions on top of the basis, writing the new
+// version to out_fd. Returns 1 when the stream ended cleanly and the rebuilt file matches
+// the size and whole-file hash announced by the client, 0 otherwise.
+int apply_delta_stream(int client_socket, int out_fd, const unsigned char *basis, uint32_t block_size, uint32_t block_count,
+                       uint64_t *literal_bytes, uint64_t *copied_blocks) {
+    unsigned char *literal = malloc(DELTA_MAX_LITERAL);
+    if (!literal) {
+        LOG_ERROR("Failed to allocate literal buffer: %m\n");
+        return 0;
+    }
+
+    int ended = 0;
+    uint64_t expected_size = 0, expected_hash = 0;
+    while (!ended) {
+        unsigned char op[17];
+        if (delta_recv_all(client_socket, op, 1) < 0) break;
+
+        if (op[0] == DELTA_OP_LITERAL) {
+            if (delta_recv_all(client_socket, op + 1, 4) < 0) break;
+            uint32_t len = delta_get_u32(op + 1);
+            if (len > DELTA_MAX_LITERAL || delta_recv_all(client_socket, literal, len) < 0) break;
+            if (write_all(out_fd, literal, len) < 0) break;
+            *literal_bytes += len;
+        } else if (op[0] == DELTA_OP_COPY) {
+            if (delta_recv_all(client_socket, op + 1, 4) < 0) break;
+            uint32_t index = delta_get_u32(op + 1);
+            if (index >= block_count) break;
+            if (write_all(out_fd, basis + (size_t)index * block_size, block_size) < 0) break;
+            (*copied_blocks)++;
+        } else if (op[0] == DELTA_OP_END) {
+            if (delta_recv_all(client_socket, op + 1, 16) < 0) break;
+            expected_size = delta_get_u64(op + 1);
+            expected_hash = delta_get_u64(op + 9);
+            ended = 1;
+        } else {
+            LOG_ERROR("Unknown delta opcode 0x%02x\n", op[0]);
+            break;
+        }
+    }
+    free(literal);
+    if (!ended) {
+        return 0;
+    }
+
+    // Verify the rebuilt file before it is committed
+    struct stat st;
+    if (fstat(out_fd, &st) != 0 || (uint64_t)st.st_size != expected_size) {
+        return 0;
+    }
+    if (st.st_size == 0) {
+        return delta_strong_hash("", 0) == expected_hash;
+    }
+    void *rebuilt = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, out_fd, 0);
+    if (rebuilt == MAP_FAILED) {
+        LOG_ERROR("Failed to map rebuilt file: %m\n");
+        return 0;
+    }
+    int matches = delta_strong_hash(rebuilt, st.st_size) == expected_hash;
+    munmap(rebuilt, st.st_size);
+    return matches;
+}
+
+// Handle an rsync-style delta upload: send block signatures of the stored copy, then
+// rebuild the file from the client's literal and copy instructions and swap it in atomically
+void process_delta_upload(const char *filename, const char *destination_path, int client_socket) {
+    LOG_INFO("Processing delta upload: filename=%s, destination=%s\n", filename, destination_path);
+
+    // .txt and .pdf files are rebuilt here but stored by their sub-servers
+    const struct sub_server *server = upload_sub_server(filename);
+    if (server) {
+        relay_delta_upload_to_sub_server(server, filename, destination_path, client_socket);
+        return;
+    }
+
+    char final_destination[BUFFER_SIZE];
+    int dir_fd = open_upload_directory(filename, destination_path, client_socket, final_destination, sizeof(final_destination));
+    if (dir_fd < 0) {
+        return;
+    }
+
+    char full_path[BUFFER_SIZE * 2];
+    snprintf(full_path, sizeof(full_path), "%s/%s", final_destination, filename);
+    char pack_key[BUFFER_SIZE * 2];
+    int packable = pack_path_for(full_path, pack_key, sizeof(pack_key));
+
+    // Map the stored copy, if any, as the basis for the new version. A packed copy is read into
+    // an anonymous mapping so it is released the same way, as is a compressed one, decoded.
+    unsigned char *basis = NULL;
+    size_t basis_size = 0;
+    struct pack_location packed;
+    int basis_fd = -1;
+    if (packable && pack_lookup(&pack, pack_key, &packed) == 0) {
+        if (packed.length > 0) {
+            basis = mmap(NULL, packed.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (basis == MAP_FAILED) {
+                basis = NULL;
+            } else if (pread(packed.fd, basis, packed.length, packed.offset) != (ssize_t)packed.length) {
+                munmap(basis, packed.length);
+                basis = NULL;
+            } else {
+                basis_size = packed.length;
+            }
+        }
+        close(packed.fd);
+    } else {
+        basis_fd = openat(dir_fd, filename, O_RDONLY | O_CLOEXEC);
+    }
+    if (basis_fd >= 0) {
+        struct stat st;
+        if (fstat(basis_fd, &st) == 0 && st.st_size > 0) {
+            basis = seekable_map(basis_fd, st.st_size, &basis_size);
+            if (basis == MAP_FAILED) {
+                basis = NULL;
+                basis_size = 0;
+            }
+        }
+        close(basis_fd);
+    }
+
+    uint32_t block_size = delta_block_size(basis_size);
+    uint32_t block_count = basis_size / block_size;
+    if (send_block_signatures(client_socket, basis, block_size, block_count) < 0) {
+        if (basis) munmap(basis, basis_size);
+        close(dir_fd);
+        return;
+    }
+
+    // Rebuild the file under a temporary name next to the target
+    char temp_name[BUFFER_SIZE];
+    snprintf(temp_name, sizeof(temp_name), "%s.udelta.%d.%lu", filename, (int)getpid(), next_temp_id());
+    int out_fd = open_in_upload_directory(&dir_fd, final_destination, temp_name, O_RDWR | O_CREAT | O_TRUNC);
+    if (out_fd < 0) {
+        LOG_ERROR("Failed to open temporary file for delta upload: %m\n");
+        if (basis) munmap(basis, basis_size);
+        if (dir_fd >= 0) close(dir_fd);
+        return;
+    }
+
+    uint64_t literal_bytes = 0, copied_blocks = 0;
+    int ok = apply_delta_stream(client_socket, out_fd, basis, block_size, block_count, &literal_bytes, &copied_blocks);
+    close(out_fd);
+    if (basis) munmap(basis, basis_size);
+
+    if (ok) seekable_compress_at(dir_fd, temp_name);
+    if (ok && renameat(dir_fd, temp_name, dir_fd, filename) == 0) {
+        // The rebuilt file is stored loose, replacing any packed version
+        if (packable) pack_remove(&pack, pack_key);
+        note_index_change(full_path, '+');
+        note_snapshot_change(full_path, '+', 0, 0);
+        note_watch_change(full_path, '~');
+
+        char reply[BUFFER_SIZE];
+        snprintf(reply, sizeof(reply), "Delta upload applied: %llu literal bytes, %llu blocks reused.\n",
+                 (unsigned long long)literal_bytes, (unsigned long long)copied_blocks);
+        send(client_socket, reply, strlen(reply), 0);
+        LOG_INFO("File '%s' rebuilt in '%s' (%llu literal bytes, %llu blocks reused)\n", filename, final_destination,
+               (unsigned long long)literal_bytes, (unsigned long long)copied_blocks);
+    } else {
+        unlinkat(dir_fd, temp_name, 0);
+        const char *error_message = "Delta upload failed.\n";
+        send(client_socket, error_message, strlen(error_message), 0);
+        LOG_ERROR("Delta upload of '%s' failed\n", filename);
+    }
+    close(dir_fd);
+}
+
+// Read the copy of a file a sub-server stores into an in-memory file, to serve as the basis of a
+// delta upload. RETRIEVE is used even over the Unix-domain socket so that a compressed file
+// arrives decoded. A file the sub-server does not have yet gives an empty basis. Returns the
+// descriptor, or -1 if the sub-server could not be asked or stopped part way.
+int fetch_delta_basis(const struct sub_server *server, const char *relative_path, off_t *size) {
+    *size = 0;
+    int is_local;
+    int sock = transport_connect(server->socket_path, server->server_ip, server->server_port, &is_local);
+    if (sock < 0) return -1;
+
+    char message[BUFFER_SIZE * 3];
+    int len = snprintf(message, sizeof(message), "RETRIEVE %s%s\n", relative_path, trace_tag());
+    int fd = memfd_create("udelta-basis", MFD_CLOEXEC);
+    unsigned char *payload = malloc(FRAME_MAX_PAYLOAD);
+    if (len >= (int)sizeof(message) || fd < 0 || !payload || send(sock, message, len, MSG_NOSIGNAL) != len) {
+        if (fd >= 0) close(fd);
+        free(payload);
+        close(sock);
+        return -1;
+    }
+
+    struct frame_reader reader;
+    frame_reader_init(&reader, sock, NULL, 0);
+    ssize_t result;
+    while ((result = frame_read(&reader, payload)) > 0) {
+        if (write_all(fd, payload, result) < 0) break;
+    }
+    free(payload);
+    close(sock);
+
+    if (result < 0 && reader.status == FRAME_REMOTE_ERROR) {
+        LOG_DEBUG("No basis for delta upload of %s: %s\n", relative_path, reader.message);
+        if (ftruncate(fd, 0) == 0) return fd;
+    } else if (result == 0) {
+        *size = reader.total;
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+// Handle a delta upload of a file a sub-server stores. Its stored copy is fetched from the
+// sub-server as the basis, and the rebuilt file goes back with a PUT, so that the sub-server
+// commits it like any other upload and keeps its hot cache, snapshot and index current.
+void relay_delta_upload_to_sub_server(const struct sub_server *server, const char *filename, const char *destination_path, int client_socket) {
+    char final_destination[BUFFER_SIZE];
+    const char *error = resolve_upload_destination(filename, destination_path, final_destination, sizeof(final_destination));
+    if (error) {
+        char message[BUFFER_SIZE];
+        snprintf(message, sizeof(message), "%s\n", error);
+        send(client_socket, message, strlen(message), MSG_NOSIGNAL);
+        LOG_WARN("%s", message);
+        return;
+    }
+    char relative_path[BUFFER_SIZE * 2];
+    upload_relative_path(destination_path, filename, relative_path, sizeof(relative_path));
+
+    off_t basis_size;
+    uint64_t fetch_started = trace_now_us();
+    int basis_fd = fetch_delta_basis(server, relative_path, &basis_size);
+    trace_span("fetch basis from sub-server", fetch_started);
+    if (basis_fd < 0) {
+        LOG_ERROR("Failed to fetch '%s' from %s for a delta upload\n", relative_path, server->label);
+        const char *error_message = "Delta upload failed: sub-server unavailable.\n";
+        send(client_socket, error_message, strlen(error_message), MSG_NOSIGNAL);
+        return;
+    }
+    unsigned char *basis = basis_size > 0 ? mmap(NULL, basis_size, PROT_READ, MAP_SHARED, basis_fd, 0) : NULL;
+    if (basis == MAP_FAILED) {
+        basis = NULL;
+        basis_size = 0;
+    }
+
+    uint32_t block_size = delta_block_size(basis_size);
+    uint32_t block_count = basis_size / block_size;
+    int out_fd = memfd_create("udelta", MFD_CLOEXEC);
+    uint64_t literal_bytes = 0, copied_blocks = 0;
+    int ok = out_fd >= 0 && send_block_signatures(client_socket, basis, block_size, block_count) == 0 &&
+             apply_delta_stream(client_socket, out_fd, basis, block_size, block_count, &literal_bytes, &copied_blocks);
+    if (basis) munmap(basis, basis_size);
+    close(basis_fd);
+
+    // Hand the rebuilt file to the sub-server as an upload
+    char reply[BUFFER_SIZE] = "Delta upload failed.\n";
+    struct stat st;
+    if (ok && fstat(out_fd, &st) == 0) {
+        int is_local;
+        uint64_t store_started = trace_now_us();
+        int sock = transport_connect(server->socket_path, server->server_ip, server->server_port, &is_local);
+        struct frame_writer writer;
+        char line[BUFFER_SIZE];
+        if (sock >= 0 && send_put_request(sock, relative_path) == 0) {
+            frame_writer_init(&writer, sock);
+            if (frame_write_file_range(&writer, out_fd, 0, st.st_size) == 0 && frame_finish(&writer) == 0 &&
+                recv_reply_line(sock, line, sizeof(line)) == 0 && strncmp(line, "File uploaded", strlen("File uploaded")) == 0) {
+                snprintf(reply, sizeof(reply), "Delta upload applied: %llu literal bytes, %llu blocks reused.\n",
+                         (unsigned long long)literal_bytes, (unsigned long long)copied_blocks);
+                LOG_INFO("File '%s' rebuilt and stored by %s (%llu literal bytes, %llu blocks reused)\n", relative_path,
+                         server->label, (unsigned long long)literal_bytes, (unsigned long long)copied_blocks);
+            }
+        }
+        if (sock >= 0) close(sock);
+        trace_span("store on sub-server", store_started);
+    }
+    if (out_fd >= 0) close(out_fd);
+    if (strncmp(reply, "Delta upload applied", strlen("Delta upload applied")) != 0) {
+        LOG_ERROR("Delta upload of '%s' to %s failed\n", relative_path, server->label);
+    }
+    send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
+}
+
+// Handle downloading a file from the server. .c files are sent from the local tree; .txt and
+// .pdf files are relayed from the sub-server that owns them. Errors go back as error frames.
+// With if_none_match (a conditional dfile) the body is preceded by the file's validator, or
+// replaced by a not-modified answer if the client's copy is current. A client that accepts the
+// stored encoding (accept_encoded) is sent a compressed file as it is stored.
+void process_download_file(const char *filename, const char *if_none_match, int accept_encoded, int client_socket) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        LOG_ERROR("Failed to get current directory: %m\n");
+        frame_write_error(client_socket, "Server error.");
+        return;
+    }
+
+    char *ext = strrchr(filename, '.');
+    char target_dir[BUFFER_SIZE + 8];
+    char filepath[BUFFER_SIZE * 2];
+
+    // Determine the appropriate directory based on file extension
+    if (ext) {
+        // Extract the relative path of the file below the storage root
+        const char *relative_path = filename + strlen("/home/{{user}}/smain");
+        if (*relative_path == '/') relative_path++;
+
+        if (strcmp(ext, ".c") == 0) {
+            snprintf(target_dir, sizeof(target_dir), "%s/smain", base_dir);
+        } else if (strcmp(ext, ".txt") == 0) {
+            fetch_file_from_sub_server(relative_path, if_none_match, accept_encoded, STEXT_SOCKET_PATH, STEXT_IP, STEXT_PORT, client_socket, "RETRIEVE");
+            return;
+        } else if (strcmp(ext, ".pdf") == 0) {
+            fetch_file_from_sub_server(relative_path, if_none_match, accept_encoded, SPDF_SOCKET_PATH, SPDF_IP, SPDF_PORT, client_socket, "RETRIEVE");
+            return;
+        } else {
+            frame_write_error(client_socket, "Unsupported file type.");
+            LOG_WARN("Unsupported file type\n");
+            return;
+        }
+
+        // Construct the full file path
+        if (snprintf(filepath, sizeof(filepath), "%s/%s", target_dir, relative_path) >= (int)sizeof(filepath)) {
+            frame_write_error(client_socket, "Path too long.");
+            return;
+        }
+
+        // Small files may be in the pack store rather than the tree
+        uint64_t lookup_started = trace_now_us();
+        char pack_key[BUFFER_SIZE * 2];
+        struct pack_location packed;
+        if (pack_path_for(filepath, pack_key, sizeof(pack_key)) && pack_lookup(&pack, pack_key, &packed) == 0) {
+            trace_span("fs lookup", lookup_started);
+            struct timespec mtime = { packed.mtime, 0 };
+            if (!answer_conditional_download(if_none_match, packed.length, &mtime, client_socket)) {
+                LOG_INFO("Sending packed file: %s\n", filepath);
+                transmit_open_file_to_client(packed.fd, packed.offset, packed.length, SEEKABLE_RAW, filepath, client_socket, SCHED_INTERACTIVE);
+            }
+            close(packed.fd);
+            return;
+        }
+
+        // Check if the file exists before attempting to send
+        int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        int missing = fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode);
+        trace_span("fs lookup", lookup_started);
+        if (missing) {
+            frame_write_error(client_socket, "File not found.");
+            LOG_WARN("File not found at '%s'\n", filepath);
+            if (fd >= 0) close(fd);
+            return;
+        }
+
+        // Send the file to the client, unless its copy is current
+        if (!answer_conditional_download(if_none_match, st.st_size, &st.st_mtim, client_socket)) {
+            LOG_INFO("Sending file: %s\n", filepath);
+            enum seekable_mode mode = accept_encoded ? SEEKABLE_PASS_THROUGH : SEEKABLE_DECODE;
+            if (transmit_open_file_to_client(fd, 0, st.st_size, mode, filepath, client_socket, SCHED_INTERACTIVE) == 0) {
+                LOG_INFO("File transfer completed for '%s'\n", filepath);
+            }
+        }
+        close(fd);
+    } else {
+        frame_write_error(client_socket, "File has no extension.");
+        LOG_WARN("File has no extension\n");
+    }
+}
+
+// Answer a conditional download from the stored file's metadata. Returns 1 if the client's
+// copy is current and it has been told so; otherwise 0, after sending the validator the body
+// follows (nothing is sent for an unconditional request).
+int answer_conditional_download(const char *if_none_match, off_t size, const struct timespec *mtime, int client_socket) {
+    if (!if_none_match) return 0;
+    char validator[FRAME_VALIDATOR_MAX];
+    frame_validator(size, mtime, validator, sizeof(validator));
+    int current = frame_validator_matches(if_none_match, validator);
+    frame_write_validator(client_socket, validator, current);
+    if (current) {
+        TRANSFER_STAT_ADD(not_modified, 1);
+        LOG_INFO("Not modified: %s\n", validator);
+    }
+    return current;
+}
+
+// Handle file deletion on the server
+void process_remove_file(const char *filename, int client_socket) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        LOG_ERROR("Failed to get current directory: %m\n");
+        return;
+    }
+
+    char target_dir[BUFFER_SIZE + 8];
+    char filepath[BUFFER_SIZE * 2];
+
+    char *ext = strrchr(filename, '.');
+    if (ext) {
+        // Extract the relative path of the file below the storage root
+        const char *relative_path = filename + strlen("/home/{{user}}/smain");
+        if (*relative_path == '/') relative_path++;
+
+        // .txt and .pdf files are removed by the sub-server that stores them
+        const struct sub_server *server = upload_sub_server(filename);
+        if (server) {
+            remove_file_on_sub_server(server, relative_path, client_socket);
+            return;
+        } else if (strcmp(ext, ".c") == 0) {
+            snprintf(target_dir, sizeof(target_dir), "%s/smain", base_dir);
+        } else {
+            const char *error_message = "Unsupported file type.\n";
+            send(client_socket, error_message, strlen(error_message), 0);
+            LOG_WARN("Unsupported file type\n");
+            return;
+        }
+
+        // Construct the full file path
+        if (snprintf(filepath, sizeof(filepath), "%s/%s", target_dir, relative_path) >= (int)sizeof(filepath)) {
+            const char *error_message = "Path too long.\n";
+            send(client_socket, error_message, strlen(error_message), 0);
+            return;
+        }
+
+        // Attempt to delete the file, which has no file of its own if it is packed
+        char pack_key[BUFFER_SIZE * 2];
+        int unpacked = pack_path_for(filepath, pack_key, sizeof(pack_key)) && pack_remove(&pack, pack_key) == 1;
+        if (unpacked || remove(filepath) == 0) {
+            note_index_change(filepath, '-');
+            note_snapshot_change(filepath, '-', 0, 0);
+            note_watch_change(filepath, '-');
+            const char *success_message = "File deleted successfully.\n";
+            send(client_socket, success_message, strlen(success_message), 0);
+            LOG_INFO("File '%s' deleted successfully\n", filepath);
+        } else {
+            LOG_ERROR("Failed to delete file: %m\n");
+            const char *error_message = "Failed to delete file.\n";
+            send(client_socket, error_message, strlen(error_message), 0);
+        }
+    } else {
+        const char *error_message = "File has no extension.\n";
+        send(client_socket, error_message, strlen(error_message), 0);
+        LOG_WARN("File has no extension\n");
+    }
+}
+
+// Have a sub-server delete one of its files, passing its reply on to the client
+void remove_file_on_sub_server(const struct sub_server *server, const char *relative_path, int client_socket) {
+    int is_local;
+    char message[BUFFER_SIZE * 2];
+    int sock = transport_connect(server->socket_path, server->server_ip, server->server_port, &is_local);
+    snprintf(message, sizeof(message), "DELETE %s%s\n", relative_path, trace_tag());
+    if (sock < 0 || send(sock, message, strlen(message), MSG_NOSIGNAL) < 0 ||
+        recv_reply_line(sock, message, sizeof(message)) < 0) {
+        LOG_ERROR("Failed to reach %s to delete '%s': %m\n", server->label, relative_path);
+        snprintf(message, sizeof(message), "Failed to delete file: sub-server unavailable.\n");
+    }
+    if (sock >= 0) close(sock);
+    send(client_socket, message, strlen(message), MSG_NOSIGNAL);
+}
+
+// Handle requests to create and transmit tar files of specified file types. The .c archive is
+// built here; .txt and .pdf archives are relayed from the sub-servers. "*" merges all three.
+void process_archive_request(const char *filetype, int client_socket) {
+    if (strcmp(filetype, "*") == 0) {
+        process_full_archive_request(client_socket);
+        return;
+    } else if (strcmp(filetype, ".txt") == 0) {
+        fetch_archive_from_sub_server(filetype, STEXT_SOCKET_PATH, STEXT_IP, STEXT_PORT, client_socket);
+        return;
+    } else if (strcmp(filetype, ".pdf") == 0) {
+        fetch_archive_from_sub_server(filetype, SPDF_SOCKET_PATH, SPDF_IP, SPDF_PORT, client_socket);
+        return;
+    } else if (strcmp(filetype, ".c") != 0) {
+        frame_write_error(client_socket, "Unsupported file type for archive creation.");
+        LOG_WARN("Unsupported file type for archive creation\n");
+        return;
+    }
+
+    // Stream the archive straight into the transfer instead of building it on disk first
+    uint64_t send_started = trace_now_us();
+    struct frame_writer writer;
+    frame_writer_init(&writer, client_socket);
+    struct sched_flow *flow = sched_open(transfer_sched, SCHED_BULK, peer_address(client_socket));
+    frame_writer_schedule(&writer, transfer_sched, flow);
+    struct tar_stream stream;
+    int failed = tar_stream_init(&stream, &writer) < 0 || add_stored_c_files(&stream) < 0;
+    failed = tar_stream_finish(&stream) < 0 || failed || frame_finish(&writer) < 0;
+    sched_close(transfer_sched, flow);
+    trace_span("send to client", send_started);
+
+    if (!failed) {
+        TRANSFER_STAT_ADD(downloads_sent, 1);
+        LOG_INFO("Successfully created and sent tar file for %s files (%llu members, %llu bytes, CRC32C %08x)\n",
+                 filetype, stream.members, (unsigned long long)writer.total, writer.crc);
+    } else if (writer.failed) {
+        LOG_ERROR("Failed to send tar file: %m\n");
+    } else {
+        LOG_ERROR("Failed to create tar file\n");
+        frame_write_error(client_socket, "Failed to create tar file.");
+    }
+}
+
+// Send one archive of every stored file. Stext and Spdf stream their members at the same time
+// as the .c files are added here, and whole members from all three are written as each becomes
+// ready, so the archive takes about as long as the slowest backend rather than all of them in turn.
+void process_full_archive_request(int client_socket) {
+    uint64_t send_started = trace_now_us();
+    struct frame_writer writer;
+    frame_writer_init(&writer, client_socket);
+    struct sched_flow *flow = sched_open(transfer_sched, SCHED_BULK, peer_address(client_socket));
+    frame_writer_schedule(&writer, transfer_sched, flow);
+    pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct tar_stream stream;
+    int failed = tar_stream_init(&stream, &writer) < 0;
+    tar_stream_set_lock(&stream, &stream_lock);
+
+    struct member_source sources[] = {
+        { .name = "Stext", .filetype = ".txt", .socket_path = STEXT_SOCKET_PATH, .server_ip = STEXT_IP, .server_port = STEXT_PORT },
+        { .name = "Spdf", .filetype = ".pdf", .socket_path = SPDF_SOCKET_PATH, .server_ip = SPDF_IP, .server_port = SPDF_PORT },
+    };
+    size_t source_count = sizeof(sources) / sizeof(sources[0]);
+    for (size_t i = 0; i < source_count && !failed; i++) {
+        sources[i].stream = &stream;
+        snprintf(sources[i].request, sizeof(sources[i].request), "MEMBERS %s%s\n", sources[i].filetype, trace_tag());
+        sources[i].started = pthread_create(&sources[i].thread, NULL, merge_sub_server_members, &sources[i]) == 0;
+        if (!sources[i].started) merge_sub_server_members(&sources[i]);
+    }
+    if (!failed) failed = add_stored_c_files(&stream) < 0;
+    for (size_t i = 0; i < source_count; i++) {
+        if (sources[i].started) pthread_join(sources[i].thread, NULL);
+    }
+
+    // Report the first backend that failed, unless the client itself went away
+    const char *error_message = "Failed to create tar file.";
+    for (size_t i = 0; i < source_count; i++) {
+        if (sources[i].error[0]) {
+            failed = 1;
+            error_message = sources[i].error;
+            break;
+        }
+    }
+    failed = tar_stream_finish(&stream) < 0 || failed || frame_finish(&writer) < 0;
+    sched_close(transfer_sched, flow);
+    trace_span("send to client", send_started);
+    pthread_mutex_destroy(&stream_lock);
+
+    if (!failed) {
+        TRANSFER_STAT_ADD(downloads_sent, 1);
+        LOG_INFO("Successfully created and sent tar file for all files (%llu members: %llu .txt, %llu .pdf; %llu bytes, CRC32C %08x)\n",
+                 stream.members, sources[0].members, sources[1].members, (unsigned long long)writer.total, writer.crc);
+    } else if (writer.failed) {
+        LOG_ERROR("Failed to send tar file: %m\n");
+    } else {
+        LOG_ERROR("Failed to create tar file: %s\n", error_message);
+        frame_write_error(client_socket, error_message);
+    }
+}
+
+// Thread reading one sub-server's member stream into a dtar * archive. On failure the reason is
+// left in source->error.
+void *merge_sub_server_members(void *arg) {
+    struct member_source *source = arg;
+    int is_local;
+    int sock = transport_connect(source->socket_path, source->server_ip, source->server_port, &is_local);
+    if (sock < 0) {
+        LOG_ERROR("Failed to connect to %s: %m\n", source->name);
+        snprintf(source->error, sizeof(source->error), "Sub-server unavailable.");
+        return NULL;
+    }
+    send(sock, source->request, strlen(source->request), MSG_NOSIGNAL);
+
+    char *payload = malloc(FRAME_MAX_PAYLOAD);
+    struct tar_member_reader members;
+    if (!payload || tar_member_reader_init(&members, source->stream) < 0) {
+        LOG_ERROR("Failed to allocate member buffers: %m\n");
+        snprintf(source->error, sizeof(source->error), "Server error.");
+        free(payload);
+        close(sock);
+        return NULL;
+    }
+
+    struct frame_reader reader;
+    frame_reader_init(&reader, sock, NULL, 0);
+    ssize_t result;
+    int stopped = 0;
+    while ((result = frame_read(&reader, payload)) > 0) {
+        if (tar_member_reader_feed(&members, payload, result) < 0) {
+            stopped = 1;
+            break;
+        }
+    }
+    int partial = tar_member_reader_end(&members) < 0;
+    source->members = members.members;
+    free(payload);
+    close(sock);
+
+    // Stopping because another source or the client already failed the archive is not an error
+    // of this source's own
+    tar_stream_lock(source->stream);
+    int already_failed = source->stream->failed && stopped;
+    if (result != 0 || partial || stopped) source->stream->failed = 1;
+    tar_stream_unlock(source->stream);
+
+    if (result == 0 && !partial && !stopped) {
+        TRANSFER_STAT_ADD(relays_verified, 1);
+        TRANSFER_STAT_ADD(bytes_verified, reader.total);
+        LOG_INFO("Merged %llu members from %s (%llu verified bytes)\n", source->members, source->name, (unsigned long long)reader.total);
+    } else if (result < 0) {
+        record_transfer_failure(&reader);
+        LOG_ERROR("Member stream from %s failed: %s\n", source->name, frame_status_text(&reader));
+        snprintf(source->error, sizeof(source->error), "Transfer from sub-server failed: %s.", frame_status_text(&reader));
+    } else if (!already_failed) {
+        LOG_ERROR("Malformed member stream from %s\n", source->name);
+        snprintf(source->error, sizeof(source->error), "Transfer from sub-server failed: malformed archive.");
+    }
+    return NULL;
+}
+
+// Add every stored .c file to an archive as "smain/<path>": loose ones from the tree, then
+// packed ones in store order, so that reading them is one sequential pass over each segment.
+// Returns -1 if the archive failed.
+int add_stored_c_files(struct tar_stream *stream) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        LOG_ERROR("Failed to get current directory: %m\n");
+        return -1;
+    }
+
+    char root[BUFFER_SIZE + 8];
+    snprintf(root, sizeof(root), "%s/smain", base_dir);
+    uint64_t lookup_started = trace_now_us();
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char **paths = NULL;
+    size_t path_count = 0, path_cap = 0;
+    if (root_fd >= 0 && meta_snapshot_paths(root, "", &paths, &path_count) < 0) {
+        grep_collect_files(dup(root_fd), "", ".c", &paths, &path_count, &path_cap);
+    }
+    struct pack_item *items;
+    size_t item_count = pack_list(&pack, &items);
+    trace_span("fs lookup", lookup_started);
+
+    int failed = tar_stream_add_tree(stream, root_fd, paths, path_count, "smain") < 0;
+    char member[TAR_NAME_MAX];
+    for (size_t i = 0; i < item_count && !failed; i++) {
+        if (i + TAR_READAHEAD < item_count) {
+            tar_readahead(items[i + TAR_READAHEAD].fd, items[i + TAR_READAHEAD].offset, items[i + TAR_READAHEAD].length);
+        }
+        snprintf(member, sizeof(member), "smain/%s", items[i].path);
+        failed = tar_stream_add_file(stream, member, items[i].fd, items[i].offset, items[i].length, items[i].mtime) < 0;
+    }
+
+    for (size_t i = 0; i < path_count; i++) free(paths[i]);
+    free(paths);
+    pack_list_free(items, item_count);
+    if (root_fd >= 0) close(root_fd);
+    return failed ? -1 : 0;
+}
+
+// Send size bytes of an open file from offset on (named label in the log) as CRC32C-checked
+// frames, using sendfile() for the payloads. Unless mode is SEEKABLE_RAW, a whole file that is
+// stored compressed is either announced and sent as it is (SEEKABLE_PASS_THROUGH) or decoded
+// as it goes.
+int transmit_open_file_to_client(int fd, off_t offset, off_t size, enum seekable_mode mode, const char *label, int client_socket, int sched_class) {
+    struct seekable_info info = { 0 };
+    int compressed = mode != SEEKABLE_RAW && offset == 0 && seekable_probe(fd, size, &info);
+    uint64_t send_started = trace_now_us();
+    struct frame_writer writer;
+    frame_writer_init(&writer, client_socket);
+    struct sched_flow *flow = sched_open(transfer_sched, sched_class, peer_address(client_socket));
+    frame_writer_schedule(&writer, transfer_sched, flow);
+    int result;
+    if (compressed && mode == SEEKABLE_PASS_THROUGH) {
+        TRANSFER_STAT_ADD(sent_encoded, 1);
+        result = frame_write_encoding(client_socket, SEEKABLE_ENCODING) < 0 ? -1 : frame_write_file_range(&writer, fd, 0, size);
+        if (result < 0) writer.failed = 1;
+    } else if (compressed) {
+        result = seekable_write_range(&writer, fd, &info, 0, info.size);
+    } else {
+        result = frame_write_file_range(&writer, fd, offset, size);
+    }
+    if (compressed) seekable_release(&info);
+    if (result == 0) {
+        result = frame_finish(&writer);
+    } else if (!writer.failed) {
+        LOG_ERROR("Failed to read file: %m\n");
+        frame_write_error(client_socket, "Failed to read file.");
+    }
+    sched_close(transfer_sched, flow);
+    trace_span("send to client", send_started);
+    if (result < 0) {
+        if (writer.failed) LOG_ERROR("Failed to send file: %m\n");
+        return -1;
+    }
+
+    TRANSFER_STAT_ADD(downloads_sent, 1);
+    LOG_INFO("File '%s' successfully transmitted (%llu bytes, CRC32C %08x)\n", label,
+           (unsigned long long)writer.total, writer.crc);
+    return 0;
+}
+
+// Forward a framed body from a sub-server to the client, checking every frame on the way.
+// Frames are passed on unchanged so the client verifies the same checksums; if the sub-server
+// stops early or a frame does not match, the client gets an error frame instead of a short file.
+int relay_verified_frames(int server_socket, int client_socket, int sched_class) {
+    unsigned char *raw = malloc(FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+    if (!raw) {
+        LOG_ERROR("Failed to allocate relay buffer: %m\n");
+        frame_write_error(client_socket, "Server error.");
+        return -1;
+    }
+    struct frame_reader reader;
+    frame_reader_init(&reader, server_socket, NULL, 0);
+    struct sched_flow *flow = sched_open(transfer_sched, sched_class, peer_address(client_socket));
+
+    ssize_t result;
+    size_t raw_len = 0;
+    int send_failed = 0;
+    uint64_t requested = trace_now_us(), first_byte = 0;
+    do {
+        result = frame_read_raw(&reader, NULL, raw, &raw_len);
+        if (!first_byte) {
+            trace_span("sub-server first byte", requested);
+            first_byte = trace_now_us();
+        }
+        if (result < 0 && reader.status != FRAME_REMOTE_ERROR && reader.status != FRAME_NOT_MODIFIED) break;
+
+        struct iovec iov = { raw, raw_len };
+        if (flow) frame_wait_writable(client_socket);
+        sched_acquire(transfer_sched, flow, raw_len);
+        send_failed = frame_sendv(client_socket, &iov, 1) < 0;
+        sched_release(transfer_sched, flow, raw_len);
+        if (send_failed) break;
+    } while (result > 0);
+    trace_span("sub-server last byte", first_byte);
+    sched_close(transfer_sched, flow);
+    free(raw);
+
+    if (send_failed) {
+        LOG_ERROR("Failed to relay frame to client: %m\n");
+        return -1;
+    }
+    if (result < 0 && reader.status == FRAME_NOT_MODIFIED) {
+        TRANSFER_STAT_ADD(not_modified, 1);
+        LOG_INFO("Sub-server reports not modified: %s\n", reader.validator);
+        return 0;
+    }
+    if (result == 0) {
+        if (reader.encoding[0]) TRANSFER_STAT_ADD(sent_encoded, 1);
+        TRANSFER_STAT_ADD(relays_verified, 1);
+        TRANSFER_STAT_ADD(bytes_verified, reader.total);
+        LOG_INFO("Relayed %llu verified bytes (CRC32C %08x)\n", (unsigned long long)reader.total, reader.crc);
+        return 0;
+    }
+
+    record_transfer_failure(&reader);
+    LOG_ERROR("Relay from sub-server failed: %s\n", frame_status_text(&reader));
+    if (reader.status != FRAME_REMOTE_ERROR) {
+        char message[BUFFER_SIZE];
+        snprintf(message, sizeof(message), "Transfer from sub-server failed: %s.", frame_status_text(&reader));
+        frame_write_error(client_socket, message);
+    }
+    return -1;
+}
+
+// Send the client a file whose descriptor a co-located sub-server passed over its Unix-domain
+// socket, so the data goes from the sub-server's storage (or its hot cache) straight to the
+// client socket. A conditional request is answered from the size and mtime sent with it.
+int send_passed_descriptor(int server_socket, const char *label, const char *if_none_match, enum seekable_mode mode, int client_socket, int sched_class) {
+    char message[TRANSPORT_REPLY_MAX];
+    off_t offset, size;
+    struct timespec mtime;
+    uint64_t requested = trace_now_us();
+    int fd = transport_recv_fd(server_socket, &offset, &size, &mtime, message, sizeof(message));
+    trace_span("sub-server first byte", requested);
+    if (fd < 0) {
+        LOG_ERROR("Sub-server could not open %s: %s\n", label, message);
+        frame_write_error(client_socket, message);
+        return -1;
+    }
+
+    if (if_none_match && answer_conditional_download(if_none_match, size, &mtime, client_socket)) {
+        close(fd);
+        return 0;
+    }
+    TRANSFER_STAT_ADD(descriptors_passed, 1);
+    int result = transmit_open_file_to_client(fd, offset, size, mode, label, client_socket, sched_class);
+    close(fd);
+    return result;
+}
+
+// Retrieve and send a file from a sub-server. Over the Unix-domain socket the sub-server just
+// opens the file for us; over TCP its frames are relayed, and it answers a conditional request
+// itself and sends a compressed file as stored if the client accepts that.
+void fetch_file_from_sub_server(const char *filename, const char *if_none_match, int accept_encoded, const char *socket_path, const char *server_ip, int server_port, int client_socket, const char *operation) {
+    int is_local;
+    uint64_t connect_started = trace_now_us();
+    int sock = transport_connect(socket_path, server_ip, server_port, &is_local);
+    trace_span("connect to sub-server", connect_started);
+    if (sock < 0) {
+        LOG_ERROR("Failed to connect to sub-server: %m\n");
+        frame_write_error(client_socket, "Sub-server unavailable.");
+        return;
+    }
+
+    char message[BUFFER_SIZE * 2];
+    char condition[FRAME_VALIDATOR_MAX + 32] = "";
+    if (if_none_match && !is_local) snprintf(condition, sizeof(condition), " " FRAME_IF_NONE_MATCH "%s", if_none_match);
+    const char *encoding = accept_encoded && !is_local ? " " SEEKABLE_ACCEPT_ENCODING SEEKABLE_ENCODING : "";
+    snprintf(message, sizeof(message), "%s %s%s%s%s\n", is_local ? "OPEN" : operation, filename, condition, encoding, trace_tag());
+    send(sock, message, strlen(message), MSG_NOSIGNAL);
+
+    if (is_local) {
+        enum seekable_mode mode = accept_encoded ? SEEKABLE_PASS_THROUGH : SEEKABLE_DECODE;
+        send_passed_descriptor(sock, filename, if_none_match, mode, client_socket, SCHED_INTERACTIVE);
+    } else {
+        relay_verified_frames(sock, client_socket, SCHED_INTERACTIVE);
+    }
+    close(sock);
+}
+
+// Retrieve and send an archive file from a sub-server. The sub-servers build their archives as
+// they send them, so the frames are relayed even over the local socket.
+void fetch_archive_from_sub_server(const char *filetype, const char *socket_path, const char *server_ip, int server_port, int client_socket) {
+    int is_local;
+    uint64_t connect_started = trace_now_us();
+    int sock = transport_connect(socket_path, server_ip, server_port, &is_local);
+    trace_span("connect to sub-server", connect_started);
+    if (sock < 0) {
+        LOG_ERROR("Failed to connect to sub-server: %m\n");
+        frame_write_error(client_socket, "Sub-server unavailable.");
+        return;
+    }
+
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message), "dtar %s%s\n", filetype, trace_tag());
+    send(sock, message, strlen(message), MSG_NOSIGNAL);
+    relay_verified_frames(sock, client_socket, SCHED_BULK);
+    close(sock);
+}
+
+// Report the transfer verification counters
+void process_stats_request(int client_socket) {
+    pthread_mutex_lock(&admission.lock);
+    unsigned long long admitted = admission.admitted, delayed = admission.delayed, shed = admission.shed;
+    double limit = admission.limit;
+    pthread_mutex_unlock(&admission.lock);
+
+    pthread_mutex_lock(&pack.lock);
+    size_t packed_files = pack.count;
+    unsigned long long packed_bytes = pack.live_bytes, compactions = pack.compactions;
+    pthread_mutex_unlock(&pack.lock);
+
+    pthread_mutex_lock(&flights.lock);
+    unsigned long long flights_direct = flights.direct, flights_started = flights.started, flights_joined = flights.joined;
+    unsigned long long flights_fell_back = flights.fell_back, flights_diverged = flights.diverged;
+    pthread_mutex_unlock(&flights.lock);
+
+    int subscribers = 0;
+    unsigned long long events_published = 0, events_coalesced = 0;
+    if (__atomic_load_n(&watch_feed_started, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&watch_feed.lock);
+        subscribers = watch_subscribers;
+        events_published = watch_feed.published;
+        events_coalesced = watch_feed.coalesced;
+        pthread_mutex_unlock(&watch_feed.lock);
+    }
+
+    unsigned long long tls_kernel, tls_user;
+    tls_channel_counts(&tls_kernel, &tls_user);
+
+    char reply[BUFFER_SIZE * 2];
+    snprintf(reply, sizeof(reply),
+             "Verified uploads: %llu\n"
+             "Downloads sent: %llu\n"
+             "Verified sub-server relays: %llu\n"
+             "Sent from sub-server descriptors: %llu\n"
+             "Verified bytes received: %llu\n"
+             "CRC32C mismatches: %llu\n"
+             "Truncated transfers: %llu\n"
+             "Transfers aborted by sender: %llu\n"
+             "Not modified replies: %llu\n"
+             "Downloads sent compressed: %llu\n"
+             "Requests admitted: %llu (%llu after queueing)\n"
+             "Requests shed: %llu\n"
+             "Concurrency limit: %.1f\n"
+             "Coalesced requests: %llu joined to %llu replies (%llu fell behind, %llu of them diverged), %llu sent directly\n"
+             "Log messages dropped: %llu\n"
+             "Resumable uploads: %llu completed (%llu chunks received)\n"
+             "Packed files: %zu (%llu bytes, %llu compactions)\n"
+             "Watch subscribers: %d (%llu events published, %llu changes coalesced)\n"
+             "Connections reaped: %llu header timeouts, %llu idle, %llu too slow\n"
+             "TLS connections: %llu encrypted by the kernel, %llu in user space\n",
+             __atomic_load_n(&transfer_stats.uploads_verified, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.downloads_sent, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.relays_verified, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.descriptors_passed, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.bytes_verified, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.crc_mismatches, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.truncated, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.remote_errors, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.not_modified, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.sent_encoded, __ATOMIC_RELAXED),
+             admitted, delayed, shed, limit, flights_joined, flights_started, flights_fell_back, flights_diverged, flights_direct, log_dropped(),
+             __atomic_load_n(&transfer_stats.upload_sessions, __ATOMIC_RELAXED),
+             __atomic_load_n(&transfer_stats.upload_chunks, __ATOMIC_RELAXED), packed_files, packed_bytes, compactions,
+             subscribers, events_published, events_coalesced, deadline_reaped(&deadlines, DEADLINE_REAP_HEADER),
+             deadline_reaped(&deadlines, DEADLINE_REAP_IDLE), deadline_reaped(&deadlines, DEADLINE_REAP_SLOW),
+             tls_kernel, tls_user);
+    send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
+}
+
+// Handle file list display requests by combining file lists from multiple servers
+void process_display_request(const char *pathname, int client_socket) {
+    // Anonymous temporary file, private to this connection
+    FILE *temp_file = tmpfile();
+    if (!temp_file) {
+        LOG_ERROR("Failed to create temporary file for file list: %m\n");
+        return;
+    }
+
+    combine_and_send_file_list(pathname, fileno(temp_file));
+
+    // Send the combined list to the client
+    uint64_t send_started = trace_now_us();
+    rewind(temp_file);
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), temp_file)) {
+        if (send(client_socket, line, strlen(line), MSG_NOSIGNAL) == -1) {
+            break;
+        }
+    }
+    trace_span("send to client", send_started);
+
+    fclose(temp_file);
+    LOG_INFO("File list successfully sent\n");
+}
+
+// Fetch file lists from sub-servers and combine them into a single list
+void retrieve_and_combine_file_lists(const char *filetype, const char *socket_path, const char *server_ip, int server_port, int output_fd) {
+    int is_local;
+    uint64_t connect_started = trace_now_us();
+    int sock = transport_connect(socket_path, server_ip, server_port, &is_local);
+    trace_span("connect to sub-server", connect_started);
+    if (sock < 0) {
+        LOG_ERROR("Failed to connect to sub-server: %m\n");
+        return;
+    }
+
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message), "display %s%s\n", filetype, trace_tag());
+    send(sock, message, strlen(message), 0);
+
+    char buffer[BUFFER_SIZE];
+    int bytes_received;
+    uint64_t requested = trace_now_us(), first_byte = 0;
+    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
+        if (!first_byte) {
+            trace_span("sub-server first byte", requested);
+            first_byte = trace_now_us();
+        }
+        write(output_fd, buffer, bytes_received);
+    }
+    trace_span("sub-server last byte", first_byte ? first_byte : requested);
+
+    close(sock);
+}
+
+// Combine file lists from different servers and write them to output_fd
+void combine_and_send_file_list(const char *pathname, int output_fd) {
+    char command[BUFFER_SIZE * 3];
+    FILE *temp_file = tmpfile();
+
+    if (!temp_file) {
+        LOG_ERROR("Failed to create temporary file for file list: %m\n");
+        return;
+    }
+
+    // List .c files and append to the temp file. Paths under ~/smain name the local tree, as for
+    // dfile, which is also where packed files are looked up.
+    char base_dir[BUFFER_SIZE];
+    char local_path[BUFFER_SIZE * 2];
+    const char *relative_path = NULL;
+    if (strncmp(pathname, "/home/{{user}}/smain", strlen("/home/{{user}}/smain")) == 0 && getcwd(base_dir, sizeof(base_dir))) {
+        relative_path = pathname + strlen("/home/{{user}}/smain");
+        while (*relative_path == '/') relative_path++;
+        snprintf(local_path, sizeof(local_path), "%s/smain/%s", base_dir, relative_path);
+        pathname = local_path;
+    }
+    uint64_t find_started = trace_now_us();
+    char line[BUFFER_SIZE];
+    char root[BUFFER_SIZE + 8];
+    char **paths;
+    size_t path_count;
+    if (relative_path) snprintf(root, sizeof(root), "%s/smain", base_dir);
+    if (relative_path && meta_snapshot_paths(root, relative_path, &paths, &path_count) == 0) {
+        // The metadata snapshot lists the tree without walking it
+        for (size_t i = 0; i < path_count; i++) {
+            const char *name = strrchr(paths[i], '/');
+            fprintf(temp_file, "%s\n", name ? name + 1 : paths[i]);
+            free(paths[i]);
+        }
+        free(paths);
+    } else {
+        snprintf(command, sizeof(command), "find %s -type f -name '*.c' -exec basename {} \\;", pathname);
+        FILE *pipe = popen(command, "r");
+        if (!pipe) {
+            LOG_ERROR("Failed to list .c files: %m\n");
+            fclose(temp_file);
+            return;
+        }
+        while (fgets(line, sizeof(line), pipe)) {
+            fprintf(temp_file, "%s", line);
+        }
+        pclose(pipe);
+    }
+
+    // Packed files below the same directory
+    struct pack_item *items;
+    size_t item_count = relative_path ? pack_list(&pack, &items) : 0;
+    size_t prefix_len = relative_path ? strlen(relative_path) : 0;
+    while (prefix_len > 0 && relative_path[prefix_len - 1] == '/') prefix_len--;
+    for (size_t i = 0; i < item_count; i++) {
+        const char *path = items[i].path;
+        if (prefix_len > 0 && (strncmp(path, relative_path, prefix_len) != 0 || path[prefix_len] != '/')) continue;
+        const char *name = strrchr(path, '/');
+        fprintf(temp_file, "%s\n", name ? name + 1 : path);
+    }
+    if (relative_path) pack_list_free(items, item_count);
+    trace_span("fs lookup", find_started);
+
+    // Append .pdf and .txt file lists from sub-servers
+    fseek(temp_file, 0, SEEK_END);
+    retrieve_and_combine_file_lists("pdf", SPDF_SOCKET_PATH, SPDF_IP, SPDF_PORT, fileno(temp_file));
+    fseek(temp_file, 0, SEEK_END);
+    retrieve_and_combine_file_lists("txt", STEXT_SOCKET_PATH, STEXT_IP, STEXT_PORT, fileno(temp_file));
+
+    // Copy the combined list to the output
+    rewind(temp_file);
+    while (fgets(line, sizeof(line), temp_file)) {
+        if (write_all(output_fd, line, strlen(line)) < 0) {
+            break;
+        }
+    }
+
+    fclose(temp_file);
+    LOG_INFO("File list assembled\n");
+}
+
+// State shared with the thread relaying Stext's grep/search results
+struct grep_relay {
+    const char *command;
+    const char *pattern_text;
+    int client_socket;
+    pthread_mutex_t *output_lock;
+    size_t matches;
+    uint64_t trace_id;
+};
+
+// Forward a grep/search request to Stext and relay its results, whole lines at a time, so they
+// interleave cleanly with the local results written under the same lock
+void *relay_grep_results(void *arg) {
+    struct grep_relay *relay = arg;
+    trace_begin(relay->trace_id);
+    int is_local;
+    uint64_t connect_started = trace_now_us();
+    int sock = transport_connect(STEXT_SOCKET_PATH, STEXT_IP, STEXT_PORT, &is_local);
+    trace_span("connect to sub-server", connect_started);
+    if (sock < 0) {
+        LOG_ERROR("Failed to connect to sub-server: %m\n");
+        trace_flush("Smain");
+        return NULL;
+    }
+
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message), "%s %s%s\n", relay->command, relay->pattern_text, trace_tag());
+    send(sock, message, strlen(message), 0);
+
+    char buffer[BUFFER_SIZE * 8];
+    size_t pending = 0;
+    int bytes_received;
+    uint64_t requested = trace_now_us(), first_byte = 0;
+    while ((bytes_received = recv(sock, buffer + pending, sizeof(buffer) - pending, 0)) > 0) {
+        if (!first_byte) {
+            trace_span("sub-server first byte", requested);
+            first_byte = trace_now_us();
+        }
+        pending += bytes_received;
+        char *last_newline = memrchr(buffer, '\n', pending);
+        if (!last_newline && pending < sizeof(buffer)) continue;
+
+        size_t complete = last_newline ? (size_t)(last_newline - buffer + 1) : pending;
+        for (char *p = buffer; (p = memchr(p, '\n', buffer + complete - p)) != NULL; p++) relay->matches++;
+        pthread_mutex_lock(relay->output_lock);
+        int failed = grep_write_all(relay->client_socket, buffer, complete) < 0;
+        pthread_mutex_unlock(relay->output_lock);
+        if (failed) break;
+
+        memmove(buffer, buffer + complete, pending - complete);
+        pending -= complete;
+    }
+    if (pending > 0) {
+        pthread_mutex_lock(relay->output_lock);
+        grep_write_all(relay->client_socket, buffer, pending);
+        pthread_mutex_unlock(relay->output_lock);
+    }
+    trace_span("sub-server last byte", first_byte ? first_byte : requested);
+
+    close(sock);
+    trace_flush("Smain");
+    return NULL;
+}
+
+// Search stored .c files locally and .txt files on Stext in parallel, streaming
+// "path:line:snippet" lines for every match back to the client. "grep" scans every file;
+// "search" narrows the files to scan with the trigram index first.
+void process_search_request(const char *command, const char *pattern_text, int client_socket) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        LOG_ERROR("Failed to get current directory: %m\n");
+        return;
+    }
+
+    struct grep_pattern pattern;
+    if (grep_pattern_compile(&pattern, pattern_text) < 0) {
+        const char *error_message = "Invalid search pattern.\n";
+        send(client_socket, error_message, strlen(error_message), 0);
+        LOG_WARN("Invalid search pattern '%s'\n", pattern_text);
+        return;
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // Let Stext search its tree while the local one is scanned
+    pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct grep_relay relay = { .command = command, .pattern_text = pattern_text, .client_socket = client_socket,
+                                .output_lock = &output_lock, .matches = 0, .trace_id = trace_current() };
+    pthread_t relay_thread;
+    int relaying = pthread_create(&relay_thread, NULL, relay_grep_results, &relay) == 0;
+
+    char root[BUFFER_SIZE + 8];
+    snprintf(root, sizeof(root), "%s/smain", base_dir);
+    size_t matches, candidates = 0;
+    uint64_t scan_started = trace_now_us();
+    if (strcmp(command, "search") == 0) {
+        matches = trigram_index_search(root, ".c", "smain", &pattern, client_socket, &output_lock, &candidates);
+    } else {
+        matches = grep_scan_tree(root, ".c", "smain", &pattern, client_socket, &output_lock);
+    }
+    // Packed files are not in the tree (or its index); they are scanned in one pass per segment
+    matches += scan_packed_files(&pattern, client_socket, &output_lock);
+    trace_span("local scan", scan_started);
+
+    if (relaying) {
+        pthread_join(relay_thread, NULL);
+    }
+    grep_pattern_free(&pattern);
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double elapsed_ms = (finished.tv_sec - started.tv_sec) * 1e3 + (finished.tv_nsec - started.tv_nsec) / 1e6;
+    if (strcmp(command, "search") == 0) {
+        LOG_INFO("Search for '%s' found %zu matching lines locally (%zu candidate files) and %zu on Stext in %.2f ms\n",
+               pattern_text, matches, candidates, relay.matches, elapsed_ms);
+    } else {
+        LOG_INFO("Search for '%s' found %zu matching lines locally and %zu on Stext in %.2f ms\n",
+               pattern_text, matches, relay.matches, elapsed_ms);
+    }
+}
+
+// Report a change Smain made to the .c tree to watch subscribers. The .txt and .pdf trees are
+// reported by Stext and Spdf, which watch them; packed files have no inode to watch, so Smain
+// announces its own changes here instead.
+void note_watch_change(const char *full_path, char op) {
+    char base_dir[BUFFER_SIZE];
+    if (!__atomic_load_n(&watch_feed_started, __ATOMIC_ACQUIRE) || getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        return;
+    }
+
+    char root[BUFFER_SIZE + 8];
+    int root_len = snprintf(root, sizeof(root), "%s/smain", base_dir);
+    size_t path_len = strlen(full_path);
+    if (strncmp(full_path, root, root_len) != 0 || full_path[root_len] != '/' ||
+        path_len < 2 || strcmp(full_path + path_len - 2, ".c") != 0) {
+        return;
+    }
+
+    char relative[BUFFER_SIZE], path[BUFFER_SIZE * 2];
+    relative_to_tree(full_path, root_len, relative, sizeof(relative));
+    snprintf(path, sizeof(path), "%s%s", WATCH_CLIENT_PATH, relative);
+    watch_feed_note(&watch_feed, op, path);
+}
+
+// Start the change feed: the flusher and one subscription per sub-server. Waits a little for the
+// sub-servers to start watching, so the first subscriber does not miss changes right after it.
+void start_watch_feed(void) {
+    if (watch_feed_init(&watch_feed) < 0) {
+        LOG_ERROR("Failed to allocate the change feed\n");
+        return;
+    }
+    __atomic_store_n(&watch_feed_started, 1, __ATOMIC_RELEASE);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, flush_watch_feed, NULL) != 0) {
+        LOG_ERROR("Failed to start the change feed flusher: %m\n");
+    }
+    size_t source_count = sizeof(sub_servers) / sizeof(sub_servers[0]);
+    for (size_t i = 0; i < source_count; i++) {
+        if (pthread_create(&thread, &attr, follow_sub_server_changes, (void *)&sub_servers[i]) != 0) {
+            LOG_ERROR("Failed to subscribe to %s changes: %m\n", sub_servers[i].label);
+            pthread_mutex_lock(&watch_feed.lock);
+            watch_sources_ready++;
+            pthread_mutex_unlock(&watch_feed.lock);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += WATCH_READY_WAIT_MS / 1000;
+    deadline.tv_nsec += (WATCH_READY_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&watch_feed.lock);
+    while (watch_sources_ready < (int)source_count &&
+           pthread_cond_timedwait(&watch_feed.changed, &watch_feed.lock, &deadline) != ETIMEDOUT) {
+    }
+    pthread_mutex_unlock(&watch_feed.lock);
+    LOG_INFO("Change feed started from sequence %llu\n", (unsigned long long)watch_feed.next_seq);
+}
+
+// Publish coalesced changes as they come in
+void *flush_watch_feed(void *arg) {
+    (void)arg;
+    while (1) {
+        watch_feed_flush_next(&watch_feed);
+    }
+    return NULL;
+}
+
+// Keep one NOTIFY subscription open to a sub-server and feed its changes in, subscribing again if
+// it drops. Changes made while no subscription was open are lost, so every gap after the first
+// subscription is published as a resync.
+void *follow_sub_server_changes(void *arg) {
+    const struct sub_server *source = arg;
+    int settled = 0, gap = 0;
+    char *buffer = malloc(WATCH_PATH_MAX * 2);
+    if (!buffer) {
+        LOG_ERROR("Failed to allocate %s change buffer\n", source->label);
+        return NULL;
+    }
+
+    while (1) {
+        int is_local, ready = 0;
+        int sock = transport_connect(source->socket_path, source->server_ip, source->server_port, &is_local);
+        const char *request = "NOTIFY\n";
+        if (sock >= 0 && send(sock, request, strlen(request), MSG_NOSIGNAL) > 0) {
+            size_t len = 0;
+            ssize_t n;
+            while ((n = recv(sock, buffer + len, WATCH_PATH_MAX * 2 - 1 - len, 0)) > 0) {
+                len += n;
+                char *line = buffer, *newline;
+                while ((newline = memchr(line, '\n', buffer + len - line)) != NULL) {
+                    *newline = '\0';
+                    if (!ready && strcmp(line, "ready") == 0) {
+                        ready = 1;
+                        if (gap) watch_feed_note(&watch_feed, '!', "");
+                        gap = 0;
+                        if (!settled) {
+                            settled = 1;
+                            pthread_mutex_lock(&watch_feed.lock);
+                            watch_sources_ready++;
+                            pthread_cond_broadcast(&watch_feed.changed);
+                            pthread_mutex_unlock(&watch_feed.lock);
+                        }
+                        LOG_INFO("Following changes from %s\n", source->label);
+                    } else if (ready && line[0] && (line[1] == ' ' || line[1] == '\0')) {
+                        char path[WATCH_PATH_MAX * 2 + 32];
+                        snprintf(path, sizeof(path), "%s%s", WATCH_CLIENT_PATH, line[1] ? line + 2 : "");
+                        watch_feed_note(&watch_feed, line[0], path);
+                    }
+                    line = newline + 1;
                 }
-            } else {
-                fprintf(stderr, "Failed to parse command: %s\n", buffer);
+                len -= line - buffer;
+                memmove(buffer, line, len);
+                if (len == WATCH_PATH_MAX * 2 - 1) len = 0;  // No path is that long; drop the garbage
+            }
+        }
+        if (sock >= 0) close(sock);
+
+        if (ready) {
+            LOG_WARN("Lost the change stream from %s, subscribing again\n", source->label);
+        } else if (!settled) {
+            LOG_WARN("Could not subscribe to %s changes, retrying\n", source->label);
+            settled = 1;
+            pthread_mutex_lock(&watch_feed.lock);
+            watch_sources_ready++;
+            pthread_cond_broadcast(&watch_feed.changed);
+            pthread_mutex_unlock(&watch_feed.lock);
+        }
+        gap = 1;
+        struct timespec pause = { WATCH_RECONNECT_MS / 1000, (WATCH_RECONNECT_MS % 1000) * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// Stream changes to a watch subscriber as "<seq> <create|modify|delete> <path>" lines, starting
+// with "<seq> watching". A subscriber that passes the last sequence number it saw gets the changes
+// since then; if they are no longer all kept (or it fell too far behind) it gets "<seq> resync"
+// and should list the files again. The stream lasts until the subscriber disconnects.
+void process_watch_request(const char *since, int client_socket) {
+    pthread_once(&watch_feed_once, start_watch_feed);
+    if (!__atomic_load_n(&watch_feed_started, __ATOMIC_ACQUIRE)) {
+        const char *message = "Change feed unavailable.\n";
+        send(client_socket, message, strlen(message), MSG_NOSIGNAL);
+        return;
+    }
+
+    size_t out_size = WATCH_PATH_MAX * 4;
+    char *out = malloc(out_size);
+    pthread_mutex_lock(&watch_feed.lock);
+    if (!out || watch_subscribers >= WATCH_MAX_SUBSCRIBERS) {
+        pthread_mutex_unlock(&watch_feed.lock);
+        free(out);
+        const char *message = "Too many watchers, retry later.\n";
+        send(client_socket, message, strlen(message), MSG_NOSIGNAL);
+        return;
+    }
+    watch_subscribers++;
+    uint64_t last = watch_feed.next_seq - 1;
+    uint64_t cursor = since ? strtoull(since, NULL, 10) + 1 : watch_feed.next_seq;
+    pthread_mutex_unlock(&watch_feed.lock);
+    LOG_INFO("Watch subscriber joined at sequence %llu\n", (unsigned long long)cursor);
+
+    int len = snprintf(out, out_size, "%llu watching\n", (unsigned long long)last);
+    int failed = send(client_socket, out, len, MSG_NOSIGNAL) != len;
+    while (!failed) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += 1;
+        pthread_mutex_lock(&watch_feed.lock);
+        int timed_out = 0;
+        while (cursor == watch_feed.next_seq && !timed_out) {
+            timed_out = pthread_cond_timedwait(&watch_feed.changed, &watch_feed.lock, &deadline) == ETIMEDOUT;
+        }
+        ssize_t ready = watch_feed_format_locked(&watch_feed, &cursor, out, out_size);
+        if (ready < 0) {
+            cursor = watch_feed.next_seq;
+            ready = snprintf(out, out_size, "%llu resync\n", (unsigned long long)(cursor - 1));
+        }
+        pthread_mutex_unlock(&watch_feed.lock);
+
+        if (ready > 0) {
+            failed = write_all(client_socket, out, ready) < 0;
+        } else {
+            // Nothing new for a while: find out whether the subscriber is still there
+            char probe;
+            failed = recv(client_socket, &probe, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+        }
+    }
+
+    pthread_mutex_lock(&watch_feed.lock);
+    watch_subscribers--;
+    pthread_mutex_unlock(&watch_feed.lock);
+    free(out);
+    LOG_INFO("Watch subscriber left at sequence %llu\n", (unsigned long long)cursor);
+}
+
+// Journal a change to a stored .c or .txt file so the trigram index picks it up
+void note_index_change(const char *full_path, char op) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        return;
+    }
+
+    const char *trees[][2] = { { "smain", ".c" }, { "stext", ".txt" } };
+    for (size_t i = 0; i < sizeof(trees) / sizeof(trees[0]); i++) {
+        char root[BUFFER_SIZE + 8];
+        int root_len = snprintf(root, sizeof(root), "%s/%s", base_dir, trees[i][0]);
+        size_t path_len = strlen(full_path), ext_len = strlen(trees[i][1]);
+        if (strncmp(full_path, root, root_len) != 0 || full_path[root_len] != '/' ||
+            path_len < ext_len || strcmp(full_path + path_len - ext_len, trees[i][1]) != 0) {
+            continue;
+        }
+
+        char relative[BUFFER_SIZE];
+        relative_to_tree(full_path, root_len, relative, sizeof(relative));
+        trigram_index_note_change(root, relative, op);
+        return;
+    }
+}
+
+// Journal a change to a loose .c file in the metadata snapshot; crc is the digest of an upload
+void note_snapshot_change(const char *full_path, char op, int have_crc, uint32_t crc) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        return;
+    }
+
+    char root[BUFFER_SIZE + 8];
+    int root_len = snprintf(root, sizeof(root), "%s/smain", base_dir);
+    size_t path_len = strlen(full_path);
+    if (strncmp(full_path, root, root_len) != 0 || full_path[root_len] != '/' ||
+        path_len < 2 || strcmp(full_path + path_len - 2, ".c") != 0) {
+        return;
+    }
+
+    char relative[BUFFER_SIZE];
+    relative_to_tree(full_path, root_len, relative, sizeof(relative));
+    meta_snapshot_note(root, relative, op, have_crc, crc);
+}
+
+// Bring the metadata snapshot of the .c tree up to date with the disk, in the background so
+// that the server serves from the snapshot it has meanwhile
+void *reconcile_metadata(void *arg) {
+    char *root = arg;
+    uint64_t started = trace_now_us();
+    struct meta_reconcile_stats stats;
+    if (meta_snapshot_reconcile(root, ".c", &stats) < 0) {
+        LOG_ERROR("Failed to reconcile the metadata snapshot of %s\n", root);
+    } else {
+        LOG_INFO("Reconciled the metadata snapshot of %s in %.1f ms: %zu files, %zu added, %zu changed, %zu removed\n",
+                 root, (trace_now_us() - started) / 1000.0, stats.files, stats.added, stats.changed, stats.removed);
+    }
+    free(root);
+    return NULL;
+}
+
+// Path of a file below a tree root root_len bytes long, without the root or repeated slashes,
+// as the trigram index and the pack store key them
+void relative_to_tree(const char *full_path, size_t root_len, char *relative, size_t relative_size) {
+    size_t len = 0;
+    for (const char *p = full_path + root_len; *p && len + 1 < relative_size; p++) {
+        if (*p == '/' && (len == 0 || relative[len - 1] == '/')) continue;
+        relative[len++] = *p;
+    }
+    relative[len] = '\0';
+}
+
+// Whether full_path is a .c file the pack store keeps; if so, relative receives its key
+int pack_path_for(const char *full_path, char *relative, size_t relative_size) {
+    char base_dir[BUFFER_SIZE];
+    if (!pack_enabled(&pack) || getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        return 0;
+    }
+    char root[BUFFER_SIZE + 8];
+    int root_len = snprintf(root, sizeof(root), "%s/smain", base_dir);
+    size_t path_len = strlen(full_path);
+    if (strncmp(full_path, root, root_len) != 0 || full_path[root_len] != '/' ||
+        path_len < 2 || strcmp(full_path + path_len - 2, ".c") != 0) {
+        return 0;
+    }
+    relative_to_tree(full_path, root_len, relative, relative_size);
+    return 1;
+}
+
+// Grep every packed file, streaming "smain/<path>:line:snippet" records like grep_scan_tree().
+// Returns the number of matching lines.
+size_t scan_packed_files(const struct grep_pattern *pattern, int client_socket, pthread_mutex_t *output_lock) {
+    struct pack_item *items;
+    size_t item_count = pack_list(&pack, &items);
+    struct grep_output out = { 0 };
+    size_t matches = 0;
+    char *buffer = item_count > 0 ? malloc(PACK_MAX_FILE_SIZE > 0 ? PACK_MAX_FILE_SIZE : 1) : NULL;
+    for (size_t i = 0; i < item_count && buffer; i++) {
+        if (items[i].length > PACK_MAX_FILE_SIZE ||
+            pread(items[i].fd, buffer, items[i].length, items[i].offset) != (ssize_t)items[i].length) {
+            continue;
+        }
+        char label[BUFFER_SIZE * 5];
+        snprintf(label, sizeof(label), "smain/%s", items[i].path);
+        size_t found = grep_scan_buffer(pattern, buffer, items[i].length, label, &out);
+        if (found > 0) {
+            pthread_mutex_lock(output_lock);
+            int failed = grep_write_all(client_socket, out.data, out.len) < 0;
+            pthread_mutex_unlock(output_lock);
+            out.len = 0;
+            matches += found;
+            if (failed) break;
+        }
+    }
+    free(buffer);
+    free(out.data);
+    pack_list_free(items, item_count);
+    return matches;
+}
+
+// Read one request from a client, run it and close the connection
+void *handle_client_connection(void *arg) {
+    struct client_connection *connection = arg;
+    int client_sock = connection->sock;
+    char peer[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &connection->address.sin_addr, peer, sizeof(peer));
+    free(connection);
+
+    uint64_t accepted = trace_now_us();
+    client_sock = tls_channel_accept(client_sock);
+    if (client_sock < 0) {
+        LOG_WARN("TLS handshake with %s failed: %s\n", peer, tls_channel_last_error());
+        return NULL;
+    }
+    struct deadline_entry deadline;
+    deadline_track(&deadlines, &deadline, client_sock);
+    struct command_reader reader;
+    command_reader_init(&reader);
+    if (command_read(&reader, client_sock) == 0) {
+        deadline_header_done(&deadlines, &deadline);
+        trace_begin(trace_sample());
+        trace_span("receive command", accepted);
+        uint64_t parse_started = trace_now_us();
+
+        // Anything after the command line is the start of an upload body
+        size_t body_len;
+        const char *body = command_body(&reader, &body_len);
+        LOG_INFO("Received command: %.*s\n", (int)reader.line_len, reader.line);
+        struct command command;
+        command_parse(&reader, &command);
+        const struct command_cost *cost = command_costs[command.op].cost ? &command_costs[command.op] : &command_costs[OP_UNKNOWN];
+        trace_span("parse", parse_started);
+
+        // Admit the request according to its cost, or turn it away quickly if the server is saturated.
+        // A watch subscription lasts as long as its client and is bounded by WATCH_MAX_SUBSCRIBERS
+        // instead, so that it does not hold admission capacity forever. A request that will share
+        // a reply already being produced only costs the sending.
+        struct admission_ticket ticket;
+        int retry_after_ms;
+        char key[FLIGHT_KEY_MAX];
+        int units = coalescing_key(&command, key, sizeof(key)) && flight_joinable(&flights, key) ? 1 : cost->cost;
+        uint64_t admission_started = trace_now_us();
+        if (command.op == OP_WATCH) {
+            deadline_exempt(&deadlines, &deadline);
+            process_watch_request(command.argc > 0 ? command.argv[0] : NULL, client_sock);
+        } else if (admission_enter(&admission, command.op, units, &ticket, &retry_after_ms) < 0) {
+            trace_span("shed", admission_started);
+            LOG_WARN("Shed %s request, retry after %d ms\n", cost->name, retry_after_ms);
+            reply_server_busy(client_sock, cost->framed_reply, retry_after_ms);
+        } else {
+            trace_span("admission", admission_started);
+            uint64_t dispatched = trace_now_us();
+            if (cost->changes_tree) flight_change_begin(&flights);
+            dispatch_client_command(&command, client_sock, body, body_len);
+            if (cost->changes_tree) flight_change_end(&flights);
+            trace_span(cost->name, dispatched);
+            admission_exit(&admission, &ticket);
+        }
+        trace_flush("Smain");
+    } else {
+        LOG_INFO("No data received or client disconnected.\n");
+    }
+
+    int reaped = deadline_untrack(&deadlines, &deadline);
+    if (reaped) LOG_WARN("Reaped connection from %s (%s)\n", peer, deadline_reason_names[reaped - 1]);
+    tls_channel_close(client_sock);
+    return NULL;
+}
+
+// Run the handler for a parsed request
+void dispatch_client_command(const struct command *command, int client_sock, const char *body, size_t body_len) {
+    const char *const *argv = command->argv;
+    switch (command->op) {
+    case OP_UFILE:
+        if (command->argc < 2) break;
+        process_upload_file(argv[0], argv[1], client_sock, body, body_len);
+        return;
+    case OP_UDELTA:
+        if (command->argc < 2) break;
+        process_delta_upload(argv[0], argv[1], client_sock);
+        return;
+    case OP_UTAR:
+        if (command->argc < 1) break;
+        process_archive_upload(argv[0], client_sock, body, body_len);
+        return;
+    case OP_UDECLARE:
+        if (command->argc < 5) break;
+        process_upload_declare(argv[0], argv[1], argv[2], argv[3], argv[4], client_sock);
+        return;
+    case OP_UCHUNK:
+        if (command->argc < 2) break;
+        process_upload_chunk(argv[0], argv[1], client_sock, body, body_len);
+        return;
+    case OP_DFILE: {
+        if (command->argc < 1) break;
+        struct coalesced_request request = { .op = OP_DFILE };
+        for (int i = 1; i < command->argc; i++) {
+            const char *if_none_match = frame_if_none_match(argv[i]);
+            if (if_none_match) {
+                request.conditional = 1;
+                snprintf(request.if_none_match, sizeof(request.if_none_match), "%s", if_none_match);
+            } else if (seekable_accepts(argv[i])) {
+                request.accept_encoded = 1;
             }
+        }
+        snprintf(request.argument, sizeof(request.argument), "%s", argv[0]);
+        serve_coalesced_request(&request, command, client_sock);
+        return;
+    }
+    case OP_RMFILE:
+        if (command->argc < 1) break;
+        process_remove_file(argv[0], client_sock);
+        return;
+    case OP_DTAR:
+    case OP_DISPLAY: {
+        if (command->argc < 1) break;
+        struct coalesced_request request = { .op = command->op };
+        snprintf(request.argument, sizeof(request.argument), "%s", argv[0]);
+        serve_coalesced_request(&request, command, client_sock);
+        return;
+    }
+    case OP_GREP:
+    case OP_SEARCH:
+        if (command->argc < 1) break;
+        process_search_request(command->name, argv[0], client_sock);
+        return;
+    case OP_STATS:
+        process_stats_request(client_sock);
+        return;
+    default:
+        LOG_WARN("Unsupported command: %s\n", command->name);
+        return;
+    }
+    LOG_WARN("Missing arguments for %s\n", command->name);
+}
+
+// The key under which identical requests share a reply: the command and its arguments, so a dfile
+// only shares with one naming the same file, validator and encoding. Returns 0 for a command
+// whose reply is never shared.
+int coalescing_key(const struct command *command, char *key, size_t key_size) {
+    if (command->op != OP_DFILE && command->op != OP_DTAR && command->op != OP_DISPLAY) return 0;
+    size_t len = snprintf(key, key_size, "%s", command_costs[command->op].name);
+    for (int i = 0; i < command->argc && len < key_size; i++) {
+        len += snprintf(key + len, key_size - len, " %s", command->argv[i]);
+    }
+    return len < key_size;
+}
+
+// Send the reply to a dfile, dtar or display request, sharing it with any identical request
+// already in progress (see single_flight.h). A request nobody shares runs on client_sock itself.
+void serve_coalesced_request(struct coalesced_request *request, const struct command *command, int client_sock) {
+    char key[FLIGHT_KEY_MAX];
+    int sched_class = request->op == OP_DTAR ? SCHED_BULK : SCHED_INTERACTIVE;
+    if (!coalescing_key(command, key, sizeof(key)) ||
+        flight_serve(&flights, key, run_coalesced_request, request, sizeof(*request), client_sock,
+                     transfer_sched, sched_class, peer_address(client_sock)) < 0) {
+        run_coalesced_request(request, client_sock);
+    }
+}
+
+// Run a request that may share its reply, sending the reply to sock
+void run_coalesced_request(void *arg, int sock) {
+    struct coalesced_request *request = arg;
+    switch (request->op) {
+    case OP_DFILE:
+        process_download_file(request->argument, request->conditional ? request->if_none_match : NULL,
+                              request->accept_encoded, sock);
+        break;
+    case OP_DTAR:
+        process_archive_request(request->argument, sock);
+        break;
+    case OP_DISPLAY:
+        process_display_request(request->argument, sock);
+        break;
+    default:
+        break;
+    }
+}
+
+// Tell a shed client when to try again, in the form its command expects a reply in
+void reply_server_busy(int client_socket, int framed_reply, int retry_after_ms) {
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message), "Server busy, retry after %d ms.", retry_after_ms);
+    if (framed_reply) {
+        frame_write_error(client_socket, message);
+    } else {
+        strcat(message, "\n");
+        send(client_socket, message, strlen(message), MSG_NOSIGNAL);
+    }
+}
+
+// Main function to run the server
+int main() {
+    // A client that disconnects mid-transfer must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+    log_start();
+
+    if (tls_channel_init(TLS_ROLE_SERVER | TLS_ROLE_CLIENT) < 0) {
+        LOG_ERROR("Failed to set up TLS: %s\n", tls_channel_last_error());
+        exit(EXIT_FAILURE);
+    }
+    if (tls_channel_user_space_only()) LOG_WARN("Kernel TLS is not available (load the tls module); TLS is encrypted in user space\n");
+    int server_fd = initialize_server_socket(PORT);
+    transfer_sched = sched_create();
+    admission_init(&admission);
+    flight_table_init(&flights);
+    deadline_init(&deadlines);
+    if (deadline_start(&deadlines) < 0) {
+        LOG_ERROR("Failed to start the connection deadline thread: %m\n");
+    }
+
+    // Replay the pack store's journal before serving anything from it
+    char base_dir[BUFFER_SIZE];
+    char pack_root[BUFFER_SIZE + 8];
+    pack.dir_fd = -1;
+    pthread_mutex_init(&pack.lock, NULL);
+    if (PACK_MAX_FILE_SIZE > 0 && getcwd(base_dir, sizeof(base_dir))) {
+        snprintf(pack_root, sizeof(pack_root), "%s/smain", base_dir);
+        if (pack_open(&pack, pack_root) < 0) {
+            LOG_ERROR("Failed to open pack store in %s, storing every file loose\n", pack_root);
+        } else {
+            LOG_INFO("Pack store holds %zu files (%llu bytes)\n", pack.count, (unsigned long long)pack.live_bytes);
+        }
+    }
+
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+
+    // display and dtar .c serve from the metadata snapshot as soon as it is mapped; the walk
+    // that checks it against the disk runs behind them
+    char meta_root[BUFFER_SIZE + 8];
+    if (getcwd(base_dir, sizeof(base_dir))) {
+        snprintf(meta_root, sizeof(meta_root), "%s/smain", base_dir);
+        uint64_t load_started = trace_now_us();
+        struct meta_view view;
+        if (meta_view_open(&view, meta_root) == 0) {
+            LOG_INFO("Metadata snapshot of %s: %u files, %zu journal records, loaded in %.2f ms\n", meta_root,
+                     view.header->entry_count, view.records, (trace_now_us() - load_started) / 1000.0);
         } else {
-            printf("No data received or client disconnected.\n");
+            LOG_INFO("No metadata snapshot of %s yet, walking it until one is built\n", meta_root);
+        }
+        meta_view_close(&view);
+        pthread_t thread;
+        char *root = strdup(meta_root);
+        if (!root || pthread_create(&thread, &thread_attr, reconcile_metadata, root) != 0) {
+            LOG_ERROR("Failed to start metadata reconcile: %m\n");
+            free(root);
+        }
+    }
+
+    // Serve each client on its own thread so that small requests need not wait for bulk transfers
+    while (1) {
+        struct client_connection *connection = malloc(sizeof(*connection));
+        if (!connection) {
+            LOG_ERROR("Failed to allocate connection: %m\n");
+            sleep(1);
+            continue;
+        }
+        socklen_t addrlen = sizeof(connection->address);
+        connection->sock = accept(server_fd, (struct sockaddr *)&connection->address, &addrlen);
+        if (connection->sock < 0) {
+            LOG_ERROR("Failed to accept connection: %m\n");
+            free(connection);
+            continue;
         }
 
-        close(client_sock);
+        pthread_t thread;
+        int client_sock = connection->sock;
+        if (pthread_create(&thread, &thread_attr, handle_client_connection, connection) != 0) {
+            LOG_ERROR("Failed to start connection thread: %m\n");
+            close(client_sock);
+            free(connection);
+        }
     }
 
     return 0;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // For memmem() and REG_STARTEND used by grep_scan.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,18 +9,59 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>  // For the `getcwd()` function
+#include "grep_scan.h"  // Parallel content search for the grep command
+#include "trigram_index.h"  // Persistent index for the search command
+#include "frame.h"  // CRC32C-checked framing for file transfers
+#include "sched.h"  // Fair-share scheduling of outgoing transfers
+#include "transport.h"  // Unix-domain socket and descriptor passing for a co-located Smain
+#include "trace.h"  // Spans for requests Smain is tracing
+#include "command.h"  // Request line parsing and opcodes
+#include "log.h"  // Asynchronous logging off the transfer path
+#include "tar_stream.h"  // Tar archives and members for Smain's dtar requests
+#include "seekable.h"  // Compressed storage of .txt files, sent as stored or decoded
+#include "watch_feed.h"  // Change notifications for Smain's watch command
+#include "deadline.h"  // Header, idle and throughput deadlines for connections
+#include "hot_cache.h"  // Shared memory cache of the most requested files
+#include "meta_snapshot.h"  // Metadata snapshot of the .txt tree for display and dtar
+#include <sys/wait.h>
+#include <poll.h>
 
 #define PORT 50502
+#define SOCKET_PATH "/tmp/stext.sock"
 #define BUFFER_SIZE 1024
 
+// Created before the first fork so that every child schedules against the same flows
+static struct transfer_sched *transfer_sched;
+
+// Set up before forking and shared with every child: the parent's thread checks all of the
+// connections, each child only flags the progress of its own
+static struct deadline_wheel *deadlines;
+static struct deadline_entry *connection_deadline;
+
+// Shared by every child, so a file one child read in is served from memory to all of them
+static struct hot_cache *hot_cache;
+
 // Function prototypes
 int initialize_server();
-void process_client_request(int client_sock);
-void transfer_file_to_client(const char *filename, int client_socket);
+void process_client_request(int client_sock, int is_local);
+int open_stored_file(const char *filename, off_t *size, const char **error_message);
+int answer_if_none_match(const char *filename, const char *if_none_match, off_t size, const struct timespec *mtime, int client_socket);
+void transfer_cached_file(const char *filename, struct hot_cache_hit *hit, const char *if_none_match, int client_socket, int sched_class);
+void transfer_file_to_client(const char *filename, const char *if_none_match, int accept_encoded, int client_socket, int sched_class);
+void log_hot_cache(void);
+void pass_file_descriptor(const char *filename, int client_socket);
 void remove_file(const char *filename, int client_socket);
+void receive_uploaded_files(const char *filename, int client_socket, const char *received, size_t received_len);
+int store_uploaded_file(const char *filename, int client_socket, const char *received, size_t received_len);
+int create_parent_directories(char *filepath, size_t root_len);
 void generate_tar_archive(int client_socket);
+void stream_tar_members(int client_socket, int whole_archive);
+void stream_tree_events(int client_socket);
 void display_files(int client_sock);
+void start_metadata_snapshot(void);
+void search_file_contents(const char *command, const char *pattern_text, int client_sock);
 
 // Function to initialize the server and set up the listening socket
 int initialize_server() {
@@ -29,13 +71,13 @@ int initialize_server() {
     // Create a socket for the server
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == 0) {
-        printf("Error: Socket creation failed\n");
+        LOG_ERROR("Error: Socket creation failed\n");
         exit(EXIT_FAILURE);
     }
 
     // Set socket options to allow reuse of the address and port
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        printf("Error: Setsockopt failed\n");
+        LOG_ERROR("Error: Setsockopt failed\n");
         exit(EXIT_FAILURE);
     }
 
@@ -46,187 +88,702 @@ int initialize_server() {
 
     // Bind the socket to the specified port
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        printf("Error: Bind failed\n");
+        LOG_ERROR("Error: Bind failed\n");
         exit(EXIT_FAILURE);
     }
 
     // Start listening for incoming connections
-    if (listen(server_fd, 10) < 0) {
-        printf("Error: Listen failed\n");
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        LOG_ERROR("Error: Listen failed\n");
         exit(EXIT_FAILURE);
     }
 
-    printf("Stext server initialized and listening on port %d...\n", PORT);
+    LOG_INFO("Stext server initialized and listening on port %d...\n", PORT);
     return server_fd;
 }
 
-// Function to handle client requests
-void process_client_request(int client_sock) {
-    char message[BUFFER_SIZE], command[16], filename[256];
-    int bytes_read;
-
-    // Read the incoming message from the client
-    bytes_read = recv(client_sock, message, sizeof(message) - 1, 0);
-    if (bytes_read <= 0) {
-        printf("Error: Failed to read message\n");
+// Function to handle client requests. OPEN hands back a descriptor instead of the data and is
+// only served over the Unix-domain socket (is_local).
+void process_client_request(int client_sock, int is_local) {
+    struct command_reader reader;
+    struct command command;
+    uint64_t accepted = trace_now_us();
+
+    // Read the request line, however it is split across segments
+    command_reader_init(&reader);
+    if (command_read(&reader, client_sock) < 0) {
+        LOG_ERROR("Error: Failed to read message\n");
         return;
     }
-    message[bytes_read] = '\0';  // Null-terminate the message
-    printf("Received message: %s\n", message);  // For debugging purposes
+    deadline_header_done(deadlines, connection_deadline);
+    LOG_DEBUG("Received message: %.*s\n", (int)reader.line_len, reader.line);
 
     // Parse the command and filename from the message
-    sscanf(message, "%15s %255s", command, filename);
-    printf("Parsed command: %s, filename: %s\n", command, filename);
-
-    // Handle the command based on its type
-    if (strcmp(command, "RETRIEVE") == 0) {
-        transfer_file_to_client(filename, client_sock);
-        printf("Successfully retrieved file: %s\n", filename);
-    } else if (strcmp(command, "DELETE") == 0) {
+    command_parse(&reader, &command);
+
+    // Smain tags requests it is tracing; record this side of them under the same id
+    uint64_t trace_id = 0;
+    if (command.argc > 0 && (trace_id = trace_tag_value(command.argv[command.argc - 1])) != 0) command.argc--;
+    trace_begin(trace_id);
+    trace_span("receive command", accepted);
+    uint64_t handled = trace_now_us();
+
+    const char *filename = command.argc > 0 ? command.argv[0] : "";
+    LOG_DEBUG("Parsed command: %s, filename: %s\n", command.name, filename);
+
+    // Descriptor passing only makes sense to a co-located Smain
+    if (!is_local && command.op == OP_OPEN) command.op = OP_UNKNOWN;
+
+    // Execute the appropriate action based on the command
+    switch (command.op) {
+    case OP_PUT: {
+        size_t body_len;
+        const char *body = command_body(&reader, &body_len);
+        receive_uploaded_files(filename, client_sock, body, body_len);
+        break;
+    }
+    case OP_RETRIEVE: {
+        const char *if_none_match = NULL;
+        int accept_encoded = 0;
+        for (int i = 1; i < command.argc; i++) {
+            if (frame_if_none_match(command.argv[i])) if_none_match = frame_if_none_match(command.argv[i]);
+            else if (seekable_accepts(command.argv[i])) accept_encoded = 1;
+        }
+        transfer_file_to_client(filename, if_none_match, accept_encoded, client_sock, SCHED_INTERACTIVE);
+        LOG_INFO("Successfully retrieved file: %s\n", filename);
+        break;
+    }
+    case OP_DELETE:
         remove_file(filename, client_sock);
-        printf("Successfully deleted file: %s\n", filename);
-    } else if (strcmp(command, "dtar") == 0) {
+        LOG_INFO("Successfully deleted file: %s\n", filename);
+        break;
+    case OP_OPEN:
+        pass_file_descriptor(filename, client_sock);
+        break;
+    case OP_DTAR:
         generate_tar_archive(client_sock);
-        printf("Successfully created and sent tar archive\n");
-    } else if (strcmp(command, "display") == 0) {
+        LOG_INFO("Successfully created and sent tar archive\n");
+        break;
+    case OP_MEMBERS:
+        stream_tar_members(client_sock, 0);
+        break;
+    case OP_NOTIFY:
+        // Quiet for as long as the tree is; the stream ends when Smain hangs up
+        deadline_exempt(deadlines, connection_deadline);
+        stream_tree_events(client_sock);
+        break;
+    case OP_DISPLAY:
         display_files(client_sock);
-        printf("Successfully displayed files\n");
-    } else {
+        LOG_INFO("Successfully displayed files\n");
+        break;
+    case OP_GREP:
+    case OP_SEARCH:
+        search_file_contents(command.name, filename, client_sock);
+        break;
+    default: {
         char *error_message = "Unsupported command received.\n";
         send(client_sock, error_message, strlen(error_message), 0);
-        printf("Error: Unsupported command received\n");
+        LOG_WARN("Error: Unsupported command received\n");
+        break;
     }
+    }
+
+    trace_span("handle request", handled);
+    trace_flush("Stext");
 }
 
-// Function to transfer a file to the client
-void transfer_file_to_client(const char *filename, int client_socket) {
+// Function to open a stored file (relative to the stext directory) for reading.
+// Returns the descriptor and its size, or -1 with the message to send back.
+int open_stored_file(const char *filename, off_t *size, const char **error_message) {
     char base_dir[BUFFER_SIZE];
     if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
-        printf("Error: getcwd() failed\n");
-        return;
+        LOG_ERROR("Error: getcwd() failed\n");
+        *error_message = "Server error.";
+        return -1;
+    }
+
+    // Only paths below the storage directory may be requested
+    if (strstr(filename, "..") != NULL) {
+        LOG_WARN("Error: Rejected file name %s\n", filename);
+        *error_message = "Invalid file name.";
+        return -1;
     }
 
-    char filepath[512];
+    char filepath[BUFFER_SIZE + 512];
     snprintf(filepath, sizeof(filepath), "%s/stext/%s", base_dir, filename);
 
-    FILE *file = fopen(filepath, "rb");
-    if (!file) {
-        printf("Error: Failed to open file %s\n", filepath);
+    uint64_t lookup_started = trace_now_us();
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    int usable = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    trace_span("fs lookup", lookup_started);
+    if (!usable) {
+        LOG_ERROR("Error: Failed to open file %s\n", filepath);
+        if (fd >= 0) close(fd);
+        *error_message = "File not found.";
+        return -1;
+    }
+    *size = st.st_size;
+    return fd;
+}
+
+// Function to answer a conditional request from the size and mtime of the file; returns 1 if
+// the client's copy is current and nothing more is to be sent
+int answer_if_none_match(const char *filename, const char *if_none_match, off_t size, const struct timespec *mtime, int client_socket) {
+    if (!if_none_match) return 0;
+    char validator[FRAME_VALIDATOR_MAX];
+    frame_validator(size, mtime, validator, sizeof(validator));
+    int current = frame_validator_matches(if_none_match, validator);
+    frame_write_validator(client_socket, validator, current);
+    if (current) LOG_INFO("Not modified: %s\n", filename);
+    return current;
+}
+
+// Function to send a file straight from the hot cache
+void transfer_cached_file(const char *filename, struct hot_cache_hit *hit, const char *if_none_match, int client_socket, int sched_class) {
+    if (answer_if_none_match(filename, if_none_match, hit->size, &hit->mtime, client_socket)) {
+        hot_cache_release(hot_cache, hit, 0);
+        return;
+    }
+
+    struct frame_writer writer;
+    frame_writer_init(&writer, client_socket);
+    struct sched_flow *flow = sched_open(transfer_sched, sched_class, 0);
+    frame_writer_schedule(&writer, transfer_sched, flow);
+    int result = 0;
+    if (hit->compressed && frame_write_encoding(client_socket, SEEKABLE_ENCODING) < 0) result = -1;
+    if (result == 0) result = frame_write_file_range(&writer, hit->fd, hit->offset, hit->size);
+    if (result < 0 || frame_finish(&writer) < 0) {
+        result = -1;
+        LOG_ERROR("Error: Failed to send file data\n");
+    } else {
+        LOG_INFO("Sent %llu bytes from %s out of the hot cache (CRC32C %08x)\n", (unsigned long long)writer.total, filename, writer.crc);
+    }
+    sched_close(transfer_sched, flow);
+    hot_cache_release(hot_cache, hit, result < 0 ? 0 : hit->size);
+    log_hot_cache();
+}
+
+// Function to transfer a file to the client as CRC32C-checked frames,
+// sharing the link with the other children's transfers according to sched_class. A
+// conditional request (if_none_match) gets the file's validator first, or only a not-modified
+// answer if Smain's client already has this version. A file stored compressed is sent as it is
+// if the client accepts that encoding (accept_encoded), and otherwise decoded as it goes.
+void transfer_file_to_client(const char *filename, const char *if_none_match, int accept_encoded, int client_socket, int sched_class) {
+    struct hot_cache_hit hit;
+    if (strstr(filename, "..") == NULL && hot_cache_lookup(hot_cache, filename, accept_encoded, &hit) == 0) {
+        transfer_cached_file(filename, &hit, if_none_match, client_socket, sched_class);
+        return;
+    }
+
+    const char *error_message;
+    off_t size;
+    uint64_t since = hot_cache_changes(hot_cache);
+    int fd = open_stored_file(filename, &size, &error_message);
+    if (fd < 0) {
+        frame_write_error(client_socket, error_message);
+        return;
+    }
+
+    struct stat st;
+    int have_stat = fstat(fd, &st) == 0;
+    if (have_stat && answer_if_none_match(filename, if_none_match, size, &st.st_mtim, client_socket)) {
+        close(fd);
         return;
     }
 
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        int bytes_sent = send(client_socket, buffer, bytes_read, 0);
-        if (bytes_sent < 0) {
-            printf("Error: Failed to send file data\n");
-            break;
+    struct seekable_info info = { 0 };
+    int compressed = seekable_probe(fd, size, &info);
+    if (have_stat) hot_cache_insert(hot_cache, filename, fd, size, &st.st_mtim, compressed, since);
+    uint64_t send_started = trace_now_us();
+    struct frame_writer writer;
+    frame_writer_init(&writer, client_socket);
+    struct sched_flow *flow = sched_open(transfer_sched, sched_class, 0);
+    frame_writer_schedule(&writer, transfer_sched, flow);
+    int result;
+    if (compressed && accept_encoded) {
+        result = frame_write_encoding(client_socket, SEEKABLE_ENCODING) < 0 ? -1 : frame_write_file(&writer, fd, size);
+        if (result < 0) writer.failed = 1;
+    } else if (compressed) {
+        result = seekable_write_range(&writer, fd, &info, 0, info.size);
+    } else {
+        result = frame_write_file(&writer, fd, size);
+    }
+    if (compressed) seekable_release(&info);
+    if (result < 0) {
+        LOG_ERROR("Error: Failed to send file data\n");
+        if (!writer.failed) frame_write_error(client_socket, "Failed to read file.");
+    } else if (frame_finish(&writer) < 0) {
+        LOG_ERROR("Error: Failed to send file data\n");
+    } else {
+        LOG_INFO("Sent %llu bytes from %s (CRC32C %08x)\n", (unsigned long long)writer.total, filename, writer.crc);
+    }
+
+    sched_close(transfer_sched, flow);
+    trace_span("send file", send_started);
+    close(fd);
+    log_hot_cache();
+    LOG_INFO("File transfer completed for %s\n", filename);
+}
+
+// Log how well the hot cache is doing across all children
+void log_hot_cache(void) {
+    struct hot_cache_stats stats;
+    if (hot_cache_stats(hot_cache, &stats) < 0) return;
+    LOG_INFO("Hot cache: %.1f%% hits (%llu of %llu lookups), %llu bytes served from memory, %llu files admitted, %llu rejected\n",
+             stats.lookups ? 100.0 * stats.hits / stats.lookups : 0.0, stats.hits, stats.lookups,
+             stats.bytes_saved, stats.admitted, stats.rejected);
+}
+
+// Function to hand Smain an open descriptor for a stored file so that it can send the file
+// to its client itself. A file in the hot cache is handed over as its place in the arena, which
+// stays pinned until Smain hangs up.
+void pass_file_descriptor(const char *filename, int client_socket) {
+    struct hot_cache_hit hit;
+    uint64_t pass_started = trace_now_us();
+    // A compressed entry is passed over: Smain decides from the stored copy whether to decode it
+    if (strstr(filename, "..") == NULL && hot_cache_lookup(hot_cache, filename, 0, &hit) == 0) {
+        int passed = transport_send_fd(client_socket, hit.fd, hit.offset, hit.size, &hit.mtime);
+        trace_span("pass descriptor", pass_started);
+        if (passed < 0) {
+            LOG_ERROR("Error: Failed to pass descriptor for %s\n", filename);
+            hot_cache_release(hot_cache, &hit, 0);
+            return;
         }
-        printf("Sent %d bytes from %s\n", bytes_sent, filepath);
+
+        // Smain reads the arena until it closes the connection; only then may the space be reused
+        char byte;
+        ssize_t n;
+        while ((n = recv(client_socket, &byte, 1, 0)) > 0 || (n < 0 && errno == EINTR));
+        hot_cache_release(hot_cache, &hit, hit.size);
+        LOG_INFO("Passed the hot cache's copy of %s (%lld bytes)\n", filename, (long long)hit.size);
+        log_hot_cache();
+        return;
     }
 
-    fclose(file);
-    printf("File transfer completed for %s\n", filepath);
+    const char *error_message;
+    off_t size;
+    uint64_t since = hot_cache_changes(hot_cache);
+    int fd = open_stored_file(filename, &size, &error_message);
+    if (fd < 0) {
+        transport_send_error(client_socket, error_message);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        transport_send_error(client_socket, "Failed to read file.");
+        close(fd);
+        return;
+    }
+    int passed = transport_send_fd(client_socket, fd, 0, size, &st.st_mtim);
+    trace_span("pass descriptor", pass_started);
+    if (passed < 0) {
+        LOG_ERROR("Error: Failed to pass descriptor for %s\n", filename);
+        close(fd);
+        return;
+    }
+    LOG_INFO("Passed descriptor for %s (%lld bytes)\n", filename, (long long)size);
+
+    // Offer the file to the hot cache once Smain has it, as a RETRIEVE would
+    struct seekable_info info = { 0 };
+    int compressed = seekable_probe(fd, size, &info);
+    if (compressed) seekable_release(&info);
+    hot_cache_insert(hot_cache, filename, fd, size, &st.st_mtim, compressed, since);
+    close(fd);
 }
 
 // Function to remove a file from the server
 void remove_file(const char *filename, int client_socket) {
     char base_dir[BUFFER_SIZE];
     if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
-        printf("Error: getcwd() failed\n");
+        LOG_ERROR("Error: getcwd() failed\n");
         return;
     }
 
-    char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/stext/%s", base_dir, filename);
+    char root[BUFFER_SIZE + 8];
+    char filepath[BUFFER_SIZE * 2];
+    snprintf(root, sizeof(root), "%s/stext", base_dir);
+    if (snprintf(filepath, sizeof(filepath), "%s/%s", root, filename) >= (int)sizeof(filepath)) {
+        char *error_message = "Path too long.\n";
+        send(client_socket, error_message, strlen(error_message), 0);
+        return;
+    }
 
     if (remove(filepath) == 0) {
+        hot_cache_invalidate(hot_cache, filename);
+        trigram_index_note_change(root, filename, '-');
+        meta_snapshot_note(root, filename, '-', 0, 0);
         char *success_message = "File deleted successfully.\n";
         send(client_socket, success_message, strlen(success_message), 0);
-        printf("File deleted successfully: %s\n", filepath);
+        LOG_INFO("File deleted successfully: %s\n", filepath);
     } else {
-        printf("Error: Failed to delete file %s\n", filepath);
+        LOG_ERROR("Error: Failed to delete file %s\n", filepath);
         char *error_message = "Failed to delete file.\n";
         send(client_socket, error_message, strlen(error_message), 0);
     }
 }
 
-// Function to create and send a tar archive of .txt files
+// Function to store the .txt files Smain relays from its clients' uploads. Once one is
+// acknowledged Smain may send another PUT on the same connection (a utar sends one per member),
+// so the connection is kept until it asks for something else or hangs up.
+void receive_uploaded_files(const char *filename, int client_socket, const char *received, size_t received_len) {
+    struct command_reader reader;
+    struct command command;
+    while (store_uploaded_file(filename, client_socket, received, received_len) == 0) {
+        command_reader_init(&reader);
+        if (command_read(&reader, client_socket) < 0) return;
+        command_parse(&reader, &command);
+        if (command.op != OP_PUT || command.argc < 1) return;
+        filename = command.argv[0];
+        received = command_body(&reader, &received_len);
+    }
+}
+
+// Function to store one uploaded file below the stext directory. The body arrives as
+// CRC32C-checked frames (starting with any bytes that were read along with the request line)
+// and is written under a temporary name, which only replaces the target once the whole-file
+// digest has matched. The reply line is what Smain's client is told, so it is sent last.
+// Returns 0 if the connection is still in step for another request.
+int store_uploaded_file(const char *filename, int client_socket, const char *received, size_t received_len) {
+    static char buffer[FRAME_MAX_PAYLOAD];
+    char base_dir[BUFFER_SIZE];
+    char filepath[BUFFER_SIZE + 512], temp_path[BUFFER_SIZE + 560];
+    const char *error = NULL;
+    int fd = -1;
+
+    // A rejected upload is still read to its end, so that the next request can follow it
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        LOG_ERROR("Error: getcwd() failed\n");
+        error = "server error";
+    } else if (filename[0] == '\0' || strstr(filename, "..") != NULL) {
+        LOG_WARN("Error: Rejected file name %s\n", filename);
+        error = "invalid file name";
+    } else {
+        snprintf(filepath, sizeof(filepath), "%s/stext/%s", base_dir, filename);
+        snprintf(temp_path, sizeof(temp_path), "%s.put.%d", filepath, (int)getpid());
+        if (create_parent_directories(filepath, strlen(base_dir)) < 0 ||
+            (fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+            LOG_ERROR("Error: Failed to open %s for writing\n", temp_path);
+            error = "could not store file";
+        }
+    }
+
+    uint64_t receive_started = trace_now_us();
+    struct frame_reader reader;
+    frame_reader_init(&reader, client_socket, received, received_len);
+    ssize_t n;
+    while ((n = frame_read(&reader, buffer)) > 0) {
+        for (ssize_t written = 0, w; !error && written < n; written += w) {
+            if ((w = write(fd, buffer + written, n - written)) < 0) {
+                if (errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                LOG_ERROR("Error: Failed to write %s\n", temp_path);
+                error = "could not store file";
+            }
+        }
+    }
+    trace_span("receive file", receive_started);
+    if (fd >= 0 && close(fd) != 0 && !error) error = "could not store file";
+    if (n < 0 && !error) error = frame_status_text(&reader);
+    if (!error) seekable_compress_at(AT_FDCWD, temp_path);
+    if (!error && rename(temp_path, filepath) != 0) error = "could not store file";
+
+    char reply[BUFFER_SIZE];
+    if (error) {
+        if (fd >= 0) unlink(temp_path);
+        snprintf(reply, sizeof(reply), "Upload failed: %s.\n", error);
+        LOG_ERROR("Error: Upload of %s discarded: %s\n", filename, error);
+    } else {
+        snprintf(filepath, sizeof(filepath), "%s/stext", base_dir);
+        hot_cache_invalidate(hot_cache, filename);
+        trigram_index_note_change(filepath, filename, '+');
+        meta_snapshot_note(filepath, filename, '+', 1, reader.crc);
+        snprintf(reply, sizeof(reply), "File uploaded and verified: %llu bytes, CRC32C %08x.\n",
+                 (unsigned long long)reader.total, reader.crc);
+        LOG_INFO("Stored %llu bytes as %s (CRC32C %08x)\n", (unsigned long long)reader.total, filename, reader.crc);
+    }
+    if (send(client_socket, reply, strlen(reply), MSG_NOSIGNAL) < 0) return -1;
+    return n == 0 ? 0 : -1;
+}
+
+// Function to create the directories leading to a file, from the one after the first
+// root_len bytes of its path, as an upload may name sub-directories that do not exist yet
+int create_parent_directories(char *filepath, size_t root_len) {
+    for (char *p = filepath + root_len; (p = strchr(p + 1, '/')) != NULL;) {
+        *p = '\0';
+        int failed = mkdir(filepath, 0755) < 0 && errno != EEXIST;
+        *p = '/';
+        if (failed) return -1;
+    }
+    return 0;
+}
+
+// Function to create and send a tar archive of .txt files, built as it is sent so that files
+// stored compressed go into it with their original contents
 void generate_tar_archive(int client_socket) {
+    stream_tar_members(client_socket, 1);
+    LOG_INFO("Tar archive of .txt files sent\n");
+}
+
+// Function to send every stored .txt file to Smain as tar members named "stext/<path>". Without
+// whole_archive the end-of-archive blocks are left off, for Smain to merge the members into a
+// dtar * archive.
+void stream_tar_members(int client_socket, int whole_archive) {
     char base_dir[BUFFER_SIZE];
     if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
-        printf("Error: getcwd() failed\n");
+        LOG_ERROR("Error: getcwd() failed\n");
+        frame_write_error(client_socket, "Server error.");
         return;
     }
 
-    // Command to create a tar archive of all .txt files in the stext directory
-    char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "tar -cvf %s/stext/textfiles.tar -C %s/stext --exclude=textfiles.tar *.txt", base_dir, base_dir);
-    system(command);
+    char root[BUFFER_SIZE + 8];
+    snprintf(root, sizeof(root), "%s/stext", base_dir);
+    uint64_t lookup_started = trace_now_us();
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char **paths = NULL;
+    size_t path_count = 0, path_cap = 0;
+    if (root_fd >= 0 && meta_snapshot_paths(root, "", &paths, &path_count) < 0) {
+        grep_collect_files(dup(root_fd), "", ".txt", &paths, &path_count, &path_cap);
+    }
+    trace_span("fs lookup", lookup_started);
+
+    uint64_t send_started = trace_now_us();
+    struct frame_writer writer;
+    frame_writer_init(&writer, client_socket);
+    struct sched_flow *flow = sched_open(transfer_sched, SCHED_BULK, 0);
+    frame_writer_schedule(&writer, transfer_sched, flow);
+    struct tar_stream stream;
+    int failed = tar_stream_init(&stream, &writer) < 0 || tar_stream_add_tree(&stream, root_fd, paths, path_count, "stext") < 0;
+    int ended = whole_archive ? tar_stream_finish(&stream) : tar_stream_close(&stream);
+    failed = ended < 0 || failed || frame_finish(&writer) < 0;
+    sched_close(transfer_sched, flow);
+    trace_span("send members", send_started);
+
+    for (size_t i = 0; i < path_count; i++) free(paths[i]);
+    free(paths);
+    if (root_fd >= 0) close(root_fd);
+
+    if (!failed) {
+        LOG_INFO("Sent %llu tar members (%llu bytes, CRC32C %08x)\n", stream.members, (unsigned long long)writer.total, writer.crc);
+    } else if (writer.failed) {
+        LOG_ERROR("Error: Failed to send tar members\n");
+    } else {
+        LOG_ERROR("Error: Failed to create tar members\n");
+        frame_write_error(client_socket, "Failed to create tar file.");
+    }
+}
 
-    // Send the tar file to the client
-    transfer_file_to_client("textfiles.tar", client_socket);
+// Send Smain the changes to the .txt tree for as long as it stays subscribed. Only the
+// initial walk visits the whole tree; after that the work follows the rate of change.
+void stream_tree_events(int client_socket) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        LOG_ERROR("Error: getcwd() failed\n");
+        return;
+    }
 
-    // Remove the tar file after sending it
-    snprintf(command, sizeof(command), "%s/stext/textfiles.tar", base_dir);
-    remove(command);
-    printf("Tar file for .txt files created, sent, and removed successfully\n");
+    char root[BUFFER_SIZE + 8];
+    snprintf(root, sizeof(root), "%s/stext", base_dir);
+    LOG_INFO("Smain subscribed to changes in %s\n", root);
+    if (tree_watch_stream(client_socket, root, ".txt") < 0) {
+        LOG_ERROR("Failed to watch %s: %m\n", root);
+        return;
+    }
+    LOG_INFO("Smain unsubscribed from changes in %s\n", root);
 }
 
 // Function to display the list of .txt files to the client
 void display_files(int client_sock) {
     char base_dir[BUFFER_SIZE];
     if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
-        printf("Error: getcwd() failed\n");
+        LOG_ERROR("Error: getcwd() failed\n");
         return;
     }
 
     // Command to find and list all .txt files in the stext directory
     const char *file_extension = ".txt";
-    char command[BUFFER_SIZE];
+    char command[BUFFER_SIZE * 2];
     FILE *pipe;
     char line[BUFFER_SIZE];
 
+    uint64_t list_started = trace_now_us();
+    char root[BUFFER_SIZE + 8];
+    char **paths;
+    size_t path_count;
+    snprintf(root, sizeof(root), "%s/stext", base_dir);
+    if (meta_snapshot_paths(root, "", &paths, &path_count) == 0) {
+        // The metadata snapshot lists the tree without walking it
+        for (size_t i = 0; i < path_count; i++) {
+            const char *name = strrchr(paths[i], '/');
+            snprintf(line, sizeof(line), "%s\n", name ? name + 1 : paths[i]);
+            send(client_sock, line, strlen(line), 0);
+            free(paths[i]);
+        }
+        free(paths);
+        trace_span("list files", list_started);
+        LOG_INFO("File list sent successfully\n");
+        return;
+    }
+
     snprintf(command, sizeof(command), "find %s/stext -type f -name '*%s' -exec basename {} \\;", base_dir, file_extension);
     pipe = popen(command, "r");
     if (!pipe) {
-        printf("Error: Failed to list files\n");
+        LOG_ERROR("Error: Failed to list files\n");
         return;
     }
 
     while (fgets(line, sizeof(line), pipe)) {
         send(client_sock, line, strlen(line), 0);
-        printf("Listed file: %s", line);
+        LOG_DEBUG("Listed file: %s", line);
     }
 
     pclose(pipe);
-    printf("File list sent successfully\n");
+    trace_span("list files", list_started);
+    LOG_INFO("File list sent successfully\n");
+}
+
+// Function to report what the metadata snapshot of the .txt tree holds, then reconcile it with
+// the disk in a child of its own, so that display and dtar are served from it meanwhile
+void start_metadata_snapshot(void) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        LOG_ERROR("Error: getcwd() failed\n");
+        return;
+    }
+
+    char root[BUFFER_SIZE + 8];
+    snprintf(root, sizeof(root), "%s/stext", base_dir);
+    uint64_t load_started = trace_now_us();
+    struct meta_view view;
+    if (meta_view_open(&view, root) == 0) {
+        LOG_INFO("Metadata snapshot of %s: %u files, %zu journal records, loaded in %.2f ms\n", root,
+                 view.header->entry_count, view.records, (trace_now_us() - load_started) / 1000.0);
+    } else {
+        LOG_INFO("No metadata snapshot of %s yet, walking it until one is built\n", root);
+    }
+    meta_view_close(&view);
+
+    int pid = fork();
+    if (pid == 0) {
+        log_start();  // The parent's flusher thread does not survive fork()
+        struct meta_reconcile_stats stats;
+        uint64_t started = trace_now_us();
+        if (meta_snapshot_reconcile(root, ".txt", &stats) < 0) {
+            LOG_ERROR("Error: Failed to reconcile the metadata snapshot of %s\n", root);
+        } else {
+            LOG_INFO("Reconciled the metadata snapshot of %s in %.1f ms: %zu files, %zu added, %zu changed, %zu removed\n",
+                     root, (trace_now_us() - started) / 1000.0, stats.files, stats.added, stats.changed, stats.removed);
+        }
+        exit(0);
+    } else if (pid < 0) {
+        LOG_ERROR("Error: Fork failed\n");
+    }
+}
+
+// Function to search the stored .txt files and send every matching line to the client.
+// "grep" scans every file; "search" uses the trigram index to pick the files to scan.
+void search_file_contents(const char *command, const char *pattern_text, int client_sock) {
+    char base_dir[BUFFER_SIZE];
+    if (getcwd(base_dir, sizeof(base_dir)) == NULL) {
+        LOG_ERROR("Error: getcwd() failed\n");
+        return;
+    }
+
+    struct grep_pattern pattern;
+    if (grep_pattern_compile(&pattern, pattern_text) < 0) {
+        char *error_message = "Invalid search pattern.\n";
+        send(client_sock, error_message, strlen(error_message), 0);
+        LOG_WARN("Error: Invalid search pattern %s\n", pattern_text);
+        return;
+    }
+
+    char root[BUFFER_SIZE + 8];
+    snprintf(root, sizeof(root), "%s/stext", base_dir);
+    pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+    size_t matches, candidates = 0;
+    uint64_t scan_started = trace_now_us();
+    if (strcmp(command, "search") == 0) {
+        matches = trigram_index_search(root, ".txt", "stext", &pattern, client_sock, &output_lock, &candidates);
+        LOG_INFO("Indexed search for %s found %zu matching lines in %zu candidate files\n", pattern_text, matches, candidates);
+    } else {
+        matches = grep_scan_tree(root, ".txt", "stext", &pattern, client_sock, &output_lock);
+        LOG_INFO("Search for %s found %zu matching lines\n", pattern_text, matches);
+    }
+
+    trace_span("scan", scan_started);
+    grep_pattern_free(&pattern);
 }
 
 // Main function to start the server and handle incoming connections
 int main() {
+    log_start();
+    start_metadata_snapshot();
     int server_fd = initialize_server();
-    printf("Stext server is now listening on port %d...\n", PORT);
+    transfer_sched = sched_create();
+    if (tls_channel_init(TLS_ROLE_SERVER) < 0) {
+        LOG_ERROR("Error: Failed to set up TLS: %s\n", tls_channel_last_error());
+        exit(EXIT_FAILURE);
+    }
+    if (tls_channel_user_space_only()) LOG_WARN("Error: Kernel TLS is not available (load the tls module); TLS is encrypted in user space\n");
+    hot_cache = hot_cache_create("stext-hot-cache");
+    deadlines = deadline_create_shared();
+    if (!deadlines || deadline_start(deadlines) < 0) {
+        LOG_ERROR("Error: Failed to start the connection deadline thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A co-located Smain connects here instead of going through TCP loopback
+    int local_fd = transport_listen_local(SOCKET_PATH);
+    if (local_fd < 0) {
+        LOG_WARN("Error: Could not listen on %s, serving TCP only\n", SOCKET_PATH);
+    }
+    LOG_INFO("Stext server is now listening on port %d...\n", PORT);
 
     while (1) {
-        struct sockaddr_in address;
-        int addrlen = sizeof(address);
-        int client_sock = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
+        struct pollfd listeners[2] = { { server_fd, POLLIN, 0 }, { local_fd, POLLIN, 0 } };
+        if (poll(listeners, local_fd >= 0 ? 2 : 1, -1) < 0) continue;
+        int is_local = !(listeners[0].revents & POLLIN);
+        int client_sock = accept(is_local ? local_fd : server_fd, NULL, NULL);
         if (client_sock < 0) {
-            printf("Error: Accept failed\n");
+            LOG_ERROR("Error: Accept failed\n");
             continue;
         }
 
+        // Reap finished children so the scheduler can tell crashed ones from live ones
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+
+        // The deadline thread keeps the parent's descriptor to watch the connection through
+        connection_deadline = deadline_track_shared(deadlines, client_sock);
+        if (!connection_deadline) LOG_WARN("Error: Too many connections to track, serving this one without deadlines\n");
+
         int pid = fork();
         if (pid == 0) {
+            log_start();  // The parent's flusher thread does not survive fork()
             close(server_fd);
-            process_client_request(client_sock);
+            if (local_fd >= 0) close(local_fd);
+            if (!is_local && (client_sock = tls_channel_accept(client_sock)) < 0) {
+                LOG_WARN("Error: TLS handshake failed: %s\n", tls_channel_last_error());
+                deadline_untrack(deadlines, connection_deadline);
+                exit(0);
+            }
+            process_client_request(client_sock, is_local);
+            int reaped = deadline_untrack(deadlines, connection_deadline);
+            if (reaped) {
+                LOG_WARN("Reaped connection (%s); reaped so far: %llu header timeouts, %llu idle, %llu too slow\n",
+                         deadline_reason_names[reaped - 1], deadline_reaped(deadlines, DEADLINE_REAP_HEADER),
+                         deadline_reaped(deadlines, DEADLINE_REAP_IDLE), deadline_reaped(deadlines, DEADLINE_REAP_SLOW));
+            }
+            tls_channel_close(client_sock);
             exit(0);
         } else if (pid > 0) {
-            close(client_sock);
+            if (connection_deadline) deadline_set_owner(deadlines, connection_deadline, pid);
+            else close(client_sock);
         } else {
-            printf("Error: Fork failed\n");
+            LOG_ERROR("Error: Fork failed\n");
+            if (connection_deadline) deadline_untrack(deadlines, connection_deadline);
+            else close(client_sock);
         }
     }
 
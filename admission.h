@@ -0,0 +1,175 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+// Admission control for Smain's connection threads.
+//
+// Every command has a cost in abstract units (a dtar counts far more than an rmfile). A request
+// is admitted while the cost of the requests in progress stays under the concurrency limit;
+// otherwise it waits in a bounded queue for up to ADMISSION_QUEUE_WAIT_MS, and once the queue is
+// full, or the wait runs out, it is turned away at once with an estimate of when to retry. That
+// keeps an overloaded server working at its best rate instead of letting every request slow down
+// together until clients time out.
+//
+// The limit adapts AIMD-style to observed service time. Each command kind keeps a baseline, the
+// best service time it recently achieved, and every completion is scored as its ratio to that
+// baseline (capped, so one huge transfer cannot dominate). While the smoothed ratio stays within
+// ADMISSION_LATENCY_TOLERANCE the limit grows by about one unit per limit's worth of completed
+// work; above it, the limit is cut by ADMISSION_BACKOFF, at most once per ADMISSION_BACKOFF_GAP_MS.
+
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#define ADMISSION_INITIAL_LIMIT 32.0    // Cost units in progress at once
+#define ADMISSION_MIN_LIMIT 4.0
+#define ADMISSION_MAX_LIMIT 512.0
+#define ADMISSION_QUEUE_MAX 64          // Requests allowed to wait for capacity
+#define ADMISSION_QUEUE_WAIT_MS 2000    // Longest a queued request waits before it is shed
+#define ADMISSION_LATENCY_TOLERANCE 2.0
+#define ADMISSION_RATIO_CAP 8.0
+#define ADMISSION_BACKOFF 0.8
+#define ADMISSION_BACKOFF_GAP_MS 100
+#define ADMISSION_KINDS 16              // Command kinds with their own latency baseline
+#define ADMISSION_RETRY_MIN_MS 50
+#define ADMISSION_RETRY_MAX_MS 10000
+
+struct admission {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    double limit;
+    int in_flight;              // Cost units of the requests being served
+    int queued;                 // Requests waiting for capacity
+    int queued_cost;
+    double baseline[ADMISSION_KINDS];   // Best recent service time per kind, in seconds
+    double per_unit;            // Moving average of service time per cost unit, for retry hints
+    double ratio;               // Moving average of service time over baseline
+    struct timespec last_backoff;
+    unsigned long long admitted;
+    unsigned long long delayed; // Admitted after waiting in the queue
+    unsigned long long shed;
+};
+
+// An admitted request, handed back to admission_exit()
+struct admission_ticket {
+    int kind;
+    int cost;
+    struct timespec started;
+};
+
+static inline double admission_seconds_between(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static inline void admission_init(struct admission *adm) {
+    memset(adm, 0, sizeof(*adm));
+    pthread_mutex_init(&adm->lock, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adm->changed, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    adm->limit = ADMISSION_INITIAL_LIMIT;
+}
+
+// A request always fits on an idle server, however costly it is
+static inline int admission_fits(const struct admission *adm, int cost) {
+    return adm->in_flight == 0 || adm->in_flight + cost <= adm->limit;
+}
+
+// How long a turned-away client should wait: the time to work off the queue ahead of it
+static inline int admission_retry_after_ms(const struct admission *adm, int cost) {
+    double per_unit = adm->per_unit > 0 ? adm->per_unit : 0.1;
+    int ms = (int)(per_unit * (adm->queued_cost + adm->in_flight + cost) / adm->limit * 1000);
+    if (ms < ADMISSION_RETRY_MIN_MS) ms = ADMISSION_RETRY_MIN_MS;
+    if (ms > ADMISSION_RETRY_MAX_MS) ms = ADMISSION_RETRY_MAX_MS;
+    return ms;
+}
+
+// Admit a request of the given kind and cost, waiting in the queue if need be. Returns 0 once
+// admitted (pair with admission_exit()), or -1 with the suggested retry delay if it is shed.
+static inline int admission_enter(struct admission *adm, int kind, int cost, struct admission_ticket *ticket, int *retry_after_ms) {
+    pthread_mutex_lock(&adm->lock);
+    int waited = 0;
+    if (adm->queued > 0 || !admission_fits(adm, cost)) {
+        if (adm->queued >= ADMISSION_QUEUE_MAX) {
+            adm->shed++;
+            *retry_after_ms = admission_retry_after_ms(adm, cost);
+            pthread_mutex_unlock(&adm->lock);
+            return -1;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ADMISSION_QUEUE_WAIT_MS / 1000;
+        deadline.tv_nsec += (ADMISSION_QUEUE_WAIT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        adm->queued++;
+        adm->queued_cost += cost;
+        int timed_out = 0;
+        while (!admission_fits(adm, cost) && !timed_out) {
+            timed_out = pthread_cond_timedwait(&adm->changed, &adm->lock, &deadline) == ETIMEDOUT;
+        }
+        adm->queued--;
+        adm->queued_cost -= cost;
+        if (!admission_fits(adm, cost)) {
+            adm->shed++;
+            *retry_after_ms = admission_retry_after_ms(adm, cost);
+            pthread_mutex_unlock(&adm->lock);
+            return -1;
+        }
+        waited = 1;
+    }
+
+    adm->in_flight += cost;
+    adm->admitted++;
+    adm->delayed += waited;
+    pthread_mutex_unlock(&adm->lock);
+    ticket->kind = kind % ADMISSION_KINDS;
+    ticket->cost = cost;
+    clock_gettime(CLOCK_MONOTONIC, &ticket->started);
+    return 0;
+}
+
+// Finish an admitted request and feed its service time back into the limit
+static inline void admission_exit(struct admission *adm, const struct admission_ticket *ticket) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = admission_seconds_between(&ticket->started, &now);
+
+    pthread_mutex_lock(&adm->lock);
+    int busy = adm->in_flight >= adm->limit / 2;
+    adm->in_flight -= ticket->cost;
+
+    // The baseline follows new minimums at once and drifts up slowly otherwise, so it tracks the
+    // unloaded speed even if that changes
+    double *baseline = &adm->baseline[ticket->kind];
+    if (*baseline == 0 || elapsed < *baseline) *baseline = elapsed;
+    else *baseline += (elapsed - *baseline) * 0.01;
+    double ratio = *baseline > 0 ? elapsed / *baseline : 1.0;
+    if (ratio > ADMISSION_RATIO_CAP) ratio = ADMISSION_RATIO_CAP;
+    adm->ratio = adm->ratio == 0 ? ratio : adm->ratio * 0.9 + ratio * 0.1;
+    double per_unit = elapsed / ticket->cost;
+    adm->per_unit = adm->per_unit == 0 ? per_unit : adm->per_unit * 0.9 + per_unit * 0.1;
+
+    if (adm->ratio > ADMISSION_LATENCY_TOLERANCE) {
+        if (admission_seconds_between(&adm->last_backoff, &now) * 1000 >= ADMISSION_BACKOFF_GAP_MS) {
+            adm->limit *= ADMISSION_BACKOFF;
+            if (adm->limit < ADMISSION_MIN_LIMIT) adm->limit = ADMISSION_MIN_LIMIT;
+            adm->last_backoff = now;
+        }
+    } else if (busy) {
+        // Only grow while the limit is actually in use, or an idle server would drift to the maximum
+        adm->limit += (double)ticket->cost / adm->limit;
+        if (adm->limit > ADMISSION_MAX_LIMIT) adm->limit = ADMISSION_MAX_LIMIT;
+    }
+
+    pthread_cond_broadcast(&adm->changed);
+    pthread_mutex_unlock(&adm->lock);
+}
+
+#endif
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "command.h"
+
+// Microbenchmark and fuzz driver for the request parser (command.h).
+//
+// The benchmark feeds a mix of real request lines to the parser, whole and split into segments
+// of a few bytes as TCP may deliver them, and reports parses per second on one core. The
+// sscanf() and strcmp() chain the servers used before is timed on the same lines for comparison.
+//
+// --fuzz N runs N inputs derived from valid requests by random byte flips, insertions,
+// deletions and truncations, plus purely random bytes. Each input is parsed three ways: fed to
+// the reader in one piece, fed in random segments, and sent over a socket pair to command_read().
+// All three must agree with a plain reference parser on the line, the opcode (looked up by a
+// linear scan instead of the perfect hash), every argument and the body. Any difference aborts
+// and prints the input in hex. Build with -DCOMMAND_LIBFUZZER and -fsanitize=fuzzer to hand the
+// same check to libFuzzer instead of the built-in driver.
+
+#define BENCH_SECONDS 1.0
+#define FUZZ_INPUT_MAX (COMMAND_LINE_MAX + 256)
+
+// Request lines as clients and Smain send them
+static const char *const bench_lines[] = {
+    "ufile report.txt /home/{{user}}/smain/docs/2024\n",
+    "dfile /home/{{user}}/smain/src/main.c if-crc=1a2b3c4d encoding=deflate-seekable\n",
+    "rmfile /home/{{user}}/smain/old/notes.pdf\n",
+    "dtar .txt\n",
+    "display /home/{{user}}/smain/projects\n",
+    "grep ^int[[:space:]]+main\n",
+    "search foo_bar\n",
+    "stats\n",
+    "watch 1042\n",
+    "PUT docs/2024/report.txt 18234 8e0f1a2b\n",
+    "RETRIEVE src/main.c\n",
+    "OPEN big/archive.pdf\n",
+    "MEMBERS 0\n",
+    "udelta main.c /home/{{user}}/smain/src 4096 731\n",
+    "bogus command line\n",
+};
+#define BENCH_LINE_COUNT (sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+// Command words for the reference lookup, in opcode order
+static const char *const reference_words[OP_COUNT] = {
+    [OP_UFILE] = "ufile", [OP_UDELTA] = "udelta", [OP_UTAR] = "utar", [OP_UDECLARE] = "udeclare",
+    [OP_UCHUNK] = "uchunk", [OP_DFILE] = "dfile", [OP_RMFILE] = "rmfile", [OP_DTAR] = "dtar",
+    [OP_DISPLAY] = "display", [OP_GREP] = "grep", [OP_SEARCH] = "search", [OP_STATS] = "stats",
+    [OP_WATCH] = "watch", [OP_PUT] = "PUT", [OP_RETRIEVE] = "RETRIEVE", [OP_DELETE] = "DELETE",
+    [OP_OPEN] = "OPEN", [OP_MEMBERS] = "MEMBERS", [OP_NOTIFY] = "NOTIFY",
+};
+
+// What an input should parse to
+struct expected {
+    int complete;            // 0 if command_read() must fail
+    size_t line_len;
+    enum opcode op;
+    int argc;
+    char argv[COMMAND_MAX_ARGS][COMMAND_LINE_MAX];
+    char name[COMMAND_LINE_MAX];
+};
+
+static uint64_t fuzz_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t fuzz_random(void) {
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 7;
+    fuzz_state ^= fuzz_state << 17;
+    return fuzz_state;
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Function to feed an input to a reader in segments of at most segment bytes (0 for one piece),
+// the way command_read() fills it from recv(). Returns 0 once the line is complete, -1 otherwise.
+int feed_reader(struct command_reader *reader, const char *data, size_t size, size_t segment) {
+    size_t offset = 0;
+    command_reader_init(reader);
+    while (!command_reader_scan(reader)) {
+        size_t room = sizeof(reader->line) - 1 - reader->len;
+        if (room == 0) return -1;
+        size_t n = size - offset;
+        if (segment && n > segment) n = segment;
+        if (n > room) n = room;
+        if (n == 0) {
+            if (reader->len == 0) return -1;
+            reader->line_len = reader->len;
+            return 0;
+        }
+        memcpy(reader->line + reader->len, data + offset, n);
+        reader->len += n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Function to work out what an input should parse to, without command.h
+void reference_parse(const char *data, size_t size, struct expected *expected) {
+    memset(expected, 0, sizeof(*expected));
+    const char *newline = memchr(data, '\n', size < COMMAND_LINE_MAX - 1 ? size : COMMAND_LINE_MAX - 1);
+    if (newline) {
+        expected->line_len = newline - data;
+    } else if (size > 0 && size < COMMAND_LINE_MAX - 1) {
+        expected->line_len = size;
+    } else {
+        return;
+    }
+    expected->complete = 1;
+
+    size_t end = expected->line_len;
+    if (end > 0 && data[end - 1] == '\r') end--;
+    int tokens = 0;
+    for (size_t i = 0; i < end;) {
+        while (i < end && (data[i] == ' ' || data[i] == '\t')) i++;
+        if (i == end) break;
+        size_t start = i;
+        while (i < end && data[i] != ' ' && data[i] != '\t') i++;
+        size_t len = i - start;
+
+        if (tokens == 0) {
+            memcpy(expected->name, data + start, len);
+            expected->name[len] = '\0';
+            for (int op = 1; op < OP_COUNT; op++) {
+                if (strlen(reference_words[op]) == len && memcmp(reference_words[op], data + start, len) == 0) expected->op = op;
+            }
+        } else if (expected->argc < COMMAND_MAX_ARGS) {
+            memcpy(expected->argv[expected->argc], data + start, len);
+            expected->argv[expected->argc][len] = '\0';
+            expected->argc++;
+        }
+        tokens++;
+    }
+}
+
+// Function to print an input that broke the parser, and stop
+void fuzz_fail(const char *how, const char *what, const uint8_t *data, size_t size) {
+    fprintf(stderr, "Fuzz failure (%s): %s\nInput (%zu bytes):", how, what, size);
+    for (size_t i = 0; i < size; i++) fprintf(stderr, "%s%02x", i % 32 ? " " : "\n  ", data[i]);
+    fprintf(stderr, "\n");
+    abort();
+}
+
+// Function to compare one parse of an input with the reference
+void fuzz_check(const char *how, int status, struct command_reader *reader, const struct expected *expected,
+                const uint8_t *data, size_t size) {
+    if (!expected->complete) {
+        if (status == 0) fuzz_fail(how, "accepted a line that cannot be complete", data, size);
+        return;
+    }
+    if (status != 0) fuzz_fail(how, "rejected a complete line", data, size);
+    if (reader->line_len != expected->line_len) fuzz_fail(how, "line length", data, size);
+    if (reader->len > sizeof(reader->line) - 1) fuzz_fail(how, "reader overran its buffer", data, size);
+
+    size_t body_len;
+    const char *body = command_body(reader, &body_len);
+    size_t body_start = expected->line_len + (expected->line_len < reader->len);
+    if (body != reader->line + body_start || body_len != reader->len - body_start ||
+        memcmp(body, data + body_start, body_len) != 0) {
+        fuzz_fail(how, "body", data, size);
+    }
+
+    struct command command;
+    command_parse(reader, &command);
+    if (command.op != expected->op) fuzz_fail(how, "opcode", data, size);
+    if (strcmp(command.name, expected->name) != 0) fuzz_fail(how, "command word", data, size);
+    if (command.argc != expected->argc) fuzz_fail(how, "argument count", data, size);
+    for (int i = 0; i < command.argc; i++) {
+        if (command.argv[i] < reader->line || command.argv[i] >= reader->line + reader->line_len + 1) {
+            fuzz_fail(how, "argument outside the line", data, size);
+        }
+        if (strcmp(command.argv[i], expected->argv[i]) != 0) fuzz_fail(how, "argument", data, size);
+    }
+}
+
+// Function to check one input three ways: whole, in random segments, and through command_read()
+void fuzz_one(const uint8_t *data, size_t size) {
+    struct expected expected;
+    reference_parse((const char *)data, size, &expected);
+
+    struct command_reader reader;
+    fuzz_check("whole", feed_reader(&reader, (const char *)data, size, 0), &reader, &expected, data, size);
+    fuzz_check("segments", feed_reader(&reader, (const char *)data, size, 1 + fuzz_random() % 16), &reader, &expected, data, size);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return;
+    for (size_t offset = 0; offset < size;) {
+        size_t n = 1 + fuzz_random() % 64;
+        if (n > size - offset) n = size - offset;
+        if (send(sv[0], data + offset, n, 0) != (ssize_t)n) break;
+        offset += n;
+    }
+    shutdown(sv[0], SHUT_WR);
+    command_reader_init(&reader);
+    fuzz_check("command_read", command_read(&reader, sv[1]), &reader, &expected, data, size);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+#ifdef COMMAND_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size <= FUZZ_INPUT_MAX) fuzz_one(data, size);
+    return 0;
+}
+#else
+
+// Function to make the next fuzz input from a random request line
+size_t fuzz_mutate(uint8_t *input) {
+    size_t size;
+    if (fuzz_random() % 16 == 0) {
+        // Random bytes, sometimes longer than a request line may be
+        size = fuzz_random() % FUZZ_INPUT_MAX;
+        for (size_t i = 0; i < size; i++) input[i] = (uint8_t)fuzz_random();
+        return size;
+    }
+
+    const char *line = bench_lines[fuzz_random() % BENCH_LINE_COUNT];
+    size = strlen(line);
+    memcpy(input, line, size);
+    int mutations = 1 + fuzz_random() % 4;
+    for (int m = 0; m < mutations; m++) {
+        size_t at = size ? fuzz_random() % size : 0;
+        switch (fuzz_random() % 6) {
+        case 0:  // Flip a byte to anything
+            if (size) input[at] = (uint8_t)fuzz_random();
+            break;
+        case 1:  // Insert a separator, CR, newline or NUL
+            if (size < FUZZ_INPUT_MAX) {
+                static const char specials[] = " \t\r\n\0";
+                memmove(input + at + 1, input + at, size - at);
+                input[at] = specials[fuzz_random() % (sizeof(specials) - 1)];
+                size++;
+            }
+            break;
+        case 2:  // Delete a byte
+            if (size) {
+                memmove(input + at, input + at + 1, size - at - 1);
+                size--;
+            }
+            break;
+        case 3:  // Truncate
+            size = at;
+            break;
+        case 4:  // Pad towards and past the line limit
+            while (size < FUZZ_INPUT_MAX && fuzz_random() % 64) input[size++] = 'a' + fuzz_random() % 26;
+            break;
+        case 5:  // Append a body or another request
+            if (size + 64 <= FUZZ_INPUT_MAX) {
+                const char *next = bench_lines[fuzz_random() % BENCH_LINE_COUNT];
+                memcpy(input + size, next, strlen(next));
+                size += strlen(next);
+            }
+            break;
+        }
+    }
+    return size;
+}
+
+// Function to parse every benchmark line for a while, fed in segments of the given size, and
+// return parses per second
+double bench_parser(size_t segment) {
+    struct command_reader reader;
+    struct command command;
+    size_t lengths[BENCH_LINE_COUNT];
+    for (size_t i = 0; i < BENCH_LINE_COUNT; i++) lengths[i] = strlen(bench_lines[i]);
+
+    unsigned long long parses = 0, opcodes = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double seconds;
+    do {
+        for (int round = 0; round < 1000; round++) {
+            for (size_t i = 0; i < BENCH_LINE_COUNT; i++) {
+                feed_reader(&reader, bench_lines[i], lengths[i], segment);
+                command_parse(&reader, &command);
+                opcodes += command.op + command.argc;
+            }
+        }
+        parses += 1000 * BENCH_LINE_COUNT;
+    } while ((seconds = elapsed_since(&start)) < BENCH_SECONDS);
+    if (opcodes == 0) fprintf(stderr, "Warning: nothing parsed\n");
+    return parses / seconds;
+}
+
+// Function to parse every benchmark line the way the servers did before command.h: sscanf()
+// into fixed buffers, then a strcmp() chain over the command words
+double bench_sscanf(void) {
+    static const char *const words[] = {
+        "ufile", "udelta", "utar", "udeclare", "uchunk", "dfile", "rmfile", "dtar", "display", "grep",
+        "search", "stats", "watch", "PUT", "RETRIEVE", "DELETE", "OPEN", "MEMBERS", "NOTIFY",
+    };
+    char buffer[COMMAND_LINE_MAX], word[16], first[COMMAND_LINE_MAX], second[COMMAND_LINE_MAX];
+    unsigned long long parses = 0, opcodes = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double seconds;
+    do {
+        for (int round = 0; round < 1000; round++) {
+            for (size_t i = 0; i < BENCH_LINE_COUNT; i++) {
+                snprintf(buffer, sizeof(buffer), "%s", bench_lines[i]);
+                int fields = sscanf(buffer, "%15s %1023s %1023s", word, first, second);
+                for (size_t w = 0; w < sizeof(words) / sizeof(words[0]); w++) {
+                    if (strcmp(word, words[w]) == 0) {
+                        opcodes += w + fields;
+                        break;
+                    }
+                }
+            }
+        }
+        parses += 1000 * BENCH_LINE_COUNT;
+    } while ((seconds = elapsed_since(&start)) < BENCH_SECONDS);
+    if (opcodes == 0) fprintf(stderr, "Warning: nothing parsed\n");
+    return parses / seconds;
+}
+
+// Function to print the options; returns the exit status for bad arguments
+int usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--fuzz N] [--seed S]\n", program);
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long fuzz_inputs = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) return usage(argv[0]);
+        if (strcmp(argv[i], "--fuzz") == 0) fuzz_inputs = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i], "--seed") == 0) fuzz_state = strtoull(value, NULL, 0) | 1;
+        else return usage(argv[0]);
+        i++;
+    }
+
+    if (fuzz_inputs > 0) {
+        static uint8_t input[FUZZ_INPUT_MAX];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned long long i = 0; i < fuzz_inputs; i++) {
+            size_t size = fuzz_mutate(input);
+            fuzz_one(input, size);
+        }
+        double seconds = elapsed_since(&start);
+        printf("Fuzzed %llu inputs in %.1f s (%.0f per second), no differences from the reference parser\n",
+               fuzz_inputs, seconds, fuzz_inputs / seconds);
+        return 0;
+    }
+
+    printf("parser\tsegment\tparses_per_s\n");
+    printf("command.h\twhole\t%.0f\n", bench_parser(0));
+    printf("command.h\t8\t%.0f\n", bench_parser(8));
+    printf("command.h\t1\t%.0f\n", bench_parser(1));
+    printf("sscanf\twhole\t%.0f\n", bench_sscanf());
+    return 0;
+}
+
+#endif
@@ -0,0 +1,497 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "grep_scan.h"
+
+// Benchmark of the grep command's scan (grep_scan.h) against GNU grep on the same tree.
+//
+// A corpus of .txt files is generated under --dir (kept between runs with --keep) and every
+// pattern is searched by each engine:
+//
+//   scan        grep_scan_tree(), as Smain and Stext run it, one thread per core
+//   grep        GNU grep -rn over the tree, one process
+//   grep-xargs  GNU grep -n run by xargs -P over batches of files, one process per core
+//   memchr      a byte the corpus never contains searched with memchr() by the same thread pool:
+//               how fast the mapped tree can be read at all, the ceiling for any scan
+//
+// Matches go to a socket (or pipe) drained by a thread, so no engine is timed writing to a
+// terminal or skips work the way GNU grep does when its output is /dev/null. Each run prints one
+// tab-separated line: throughput, CPU seconds per GiB across all threads and child processes,
+// and the matching lines found. The engines must agree on the matching lines; if they do not,
+// the run fails. With --baseline, lines of an earlier run are compared and a drop in scan
+// throughput beyond --tolerance makes the run fail as well.
+//
+// With --check no corpus is made: grep_scan_buffer() is instead run on single lines for patterns
+// whose required literal is easy to get wrong (groups, \w escapes, brackets, bounds), and every
+// line must match exactly when regexec() says it does.
+
+#define BENCH_FILE_TARGET (256 * 1024)  // Bytes per generated file
+#define BENCH_MAX_PATTERNS 16
+#define BENCH_MAX_BASELINE 256
+#define BENCH_MARKER "xyzzy_marker"     // Planted once every BENCH_MARKER_EVERY lines
+#define BENCH_MARKER_EVERY 50000
+
+// Drains one output stream, counting lines
+struct drain {
+    int fd;
+    unsigned long long lines;
+};
+
+int listed(const char *list, const char *name);
+int prepare_corpus(const char *dir, off_t size, size_t *files, off_t *bytes);
+void remove_corpus(const char *dir, size_t files);
+void *drain_output(void *arg);
+int run_scan(const char *dir, const char *pattern_text, int memchr_only, unsigned long long *lines);
+int run_gnu_grep(const char *dir, const char *pattern_text, int parallel, unsigned long long *lines);
+int run_case(const char *engine, const char *dir, const char *pattern, int repeat,
+             double *mib_per_s, double *cpu_s_per_gib, unsigned long long *lines, off_t bytes);
+int load_baseline(const char *path);
+int check_prefilter(void);
+double baseline_for(const char *key);
+int usage(const char *program);
+
+static char *baseline_keys[BENCH_MAX_BASELINE];
+static double baseline_values[BENCH_MAX_BASELINE];
+static int baseline_count;
+
+// Function to parse a size such as 4096, 64K, 16M or 10G (binary multiples)
+off_t parse_size(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+    case 'k': case 'K': value *= 1024; break;
+    case 'm': case 'M': value *= 1024 * 1024; break;
+    case 'g': case 'G': value *= 1024.0 * 1024 * 1024; break;
+    }
+    return (off_t)value;
+}
+
+// Function to tell whether a comma-separated list names an item
+int listed(const char *list, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = list; p && *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) return 1;
+    }
+    return 0;
+}
+
+// Function to generate the corpus: files of source-like text lines in a two-level tree, unless
+// a corpus of the same size is already there. Some words carry numeric suffixes so that the
+// regular expressions have something to match, and BENCH_MARKER is planted for a rare literal.
+int prepare_corpus(const char *dir, off_t size, size_t *files, off_t *bytes) {
+    static const char *const words[] = {
+        "the", "static", "int", "return", "buffer", "socket", "file", "struct", "const", "char",
+        "while", "length", "offset", "server", "client", "foobar_", "forbaz_", "size_t", "void", "if",
+    };
+    char stamp_path[PATH_MAX];
+    snprintf(stamp_path, sizeof(stamp_path), "%s/.corpus-size", dir);
+    FILE *stamp = fopen(stamp_path, "r");
+    if (stamp) {
+        long long stamped_size, stamped_files, stamped_bytes;
+        int matched = fscanf(stamp, "%lld %lld %lld", &stamped_size, &stamped_files, &stamped_bytes) == 3 &&
+                      stamped_size == (long long)size;
+        fclose(stamp);
+        if (matched) {
+            *files = (size_t)stamped_files;
+            *bytes = (off_t)stamped_bytes;
+            return 0;
+        }
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    unsigned long long line_number = 0;
+    static char text[BENCH_FILE_TARGET + 256];
+    *files = 0;
+    *bytes = 0;
+    while (*bytes < size) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/d%02zu", dir, *files % 64);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) return -1;
+        snprintf(path, sizeof(path), "%s/d%02zu/f%06zu.txt", dir, *files % 64, *files);
+
+        size_t len = 0;
+        while (len < BENCH_FILE_TARGET) {
+            if (++line_number % BENCH_MARKER_EVERY == 0) {
+                len += sprintf(text + len, "    /* %s */\n", BENCH_MARKER);
+                continue;
+            }
+            len += sprintf(text + len, "    ");
+            for (int w = 0; w < 8; w++) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                const char *word = words[state % (sizeof(words) / sizeof(words[0]))];
+                len += sprintf(text + len, "%s", word);
+                if (word[strlen(word) - 1] == '_') len += sprintf(text + len, "%u", (unsigned)(state >> 40) % 1000);
+                text[len++] = w == 7 ? '\n' : ' ';
+            }
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -1;
+        ssize_t n = write(fd, text, len);
+        close(fd);
+        if (n != (ssize_t)len) return -1;
+        *bytes += len;
+        (*files)++;
+    }
+
+    stamp = fopen(stamp_path, "w");
+    if (!stamp) return -1;
+    fprintf(stamp, "%lld %lld %lld\n", (long long)size, (long long)*files, (long long)*bytes);
+    fclose(stamp);
+    return 0;
+}
+
+// Function to remove the files prepare_corpus() made, and nothing else
+void remove_corpus(const char *dir, size_t files) {
+    char path[PATH_MAX];
+    for (size_t i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/d%02zu/f%06zu.txt", dir, i % 64, i);
+        unlink(path);
+    }
+    for (size_t i = 0; i < 64 && i < files; i++) {
+        snprintf(path, sizeof(path), "%s/d%02zu", dir, i);
+        rmdir(path);
+    }
+    snprintf(path, sizeof(path), "%s/.corpus-size", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+// Function to read an output stream to its end, counting lines
+void *drain_output(void *arg) {
+    struct drain *drain = arg;
+    static __thread char buffer[1 << 16];
+    ssize_t n;
+    while ((n = read(drain->fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (char *p = buffer; (p = memchr(p, '\n', buffer + n - p)) != NULL; p++) drain->lines++;
+    }
+    return NULL;
+}
+
+// Function to run one scan of the corpus through grep_scan.h. With memchr_only the pattern is a
+// byte the corpus never contains, so the scan does nothing but read. Returns -1 on failure.
+int run_scan(const char *dir, const char *pattern_text, int memchr_only, unsigned long long *lines) {
+    struct grep_pattern pattern;
+    if (grep_pattern_compile(&pattern, memchr_only ? "\x01" : pattern_text) < 0) return -1;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        grep_pattern_free(&pattern);
+        return -1;
+    }
+    struct drain drain = { sv[1], 0 };
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain_output, &drain);
+
+    pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+    size_t matches = grep_scan_tree(dir, ".txt", "bench", &pattern, sv[0], &output_lock);
+    shutdown(sv[0], SHUT_WR);
+    pthread_join(drainer, NULL);
+    close(sv[0]);
+    close(sv[1]);
+    grep_pattern_free(&pattern);
+
+    *lines = drain.lines;
+    return drain.lines == matches ? 0 : -1;
+}
+
+// Function to run GNU grep over the corpus, either as one process over the whole tree or as
+// one process per core fed batches of files by find | xargs. Returns -1 on failure.
+int run_gnu_grep(const char *dir, const char *pattern_text, int parallel, unsigned long long *lines) {
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) < 0) return -1;
+    struct drain drain = { out[0], 0 };
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain_output, &drain);
+
+    // The scan treats a pattern with metacharacters as an extended regex and anything else as a
+    // literal; GNU grep is told the same
+    int is_regex = 0;
+    for (const char *p = pattern_text; *p; p++) {
+        if (grep_is_meta(*p)) is_regex = 1;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    char jobs[32];
+    snprintf(jobs, sizeof(jobs), "%ld", cores > 0 ? cores : 1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        setenv("LC_ALL", "C", 1);
+        if (parallel) {
+            char script[PATH_MAX + 64];
+            // A batch without matches makes grep exit 1, which is not a failure here
+            snprintf(script, sizeof(script), "find \"$1\" -name '*.txt' -type f -print0 | "
+                     "xargs -0 -P %s -n 64 sh -c 'grep -Hn %s -e \"$0\" \"$@\"; [ $? -le 1 ]' \"$2\"",
+                     jobs, is_regex ? "-E" : "-F");
+            execlp("sh", "sh", "-c", script, "sh", dir, pattern_text, (char *)NULL);
+        } else {
+            execlp("grep", "grep", "-rn", "--include=*.txt", is_regex ? "-E" : "-F", "-e", pattern_text, dir, (char *)NULL);
+        }
+        _exit(127);
+    }
+    close(out[1]);
+    int status = 0;
+    if (pid > 0) waitpid(pid, &status, 0);
+    pthread_join(drainer, NULL);
+    close(out[0]);
+
+    *lines = drain.lines;
+    // Status 1 is GNU grep finding nothing
+    if (pid < 0 || !WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status) <= 1 ? 0 : -1;
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double cpu_seconds_used(void) {
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    return self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6 + self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6 +
+           children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6 + children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to run repeat searches with one engine and report their medians; the first search
+// is not timed, so that every engine is measured with the corpus in the page cache
+int run_case(const char *engine, const char *dir, const char *pattern, int repeat,
+             double *mib_per_s, double *cpu_s_per_gib, unsigned long long *lines, off_t bytes) {
+    double rates[repeat + 1], cpu[repeat + 1];
+    for (int i = 0; i <= repeat; i++) {
+        double cpu_start = cpu_seconds_used();
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int failed;
+        if (strcmp(engine, "scan") == 0) failed = run_scan(dir, pattern, 0, lines);
+        else if (strcmp(engine, "memchr") == 0) failed = run_scan(dir, pattern, 1, lines);
+        else failed = run_gnu_grep(dir, pattern, strcmp(engine, "grep-xargs") == 0, lines);
+        if (failed < 0) return -1;
+        if (i == 0) continue;
+
+        double seconds = elapsed_since(&start);
+        double gib = (double)bytes / (1024.0 * 1024 * 1024);
+        rates[i - 1] = gib * 1024 / (seconds > 0 ? seconds : 1e-9);
+        cpu[i - 1] = (cpu_seconds_used() - cpu_start) / gib;
+    }
+    qsort(rates, repeat, sizeof(double), compare_doubles);
+    qsort(cpu, repeat, sizeof(double), compare_doubles);
+    *mib_per_s = rates[repeat / 2];
+    *cpu_s_per_gib = cpu[repeat / 2];
+    return 0;
+}
+
+// Function to load the throughput of every case in an earlier run's output
+int load_baseline(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    char line[512];
+    while (baseline_count < BENCH_MAX_BASELINE && fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "pattern\t", 8) == 0) continue;
+        // The key is the first three fields, the throughput the fourth
+        char *field = line;
+        for (int i = 0; i < 3 && field; i++) {
+            field = strchr(field, '\t');
+            if (field) field++;
+        }
+        if (!field) continue;
+        field[-1] = '\0';
+        baseline_keys[baseline_count] = strdup(line);
+        baseline_values[baseline_count] = strtod(field, NULL);
+        baseline_count++;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Baseline throughput of a case, or 0 if the baseline does not have it
+double baseline_for(const char *key) {
+    for (int i = 0; i < baseline_count; i++) {
+        if (strcmp(baseline_keys[i], key) == 0) return baseline_values[i];
+    }
+    return 0;
+}
+
+// Function to compare the scan with plain regexec() line by line. A prefilter literal that a
+// match does not actually need makes the scan skip that line. Returns the number of mismatches.
+int check_prefilter(void) {
+    static const struct {
+        const char *pattern;
+        const char *lines[4];
+    } cases[] = {
+        { "x(abc)?y", { "xy", "xabcy", "abc" } },
+        { "x(ab)*y", { "xy", "xababy", "ab" } },
+        { "(foo)+bar", { "foobar", "foofoobar", "bar" } },
+        { "(x)(yz)w", { "xyzw", "yzw" } },
+        { "a\\wb", { "axb", "a_b", "awb", "wb" } },
+        { "\\bword\\b", { "a word here", "swordfish" } },
+        { "ab+c", { "abbc", "abc", "ac" } },
+        { "ab?cd", { "acd", "abcd", "bcd" } },
+        { "x{2}y", { "xxy", "2}y" } },
+        { "a.b+c{1,3}d", { "axbbccd", "a-bcd", "bc" } },
+        { "a[]b]c", { "a]c", "abc", "ac" } },
+        { "a[^]b]c", { "axc", "a]c" } },
+        { "a[[:digit:]]b", { "a1b", "a:b" } },
+        { "(a|b)cd", { "acd", "bcd", "cd" } },
+        { "\\.txt$", { "file.txt", "txt" } },
+        { "fo[or]ba[rz]_9[0-9]+", { "foobar_91", "forbaz_90x", "foobar_8" } },
+    };
+    int mismatches = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct grep_pattern pattern;
+        regex_t reference;
+        if (grep_pattern_compile(&pattern, cases[i].pattern) < 0 ||
+            regcomp(&reference, cases[i].pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE) != 0) {
+            fprintf(stderr, "Error: Pattern does not compile: %s\n", cases[i].pattern);
+            mismatches++;
+            continue;
+        }
+        for (int j = 0; j < 4 && cases[i].lines[j]; j++) {
+            const char *line = cases[i].lines[j];
+            struct grep_output out = { 0 };
+            int scanned = grep_scan_buffer(&pattern, line, strlen(line), "check", &out) > 0;
+            int expected = regexec(&reference, line, 0, NULL, 0) == 0;
+            free(out.data);
+            printf("%s\t%s\t%s\t%s\n", cases[i].pattern, pattern.literal, line,
+                   scanned == expected ? "ok" : "MISMATCH");
+            if (scanned != expected) mismatches++;
+        }
+        regfree(&reference);
+        grep_pattern_free(&pattern);
+    }
+    return mismatches;
+}
+
+// Function to print the options; returns the exit status for bad arguments
+int usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--size 256M] [--pattern P]... [--engines scan,grep,grep-xargs,memchr]\n"
+                    "       [--repeat N] [--dir DIR] [--keep] [--baseline FILE] [--tolerance 0.15]\n"
+                    "       %s --check\n", program, program);
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    const char *patterns[BENCH_MAX_PATTERNS];
+    int pattern_count = 0;
+    const char *engines = "scan,grep,grep-xargs,memchr";
+    const char *dir = "/tmp/bench-grep";
+    const char *baseline = NULL;
+    off_t size = 256LL * 1024 * 1024;
+    double tolerance = 0.15;
+    int repeat = 3, keep = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--keep") == 0) { keep = 1; continue; }
+        if (strcmp(argv[i], "--check") == 0) {
+            int mismatches = check_prefilter();
+            if (mismatches) fprintf(stderr, "%d lines where the scan and regexec() disagree\n", mismatches);
+            return mismatches ? 1 : 0;
+        }
+        if (!value) return usage(argv[0]);
+        if (strcmp(argv[i], "--size") == 0) size = parse_size(value);
+        else if (strcmp(argv[i], "--pattern") == 0 && pattern_count < BENCH_MAX_PATTERNS) patterns[pattern_count++] = value;
+        else if (strcmp(argv[i], "--engines") == 0) engines = value;
+        else if (strcmp(argv[i], "--repeat") == 0) repeat = atoi(value) > 0 ? atoi(value) : 1;
+        else if (strcmp(argv[i], "--dir") == 0) dir = value;
+        else if (strcmp(argv[i], "--baseline") == 0) baseline = value;
+        else if (strcmp(argv[i], "--tolerance") == 0) tolerance = strtod(value, NULL);
+        else return usage(argv[0]);
+        i++;
+    }
+    if (pattern_count == 0) {
+        // A rare literal, a common one, and a regex with a required literal for the prefilter
+        patterns[pattern_count++] = BENCH_MARKER;
+        patterns[pattern_count++] = "socket";
+        patterns[pattern_count++] = "fo[or]ba[rz]_9[0-9]+";
+    }
+    if (baseline && load_baseline(baseline) < 0) {
+        fprintf(stderr, "Error: Could not read baseline %s\n", baseline);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t files;
+    off_t bytes;
+    if (size <= 0 || prepare_corpus(dir, size, &files, &bytes) < 0) {
+        fprintf(stderr, "Error: Could not create the corpus in %s: %s\n", dir, strerror(errno));
+        return 2;
+    }
+    fprintf(stderr, "Corpus: %zu files, %lld bytes in %s\n", files, (long long)bytes, dir);
+
+    static const char *all_engines[] = { "scan", "grep", "grep-xargs", "memchr" };
+    int regressions = 0, failures = 0, disagreements = 0;
+    printf("pattern\tengine\tbytes\tmib_per_s\tcpu_s_per_gib\tlines\n");
+
+    for (int p = 0; p < pattern_count; p++) {
+        unsigned long long expected_lines = 0;
+        int have_expected = 0;
+        for (size_t e = 0; e < sizeof(all_engines) / sizeof(all_engines[0]); e++) {
+            if (!listed(engines, all_engines[e])) continue;
+            // The read ceiling does not depend on the pattern, so it is measured once
+            if (e == 3 && p > 0) continue;
+
+            double mib_per_s, cpu_s_per_gib;
+            unsigned long long lines = 0;
+            char key[512];
+            snprintf(key, sizeof(key), "%s\t%s\t%lld", e == 3 ? "-" : patterns[p], all_engines[e], (long long)bytes);
+            if (run_case(all_engines[e], dir, patterns[p], repeat, &mib_per_s, &cpu_s_per_gib, &lines, bytes) < 0) {
+                fprintf(stderr, "Error: Search failed: %s\n", key);
+                failures++;
+                continue;
+            }
+            printf("%s\t%.1f\t%.3f\t%llu\n", key, mib_per_s, cpu_s_per_gib, lines);
+            fflush(stdout);
+
+            if (e != 3) {
+                if (have_expected && lines != expected_lines) {
+                    fprintf(stderr, "Mismatch: %s found %llu lines, the engine before it %llu\n", key, lines, expected_lines);
+                    disagreements++;
+                }
+                expected_lines = lines;
+                have_expected = 1;
+            }
+            double expected = baseline_for(key);
+            if (e == 0 && expected > 0 && mib_per_s < expected * (1 - tolerance)) {
+                fprintf(stderr, "Regression: %s: %.1f MiB/s against a baseline of %.1f\n", key, mib_per_s, expected);
+                regressions++;
+            }
+        }
+    }
+
+    if (!keep) remove_corpus(dir, files);
+    if (regressions || failures || disagreements) {
+        fprintf(stderr, "%d regressions, %d failed searches, %d disagreements\n", regressions, failures, disagreements);
+        return 1;
+    }
+    return 0;
+}
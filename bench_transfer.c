@@ -0,0 +1,763 @@
+#define _GNU_SOURCE  // For splice() and F_SETPIPE_SZ
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include "crc32c.h"
+#include "sched.h"
+#include "tls_channel.h"
+
+// Microbenchmark of the transfer path: the frame.h routines Smain, Stext and Spdf send and
+// receive file bodies with, run between threads over loopback TCP and AF_UNIX socket pairs, and
+// over loopback TLS when built with -DTLS_ENABLED=1 -lssl -lcrypto (see tls_channel.h).
+//
+//   download  a stored file is sent as frames and the receiver verifies and discards it
+//   upload    frames are received and written to a file, as the sub-servers store uploads
+//   relay     frames pass through a middle hop unchanged, as Smain relays sub-server bodies
+//
+// The sending side is swept over the ways of getting file data onto the socket: read (pread()
+// and sendmsg(), frame_write_fd_range()), sendfile (frame_write_file_range(), what the servers
+// use), splice (through a pipe) and io_uring (reads and sends submitted in batches). Each run
+// prints one tab-separated line: throughput, CPU seconds per GiB across all threads, and the
+// system calls each side made per transfer. With --baseline, lines of an earlier run are
+// compared and a drop in throughput beyond --tolerance makes the run fail.
+//
+// The tls transport lets the kernel encrypt where it can (kTLS), so sendfile and splice stay
+// zero-copy; tls-user keeps every connection on the user-space pump, for comparison. Both need
+// server.crt and server.key in the working directory.
+
+// Every I/O system call the frame routines make is counted for the thread that made it. The
+// macros wrap the calls in frame.h, which is included after them; the system headers above
+// have already declared the real functions.
+static __thread unsigned long long bench_syscalls;
+#define COUNTED(call) (bench_syscalls++, call)
+#define read(...) COUNTED(read(__VA_ARGS__))
+#define pread(...) COUNTED(pread(__VA_ARGS__))
+#define write(...) COUNTED(write(__VA_ARGS__))
+#define recv(...) COUNTED(recv(__VA_ARGS__))
+#define send(...) COUNTED(send(__VA_ARGS__))
+#define sendmsg(...) COUNTED(sendmsg(__VA_ARGS__))
+#define sendfile(...) COUNTED(sendfile(__VA_ARGS__))
+#define splice(...) COUNTED(splice(__VA_ARGS__))
+#define poll(...) COUNTED(poll(__VA_ARGS__))
+#define mmap(...) COUNTED(mmap(__VA_ARGS__))
+#define munmap(...) COUNTED(munmap(__VA_ARGS__))
+#define madvise(...) COUNTED(madvise(__VA_ARGS__))
+#include "frame.h"
+
+#define BENCH_WARM_BYTES (64LL << 20)  // Bytes moved per sample of a warm run, small files repeated
+#define BENCH_MAX_REPS 10000
+#define BENCH_MAX_BASELINE 4096
+#define URING_DEPTH 8                  // Frames read, then sent, per io_uring submission
+
+// One point of the sweep
+struct bench_case {
+    const char *scenario;
+    const char *transport;
+    const char *strategy;
+    int cold;
+    off_t size;
+    int sockbuf;               // SO_SNDBUF/SO_RCVBUF for every socket, 0 for the kernel default
+};
+
+struct bench_result {
+    double mib_per_s;
+    double cpu_s_per_gib;
+    double send_syscalls;      // Per transfer
+    double recv_syscalls;      // Per transfer, the relay hop included
+    int failed;
+};
+
+// A minimal io_uring, set up with the raw system calls so the benchmark needs no liburing
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned char *buffers;    // URING_DEPTH payloads
+    unsigned char headers[URING_DEPTH][FRAME_HEADER_SIZE];
+    struct iovec iov[URING_DEPTH][2];
+    struct msghdr msg[URING_DEPTH];
+};
+
+struct sender_args {
+    int sock;
+    int fd;
+    off_t size;
+    const char *strategy;
+    struct uring *ring;
+    int reps;
+    int cold;
+    int failed;
+    unsigned long long syscalls;
+};
+
+struct relay_args {
+    int upstream;
+    int downstream;
+    int reps;
+    int failed;
+    unsigned long long syscalls;
+};
+
+// Function prototypes
+off_t parse_size(const char *text);
+int listed(const char *list, const char *name);
+int prepare_data_file(const char *path, off_t size);
+int connect_pair(const char *transport, int sockbuf, int sv[2]);
+int uring_setup(struct uring *ring);
+void uring_teardown(struct uring *ring);
+int frame_write_spliced(struct frame_writer *writer, int fd, off_t size);
+int frame_write_uring(struct frame_writer *writer, struct uring *ring, int fd, off_t size);
+int send_body(struct frame_writer *writer, const char *strategy, struct uring *ring, int fd, off_t size);
+void *run_sender(void *arg);
+void *run_relay(void *arg);
+int receive_bodies(int sock, int reps, const char *store_path);
+int run_sample(const struct bench_case *bench, int fd, const char *dir, int reps, struct uring *ring,
+               double *seconds, double *cpu_seconds, double *send_calls, double *recv_calls);
+void run_case(const struct bench_case *bench, int fd, const char *dir, int repeat, struct uring *ring, struct bench_result *result);
+int load_baseline(const char *path);
+double baseline_for(const char *key);
+int usage(const char *program);
+
+static char *baseline_keys[BENCH_MAX_BASELINE];
+static double baseline_values[BENCH_MAX_BASELINE];
+static int baseline_count;
+
+// Function to parse a size such as 4096, 64K, 16M or 10G (binary multiples)
+off_t parse_size(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+    case 'k': case 'K': value *= 1024; break;
+    case 'm': case 'M': value *= 1024 * 1024; break;
+    case 'g': case 'G': value *= 1024.0 * 1024 * 1024; break;
+    }
+    return (off_t)value;
+}
+
+// Function to tell whether a comma-separated list names an item
+int listed(const char *list, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = list; p && *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) return 1;
+    }
+    return 0;
+}
+
+// Function to create a data file of the given size, unless one is already there. The contents
+// are pseudo-random so that nothing along the way can shortcut them.
+int prepare_data_file(const char *path, off_t size) {
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size == size) return 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    static uint64_t block[1 << 17];
+    uint64_t state = 0x9e3779b97f4a7c15ULL ^ (uint64_t)size;
+    off_t written = 0;
+    while (written < size) {
+        for (size_t i = 0; i < sizeof(block) / sizeof(block[0]); i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            block[i] = state;
+        }
+        size_t want = size - written < (off_t)sizeof(block) ? (size_t)(size - written) : sizeof(block);
+        ssize_t n = write(fd, block, want);
+        if (n <= 0) {
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+        written += n;
+    }
+    fsync(fd);
+    close(fd);
+    return 0;
+}
+
+// Accepting end of a TLS handshake, run on its own thread while the caller connects
+static void *accept_tls(void *arg) {
+    int *sock = arg;
+    *sock = tls_channel_accept(*sock);
+    return NULL;
+}
+
+// Function to connect two sockets over the named transport: "unix" is an AF_UNIX socket pair,
+// "tcp" a connection over loopback, "tls" and "tls-user" that connection after a handshake
+int connect_pair(const char *transport, int sockbuf, int sv[2]) {
+    if (strcmp(transport, "unix") == 0) {
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    } else {
+        struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        socklen_t address_len = sizeof(address);
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0) return -1;
+        if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 1) < 0 ||
+            getsockname(listener, (struct sockaddr *)&address, &address_len) < 0 ||
+            (sv[0] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+            close(listener);
+            return -1;
+        }
+        if (connect(sv[0], (struct sockaddr *)&address, sizeof(address)) < 0 ||
+            (sv[1] = accept(listener, NULL, NULL)) < 0) {
+            close(sv[0]);
+            close(listener);
+            return -1;
+        }
+        close(listener);
+    }
+
+    if (sockbuf > 0) {
+        for (int i = 0; i < 2; i++) {
+            setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(sockbuf));
+            setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &sockbuf, sizeof(sockbuf));
+        }
+    }
+
+    if (strncmp(transport, "tls", 3) == 0) {
+        tls_channel_set_user_space(strcmp(transport, "tls-user") == 0);
+        pthread_t acceptor;
+        if (pthread_create(&acceptor, NULL, accept_tls, &sv[1]) != 0) {
+            close(sv[0]);
+            close(sv[1]);
+            return -1;
+        }
+        sv[0] = tls_channel_connect(sv[0], "127.0.0.1");
+        pthread_join(acceptor, NULL);
+        if (sv[0] < 0 || sv[1] < 0) {
+            fprintf(stderr, "Error: TLS handshake failed: %s\n", tls_channel_last_error());
+            if (sv[0] >= 0) tls_channel_close(sv[0]);
+            if (sv[1] >= 0) tls_channel_close(sv[1]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to set up an io_uring for the io_uring strategy; returns -1 if the kernel refuses
+int uring_setup(struct uring *ring) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_ring :
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->buffers = malloc((size_t)URING_DEPTH * FRAME_MAX_PAYLOAD);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED || !ring->buffers) {
+        uring_teardown(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_teardown(struct uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    free(ring->buffers);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Queue a submission; the caller fills it in before uring_submit()
+static struct io_uring_sqe *uring_queue(struct uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Submit count queued entries and wait for all of them; results[i] gets the result of the entry
+// with user_data i. Returns -1 if the kernel refused the submission.
+static int uring_submit(struct uring *ring, int count, int *results) {
+    bench_syscalls++;
+    if (syscall(__NR_io_uring_enter, ring->fd, count, count, IORING_ENTER_GETEVENTS, NULL, 0) < 0) return -1;
+    for (int reaped = 0; reaped < count;) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            bench_syscalls++;
+            if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) return -1;
+            continue;
+        }
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->user_data < (unsigned long long)count) results[cqe->user_data] = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        reaped++;
+    }
+    return 0;
+}
+
+// Send size bytes of an open file as frames, moving each payload from the page cache to the
+// socket through a pipe with splice(); the running CRC is taken over a mapping as in
+// frame_write_file_range()
+int frame_write_spliced(struct frame_writer *writer, int fd, off_t size) {
+    if (size <= 0) return 0;
+    const unsigned char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return -1;
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        munmap((void *)map, size);
+        return -1;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, FRAME_MAX_PAYLOAD);
+
+    off_t sent = 0;
+    while (sent < size && !writer->failed) {
+        size_t chunk = size - sent < FRAME_MAX_PAYLOAD ? (size_t)(size - sent) : FRAME_MAX_PAYLOAD;
+        writer->crc = crc32c_update(writer->crc, map + sent, chunk);
+        writer->total += chunk;
+
+        unsigned char header[FRAME_HEADER_SIZE];
+        frame_put_u32(header, (uint32_t)chunk);
+        frame_put_u32(header + 4, writer->crc);
+        if (send(writer->sock, header, sizeof(header), MSG_NOSIGNAL | MSG_MORE) != sizeof(header)) writer->failed = 1;
+        off_t offset = sent;
+        size_t remaining = chunk;
+        while (remaining > 0 && !writer->failed) {
+            ssize_t in = splice(fd, &offset, pipefd[1], NULL, remaining, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in < 0 && errno == EINTR) continue;
+            if (in <= 0) {
+                writer->failed = 1;
+                break;
+            }
+            for (ssize_t out = 0; out < in && !writer->failed;) {
+                ssize_t n = splice(pipefd[0], NULL, writer->sock, NULL, in - out, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) writer->failed = 1;
+                else out += n;
+            }
+            remaining -= in;
+        }
+        sent += chunk;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    munmap((void *)map, size);
+    return writer->failed ? -1 : 0;
+}
+
+// Send size bytes of an open file as frames through io_uring: up to URING_DEPTH payloads are
+// read with one submission, then their frames are sent, in order, with another
+int frame_write_uring(struct frame_writer *writer, struct uring *ring, int fd, off_t size) {
+    int results[URING_DEPTH];
+    off_t sent = 0;
+    while (sent < size && !writer->failed) {
+        size_t lengths[URING_DEPTH];
+        int count = 0;
+        for (off_t offset = sent; count < URING_DEPTH && offset < size; count++) {
+            lengths[count] = size - offset < FRAME_MAX_PAYLOAD ? (size_t)(size - offset) : FRAME_MAX_PAYLOAD;
+            struct io_uring_sqe *sqe = uring_queue(ring);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->off = offset;
+            sqe->addr = (unsigned long)(ring->buffers + (size_t)count * FRAME_MAX_PAYLOAD);
+            sqe->len = lengths[count];
+            sqe->user_data = count;
+            offset += lengths[count];
+        }
+        if (uring_submit(ring, count, results) < 0) return -1;
+        for (int i = 0; i < count; i++) {
+            if (results[i] != (int)lengths[i]) return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            unsigned char *payload = ring->buffers + (size_t)i * FRAME_MAX_PAYLOAD;
+            writer->crc = crc32c_update(writer->crc, payload, lengths[i]);
+            writer->total += lengths[i];
+            frame_put_u32(ring->headers[i], (uint32_t)lengths[i]);
+            frame_put_u32(ring->headers[i] + 4, writer->crc);
+            ring->iov[i][0] = (struct iovec){ ring->headers[i], FRAME_HEADER_SIZE };
+            ring->iov[i][1] = (struct iovec){ payload, lengths[i] };
+            ring->msg[i] = (struct msghdr){ .msg_iov = ring->iov[i], .msg_iovlen = 2 };
+
+            // Linked so the frames go out in order; MSG_WAITALL has the kernel finish short sends
+            struct io_uring_sqe *sqe = uring_queue(ring);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = writer->sock;
+            sqe->addr = (unsigned long)&ring->msg[i];
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+            sqe->user_data = i;
+        }
+        if (uring_submit(ring, count, results) < 0) writer->failed = 1;
+        for (int i = 0; i < count && !writer->failed; i++) {
+            if (results[i] != (int)(FRAME_HEADER_SIZE + lengths[i])) writer->failed = 1;
+        }
+        for (int i = 0; i < count; i++) sent += lengths[i];
+    }
+    return writer->failed ? -1 : 0;
+}
+
+// Function to send a file body with one of the strategies
+int send_body(struct frame_writer *writer, const char *strategy, struct uring *ring, int fd, off_t size) {
+    if (strcmp(strategy, "read") == 0) return frame_write_fd_range(writer, fd, 0, size);
+    if (strcmp(strategy, "sendfile") == 0) return frame_write_file_range(writer, fd, 0, size);
+    if (strcmp(strategy, "splice") == 0) return frame_write_spliced(writer, fd, size);
+    return frame_write_uring(writer, ring, fd, size);
+}
+
+// Sending side of a sample: the file, reps times, each as a complete body
+void *run_sender(void *arg) {
+    struct sender_args *args = arg;
+    for (int i = 0; i < args->reps && !args->failed; i++) {
+        // Cold runs drop the file from the page cache first; the data file was synced, so its
+        // pages are clean and are dropped
+        if (args->cold) posix_fadvise(args->fd, 0, 0, POSIX_FADV_DONTNEED);
+        struct frame_writer writer;
+        frame_writer_init(&writer, args->sock);
+        if (send_body(&writer, args->strategy, args->ring, args->fd, args->size) < 0 || frame_finish(&writer) < 0) {
+            args->failed = 1;
+        }
+    }
+    args->syscalls = bench_syscalls;
+    shutdown(args->sock, SHUT_WR);
+    return NULL;
+}
+
+// Middle hop of a relay sample, passing every frame on as it arrived, as Smain does
+void *run_relay(void *arg) {
+    struct relay_args *args = arg;
+    unsigned char *raw = malloc(FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+    for (int i = 0; raw && i < args->reps && !args->failed; i++) {
+        struct frame_reader reader;
+        frame_reader_init(&reader, args->upstream, NULL, 0);
+        ssize_t result;
+        size_t raw_len = 0;
+        do {
+            result = frame_read_raw(&reader, NULL, raw, &raw_len);
+            if (result < 0) break;
+            struct iovec iov = { raw, raw_len };
+            if (frame_sendv(args->downstream, &iov, 1) < 0) result = -1;
+        } while (result > 0);
+        if (result < 0) args->failed = 1;
+    }
+    if (!raw) args->failed = 1;
+    free(raw);
+    args->syscalls = bench_syscalls;
+    shutdown(args->downstream, SHUT_WR);
+    return NULL;
+}
+
+// Function to receive and verify reps bodies; with a store_path each is written to that file,
+// as an upload is, and otherwise discarded. Returns -1 if any body did not verify.
+int receive_bodies(int sock, int reps, const char *store_path) {
+    static char buffer[FRAME_MAX_PAYLOAD];
+    for (int i = 0; i < reps; i++) {
+        int fd = store_path ? open(store_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+        if (store_path && fd < 0) return -1;
+        struct frame_reader reader;
+        frame_reader_init(&reader, sock, NULL, 0);
+        ssize_t n;
+        while ((n = frame_read(&reader, buffer)) > 0) {
+            if (fd >= 0 && write(fd, buffer, n) != n) n = -1;
+            if (n < 0) break;
+        }
+        if (fd >= 0) {
+            close(fd);
+            unlink(store_path);
+        }
+        if (n < 0) return -1;
+    }
+    return 0;
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double cpu_seconds_used(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Function to time one sample of reps transfers; returns -1 if a transfer failed
+int run_sample(const struct bench_case *bench, int fd, const char *dir, int reps, struct uring *ring,
+               double *seconds, double *cpu_seconds, double *send_calls, double *recv_calls) {
+    int relay = strcmp(bench->scenario, "relay") == 0;
+    int first[2] = { -1, -1 }, second[2] = { -1, -1 };
+    if (connect_pair(bench->transport, bench->sockbuf, first) < 0 ||
+        (relay && connect_pair(bench->transport, bench->sockbuf, second) < 0)) {
+        for (int i = 0; i < 2; i++) {
+            if (first[i] >= 0) tls_channel_close(first[i]);
+            if (second[i] >= 0) tls_channel_close(second[i]);
+        }
+        return -1;
+    }
+
+    char store_path[PATH_MAX];
+    snprintf(store_path, sizeof(store_path), "%s/bench-transfer-upload.tmp", dir);
+    struct sender_args sender = { first[0], fd, bench->size, bench->strategy, ring, reps, bench->cold, 0, 0 };
+    struct relay_args relay_hop = { first[1], second[0], reps, 0, 0 };
+    unsigned long long receiver_start = bench_syscalls;
+    double cpu_start = cpu_seconds_used();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t sender_thread, relay_thread;
+    pthread_create(&sender_thread, NULL, run_sender, &sender);
+    if (relay) pthread_create(&relay_thread, NULL, run_relay, &relay_hop);
+    int received = receive_bodies(relay ? second[1] : first[1], reps,
+                                  strcmp(bench->scenario, "upload") == 0 ? store_path : NULL);
+    // After a failure the receiving ends are closed, so that whoever is still sending to them
+    // fails instead of blocking
+    if (received < 0) {
+        tls_channel_close(relay ? second[1] : first[1]);
+        if (relay) second[1] = -1;
+        else first[1] = -1;
+    }
+    if (relay) {
+        pthread_join(relay_thread, NULL);
+        if (received < 0 || relay_hop.failed) {
+            tls_channel_close(first[1]);
+            first[1] = -1;
+        }
+    }
+    pthread_join(sender_thread, NULL);
+
+    *seconds = elapsed_since(&start);
+    *cpu_seconds = cpu_seconds_used() - cpu_start;
+    *send_calls = (double)sender.syscalls / reps;
+    *recv_calls = (double)(bench_syscalls - receiver_start + relay_hop.syscalls) / reps;
+    for (int i = 0; i < 2; i++) {
+        if (first[i] >= 0) tls_channel_close(first[i]);
+        if (second[i] >= 0) tls_channel_close(second[i]);
+    }
+    return received < 0 || sender.failed || relay_hop.failed ? -1 : 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to run repeat samples of a case and report their medians
+void run_case(const struct bench_case *bench, int fd, const char *dir, int repeat, struct uring *ring, struct bench_result *result) {
+    int reps = 1;
+    if (!bench->cold) {
+        // Warm the page cache, and move enough bytes per sample to time small files
+        static char buffer[1 << 20];
+        off_t offset = 0;
+        ssize_t n;
+        while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0) offset += n;
+        if (bench->size < BENCH_WARM_BYTES) reps = BENCH_WARM_BYTES / bench->size;
+        if (reps > BENCH_MAX_REPS) reps = BENCH_MAX_REPS;
+    }
+
+    double rates[repeat], cpu[repeat];
+    memset(result, 0, sizeof(*result));
+    for (int i = 0; i < repeat; i++) {
+        double seconds, cpu_seconds;
+        if (run_sample(bench, fd, dir, reps, ring, &seconds, &cpu_seconds, &result->send_syscalls, &result->recv_syscalls) < 0) {
+            result->failed = 1;
+            return;
+        }
+        double gib = (double)bench->size * reps / (1024.0 * 1024 * 1024);
+        rates[i] = gib * 1024 / (seconds > 0 ? seconds : 1e-9);
+        cpu[i] = cpu_seconds / gib;
+    }
+    qsort(rates, repeat, sizeof(double), compare_doubles);
+    qsort(cpu, repeat, sizeof(double), compare_doubles);
+    result->mib_per_s = rates[repeat / 2];
+    result->cpu_s_per_gib = cpu[repeat / 2];
+}
+
+// Function to load the throughput of every case in an earlier run's output
+int load_baseline(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    char line[512];
+    while (baseline_count < BENCH_MAX_BASELINE && fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "scenario\t", 9) == 0) continue;
+        // The key is the first six fields, the throughput the seventh
+        char *field = line;
+        for (int i = 0; i < 6 && field; i++) {
+            field = strchr(field, '\t');
+            if (field) field++;
+        }
+        if (!field) continue;
+        field[-1] = '\0';
+        baseline_keys[baseline_count] = strdup(line);
+        baseline_values[baseline_count] = strtod(field, NULL);
+        baseline_count++;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Baseline throughput of a case, or 0 if the baseline does not have it
+double baseline_for(const char *key) {
+    for (int i = 0; i < baseline_count; i++) {
+        if (strcmp(baseline_keys[i], key) == 0) return baseline_values[i];
+    }
+    return 0;
+}
+
+// Function to print the options; returns the exit status for bad arguments
+int usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--sizes 1K,...,10G] [--sockbufs 0,262144] [--scenarios download,upload,relay]\n"
+                    "       [--transports tcp,unix,tls,tls-user] [--strategies read,sendfile,splice,io_uring] [--caches warm,cold]\n"
+                    "       [--repeat N] [--dir DIR] [--keep] [--baseline FILE] [--tolerance 0.15]\n", program);
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    const char *sizes = "1K,64K,1M,16M,256M";
+    const char *sockbufs = "0,262144";
+    const char *scenarios = "download,upload,relay";
+    const char *transports = "tcp,unix";
+    const char *strategies = "read,sendfile,splice,io_uring";
+    const char *caches = "warm,cold";
+    const char *dir = "/tmp";
+    const char *baseline = NULL;
+    double tolerance = 0.15;
+    int repeat = 3, keep = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--keep") == 0) { keep = 1; continue; }
+        if (!value) return usage(argv[0]);
+        if (strcmp(argv[i], "--sizes") == 0) sizes = value;
+        else if (strcmp(argv[i], "--sockbufs") == 0) sockbufs = value;
+        else if (strcmp(argv[i], "--scenarios") == 0) scenarios = value;
+        else if (strcmp(argv[i], "--transports") == 0) transports = value;
+        else if (strcmp(argv[i], "--strategies") == 0) strategies = value;
+        else if (strcmp(argv[i], "--caches") == 0) caches = value;
+        else if (strcmp(argv[i], "--repeat") == 0) repeat = atoi(value) > 0 ? atoi(value) : 1;
+        else if (strcmp(argv[i], "--dir") == 0) dir = value;
+        else if (strcmp(argv[i], "--baseline") == 0) baseline = value;
+        else if (strcmp(argv[i], "--tolerance") == 0) tolerance = strtod(value, NULL);
+        else return usage(argv[0]);
+        i++;
+    }
+    if (baseline && load_baseline(baseline) < 0) {
+        fprintf(stderr, "Error: Could not read baseline %s\n", baseline);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct uring ring;
+    int have_uring = 0;
+    if (listed(strategies, "io_uring")) {
+        have_uring = uring_setup(&ring) == 0;
+        if (!have_uring) fprintf(stderr, "Warning: io_uring is not available, skipping it\n");
+    }
+    int have_tls = 0;
+    if (listed(transports, "tls") || listed(transports, "tls-user")) {
+        have_tls = TLS_ENABLED && tls_channel_init(TLS_ROLE_SERVER | TLS_ROLE_CLIENT) == 0;
+        if (!have_tls) fprintf(stderr, "Warning: TLS is not available (%s), skipping it\n", tls_channel_last_error());
+    }
+
+    static const char *all_scenarios[] = { "download", "upload", "relay" };
+    static const char *all_transports[] = { "tcp", "unix", "tls", "tls-user" };
+    static const char *all_strategies[] = { "read", "sendfile", "splice", "io_uring" };
+    static const char *all_caches[] = { "warm", "cold" };
+    int regressions = 0, failures = 0;
+    printf("scenario\ttransport\tstrategy\tcache\tsize\tsockbuf\tmib_per_s\tcpu_s_per_gib\tsend_syscalls\trecv_syscalls\n");
+
+    for (const char *size_text = sizes; size_text && *size_text; size_text = strchr(size_text, ',') ? strchr(size_text, ',') + 1 : NULL) {
+        off_t size = parse_size(size_text);
+        if (size <= 0) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/bench-transfer-%lld.dat", dir, (long long)size);
+        if (prepare_data_file(path, size) < 0) {
+            fprintf(stderr, "Error: Could not create %s: %s\n", path, strerror(errno));
+            return 2;
+        }
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        for (const char *buf_text = sockbufs; buf_text && *buf_text; buf_text = strchr(buf_text, ',') ? strchr(buf_text, ',') + 1 : NULL)
+        for (size_t sc = 0; sc < 3; sc++) if (listed(scenarios, all_scenarios[sc]))
+        for (size_t tr = 0; tr < 4; tr++) if (listed(transports, all_transports[tr]) && (tr < 2 || have_tls))
+        for (size_t st = 0; st < 4; st++) if (listed(strategies, all_strategies[st]) && (st != 3 || have_uring))
+        for (size_t ca = 0; ca < 2; ca++) if (listed(caches, all_caches[ca])) {
+            struct bench_case bench = { all_scenarios[sc], all_transports[tr], all_strategies[st], ca == 1, size, (int)parse_size(buf_text) };
+            struct bench_result result;
+            run_case(&bench, fd, dir, repeat, have_uring ? &ring : NULL, &result);
+
+            char key[256];
+            snprintf(key, sizeof(key), "%s\t%s\t%s\t%s\t%lld\t%d", bench.scenario, bench.transport, bench.strategy,
+                     all_caches[ca], (long long)size, bench.sockbuf);
+            if (result.failed) {
+                fprintf(stderr, "Error: Transfer failed: %s\n", key);
+                failures++;
+                continue;
+            }
+            printf("%s\t%.1f\t%.3f\t%.1f\t%.1f\n", key, result.mib_per_s, result.cpu_s_per_gib, result.send_syscalls, result.recv_syscalls);
+            fflush(stdout);
+
+            double expected = baseline_for(key);
+            if (expected > 0 && result.mib_per_s < expected * (1 - tolerance)) {
+                fprintf(stderr, "Regression: %s: %.1f MiB/s against a baseline of %.1f\n", key, result.mib_per_s, expected);
+                regressions++;
+            }
+        }
+        close(fd);
+        if (!keep) unlink(path);
+    }
+
+    if (have_uring) uring_teardown(&ring);
+    unsigned long long tls_kernel, tls_user;
+    tls_channel_counts(&tls_kernel, &tls_user);
+    if (have_tls && listed(transports, "tls") && tls_user > 0 && tls_kernel == 0) {
+        fprintf(stderr, "Warning: the kernel took no TLS connection over, tls ran in user space\n");
+    }
+    if (regressions || failures) {
+        fprintf(stderr, "%d regressions, %d failed transfers\n", regressions, failures);
+        return 1;
+    }
+    return 0;
+}
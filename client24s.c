@@ -8,21 +8,60 @@
 #include <sys/types.h>
 #include <libgen.h>  // For basename()
 #include <unistd.h>  // For getcwd()
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "delta.h"   // Block signatures for delta uploads
+#include "frame.h"   // CRC32C-checked framing for file transfers
+#include "client_cache.h"  // Local copies of downloaded files for conditional dfile
+#include "seekable.h"  // Decoding files the server sends compressed, as it stores them
+#include "tls_channel.h"  // TLS to Smain when built in
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 50501
 #define BUFFER_SIZE 1024
 
+// Files of at least this size are uploaded in chunks through a resumable upload session
+#ifndef UPLOAD_SESSION_THRESHOLD
+#define UPLOAD_SESSION_THRESHOLD (64LL * 1024 * 1024)
+#endif
+
+#ifndef UPLOAD_CHUNK_SIZE
+#define UPLOAD_CHUNK_SIZE (4 * 1024 * 1024)
+#endif
+
+#define UPLOAD_PARALLEL 4   // Chunks sent at once, each on its own connection
+#define UPLOAD_ATTEMPTS 5   // Rounds with failed chunks before giving up
+
 // Function declarations
 void send_file(const char *filename, const char *destination_path);
+void send_file_resumable(const char *filename, const char *destination_path, off_t size);
+void send_file_delta(const char *filename, const char *destination_path);
+void send_archive(const char *filename, const char *destination_path);
 void download_file(const char *filename);
 void remove_file(const char *filename);
 void download_tar_file(const char *filetype);
 void display_files(const char *pathname);
+void search_file_contents(const char *command, const char *pattern);
+void show_transfer_stats();
+void watch_changes(const char *since);
+int receive_verified_file(int sock, const char *destination_path, struct frame_reader *reader);
+int decode_received_file(const char *part_path, struct frame_reader *reader);
 int connect_to_server();
+int open_server_connection();
+
+static struct client_cache download_cache;
 
 // Function to establish a connection to the server
 int connect_to_server() {
+    int sock = open_server_connection();
+    if (sock >= 0) printf("Connected to server at %s:%d\n", SERVER_IP, SERVER_PORT);
+    return sock;
+}
+
+// Connect to the server without announcing it, for the many connections of a chunked upload
+int open_server_connection() {
     int sock;
     struct sockaddr_in server_addr;
 
@@ -44,52 +83,557 @@ int connect_to_server() {
         close(sock);
         return -1;
     }
-
-    printf("Connected to server at %s:%d\n", SERVER_IP, SERVER_PORT);
+    sock = tls_channel_connect(sock, SERVER_IP);
+    if (sock < 0) printf("Error: Secure connection to server failed: %s\n", tls_channel_last_error());
     return sock;
 }
 
-// Function to send a file to the server
+// Function to send a file to the server as CRC32C-checked frames. Large files go through a
+// resumable upload session instead, so that a failure costs only the chunks it interrupted.
 void send_file(const char *filename, const char *destination_path) {
+    struct stat st;
+    if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= UPLOAD_SESSION_THRESHOLD) {
+        send_file_resumable(filename, destination_path, st.st_size);
+        return;
+    }
+
     int sock = connect_to_server();
     if (sock < 0) return;
 
     // Prepare and send the upload command
     char command[BUFFER_SIZE];
     snprintf(command, sizeof(command), "ufile %s %s\n", filename, destination_path);
-    send(sock, command, strlen(command), 0);
+    send(sock, command, strlen(command), MSG_NOSIGNAL);
 
-    // Open the file to be sent
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
+    // Open the file to be sent; on failure tell the server to discard the upload
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         printf("Error: File open failed\n");
+        frame_write_error(sock, "Client could not open the file.");
         close(sock);
         return;
     }
 
-    // Read from the file and send its content to the server
+    // Read from the file and send its content to the server, followed by the whole-file digest
+    struct frame_writer writer;
+    frame_writer_init(&writer, sock);
+    int result = frame_write_fd(&writer, fd);
+    close(fd);
+    if (result < 0 && !writer.failed) {
+        printf("Error: File read failed\n");
+        frame_write_error(sock, "Client could not read the file.");
+    } else if (result == 0) {
+        frame_finish(&writer);
+    }
+    if (writer.failed) {
+        printf("Error: Sending file failed\n");
+    } else if (result == 0) {
+        printf("File transmission completed: %llu bytes, CRC32C %08x\n", (unsigned long long)writer.total, writer.crc);
+    }
+
+    // Receive and print the server's verdict
     char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        send(sock, buffer, bytes_read, 0);
+    int bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
+    if (bytes_received > 0) {
+        buffer[bytes_received] = '\0';
+        printf("Server response: %s", buffer);
     }
+    close(sock);
+}
 
-    fclose(file);
+// Chunks of a resumable upload still to be sent, shared by the sending threads
+struct chunk_queue {
+    pthread_mutex_t lock;
+    const char *id;
+    int fd;
+    off_t size;
+    uint32_t *indices;
+    size_t count;
+    size_t next;
+    unsigned int stored;
+    unsigned int failed;
+    char result[BUFFER_SIZE];   // The server's verdict on the whole upload, once it has one
+};
+
+// Read one reply line, newline included; -1 if the connection closed first
+static int recv_reply_line(int sock, char *line, size_t line_size) {
+    size_t len = 0;
+    while (len + 1 < line_size) {
+        ssize_t n = recv(sock, line + len, line_size - 1 - len, 0);
+        if (n <= 0) return -1;
+        len += n;
+        if (memchr(line + len - n, '\n', n)) break;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+// Sending thread: take chunks off the queue and send each with uchunk on a connection of its own
+static void *send_chunks(void *arg) {
+    struct chunk_queue *queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int finished = queue->next == queue->count || queue->result[0];
+        uint32_t index = finished ? 0 : queue->indices[queue->next++];
+        pthread_mutex_unlock(&queue->lock);
+        if (finished) break;
+
+        char command[BUFFER_SIZE], reply[BUFFER_SIZE] = "";
+        off_t offset = (off_t)index * UPLOAD_CHUNK_SIZE;
+        off_t length = queue->size - offset < UPLOAD_CHUNK_SIZE ? queue->size - offset : UPLOAD_CHUNK_SIZE;
+        int sock = open_server_connection();
+        int sent = 0;
+        if (sock >= 0) {
+            snprintf(command, sizeof(command), "uchunk %s %u\n", queue->id, index);
+            struct frame_writer writer;
+            frame_writer_init(&writer, sock);
+            sent = send(sock, command, strlen(command), MSG_NOSIGNAL) == (ssize_t)strlen(command) &&
+                   frame_write_file_range(&writer, queue->fd, offset, length) == 0 && frame_finish(&writer) == 0 &&
+                   recv_reply_line(sock, reply, sizeof(reply)) == 0;
+            close(sock);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        if (sent && strncmp(reply, "Chunk", strlen("Chunk")) == 0 && strstr(reply, " stored: ")) {
+            queue->stored++;
+        } else if (sent && (strncmp(reply, "File uploaded", strlen("File uploaded")) == 0 ||
+                            strncmp(reply, "Upload failed", strlen("Upload failed")) == 0)) {
+            if (reply[0] == 'F') queue->stored++;
+            snprintf(queue->result, sizeof(queue->result), "%s", reply);
+        } else {
+            queue->failed++;
+            printf("Chunk %u not stored: %s", index, sent ? reply : "connection failed\n");
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+// Parse the missing chunk list of a declaration reply ("0-9,12" or "none") into indices. A list
+// cut short with "..." gives only the chunks it names; the next declaration names the rest.
+static size_t parse_missing_chunks(const char *missing, uint32_t *indices, uint32_t chunks) {
+    size_t count = 0;
+    const char *p = missing;
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10), last = first;
+        if (*end == '-') last = strtoul(end + 1, &end, 10);
+        for (unsigned long i = first; i <= last && i < chunks && count < chunks; i++) indices[count++] = i;
+        if (*end != ',') break;
+        p = end + 1;
+    }
+    return count;
+}
+
+// Function to upload a large file through a resumable upload session. The file is declared
+// with its size and whole-file CRC32C; the server answers with the chunks it does not hold yet,
+// which go out UPLOAD_PARALLEL at a time. Chunks that fail are sent again after declaring the
+// file once more, and running ufile again later resumes wherever the server left off.
+void send_file_resumable(const char *filename, const char *destination_path, off_t size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: File open failed\n");
+        return;
+    }
+    static char buffer[1024 * 1024];
+    uint32_t crc = 0;
+    ssize_t n;
+    off_t total = 0;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        crc = crc32c_update(crc, buffer, n);
+        total += n;
+    }
+    uint32_t chunks = (size + UPLOAD_CHUNK_SIZE - 1) / UPLOAD_CHUNK_SIZE;
+    uint32_t *indices = malloc(chunks * sizeof(uint32_t));
+    if (n < 0 || total != size || !indices) {
+        printf("Error: File read failed\n");
+        free(indices);
+        close(fd);
+        return;
+    }
+    printf("Uploading %s in %u chunks: %llu bytes, CRC32C %08x\n", filename, chunks, (unsigned long long)size, crc);
+
+    char command[BUFFER_SIZE], reply[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "udeclare %s %s %llu %d %08x\n", filename, destination_path,
+             (unsigned long long)size, UPLOAD_CHUNK_SIZE, crc);
+    int done = 0;
+    for (int attempt = 0; !done && attempt < UPLOAD_ATTEMPTS;) {
+        // Declare the file, which tells us what the server still needs
+        int sock = connect_to_server();
+        int declared = sock >= 0 && send(sock, command, strlen(command), MSG_NOSIGNAL) == (ssize_t)strlen(command) &&
+                       recv_reply_line(sock, reply, sizeof(reply)) == 0;
+        if (sock >= 0) close(sock);
+        char id[32];
+        unsigned int held, declared_chunks;
+        int missing_start = 0;
+        if (declared && sscanf(reply, "Upload session %31[0-9a-f]: %u of %u chunks held; missing %n",
+                               id, &held, &declared_chunks, &missing_start) == 3 && missing_start > 0) {
+            printf("Server response: %s", reply);
+        } else {
+            if (declared) printf("Server response: %s", reply);
+            done = declared && strncmp(reply, "Server busy", strlen("Server busy")) != 0;
+            if (!done && ++attempt < UPLOAD_ATTEMPTS) sleep(1 << attempt);
+            continue;
+        }
+
+        struct chunk_queue queue = { .id = id, .fd = fd, .size = size, .indices = indices };
+        pthread_mutex_init(&queue.lock, NULL);
+        queue.count = parse_missing_chunks(reply + missing_start, indices, chunks);
+        pthread_t threads[UPLOAD_PARALLEL];
+        int started = 0;
+        for (; started < UPLOAD_PARALLEL && (size_t)started < queue.count; started++) {
+            if (pthread_create(&threads[started], NULL, send_chunks, &queue) != 0) break;
+        }
+        if (started == 0) send_chunks(&queue);
+        for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&queue.lock);
+
+        printf("Sent %u of %zu chunks%s\n", queue.stored, queue.count, queue.failed ? ", some failed" : "");
+        if (queue.result[0]) {
+            printf("Server response: %s", queue.result);
+            done = 1;
+        } else if (queue.failed || queue.count == 0) {
+            // Nothing was missing but nothing was committed either: someone else is committing
+            if (++attempt < UPLOAD_ATTEMPTS) sleep(1 << attempt);
+        }
+    }
+    if (!done) printf("Upload incomplete; run ufile again to resume it\n");
+    free(indices);
+    close(fd);
+}
+
+// Function to upload a tar archive, which the server unpacks as it arrives, storing every member
+// as ufile would; the server answers with one line per member
+void send_archive(const char *filename, const char *destination_path) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: File open failed\n");
+        return;
+    }
+    int sock = connect_to_server();
+    if (sock < 0) {
+        close(fd);
+        return;
+    }
+
+    // Prepare and send the upload command, then the archive as checked frames
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "utar %s\n", destination_path);
+    send(sock, command, strlen(command), MSG_NOSIGNAL);
+    struct frame_writer writer;
+    frame_writer_init(&writer, sock);
+    int result = frame_write_fd(&writer, fd);
+    close(fd);
+    if (result < 0 && !writer.failed) {
+        printf("Error: File read failed\n");
+        frame_write_error(sock, "Client could not read the file.");
+    } else if (result == 0) {
+        frame_finish(&writer);
+    }
+    if (writer.failed) {
+        printf("Error: Sending archive failed\n");
+    } else if (result == 0) {
+        printf("Archive transmission completed: %llu bytes, CRC32C %08x\n", (unsigned long long)writer.total, writer.crc);
+    }
+
+    // Print the server's summary
+    char buffer[BUFFER_SIZE];
+    int bytes_received;
+    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
+        buffer[bytes_received] = '\0';
+        printf("%s", buffer);
+    }
     close(sock);
-    printf("File transmission completed and socket closed.\n");
 }
 
-// Function to download a file from the server
+// Receive a framed file into destination_path. The data goes to a ".part" file that is
+// renamed into place only once every frame and the whole-file CRC32C have been verified.
+// A file sent compressed is then decoded, checking the CRC32C of its original contents, and
+// reader->total and reader->crc describe the decoded file.
+// Returns 1 without touching destination_path if the server answered "not modified".
+int receive_verified_file(int sock, const char *destination_path, struct frame_reader *reader) {
+    char part_path[BUFFER_SIZE];
+    snprintf(part_path, sizeof(part_path), "%s.part", destination_path);
+    int fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error: File open failed\n");
+        return -1;
+    }
+
+    static char buffer[FRAME_MAX_PAYLOAD];
+    frame_reader_init(reader, sock, NULL, 0);
+    ssize_t bytes_received;
+    int write_failed = 0;
+    while ((bytes_received = frame_read(reader, buffer)) > 0) {
+        if (!write_failed && write(fd, buffer, bytes_received) != bytes_received) {
+            write_failed = 1;
+        }
+    }
+    close(fd);
+
+    if (bytes_received < 0 || write_failed) {
+        unlink(part_path);
+        if (reader->status == FRAME_NOT_MODIFIED) {
+            return 1;
+        } else if (reader->status == FRAME_REMOTE_ERROR) {
+            printf("Server error: %s\n", reader->message);
+        } else if (write_failed) {
+            printf("Error: Writing %s failed\n", part_path);
+        } else {
+            printf("Error: Download failed (%s); nothing was saved\n", frame_status_text(reader));
+        }
+        return -1;
+    }
+    if (reader->encoding[0] && decode_received_file(part_path, reader) < 0) {
+        unlink(part_path);
+        return -1;
+    }
+    if (rename(part_path, destination_path) != 0) {
+        printf("Error: Renaming %s failed\n", part_path);
+        unlink(part_path);
+        return -1;
+    }
+    printf("Verified %llu bytes (CRC32C %08x)\n", (unsigned long long)reader->total, reader->crc);
+    return 0;
+}
+
+// Replace a received compressed file with its original contents, which must match the CRC32C
+// recorded when it was compressed
+int decode_received_file(const char *part_path, struct frame_reader *reader) {
+    if (strcmp(reader->encoding, SEEKABLE_ENCODING) != 0) {
+        printf("Error: Download sent in unknown encoding %s; nothing was saved\n", reader->encoding);
+        return -1;
+    }
+    char decoded_path[BUFFER_SIZE + 8];
+    snprintf(decoded_path, sizeof(decoded_path), "%s.decoded", part_path);
+    int in_fd = open(part_path, O_RDONLY);
+    int out_fd = open(decoded_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint64_t size = 0;
+    uint32_t crc = 0;
+    int result = in_fd < 0 || out_fd < 0 ? -1 : seekable_decode_fd(in_fd, out_fd, &size, &crc);
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0 && close(out_fd) != 0) result = -1;
+    if (result == 0 && rename(decoded_path, part_path) != 0) result = -1;
+    if (result < 0) {
+        unlink(decoded_path);
+        printf("Error: Decoding the download failed; nothing was saved\n");
+        return -1;
+    }
+    printf("Received %llu compressed bytes\n", (unsigned long long)reader->total);
+    reader->total = size;
+    reader->crc = crc;
+    return 0;
+}
+
+// Pending delta ops, batched so that runs of copy instructions go out in few sends
+struct delta_output {
+    int sock;
+    unsigned char data[BUFFER_SIZE * 4];
+    size_t len;
+    int failed;
+};
+
+static void delta_flush(struct delta_output *out) {
+    if (!out->failed && out->len > 0 && delta_send_all(out->sock, out->data, out->len) < 0) {
+        out->failed = 1;
+    }
+    out->len = 0;
+}
+
+static void delta_queue(struct delta_output *out, const unsigned char *op, size_t len) {
+    if (out->len + len > sizeof(out->data)) {
+        delta_flush(out);
+    }
+    memcpy(out->data + out->len, op, len);
+    out->len += len;
+}
+
+// Send literal bytes straight from the mapped file, split into ops the server accepts
+static void delta_send_literal(struct delta_output *out, const unsigned char *data, size_t len, uint64_t *literal_bytes) {
+    while (len > 0) {
+        size_t chunk = len < DELTA_MAX_LITERAL ? len : DELTA_MAX_LITERAL;
+        unsigned char op[5];
+        op[0] = DELTA_OP_LITERAL;
+        delta_put_u32(op + 1, (uint32_t)chunk);
+        delta_queue(out, op, sizeof(op));
+        delta_flush(out);
+        if (!out->failed && delta_send_all(out->sock, data, chunk) < 0) {
+            out->failed = 1;
+        }
+        *literal_bytes += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+// Function to upload a modified file by sending only what differs from the server's copy
+void send_file_delta(const char *filename, const char *destination_path) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("Error: File open failed\n");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    const unsigned char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("Error: File map failed\n");
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    int sock = connect_to_server();
+    if (sock < 0) {
+        if (data) munmap((void *)data, size);
+        return;
+    }
+
+    // Prepare and send the delta upload command
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "udelta %s %s\n", filename, destination_path);
+    send(sock, command, strlen(command), 0);
+
+    // Receive the signature header; anything else is an error message from the server
+    unsigned char header[12];
+    char buffer[BUFFER_SIZE];
+    if (delta_recv_all(sock, header, sizeof(header)) < 0 || memcmp(header, DELTA_SIG_MAGIC, 4) != 0) {
+        int bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
+        buffer[bytes_received > 0 ? bytes_received : 0] = '\0';
+        printf("Server response: %.12s%s\n", (char *)header, buffer);
+        close(sock);
+        if (data) munmap((void *)data, size);
+        return;
+    }
+    uint32_t block_size = delta_get_u32(header + 4);
+    uint32_t block_count = delta_get_u32(header + 8);
+
+    // Receive the block signatures and index them by weak checksum
+    size_t table_size = 1;
+    while (table_size < (size_t)block_count * 2) table_size <<= 1;
+    unsigned char *signatures = malloc((size_t)block_count * DELTA_SIG_ENTRY_SIZE + 1);
+    int32_t *buckets = malloc(table_size * sizeof(int32_t));
+    int32_t *chain = malloc(((size_t)block_count + 1) * sizeof(int32_t));
+    if (!signatures || !buckets || !chain ||
+        delta_recv_all(sock, signatures, (size_t)block_count * DELTA_SIG_ENTRY_SIZE) < 0) {
+        printf("Error: Failed to receive block signatures\n");
+        free(signatures); free(buckets); free(chain);
+        close(sock);
+        if (data) munmap((void *)data, size);
+        return;
+    }
+    for (size_t i = 0; i < table_size; i++) buckets[i] = -1;
+    for (uint32_t i = block_count; i-- > 0;) {
+        uint32_t weak = delta_get_u32(signatures + (size_t)i * DELTA_SIG_ENTRY_SIZE);
+        size_t bucket = (weak * 2654435761u) & (table_size - 1);
+        chain[i] = buckets[bucket];
+        buckets[bucket] = i;
+    }
+
+    // Slide a block-sized window over the file, emitting copies for matches and literals in between
+    struct delta_output out = { .sock = sock, .len = 0, .failed = 0 };
+    uint64_t literal_bytes = 0, copied_blocks = 0;
+    size_t pos = 0, literal_start = 0;
+    uint32_t a = 0, b = 0;
+    int window_valid = 0;
+    while (block_count > 0 && pos + block_size <= size && !out.failed) {
+        if (!window_valid) {
+            delta_weak_sums(data + pos, block_size, &a, &b);
+            window_valid = 1;
+        }
+
+        uint32_t weak = delta_weak_combine(a, b);
+        int32_t match = -1;
+        int strong_known = 0;
+        uint64_t strong = 0;
+        for (int32_t i = buckets[(weak * 2654435761u) & (table_size - 1)]; i >= 0; i = chain[i]) {
+            const unsigned char *entry = signatures + (size_t)i * DELTA_SIG_ENTRY_SIZE;
+            if (delta_get_u32(entry) != weak) continue;
+            if (!strong_known) {
+                strong = delta_strong_hash(data + pos, block_size);
+                strong_known = 1;
+            }
+            if (delta_get_u64(entry + 4) == strong) {
+                match = i;
+                break;
+            }
+        }
+
+        if (match >= 0) {
+            delta_send_literal(&out, data + literal_start, pos - literal_start, &literal_bytes);
+            unsigned char op[5];
+            op[0] = DELTA_OP_COPY;
+            delta_put_u32(op + 1, (uint32_t)match);
+            delta_queue(&out, op, sizeof(op));
+            copied_blocks++;
+            pos += block_size;
+            literal_start = pos;
+            window_valid = 0;
+        } else {
+            if (pos + block_size < size) {
+                delta_weak_roll(&a, &b, data[pos], data[pos + block_size], block_size);
+            }
+            pos++;
+            if (pos - literal_start >= DELTA_MAX_LITERAL) {
+                delta_send_literal(&out, data + literal_start, pos - literal_start, &literal_bytes);
+                literal_start = pos;
+            }
+        }
+    }
+    delta_send_literal(&out, data + literal_start, size - literal_start, &literal_bytes);
+
+    // Finish with the total size and whole-file hash so the server can verify before committing
+    unsigned char end_op[17];
+    end_op[0] = DELTA_OP_END;
+    delta_put_u64(end_op + 1, size);
+    delta_put_u64(end_op + 9, delta_strong_hash(data ? (const void *)data : "", size));
+    delta_queue(&out, end_op, sizeof(end_op));
+    delta_flush(&out);
+
+    free(signatures);
+    free(buckets);
+    free(chain);
+    if (data) munmap((void *)data, size);
+
+    if (out.failed) {
+        printf("Error: Sending delta failed\n");
+        close(sock);
+        return;
+    }
+
+    printf("Delta sent: %llu literal bytes, %llu blocks of %u bytes reused, %zu bytes total\n",
+           (unsigned long long)literal_bytes, (unsigned long long)copied_blocks, block_size, size);
+
+    // Receive and print the server's response
+    int bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
+    if (bytes_received > 0) {
+        buffer[bytes_received] = '\0';
+        printf("Server response: %s", buffer);
+    }
+    close(sock);
+}
+
+// Function to download a file from the server. A cached copy's validator goes along with
+// the request, and a "not modified" answer is served from the cache instead of the wire. The
+// server may send a file compressed as it stores it, which is decoded here.
 void download_file(const char *filename) {
+    struct client_cache_entry *cached = client_cache_find(&download_cache, filename);
     int sock = connect_to_server();
     if (sock < 0) return;
 
     // Prepare and send the download command
     char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "dfile %s\n", filename);
+    snprintf(command, sizeof(command), "dfile %s %s%s %s%s\n", filename, FRAME_IF_NONE_MATCH, cached ? cached->validator : "",
+             SEEKABLE_ACCEPT_ENCODING, SEEKABLE_ENCODING);
     send(sock, command, strlen(command), 0);
 
-    char *base_filename = basename((char *)filename);
+    char path_copy[BUFFER_SIZE];
+    snprintf(path_copy, sizeof(path_copy), "%s", filename);
+    char *base_filename = basename(path_copy);
 
     // Get the current working directory
     char base_dir[BUFFER_SIZE];
@@ -100,26 +644,32 @@ void download_file(const char *filename) {
     }
 
     // Define the full path for the downloaded file
-    char destination_path[512];
-    snprintf(destination_path, sizeof(destination_path), "%s/%s", base_dir, base_filename);
-
-    // Receive the file from the server
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    FILE *file = fopen(destination_path, "wb");
-    if (!file) {
-        printf("Error: File open failed\n");
+    char destination_path[BUFFER_SIZE * 2];
+    if (snprintf(destination_path, sizeof(destination_path), "%s/%s", base_dir, base_filename) >= (int)sizeof(destination_path)) {
+        printf("Error: Path too long\n");
         close(sock);
         return;
     }
 
-    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, file);
-    }
-
-    fclose(file);
+    // Receive and verify the file from the server
+    struct frame_reader reader;
+    int result = receive_verified_file(sock, destination_path, &reader);
     close(sock);
-    printf("File downloaded successfully to %s\n", destination_path);
+    if (result == 0) {
+        download_cache.misses++;
+        client_cache_store(&download_cache, filename, reader.validator, destination_path, (off_t)reader.total, reader.crc);
+        printf("File downloaded successfully to %s\n", destination_path);
+    } else if (result == 1 && cached && strcmp(reader.validator, cached->validator) == 0) {
+        if (client_cache_restore(&download_cache, cached, destination_path) == 0) {
+            printf("Not modified; restored %s from the cache (CRC32C %08x)\n", destination_path, cached->crc);
+        } else {
+            // The cached copy is gone or damaged; it has been evicted, so this asks for the whole file
+            printf("Cached copy failed verification; downloading again\n");
+            download_file(filename);
+        }
+    } else if (result == 1) {
+        printf("Error: Server answered not modified for a copy this client does not have\n");
+    }
 }
 
 // Function to remove a file on the server
@@ -161,6 +711,8 @@ void download_tar_file(const char *filetype) {
         strcpy(tar_filename, "text.tar");
     } else if (strcmp(filetype, ".pdf") == 0) {
         strcpy(tar_filename, "pdf.tar");
+    } else if (strcmp(filetype, "*") == 0) {
+        strcpy(tar_filename, "allfiles.tar");
     } else {
         printf("Invalid file type for dtar command.\n");
         close(sock);
@@ -176,26 +728,19 @@ void download_tar_file(const char *filetype) {
     }
 
     // Define the full path for the downloaded tar file
-    char destination_path[512];
-    snprintf(destination_path, sizeof(destination_path), "%s/%s", base_dir, tar_filename);
-
-    // Receive the tar file from the server
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    FILE *file = fopen(destination_path, "wb");
-    if (!file) {
-        printf("Error: File open failed\n");
+    char destination_path[BUFFER_SIZE * 2];
+    if (snprintf(destination_path, sizeof(destination_path), "%s/%s", base_dir, tar_filename) >= (int)sizeof(destination_path)) {
+        printf("Error: Path too long\n");
         close(sock);
         return;
     }
 
-    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, file);
+    // Receive and verify the tar file from the server
+    struct frame_reader reader;
+    if (receive_verified_file(sock, destination_path, &reader) == 0) {
+        printf("Tar file downloaded successfully %s\n", destination_path);
     }
-
-    fclose(file);
     close(sock);
-    printf("Tar file downloaded successfully %s\n", destination_path);
 }
 
 // Function to display the list of files on the server
@@ -229,18 +774,96 @@ void display_files(const char *pathname) {
     close(sock);
 }
 
+// Function to search the contents of stored .c and .txt files on the server,
+// either by scanning every file ("grep") or through the server's index ("search")
+void search_file_contents(const char *command_name, const char *pattern) {
+    int sock = connect_to_server();
+    if (sock < 0) return;
+
+    // Prepare and send the search command
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "%s %s\n", command_name, pattern);
+    send(sock, command, strlen(command), 0);
+
+    // Print matching lines as they arrive
+    char buffer[BUFFER_SIZE];
+    int bytes_received;
+    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
+        buffer[bytes_received] = '\0';
+        printf("%s", buffer);
+    }
+
+    if (bytes_received < 0) {
+        printf("Error: Receiving data from server failed\n");
+    } else {
+        printf("Search completed.\n");
+    }
+
+    close(sock);
+}
+
+// Function to show the server's transfer verification counters
+void show_transfer_stats() {
+    int sock = connect_to_server();
+    if (sock < 0) return;
+
+    const char *command = "stats\n";
+    send(sock, command, strlen(command), 0);
+
+    char buffer[BUFFER_SIZE];
+    int bytes_received;
+    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
+        buffer[bytes_received] = '\0';
+        printf("%s", buffer);
+    }
+
+    close(sock);
+    client_cache_summary(&download_cache);
+}
+
+// Follow the server's change feed, printing "<seq> <event> <path>" lines until the connection
+// ends. since is the last sequence number seen by an earlier watch, or NULL to start now.
+void watch_changes(const char *since) {
+    int sock = connect_to_server();
+    if (sock < 0) return;
+
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "watch%s%s\n", since ? " " : "", since ? since : "");
+    send(sock, command, strlen(command), 0);
+
+    char buffer[BUFFER_SIZE];
+    int bytes_received;
+    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
+        buffer[bytes_received] = '\0';
+        printf("%s", buffer);
+        fflush(stdout);
+    }
+
+    close(sock);
+}
+
 // Main function for client interaction
 int main() {
     char input[BUFFER_SIZE];
     char command[16], filename[256], destination_path[256];
 
+    if (tls_channel_init(TLS_ROLE_CLIENT) < 0) {
+        printf("Error: Failed to set up TLS: %s\n", tls_channel_last_error());
+        return 1;
+    }
     printf("Connected to Smain server at %s:%d\n", SERVER_IP, SERVER_PORT);
     printf("Enter commands in the format:\n");
     printf("1. ufile filename destination_path\n");
-    printf("2. dfile filename\n");
-    printf("3. rmfile filename\n");
-    printf("4. dtar filetype\n");
-    printf("5. display pathname\n");
+    printf("2. udelta filename destination_path\n");
+    printf("3. utar archive.tar destination_path\n");
+    printf("4. dfile filename\n");
+    printf("5. rmfile filename\n");
+    printf("6. dtar filetype\n");
+    printf("7. display pathname\n");
+    printf("8. grep pattern\n");
+    printf("9. search pattern\n");
+    printf("10. stats\n");
+    printf("11. watch [last_sequence]\n");
     printf("Type 'exit' to quit\n");
 
     // Main command loop
@@ -250,6 +873,10 @@ int main() {
 
         if (sscanf(input, "%15s %255s %255s", command, filename, destination_path) == 3 && strcmp(command, "ufile") == 0) {
             send_file(filename, destination_path);
+        } else if (sscanf(input, "%15s %255s %255s", command, filename, destination_path) == 3 && strcmp(command, "udelta") == 0) {
+            send_file_delta(filename, destination_path);
+        } else if (sscanf(input, "%15s %255s %255s", command, filename, destination_path) == 3 && strcmp(command, "utar") == 0) {
+            send_archive(filename, destination_path);
         } else if (sscanf(input, "%15s %255s", command, filename) == 2) {
             if (strcmp(command, "dfile") == 0) {
                 download_file(filename);
@@ -259,25 +886,46 @@ int main() {
                 download_tar_file(filename);
             } else if (strcmp(command, "display") == 0) {
                 display_files(filename);
+            } else if (strcmp(command, "grep") == 0 || strcmp(command, "search") == 0) {
+                search_file_contents(command, filename);
+            } else if (strcmp(command, "watch") == 0) {
+                watch_changes(filename);
             } else {
                 printf("Invalid command or format. Please use:\n");
                 printf("ufile filename destination_path\n");
+                printf("udelta filename destination_path\n");
+                printf("utar archive.tar destination_path\n");
                 printf("dfile filename\n");
                 printf("rmfile filename\n");
                 printf("dtar filetype\n");
                 printf("display pathname\n");
+                printf("grep pattern\n");
+                printf("search pattern\n");
+                printf("stats\n");
+                printf("watch [last_sequence]\n");
             }
         } else if (strncmp(input, "exit", 4) == 0) {
             break;
+        } else if (sscanf(input, "%15s", command) == 1 && strcmp(command, "stats") == 0) {
+            show_transfer_stats();
+        } else if (sscanf(input, "%15s", command) == 1 && strcmp(command, "watch") == 0) {
+            watch_changes(NULL);
         } else {
             printf("Invalid command or format. Please use:\n");
             printf("ufile filename destination_path\n");
+            printf("udelta filename destination_path\n");
+            printf("utar archive.tar destination_path\n");
             printf("dfile filename\n");
             printf("rmfile filename\n");
             printf("dtar filetype\n");
             printf("display pathname\n");
+            printf("grep pattern\n");
+            printf("search pattern\n");
+            printf("stats\n");
+            printf("watch [last_sequence]\n");
         }
     }
 
+    client_cache_summary(&download_cache);
     return 0;
 }
@@ -0,0 +1,299 @@
+#ifndef CLIENT_CACHE_H
+#define CLIENT_CACHE_H
+
+// Local content cache for client24s downloads, keyed by server path.
+//
+// Every file fetched with `dfile` is copied into CLIENT_CACHE_DIR together with the
+// server's validator (size and mtime, see frame_validator()) and the whole-file CRC32C
+// the transfer was verified with. The next `dfile` of the same path sends the validator
+// as "if-none-match=<validator>"; when the server answers "not modified" the copy is
+// restored from the cache and checked against its CRC32C again, so a cache file that
+// was damaged on disk is dropped and fetched again instead of being handed out.
+//
+// The index is one line per file, "<last used> <size> <crc32c> <validator> <path>",
+// rewritten through a temporary file and rename(). Data files are named by the FNV-1a
+// hash of the server path. Once the cached bytes exceed CLIENT_CACHE_MAX_BYTES the
+// least recently used files are evicted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "crc32c.h"
+#include "frame.h"
+
+#ifndef CLIENT_CACHE_DIR
+#define CLIENT_CACHE_DIR ".client24s_cache"
+#endif
+
+#ifndef CLIENT_CACHE_MAX_BYTES
+#define CLIENT_CACHE_MAX_BYTES (256LL * 1024 * 1024)
+#endif
+
+#define CLIENT_CACHE_INDEX "index"
+#define CLIENT_CACHE_PATH_MAX 1024
+
+struct client_cache_entry {
+    char *path;                          // Server path, as given to dfile
+    char validator[FRAME_VALIDATOR_MAX];
+    off_t size;
+    uint32_t crc;                        // CRC32C of the whole file
+    uint64_t last_used;                  // Logical clock, larger is more recent
+};
+
+struct client_cache {
+    struct client_cache_entry *entries;
+    size_t count;
+    size_t capacity;
+    uint64_t clock;
+    long long bytes;                     // Sum of the cached file sizes
+    unsigned long long hits;             // Downloads answered "not modified" and restored
+    unsigned long long misses;           // Downloads that had to transfer the file
+    int loaded;
+};
+
+// FNV-1a over the server path; names the data file
+static inline uint64_t client_cache_hash(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline void client_cache_data_path(const char *path, char *out, size_t out_size) {
+    snprintf(out, out_size, "%s/%016llx", CLIENT_CACHE_DIR, (unsigned long long)client_cache_hash(path));
+}
+
+// Load the index, creating the cache directory on first use. Lines that do not parse or
+// whose data file is missing are dropped.
+static inline void client_cache_load(struct client_cache *cache) {
+    if (cache->loaded) return;
+    cache->loaded = 1;
+    if (mkdir(CLIENT_CACHE_DIR, 0755) < 0 && errno != EEXIST) return;
+
+    char index_path[CLIENT_CACHE_PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s", CLIENT_CACHE_DIR, CLIENT_CACHE_INDEX);
+    FILE *index = fopen(index_path, "r");
+    if (!index) return;
+
+    char line[CLIENT_CACHE_PATH_MAX + 128];
+    while (fgets(line, sizeof(line), index)) {
+        unsigned long long last_used, size;
+        unsigned int crc;
+        char validator[FRAME_VALIDATOR_MAX];
+        int path_start = 0;
+        if (sscanf(line, "%llu %llu %x %63s %n", &last_used, &size, &crc, validator, &path_start) != 4 || path_start == 0) {
+            continue;
+        }
+        char *path = line + path_start;
+        path[strcspn(path, "\n")] = '\0';
+        if (!path[0]) continue;
+
+        char data_path[CLIENT_CACHE_PATH_MAX];
+        struct stat st;
+        client_cache_data_path(path, data_path, sizeof(data_path));
+        if (stat(data_path, &st) < 0 || st.st_size != (off_t)size) continue;
+
+        if (cache->count == cache->capacity) {
+            size_t capacity = cache->capacity ? cache->capacity * 2 : 64;
+            struct client_cache_entry *entries = realloc(cache->entries, capacity * sizeof(*entries));
+            if (!entries) break;
+            cache->entries = entries;
+            cache->capacity = capacity;
+        }
+        struct client_cache_entry *entry = &cache->entries[cache->count];
+        entry->path = strdup(path);
+        if (!entry->path) break;
+        snprintf(entry->validator, sizeof(entry->validator), "%s", validator);
+        entry->size = (off_t)size;
+        entry->crc = crc;
+        entry->last_used = last_used;
+        if (last_used > cache->clock) cache->clock = last_used;
+        cache->bytes += entry->size;
+        cache->count++;
+    }
+    fclose(index);
+}
+
+// Write the index to a temporary file and rename it over the old one
+static inline int client_cache_save(struct client_cache *cache) {
+    char index_path[CLIENT_CACHE_PATH_MAX], temp_path[CLIENT_CACHE_PATH_MAX + 8];
+    snprintf(index_path, sizeof(index_path), "%s/%s", CLIENT_CACHE_DIR, CLIENT_CACHE_INDEX);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", index_path);
+    FILE *index = fopen(temp_path, "w");
+    if (!index) return -1;
+    for (size_t i = 0; i < cache->count; i++) {
+        const struct client_cache_entry *entry = &cache->entries[i];
+        fprintf(index, "%llu %llu %08x %s %s\n", (unsigned long long)entry->last_used,
+                (unsigned long long)entry->size, entry->crc, entry->validator, entry->path);
+    }
+    if (fclose(index) != 0 || rename(temp_path, index_path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static inline struct client_cache_entry *client_cache_find(struct client_cache *cache, const char *path) {
+    client_cache_load(cache);
+    for (size_t i = 0; i < cache->count; i++) {
+        if (strcmp(cache->entries[i].path, path) == 0) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+// Drop an entry and its data file (the index is saved by the caller)
+static inline void client_cache_drop(struct client_cache *cache, struct client_cache_entry *entry) {
+    char data_path[CLIENT_CACHE_PATH_MAX];
+    client_cache_data_path(entry->path, data_path, sizeof(data_path));
+    unlink(data_path);
+    cache->bytes -= entry->size;
+    free(entry->path);
+    *entry = cache->entries[--cache->count];
+}
+
+static inline void client_cache_remove(struct client_cache *cache, struct client_cache_entry *entry) {
+    client_cache_drop(cache, entry);
+    client_cache_save(cache);
+}
+
+// Copy src to a temporary file next to dest and rename it into place. The copied bytes'
+// CRC32C and length are returned so the caller can check them before trusting the copy.
+static inline int client_cache_copy(const char *src, const char *dest, uint32_t *crc, off_t *copied) {
+    char temp_path[CLIENT_CACHE_PATH_MAX + 8];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.part", dest) >= (int)sizeof(temp_path)) return -1;
+    int in = open(src, O_RDONLY);
+    if (in < 0) return -1;
+    int out = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    static char buffer[64 * 1024];
+    uint32_t sum = 0;
+    off_t total = 0;
+    ssize_t n;
+    int failed = 0;
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, n) != n) {
+            failed = 1;
+            break;
+        }
+        sum = crc32c_update(sum, buffer, n);
+        total += n;
+    }
+    if (n < 0) failed = 1;
+    close(in);
+    if (close(out) != 0) failed = 1;
+    if (failed) {
+        unlink(temp_path);
+        return -1;
+    }
+    *crc = sum;
+    *copied = total;
+    // The caller may still reject the copy; it is only renamed once that check passes
+    return 0;
+}
+
+static inline int client_cache_commit_copy(const char *dest, int keep) {
+    char temp_path[CLIENT_CACHE_PATH_MAX + 8];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.part", dest) >= (int)sizeof(temp_path)) return -1;
+    if (keep && rename(temp_path, dest) == 0) return 0;
+    unlink(temp_path);
+    return -1;
+}
+
+// Restore a cached file to dest after the server said it is current. A copy whose size or
+// CRC32C no longer matches is evicted and -1 returned, so the caller downloads it again.
+static inline int client_cache_restore(struct client_cache *cache, struct client_cache_entry *entry, const char *dest) {
+    char data_path[CLIENT_CACHE_PATH_MAX];
+    uint32_t crc;
+    off_t size;
+    client_cache_data_path(entry->path, data_path, sizeof(data_path));
+    int copied = client_cache_copy(data_path, dest, &crc, &size) == 0;
+    int intact = copied && size == entry->size && crc == entry->crc;
+    if (!intact) {
+        if (copied) client_cache_commit_copy(dest, 0);
+        client_cache_remove(cache, entry);
+        return -1;
+    }
+    if (client_cache_commit_copy(dest, 1) != 0) return -1;
+    entry->last_used = ++cache->clock;
+    cache->hits++;
+    client_cache_save(cache);
+    return 0;
+}
+
+// Keep a verified download: copy it into the cache under its server path, then evict the
+// least recently used files until the cache fits in CLIENT_CACHE_MAX_BYTES again
+static inline void client_cache_store(struct client_cache *cache, const char *path, const char *validator,
+                                      const char *downloaded, off_t size, uint32_t crc) {
+    client_cache_load(cache);
+    struct client_cache_entry *old = client_cache_find(cache, path);
+    if (old) client_cache_drop(cache, old);
+    if (!validator[0] || size > CLIENT_CACHE_MAX_BYTES || strlen(path) >= CLIENT_CACHE_PATH_MAX ||
+        strchr(path, '\n')) {
+        client_cache_save(cache);
+        return;
+    }
+
+    char data_path[CLIENT_CACHE_PATH_MAX];
+    uint32_t copied_crc;
+    off_t copied_size;
+    client_cache_data_path(path, data_path, sizeof(data_path));
+    if (client_cache_copy(downloaded, data_path, &copied_crc, &copied_size) != 0) return;
+    if (client_cache_commit_copy(data_path, copied_size == size && copied_crc == crc) != 0) return;
+
+    while (cache->count > 0 && cache->bytes + size > CLIENT_CACHE_MAX_BYTES) {
+        struct client_cache_entry *oldest = &cache->entries[0];
+        for (size_t i = 1; i < cache->count; i++) {
+            if (cache->entries[i].last_used < oldest->last_used) oldest = &cache->entries[i];
+        }
+        client_cache_drop(cache, oldest);
+    }
+
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 64;
+        struct client_cache_entry *entries = realloc(cache->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            unlink(data_path);
+            client_cache_save(cache);
+            return;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    struct client_cache_entry *entry = &cache->entries[cache->count];
+    entry->path = strdup(path);
+    if (!entry->path) {
+        unlink(data_path);
+        client_cache_save(cache);
+        return;
+    }
+    snprintf(entry->validator, sizeof(entry->validator), "%s", validator);
+    entry->size = size;
+    entry->crc = crc;
+    entry->last_used = ++cache->clock;
+    cache->bytes += size;
+    cache->count++;
+    client_cache_save(cache);
+}
+
+// One summary line: hits, misses, hit ratio and what the cache holds
+static inline void client_cache_summary(struct client_cache *cache) {
+    client_cache_load(cache);
+    unsigned long long lookups = cache->hits + cache->misses;
+    printf("Client cache: %llu hits, %llu misses (%.1f%% hit ratio), %zu files, %lld of %lld bytes\n",
+           cache->hits, cache->misses, lookups ? 100.0 * cache->hits / lookups : 0.0,
+           cache->count, cache->bytes, (long long)CLIENT_CACHE_MAX_BYTES);
+}
+
+#endif
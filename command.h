@@ -0,0 +1,176 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+// Request line parsing shared by Smain, Stext and Spdf.
+//
+// A request is one line, "<command> <arg> <arg>...\n", optionally followed by a body (ufile,
+// utar, uchunk, PUT).
+// command_read() receives it straight into the reader's buffer however the bytes are split
+// across segments, scanning only newly arrived bytes for the newline. command_parse() then
+// splits the line in place: the arguments point into the reader's buffer, so nothing is copied
+// or allocated. The command word is mapped to an opcode through a perfect hash, which the
+// dispatch code in every server switches on.
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define COMMAND_LINE_MAX 1024
+#define COMMAND_MAX_ARGS 6
+
+enum opcode {
+    OP_UNKNOWN = 0,
+    // Client requests to Smain
+    OP_UFILE,
+    OP_UDELTA,
+    OP_UTAR,
+    OP_UDECLARE,
+    OP_UCHUNK,
+    OP_DFILE,
+    OP_RMFILE,
+    OP_DTAR,
+    OP_DISPLAY,
+    OP_GREP,
+    OP_SEARCH,
+    OP_STATS,
+    OP_WATCH,
+    // Smain requests to the sub-servers (which also serve dtar, display, grep and search)
+    OP_PUT,
+    OP_RETRIEVE,
+    OP_DELETE,
+    OP_OPEN,
+    OP_MEMBERS,
+    OP_NOTIFY,
+    OP_COUNT
+};
+
+struct command_reader {
+    char line[COMMAND_LINE_MAX];
+    size_t len;             // Bytes received
+    size_t scanned;         // Bytes already searched for the newline
+    size_t line_len;        // Length of the request line once complete
+};
+
+struct command {
+    enum opcode op;
+    const char *name;       // The command word as received
+    int argc;
+    const char *argv[COMMAND_MAX_ARGS];
+};
+
+// Perfect hash of the command words from their first and last characters and length: no two of
+// them share a slot, so a lookup is one table read and one comparison. The slots are computed at
+// compile time; a new command must land in a free slot (gcc -Woverride-init flags a clash).
+#define COMMAND_HASH(first, last, len) (((unsigned)(unsigned char)(first) * 4 + (unsigned)(unsigned char)(last) * 21 + (len)) & 31)
+#define COMMAND_SLOT(first, last, word, op) [COMMAND_HASH(first, last, sizeof(word) - 1)] = { word, sizeof(word) - 1, op }
+
+struct command_entry {
+    const char *word;
+    size_t len;
+    enum opcode op;
+};
+
+static const struct command_entry command_table[32] = {
+    COMMAND_SLOT('u', 'e', "ufile", OP_UFILE),
+    COMMAND_SLOT('u', 'a', "udelta", OP_UDELTA),
+    COMMAND_SLOT('u', 'r', "utar", OP_UTAR),
+    COMMAND_SLOT('u', 'e', "udeclare", OP_UDECLARE),
+    COMMAND_SLOT('u', 'k', "uchunk", OP_UCHUNK),
+    COMMAND_SLOT('d', 'e', "dfile", OP_DFILE),
+    COMMAND_SLOT('r', 'e', "rmfile", OP_RMFILE),
+    COMMAND_SLOT('d', 'r', "dtar", OP_DTAR),
+    COMMAND_SLOT('d', 'y', "display", OP_DISPLAY),
+    COMMAND_SLOT('g', 'p', "grep", OP_GREP),
+    COMMAND_SLOT('s', 'h', "search", OP_SEARCH),
+    COMMAND_SLOT('s', 's', "stats", OP_STATS),
+    COMMAND_SLOT('w', 'h', "watch", OP_WATCH),
+    COMMAND_SLOT('P', 'T', "PUT", OP_PUT),
+    COMMAND_SLOT('R', 'E', "RETRIEVE", OP_RETRIEVE),
+    COMMAND_SLOT('D', 'E', "DELETE", OP_DELETE),
+    COMMAND_SLOT('O', 'N', "OPEN", OP_OPEN),
+    COMMAND_SLOT('M', 'S', "MEMBERS", OP_MEMBERS),
+    COMMAND_SLOT('N', 'Y', "NOTIFY", OP_NOTIFY),
+};
+
+static inline enum opcode command_lookup(const char *word, size_t len) {
+    if (len == 0) return OP_UNKNOWN;
+    const struct command_entry *entry = &command_table[COMMAND_HASH(word[0], word[len - 1], len)];
+    if (entry->word && entry->len == len && memcmp(entry->word, word, len) == 0) return entry->op;
+    return OP_UNKNOWN;
+}
+
+static inline void command_reader_init(struct command_reader *reader) {
+    reader->len = 0;
+    reader->scanned = 0;
+    reader->line_len = 0;
+}
+
+// Look for the end of the request line in the bytes added since the last call. Returns 1 once
+// the line is complete (anything after it is the start of the body), 0 if more is needed.
+static inline int command_reader_scan(struct command_reader *reader) {
+    char *newline = memchr(reader->line + reader->scanned, '\n', reader->len - reader->scanned);
+    reader->scanned = reader->len;
+    if (!newline) return 0;
+    reader->line_len = newline - reader->line;
+    return 1;
+}
+
+// Receive until the request line is complete, however it is split across segments. The sender
+// closing its side also ends the line. Returns 0 on success, -1 if the connection failed or
+// closed before sending anything, or the line does not fit.
+static inline int command_read(struct command_reader *reader, int sock) {
+    while (!command_reader_scan(reader)) {
+        size_t room = sizeof(reader->line) - 1 - reader->len;
+        if (room == 0) return -1;
+        ssize_t n = recv(sock, reader->line + reader->len, room, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            if (reader->len == 0) return -1;
+            reader->line_len = reader->len;
+            return 0;
+        }
+        reader->len += n;
+    }
+    return 0;
+}
+
+// Bytes that arrived after the request line
+static inline const char *command_body(const struct command_reader *reader, size_t *len) {
+    size_t start = reader->line_len < reader->len ? reader->line_len + 1 : reader->len;
+    *len = reader->len - start;
+    return reader->line + start;
+}
+
+// Split the complete request line in place into the command and its arguments. The line is
+// NUL-terminated (replacing the newline), so it can also be logged as a string.
+static inline void command_parse(struct command_reader *reader, struct command *command) {
+    char *p = reader->line, *end = reader->line + reader->line_len;
+    *end = '\0';
+    if (end > p && end[-1] == '\r') *--end = '\0';
+
+    command->op = OP_UNKNOWN;
+    command->name = "";
+    command->argc = 0;
+    int first = 1;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p == end) break;
+        char *token = p;
+        while (p < end && *p != ' ' && *p != '\t') p++;
+        size_t token_len = p - token;
+        *p++ = '\0';
+
+        if (first) {
+            command->name = token;
+            command->op = command_lookup(token, token_len);
+            first = 0;
+        } else if (command->argc < COMMAND_MAX_ARGS) {
+            command->argv[command->argc++] = token;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+// CRC32C (Castagnoli) used to checksum every transfer frame.
+//
+// On x86-64 CPUs with SSE4.2 the crc32 instruction runs on three independent 8 KiB lanes at
+// once to hide its latency, and the lane results are merged by multiplying the earlier CRCs by
+// x^(8 * lane size) with precomputed tables (Mark Adler's method). Other CPUs use a portable
+// slicing-by-8 table implementation. crc32c_update(0, buf, len) starts a new checksum;
+// passing the previous result continues it. crc32c_combine() joins the checksums of pieces
+// that were summed separately, such as the chunks of a resumable upload.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long_shift[4][256];
+static uint32_t crc32c_short_shift[4][256];
+static int crc32c_use_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Multiply a 32x32 GF(2) matrix by a vector
+static inline uint32_t crc32c_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static inline void crc32c_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = crc32c_matrix_times(mat, mat[n]);
+    }
+}
+
+// Build tables that append len zero bytes to a CRC (len must be a power of two)
+static inline void crc32c_build_shift(uint32_t shift[4][256], size_t len) {
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    crc32c_matrix_square(even, odd);  // Operator for two zero bits
+    crc32c_matrix_square(odd, even);  // Four zero bits
+
+    // Square repeatedly: the first iteration gives one zero byte
+    const uint32_t *op;
+    for (;;) {
+        crc32c_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0) {
+            op = even;
+            break;
+        }
+        crc32c_matrix_square(odd, even);
+        len >>= 1;
+        if (len == 0) {
+            op = odd;
+            break;
+        }
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        shift[0][n] = crc32c_matrix_times(op, n);
+        shift[1][n] = crc32c_matrix_times(op, n << 8);
+        shift[2][n] = crc32c_matrix_times(op, n << 16);
+        shift[3][n] = crc32c_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t shift[4][256], uint32_t crc) {
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+    crc32c_build_shift(crc32c_long_shift, CRC32C_LONG);
+    crc32c_build_shift(crc32c_short_shift, CRC32C_SHORT);
+#ifdef CRC32C_HAVE_SSE42
+    crc32c_use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// Portable slicing-by-8
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *next, size_t len) {
+    uint64_t crc0 = crc ^ 0xffffffff;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, next, 8);
+        crc0 ^= word;
+        crc0 = crc32c_table[7][crc0 & 0xff] ^ crc32c_table[6][(crc0 >> 8) & 0xff] ^
+               crc32c_table[5][(crc0 >> 16) & 0xff] ^ crc32c_table[4][(crc0 >> 24) & 0xff] ^
+               crc32c_table[3][(crc0 >> 32) & 0xff] ^ crc32c_table[2][(crc0 >> 40) & 0xff] ^
+               crc32c_table[1][(crc0 >> 48) & 0xff] ^ crc32c_table[0][crc0 >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// Run the crc32 instruction over three adjacent lanes of lane bytes each, then fold them together
+__attribute__((target("sse4.2")))
+static inline uint64_t crc32c_hw_lanes(uint64_t crc0, const unsigned char **next_ptr, size_t *len_ptr,
+                                       size_t lane, uint32_t shift[4][256]) {
+    const unsigned char *next = *next_ptr;
+    size_t len = *len_ptr;
+    while (len >= lane * 3) {
+        uint64_t crc1 = 0, crc2 = 0, word;
+        const unsigned char *end = next + lane;
+        do {
+            memcpy(&word, next, 8);
+            crc0 = _mm_crc32_u64(crc0, word);
+            memcpy(&word, next + lane, 8);
+            crc1 = _mm_crc32_u64(crc1, word);
+            memcpy(&word, next + lane * 2, 8);
+            crc2 = _mm_crc32_u64(crc2, word);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(shift, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(shift, (uint32_t)crc0) ^ crc2;
+        next += lane * 2;
+        len -= lane * 3;
+    }
+    *next_ptr = next;
+    *len_ptr = len;
+    return crc0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *next, size_t len) {
+    uint64_t crc0 = crc ^ 0xffffffff;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        len--;
+    }
+    crc0 = crc32c_hw_lanes(crc0, &next, &len, CRC32C_LONG, crc32c_long_shift);
+    crc0 = crc32c_hw_lanes(crc0, &next, &len, CRC32C_SHORT, crc32c_short_shift);
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, next, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        len--;
+    }
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+#endif
+
+static inline uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_use_hw) return crc32c_hw(crc, (const unsigned char *)buf, len);
+#endif
+    return crc32c_sw(crc, (const unsigned char *)buf, len);
+}
+
+// Operator that appends len zero bytes to a CRC32C, for crc32c_combine(). It takes one matrix
+// squaring per bit of len, so callers joining many pieces of one length build it once.
+static inline void crc32c_zeros_operator(uint32_t op[32], uint64_t len) {
+    uint32_t power[32], product[32];
+    power[0] = CRC32C_POLY;  // One zero bit
+    for (int n = 1; n < 32; n++) power[n] = 1u << (n - 1);
+    for (int i = 0; i < 3; i++) {
+        crc32c_matrix_square(product, power);
+        memcpy(power, product, sizeof(power));
+    }
+    for (int n = 0; n < 32; n++) op[n] = 1u << n;
+    while (len) {
+        if (len & 1) {
+            for (int n = 0; n < 32; n++) product[n] = crc32c_matrix_times(power, op[n]);
+            memcpy(op, product, sizeof(product));
+        }
+        len >>= 1;
+        if (len) {
+            crc32c_matrix_square(product, power);
+            memcpy(power, product, sizeof(power));
+        }
+    }
+}
+
+// CRC32C of two pieces back to back, from the CRC32C of each and the operator for the length
+// of the second
+static inline uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, const uint32_t op[32]) {
+    return crc32c_matrix_times(op, crc1) ^ crc2;
+}
+
+#endif
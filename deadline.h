@@ -0,0 +1,433 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+// Connection deadlines for Smain's threads and the sub-servers' children.
+//
+// A connection is reaped (shut down, which wakes its handler out of whatever recv() or send() it
+// is blocked in, so it cleans up and returns its thread or child) when
+//   - the request line has not arrived DEADLINE_HEADER_MS after the connection was accepted,
+//   - nothing has moved either way for DEADLINE_IDLE_MS, or
+//   - the peer is what holds it up (we have data queued for it, or it is sending and we are
+//     keeping up) and it moves under DEADLINE_MIN_RATE bytes per second over DEADLINE_WINDOW_MS.
+// Progress is read from the kernel (TCP_INFO byte counts and the socket queue sizes), so none
+// of the transfer code has to report it. Unix-domain sockets have no byte counts; for them only
+// a peer that stops reading what is queued for it counts as idle.
+//
+// The checks are kept on a hashed timer wheel of DEADLINE_WHEEL_SLOTS slots of DEADLINE_TICK_MS:
+// adding, rescheduling and removing a connection is O(1), and one thread visits only the slots
+// that are due, sleeping through empty stretches. Every connection is looked at once per window,
+// so thousands of them cost a few getsockopt() calls per second.
+//
+// The forking sub-servers share one wheel between the parent and all of its children: the wheel,
+// its lock and a pool of entries live in a MAP_SHARED mapping made before the first fork. The
+// parent takes an entry for each connection it accepts and keeps its own descriptor of the socket
+// until the child is done with it, so the one thread in the parent can measure and shut down
+// every child's connection; the children only flag their progress on the shared entry.
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>    // For the byte counts in struct tcp_info, which glibc's copy lacks
+#include <linux/sockios.h>
+
+#ifndef DEADLINE_HEADER_MS
+#define DEADLINE_HEADER_MS 10000     // Time allowed for the request line to arrive
+#endif
+#ifndef DEADLINE_IDLE_MS
+#define DEADLINE_IDLE_MS 60000       // Time a connection may go without moving a byte
+#endif
+#ifndef DEADLINE_MIN_RATE
+#define DEADLINE_MIN_RATE 1024       // Bytes per second a peer-bound connection has to keep up
+#endif
+#ifndef DEADLINE_WINDOW_MS
+#define DEADLINE_WINDOW_MS 10000     // Interval over which progress is measured
+#endif
+#define DEADLINE_TICK_MS 100
+#define DEADLINE_WHEEL_SLOTS 512     // Covers 51.2 s; later deadlines wait for their turn round
+#ifndef DEADLINE_SHARED_ENTRIES
+#define DEADLINE_SHARED_ENTRIES 4096 // Connections a shared wheel tracks at once; more go unchecked
+#endif
+
+enum deadline_reason {
+    DEADLINE_REAP_HEADER,
+    DEADLINE_REAP_IDLE,
+    DEADLINE_REAP_SLOW,
+    DEADLINE_REASONS
+};
+
+// A tracked connection. It lives with its handler (on its stack) from deadline_track() until
+// deadline_untrack(), which must come before the socket is closed. On a shared wheel it comes
+// from the pool instead and the sock is the parent's descriptor, closed by the wheel's thread.
+struct deadline_entry {
+    struct deadline_entry *next;
+    struct deadline_entry **pprev;   // Link pointing at this entry, NULL while not on the wheel
+    uint64_t expires;                // Tick of the next check
+    int sock;
+    int header_done;
+    int is_tcp;
+    uint64_t accepted_ms;
+    uint64_t last_progress_ms;
+    uint64_t checked_ms;
+    uint64_t received;               // TCP byte counts as of the last check
+    uint64_t acked;
+    int queued;                      // Bytes queued for the peer at the last check
+    int reaped;                      // 1 + the deadline_reason it was reaped for, 0 if it was not
+    int pooled;                      // Taken from a shared wheel's pool
+    int exempt;                      // Pooled and quiet by design: only checked for its owner
+    pid_t owner;                     // The child serving a pooled entry, 0 until it is forked
+};
+
+struct deadline_counts {
+    unsigned long long reaped[DEADLINE_REASONS];
+};
+
+struct deadline_wheel {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;          // Signalled when a check is scheduled sooner than the thread sleeps
+    struct deadline_entry *slots[DEADLINE_WHEEL_SLOTS];
+    uint64_t start_ms;
+    uint64_t tick;                   // Last tick whose slot was processed
+    uint64_t sleep_until;            // Tick the thread is sleeping until
+    size_t tracked;
+    struct deadline_counts *counts;
+    int running;
+    struct deadline_entry *free_entries;   // A shared wheel's unused pool entries
+    struct deadline_entry *released;       // Pooled entries whose descriptor the thread has to close
+};
+
+struct deadline_shared {
+    struct deadline_wheel wheel;
+    struct deadline_counts counts;
+    struct deadline_entry entries[DEADLINE_SHARED_ENTRIES];
+};
+
+static const char *const deadline_reason_names[DEADLINE_REASONS] = { "header timeout", "idle", "too slow" };
+
+static inline uint64_t deadline_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static inline uint64_t deadline_tick_of(const struct deadline_wheel *wheel, uint64_t ms) {
+    return ms > wheel->start_ms ? (ms - wheel->start_ms) / DEADLINE_TICK_MS : 0;
+}
+
+static inline void deadline_setup(struct deadline_wheel *wheel, int pshared) {
+    pthread_mutexattr_t lock_attr;
+    pthread_mutexattr_init(&lock_attr);
+    if (pshared) {
+        // A child that dies holding the lock must not stop the wheel
+        pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(&wheel->lock, &lock_attr);
+    pthread_mutexattr_destroy(&lock_attr);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pshared) pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&wheel->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    wheel->start_ms = deadline_now_ms();
+}
+
+// Set up a wheel for the threads of one process
+static inline void deadline_init(struct deadline_wheel *wheel) {
+    static struct deadline_counts private_counts;
+    memset(wheel, 0, sizeof(*wheel));
+    deadline_setup(wheel, 0);
+    wheel->counts = &private_counts;
+}
+
+// Set up a wheel shared with the children forked from now on, or return NULL
+static inline struct deadline_wheel *deadline_create_shared(void) {
+    struct deadline_shared *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) return NULL;
+    struct deadline_wheel *wheel = &shared->wheel;
+    deadline_setup(wheel, 1);
+    wheel->counts = &shared->counts;
+    for (int i = DEADLINE_SHARED_ENTRIES - 1; i >= 0; i--) {
+        shared->entries[i].next = wheel->free_entries;
+        wheel->free_entries = &shared->entries[i];
+    }
+    return wheel;
+}
+
+static inline void deadline_lock(struct deadline_wheel *wheel) {
+    if (pthread_mutex_lock(&wheel->lock) == EOWNERDEAD) pthread_mutex_consistent(&wheel->lock);
+}
+
+// Put an entry on the wheel to be checked at ms. Call with the lock held.
+static inline void deadline_schedule(struct deadline_wheel *wheel, struct deadline_entry *entry, uint64_t ms) {
+    if (entry->pprev) {
+        *entry->pprev = entry->next;
+        if (entry->next) entry->next->pprev = entry->pprev;
+    }
+    entry->expires = deadline_tick_of(wheel, ms) + 1;
+    if (entry->expires <= wheel->tick) entry->expires = wheel->tick + 1;
+    struct deadline_entry **slot = &wheel->slots[entry->expires % DEADLINE_WHEEL_SLOTS];
+    entry->next = *slot;
+    if (*slot) (*slot)->pprev = &entry->next;
+    entry->pprev = slot;
+    *slot = entry;
+    if (entry->expires < wheel->sleep_until) pthread_cond_signal(&wheel->changed);
+}
+
+static inline void deadline_unlink(struct deadline_entry *entry) {
+    if (!entry->pprev) return;
+    *entry->pprev = entry->next;
+    if (entry->next) entry->next->pprev = entry->pprev;
+    entry->pprev = NULL;
+    entry->next = NULL;
+}
+
+// Read the connection's byte counts: received and acknowledged by the peer. Returns -1 where the
+// kernel does not keep them (Unix-domain sockets).
+static inline int deadline_sample(const struct deadline_entry *entry, uint64_t *received, uint64_t *acked) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (!entry->is_tcp || getsockopt(entry->sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) return -1;
+    *received = info.tcpi_bytes_received;
+    *acked = info.tcpi_bytes_acked;
+    return 0;
+}
+
+static inline void deadline_prepare(struct deadline_entry *entry, int sock) {
+    memset(entry, 0, sizeof(*entry));
+    entry->sock = sock;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    entry->is_tcp = getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0;
+    entry->accepted_ms = entry->last_progress_ms = entry->checked_ms = deadline_now_ms();
+}
+
+// Start tracking a connection that was just accepted
+static inline void deadline_track(struct deadline_wheel *wheel, struct deadline_entry *entry, int sock) {
+    deadline_prepare(entry, sock);
+    deadline_lock(wheel);
+    wheel->tracked++;
+    deadline_schedule(wheel, entry, entry->accepted_ms + DEADLINE_HEADER_MS);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+// Start tracking a connection on a shared wheel before forking its child. The wheel takes over
+// sock: the parent must not close it, the thread does once the child has untracked the entry or
+// died. Returns NULL (with sock left to the caller) when the pool is used up.
+static inline struct deadline_entry *deadline_track_shared(struct deadline_wheel *wheel, int sock) {
+    deadline_lock(wheel);
+    struct deadline_entry *entry = wheel->free_entries;
+    if (entry) wheel->free_entries = entry->next;
+    pthread_mutex_unlock(&wheel->lock);
+    if (!entry) return NULL;
+    deadline_prepare(entry, sock);
+    entry->pooled = 1;
+    deadline_lock(wheel);
+    wheel->tracked++;
+    deadline_schedule(wheel, entry, entry->accepted_ms + DEADLINE_HEADER_MS);
+    pthread_mutex_unlock(&wheel->lock);
+    return entry;
+}
+
+// Name the child serving a pooled entry, so that the thread notices if it dies without untracking
+static inline void deadline_set_owner(struct deadline_wheel *wheel, struct deadline_entry *entry, pid_t owner) {
+    if (!entry) return;
+    deadline_lock(wheel);
+    entry->owner = owner;
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+// The request line is in: from now on the connection is held to the idle and rate deadlines.
+// This and the calls below take a NULL entry (a connection a full pool left untracked).
+static inline void deadline_header_done(struct deadline_wheel *wheel, struct deadline_entry *entry) {
+    if (!entry) return;
+    deadline_lock(wheel);
+    entry->header_done = 1;
+    entry->last_progress_ms = entry->checked_ms = deadline_now_ms();
+    deadline_sample(entry, &entry->received, &entry->acked);
+    if (entry->pprev) deadline_schedule(wheel, entry, entry->last_progress_ms + DEADLINE_WINDOW_MS);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+// Stop checking a connection that is quiet by design (a watch subscription), but keep it counted
+static inline void deadline_exempt(struct deadline_wheel *wheel, struct deadline_entry *entry) {
+    if (!entry) return;
+    deadline_lock(wheel);
+    if (entry->pooled) entry->exempt = 1;
+    else deadline_unlink(entry);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+// Hand a pooled entry back to the thread, which closes the parent's descriptor and frees it.
+// Call with the lock held.
+static inline void deadline_release(struct deadline_wheel *wheel, struct deadline_entry *entry) {
+    deadline_unlink(entry);
+    wheel->tracked--;
+    entry->owner = 0;
+    entry->next = wheel->released;
+    wheel->released = entry;
+    pthread_cond_signal(&wheel->changed);
+}
+
+// Stop tracking a connection. Returns 1 + the reason it was reaped for, or 0.
+static inline int deadline_untrack(struct deadline_wheel *wheel, struct deadline_entry *entry) {
+    if (!entry) return 0;
+    deadline_lock(wheel);
+    int reaped = entry->reaped;
+    if (entry->pooled) {
+        deadline_release(wheel, entry);
+    } else {
+        deadline_unlink(entry);
+        wheel->tracked--;
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    return reaped;
+}
+
+// Whether the child serving a pooled entry has gone without untracking it (crashed, or exited
+// early). Its zombie counts as gone: the accept loop may not get round to reaping it for a while.
+static inline int deadline_owner_gone(pid_t owner) {
+    if (owner <= 0) return 0;
+    if (waitpid(owner, NULL, WNOHANG) == owner) return 1;
+    return kill(owner, 0) < 0 && errno == ESRCH;
+}
+
+static inline void deadline_reap(struct deadline_wheel *wheel, struct deadline_entry *entry, enum deadline_reason reason) {
+    entry->reaped = 1 + reason;
+    __atomic_fetch_add(&wheel->counts->reaped[reason], 1, __ATOMIC_RELAXED);
+    // Drop whatever is still queued for the peer: once closed, the socket resets instead of
+    // holding on to the data until a slow reader has drained it
+    struct linger abort_on_close = { 1, 0 };
+    setsockopt(entry->sock, SOL_SOCKET, SO_LINGER, &abort_on_close, sizeof(abort_on_close));
+    shutdown(entry->sock, SHUT_RDWR);
+    // Keep looking in on a pooled entry until its child hands it back, in case it never does
+    if (entry->pooled) deadline_schedule(wheel, entry, deadline_now_ms() + DEADLINE_WINDOW_MS);
+}
+
+// An entry's check is due: reap it, or schedule the next one. Call with the lock held.
+static inline void deadline_check(struct deadline_wheel *wheel, struct deadline_entry *entry, uint64_t now_ms) {
+    if (entry->pooled && deadline_owner_gone(entry->owner)) {
+        deadline_release(wheel, entry);
+        return;
+    }
+    if (entry->reaped || entry->exempt) {
+        deadline_schedule(wheel, entry, now_ms + DEADLINE_WINDOW_MS);
+        return;
+    }
+    if (!entry->header_done) {
+        deadline_reap(wheel, entry, DEADLINE_REAP_HEADER);
+        return;
+    }
+
+    int queued = 0, unread = 0;
+    ioctl(entry->sock, SIOCOUTQ, &queued);
+    ioctl(entry->sock, SIOCINQ, &unread);
+    uint64_t received, acked, moved;
+    int peer_bound = 0;
+    if (deadline_sample(entry, &received, &acked) == 0) {
+        uint64_t received_now = received - entry->received;
+        moved = received_now + (acked - entry->acked);
+        entry->received = received;
+        entry->acked = acked;
+        // The peer holds the connection up if we have data waiting for it, or it is sending and
+        // we are taking everything as it comes
+        peer_bound = queued > 0 || (received_now > 0 && unread == 0);
+    } else {
+        // Nothing is waiting on the peer, or it has been reading
+        moved = queued == 0 || queued != entry->queued;
+    }
+    entry->queued = queued;
+
+    uint64_t interval = now_ms - entry->checked_ms;
+    entry->checked_ms = now_ms;
+    if (!moved) {
+        if (now_ms - entry->last_progress_ms >= DEADLINE_IDLE_MS) {
+            deadline_reap(wheel, entry, DEADLINE_REAP_IDLE);
+            return;
+        }
+    } else if (peer_bound && interval >= DEADLINE_WINDOW_MS && moved * 1000 < (uint64_t)DEADLINE_MIN_RATE * interval) {
+        deadline_reap(wheel, entry, DEADLINE_REAP_SLOW);
+        return;
+    } else {
+        entry->last_progress_ms = now_ms;
+    }
+    deadline_schedule(wheel, entry, now_ms + DEADLINE_WINDOW_MS);
+}
+
+// The wheel's thread: process the slots that have come due, then sleep until the next entry
+static inline void *deadline_run(void *arg) {
+    struct deadline_wheel *wheel = arg;
+    deadline_lock(wheel);
+    while (1) {
+        uint64_t now_ms = deadline_now_ms();
+        uint64_t now = deadline_tick_of(wheel, now_ms);
+        // Past a full turn every slot has been visited; the tick test below catches the rest
+        uint64_t from = now - wheel->tick > DEADLINE_WHEEL_SLOTS ? now - DEADLINE_WHEEL_SLOTS : wheel->tick;
+        for (uint64_t tick = from + 1; tick <= now; tick++) {
+            struct deadline_entry *entry = wheel->slots[tick % DEADLINE_WHEEL_SLOTS];
+            while (entry) {
+                struct deadline_entry *next = entry->next;
+                if (entry->expires <= now) {
+                    deadline_unlink(entry);
+                    deadline_check(wheel, entry, now_ms);
+                }
+                entry = next;
+            }
+        }
+        wheel->tick = now;
+
+        // Close the parent's side of the connections whose children are done with them
+        while (wheel->released) {
+            struct deadline_entry *entry = wheel->released;
+            wheel->released = entry->next;
+            close(entry->sock);
+            entry->pooled = entry->exempt = 0;
+            entry->next = wheel->free_entries;
+            wheel->free_entries = entry;
+        }
+
+        // Sleep until the nearest slot with an entry in it, or until something is scheduled sooner
+        uint64_t next = now + DEADLINE_WHEEL_SLOTS;
+        for (uint64_t tick = now + 1; tick < now + DEADLINE_WHEEL_SLOTS; tick++) {
+            if (wheel->slots[tick % DEADLINE_WHEEL_SLOTS]) {
+                next = tick;
+                break;
+            }
+        }
+        wheel->sleep_until = next;
+        uint64_t wake_ms = wheel->start_ms + next * DEADLINE_TICK_MS;
+        struct timespec wake = { (time_t)(wake_ms / 1000), (long)(wake_ms % 1000) * 1000000L };
+        if (pthread_cond_timedwait(&wheel->changed, &wheel->lock, &wake) == EOWNERDEAD) {
+            pthread_mutex_consistent(&wheel->lock);
+        }
+    }
+    return NULL;
+}
+
+// Start the wheel's thread; a shared wheel's runs in the parent and serves every child
+static inline int deadline_start(struct deadline_wheel *wheel) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int result = pthread_create(&thread, &attr, deadline_run, wheel);
+    pthread_attr_destroy(&attr);
+    wheel->running = result == 0;
+    return result == 0 ? 0 : -1;
+}
+
+static inline unsigned long long deadline_reaped(const struct deadline_wheel *wheel, enum deadline_reason reason) {
+    return __atomic_load_n(&wheel->counts->reaped[reason], __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+// Block signatures and wire helpers for rsync-style delta uploads (`udelta`).
+//
+// The server splits its current copy of a file into fixed-size blocks and sends one
+// signature per block: a rolling weak checksum plus a 64-bit strong hash (XXH64).
+// The client slides a window over its new copy, looks up the weak checksum of every
+// offset, confirms candidates with the strong hash, and sends only literal bytes and
+// "copy block N" instructions. The server rebuilds the file and swaps it in atomically.
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 65536
+#define DELTA_MAX_LITERAL (1024 * 1024)  // Largest literal sent in a single op
+#define DELTA_SIG_MAGIC "DSIG"
+#define DELTA_SIG_ENTRY_SIZE 12          // u32 weak checksum + u64 strong hash
+
+// Delta stream opcodes (client -> server)
+#define DELTA_OP_LITERAL 'L'  // u32 length, then that many bytes
+#define DELTA_OP_COPY    'C'  // u32 block index in the server's copy
+#define DELTA_OP_END     'E'  // u64 total size, u64 strong hash of the whole new file
+
+// Pick a block size of roughly sqrt(file size), as rsync does
+static inline uint32_t delta_block_size(off_t file_size) {
+    uint32_t block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && (off_t)block * block < file_size) {
+        block <<= 1;
+    }
+    return block;
+}
+
+// Compute the two halves of the weak checksum over a block:
+//   a = sum(x[i]),  b = sum((len - i) * x[i])
+// Both are kept modulo 2^32 and folded to 16 bits by delta_weak_combine().
+// b is evaluated as len * a - sum(i * x[i]) so that 16-byte chunks can be summed in parallel.
+static inline void delta_weak_sums(const unsigned char *buf, size_t len, uint32_t *a_out, uint32_t *b_out) {
+    uint32_t a = 0, weighted = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights_lo = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m128i weights_hi = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i sum_vec = zero;       // Byte sums of all chunks so far (two 64-bit lanes)
+    __m128i prefix_vec = zero;    // Running total of sum_vec: each chunk counted once per later chunk
+    __m128i weighted_vec = zero;  // sum(j * x[j]) within each chunk (four 32-bit lanes)
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        prefix_vec = _mm_add_epi64(prefix_vec, sum_vec);
+        sum_vec = _mm_add_epi64(sum_vec, _mm_sad_epu8(v, zero));
+        weighted_vec = _mm_add_epi32(weighted_vec, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights_lo));
+        weighted_vec = _mm_add_epi32(weighted_vec, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights_hi));
+    }
+
+    // Horizontal reductions; all arithmetic is modulo 2^32
+    a = (uint32_t)_mm_cvtsi128_si32(sum_vec) + (uint32_t)_mm_cvtsi128_si32(_mm_unpackhi_epi64(sum_vec, sum_vec));
+    uint32_t prefix = (uint32_t)_mm_cvtsi128_si32(prefix_vec) + (uint32_t)_mm_cvtsi128_si32(_mm_unpackhi_epi64(prefix_vec, prefix_vec));
+    weighted_vec = _mm_add_epi32(weighted_vec, _mm_shuffle_epi32(weighted_vec, _MM_SHUFFLE(1, 0, 3, 2)));
+    weighted_vec = _mm_add_epi32(weighted_vec, _mm_shuffle_epi32(weighted_vec, _MM_SHUFFLE(2, 3, 0, 1)));
+    // Chunk k starts at 16 * k, and sum(k * chunk_k) = (chunks - 1) * a - prefix
+    uint32_t chunks = (uint32_t)(i / 16);
+    if (chunks > 0) {
+        weighted = 16 * ((chunks - 1) * a - prefix) + (uint32_t)_mm_cvtsi128_si32(weighted_vec);
+    }
+#endif
+
+    for (; i < len; i++) {
+        a += buf[i];
+        weighted += (uint32_t)i * buf[i];
+    }
+
+    *a_out = a;
+    *b_out = (uint32_t)len * a - weighted;
+}
+
+// Slide the window one byte: drop `out` from the front and append `in` at the back
+static inline void delta_weak_roll(uint32_t *a, uint32_t *b, unsigned char out, unsigned char in, uint32_t len) {
+    *a = *a - out + in;
+    *b = *b - len * out + *a;
+}
+
+static inline uint32_t delta_weak_combine(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | (b << 16);
+}
+
+// XXH64 building blocks
+#define DELTA_PRIME64_1 0x9E3779B185EBCA87ULL
+#define DELTA_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define DELTA_PRIME64_3 0x165667B19E3779F9ULL
+#define DELTA_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define DELTA_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t delta_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t delta_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t delta_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t delta_xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * DELTA_PRIME64_2;
+    acc = delta_rotl64(acc, 31);
+    return acc * DELTA_PRIME64_1;
+}
+
+static inline uint64_t delta_xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= delta_xxh64_round(0, val);
+    return acc * DELTA_PRIME64_1 + DELTA_PRIME64_4;
+}
+
+// Strong block hash: XXH64 with seed 0 (little-endian hosts)
+static inline uint64_t delta_strong_hash(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = DELTA_PRIME64_1 + DELTA_PRIME64_2;
+        uint64_t v2 = DELTA_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - DELTA_PRIME64_1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = delta_xxh64_round(v1, delta_read64(p));
+            v2 = delta_xxh64_round(v2, delta_read64(p + 8));
+            v3 = delta_xxh64_round(v3, delta_read64(p + 16));
+            v4 = delta_xxh64_round(v4, delta_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = delta_rotl64(v1, 1) + delta_rotl64(v2, 7) + delta_rotl64(v3, 12) + delta_rotl64(v4, 18);
+        h = delta_xxh64_merge(h, v1);
+        h = delta_xxh64_merge(h, v2);
+        h = delta_xxh64_merge(h, v3);
+        h = delta_xxh64_merge(h, v4);
+    } else {
+        h = DELTA_PRIME64_5;
+    }
+
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= delta_xxh64_round(0, delta_read64(p));
+        h = delta_rotl64(h, 27) * DELTA_PRIME64_1 + DELTA_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)delta_read32(p) * DELTA_PRIME64_1;
+        h = delta_rotl64(h, 23) * DELTA_PRIME64_2 + DELTA_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * DELTA_PRIME64_5;
+        h = delta_rotl64(h, 11) * DELTA_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= DELTA_PRIME64_2;
+    h ^= h >> 29;
+    h *= DELTA_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Big-endian encoding for the wire
+static inline void delta_put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static inline void delta_put_u64(unsigned char *p, uint64_t v) {
+    delta_put_u32(p, (uint32_t)(v >> 32));
+    delta_put_u32(p + 4, (uint32_t)v);
+}
+
+static inline uint32_t delta_get_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t delta_get_u64(const unsigned char *p) {
+    return ((uint64_t)delta_get_u32(p) << 32) | delta_get_u32(p + 4);
+}
+
+// Send or receive exactly len bytes; returns 0 on success, -1 on error or early EOF
+static inline int delta_send_all(int sock, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, 0);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static inline int delta_recv_all(int sock, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#endif
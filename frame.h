@@ -0,0 +1,473 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+// Checksummed framing for file bodies (ufile, dfile, dtar and the sub-server relays).
+//
+// A body is sent as a sequence of frames followed by a trailer:
+//   frame    u32 length | u32 running CRC32C of every payload byte so far | payload
+//   error    u32 (FRAME_ERROR_FLAG | length) | u32 0 | message text
+//   trailer  u32 0 | u32 0 | u64 total length | u32 CRC32C of the whole body
+// All integers are big-endian. The receiver checks each frame's running CRC as it arrives and
+// the trailer before it commits anything, so a truncated or corrupted body, or a sender that
+// gave up half way, is never mistaken for a complete file.
+//
+// A conditional download (dfile with if-none-match=<validator>) is answered with one of
+//   validator     u32 (FRAME_VALIDATOR_FLAG | length) | u32 0 | validator, then the body
+//   not modified  u32 (FRAME_VALIDATOR_FLAG | FRAME_ERROR_FLAG | length) | u32 0 | validator
+// The validator names the version of the file (see frame_validator()); it is worked out from
+// the file's metadata, so a not-modified answer never reads the file.
+//
+// A body sent in a stored encoding the requester accepted (see seekable.h) is preceded by
+//   encoding      u32 (FRAME_ENCODING_FLAG | length) | u32 0 | encoding name
+// and the frames then carry the encoded bytes, which the requester decodes once they verify.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include "crc32c.h"
+#include "sched.h"
+
+#define FRAME_MAX_PAYLOAD 65536
+#define FRAME_HEADER_SIZE 8
+#define FRAME_TRAILER_SIZE 12
+#define FRAME_ERROR_FLAG 0x80000000u
+#define FRAME_VALIDATOR_FLAG 0x40000000u
+#define FRAME_ENCODING_FLAG 0x20000000u
+#define FRAME_ENCODING_MAX 32
+#define FRAME_VALIDATOR_MAX 64
+#define FRAME_IF_NONE_MATCH "if-none-match="
+
+// Outcome of reading a framed body
+enum frame_status {
+    FRAME_OK = 0,          // A payload was read, or the trailer verified
+    FRAME_IO_ERROR,        // The connection failed or closed before the trailer
+    FRAME_CRC_MISMATCH,    // A frame or the whole-body digest did not match
+    FRAME_LENGTH_MISMATCH, // The trailer's total length differs from what arrived
+    FRAME_REMOTE_ERROR,    // The sender reported an error instead of data
+    FRAME_PROTOCOL_ERROR,  // Malformed frame header
+    FRAME_NOT_MODIFIED,    // The requester's copy is current; reader->validator names it
+};
+
+struct frame_writer {
+    int sock;
+    uint32_t crc;
+    uint64_t total;
+    int failed;
+    struct transfer_sched *sched;  // Optional fair-share scheduler gating each frame
+    struct sched_flow *flow;
+};
+
+struct frame_reader {
+    int sock;
+    const char *prefix;    // Bytes already received with the request line
+    size_t prefix_len;
+    uint32_t crc;
+    uint64_t total;
+    int done;              // Trailer seen and verified
+    enum frame_status status;
+    char message[256];     // Text of a FRAME_REMOTE_ERROR
+    char validator[FRAME_VALIDATOR_MAX];  // From a validator frame, "" if none was sent
+    int validator_seen;    // A body carries at most one validator frame
+    int encoding_seen;     // ... and at most one encoding frame, ahead of its data
+    char encoding[FRAME_ENCODING_MAX];    // From an encoding frame, "" if the body is not encoded
+};
+
+static inline void frame_put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static inline uint32_t frame_get_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Send every byte of an iovec array
+static inline int frame_sendv(int sock, struct iovec *iov, int count) {
+    while (count > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Wait until the peer can take more data, so that a slow reader does not sit on a scheduler
+// slot while its socket buffer is full
+static inline void frame_wait_writable(int sock) {
+    struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+}
+
+static inline void frame_writer_init(struct frame_writer *writer, int sock) {
+    writer->sock = sock;
+    writer->crc = 0;
+    writer->total = 0;
+    writer->failed = 0;
+    writer->sched = NULL;
+    writer->flow = NULL;
+}
+
+// Send every frame of this writer through a scheduler flow (see sched.h)
+static inline void frame_writer_schedule(struct frame_writer *writer, struct transfer_sched *sched, struct sched_flow *flow) {
+    writer->sched = sched;
+    writer->flow = flow;
+}
+
+// Send data as one or more frames
+static inline int frame_write(struct frame_writer *writer, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0 && !writer->failed) {
+        size_t chunk = len < FRAME_MAX_PAYLOAD ? len : FRAME_MAX_PAYLOAD;
+        writer->crc = crc32c_update(writer->crc, p, chunk);
+        writer->total += chunk;
+
+        unsigned char header[FRAME_HEADER_SIZE];
+        frame_put_u32(header, (uint32_t)chunk);
+        frame_put_u32(header + 4, writer->crc);
+        struct iovec iov[2] = { { header, sizeof(header) }, { (void *)p, chunk } };
+        if (writer->flow) frame_wait_writable(writer->sock);
+        sched_acquire(writer->sched, writer->flow, sizeof(header) + chunk);
+        if (frame_sendv(writer->sock, iov, 2) < 0) writer->failed = 1;
+        sched_release(writer->sched, writer->flow, sizeof(header) + chunk);
+
+        p += chunk;
+        len -= chunk;
+    }
+    return writer->failed ? -1 : 0;
+}
+
+// Send the contents of an open file as frames
+static inline int frame_write_fd(struct frame_writer *writer, int fd) {
+    static __thread char buffer[FRAME_MAX_PAYLOAD];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (frame_write(writer, buffer, bytes_read) < 0) return -1;
+    }
+    return bytes_read < 0 ? -1 : 0;
+}
+
+// Send size bytes of an open file starting at offset as frames, reading them with pread() so the
+// file position is left alone
+static inline int frame_write_fd_range(struct frame_writer *writer, int fd, off_t offset, off_t size) {
+    static __thread char buffer[FRAME_MAX_PAYLOAD];
+    while (size > 0) {
+        size_t want = size < (off_t)sizeof(buffer) ? (size_t)size : sizeof(buffer);
+        ssize_t bytes_read = pread(fd, buffer, want, offset);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) return -1;
+        if (frame_write(writer, buffer, bytes_read) < 0) return -1;
+        offset += bytes_read;
+        size -= bytes_read;
+    }
+    return 0;
+}
+
+// A file that another client truncates while frame_write_file_range() has it mapped raises
+// SIGBUS when the pages past its new end are read. The handler turns a fault inside the range the
+// faulting thread is reading into a jump back to frame_write_file_range(), which reports a read
+// error. Any other SIGBUS gets the default action, as it would without the handler.
+static __thread sigjmp_buf *frame_map_jump;
+static __thread const unsigned char *frame_map_start;
+static __thread size_t frame_map_size;
+
+static void frame_sigbus_handler(int sig, siginfo_t *info, void *context) {
+    (void)context;
+    const unsigned char *address = info->si_addr;
+    if (frame_map_jump && address >= frame_map_start && address < frame_map_start + frame_map_size) {
+        siglongjmp(*frame_map_jump, 1);
+    }
+    signal(sig, SIG_DFL);  // The access faults again on return and takes the default action
+}
+
+static void frame_install_sigbus_handler(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = frame_sigbus_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+// Send size bytes of an open regular file, starting at offset, as frames without copying them
+// through user space: the running CRC is taken over a read-only mapping and each payload goes
+// out with sendfile(). Falls back to reading the file if it cannot be mapped. Returns -1 with
+// writer->failed clear if the file was cut short before a frame's header went out, so the
+// caller can still send an error frame; once a header is out, a short file fails the writer.
+static inline int frame_write_file_range(struct frame_writer *writer, int fd, off_t offset, off_t size) {
+    static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+    if (size <= 0) return 0;
+    pthread_once(&sigbus_once, frame_install_sigbus_handler);
+    off_t map_start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t map_size = size + (offset - map_start);
+    const unsigned char *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, map_start);
+    if (map == MAP_FAILED) return frame_write_fd_range(writer, fd, offset, size);
+    madvise((void *)map, map_size, MADV_SEQUENTIAL);
+    const unsigned char *data = map + (offset - map_start);
+
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 1)) {
+        frame_map_jump = NULL;
+        munmap((void *)map, map_size);
+        errno = EIO;
+        return -1;
+    }
+    frame_map_start = map;
+    frame_map_size = map_size;
+
+    off_t sent = 0;
+    while (sent < size && !writer->failed) {
+        size_t chunk = size - sent < FRAME_MAX_PAYLOAD ? (size_t)(size - sent) : FRAME_MAX_PAYLOAD;
+        frame_map_jump = &jump;
+        uint32_t crc = crc32c_update(writer->crc, data + sent, chunk);
+        frame_map_jump = NULL;
+        writer->crc = crc;
+        writer->total += chunk;
+
+        unsigned char header[FRAME_HEADER_SIZE];
+        frame_put_u32(header, (uint32_t)chunk);
+        frame_put_u32(header + 4, writer->crc);
+        if (writer->flow) frame_wait_writable(writer->sock);
+        sched_acquire(writer->sched, writer->flow, sizeof(header) + chunk);
+        if (send(writer->sock, header, sizeof(header), MSG_NOSIGNAL | MSG_MORE) != sizeof(header)) {
+            writer->failed = 1;
+        }
+        off_t payload_offset = offset + sent;
+        size_t remaining = chunk;
+        while (remaining > 0 && !writer->failed) {
+            ssize_t n = sendfile(writer->sock, fd, &payload_offset, remaining);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) writer->failed = 1;
+            else remaining -= n;
+        }
+        sched_release(writer->sched, writer->flow, sizeof(header) + chunk);
+        sent += chunk;
+    }
+    munmap((void *)map, map_size);
+    return writer->failed ? -1 : 0;
+}
+
+// Send the first size bytes of an open regular file as frames
+static inline int frame_write_file(struct frame_writer *writer, int fd, off_t size) {
+    if (size <= 0) return frame_write_fd(writer, fd);
+    return frame_write_file_range(writer, fd, 0, size);
+}
+
+// Close the body with its total length and whole-body digest
+static inline int frame_finish(struct frame_writer *writer) {
+    if (writer->failed) return -1;
+    unsigned char trailer[FRAME_HEADER_SIZE + FRAME_TRAILER_SIZE] = { 0 };
+    frame_put_u32(trailer + 8, (uint32_t)(writer->total >> 32));
+    frame_put_u32(trailer + 12, (uint32_t)writer->total);
+    frame_put_u32(trailer + 16, writer->crc);
+    struct iovec iov = { trailer, sizeof(trailer) };
+    if (frame_sendv(writer->sock, &iov, 1) < 0) writer->failed = 1;
+    return writer->failed ? -1 : 0;
+}
+
+// Report an error in place of (or part way through) a body
+static inline int frame_write_error(int sock, const char *message) {
+    size_t len = strlen(message);
+    unsigned char header[FRAME_HEADER_SIZE] = { 0 };
+    frame_put_u32(header, FRAME_ERROR_FLAG | (uint32_t)len);
+    struct iovec iov[2] = { { header, sizeof(header) }, { (void *)message, len } };
+    return frame_sendv(sock, iov, 2);
+}
+
+// Validator of a stored file for conditional downloads: its size and modification time, which
+// fstat() gives without reading it
+static inline void frame_validator(off_t size, const struct timespec *mtime, char *validator, size_t validator_size) {
+    snprintf(validator, validator_size, "%llx-%llx.%lx", (unsigned long long)size,
+             (unsigned long long)mtime->tv_sec, (unsigned long)mtime->tv_nsec);
+}
+
+// Whether an if-none-match argument (NULL if the request had none) names this validator
+static inline int frame_validator_matches(const char *if_none_match, const char *validator) {
+    return if_none_match && if_none_match[0] && strcmp(if_none_match, validator) == 0;
+}
+
+// The validator of an "if-none-match=<validator>" request argument, or NULL if it is not one.
+// An empty validator asks for the file's validator without holding a copy yet.
+static inline const char *frame_if_none_match(const char *argument) {
+    size_t len = strlen(FRAME_IF_NONE_MATCH);
+    return strncmp(argument, FRAME_IF_NONE_MATCH, len) == 0 ? argument + len : NULL;
+}
+
+// Send a validator frame: not_modified tells the requester its copy is current and ends the
+// reply; otherwise the body follows
+static inline int frame_write_validator(int sock, const char *validator, int not_modified) {
+    size_t len = strlen(validator);
+    unsigned char header[FRAME_HEADER_SIZE] = { 0 };
+    frame_put_u32(header, FRAME_VALIDATOR_FLAG | (not_modified ? FRAME_ERROR_FLAG : 0) | (uint32_t)len);
+    struct iovec iov[2] = { { header, sizeof(header) }, { (void *)validator, len } };
+    return frame_sendv(sock, iov, 2);
+}
+
+// Announce that the body which follows is in the named encoding
+static inline int frame_write_encoding(int sock, const char *encoding) {
+    size_t len = strlen(encoding);
+    unsigned char header[FRAME_HEADER_SIZE] = { 0 };
+    frame_put_u32(header, FRAME_ENCODING_FLAG | (uint32_t)len);
+    struct iovec iov[2] = { { header, sizeof(header) }, { (void *)encoding, len } };
+    return frame_sendv(sock, iov, 2);
+}
+
+static inline void frame_reader_init(struct frame_reader *reader, int sock, const char *prefix, size_t prefix_len) {
+    memset(reader, 0, sizeof(*reader));
+    reader->sock = sock;
+    reader->prefix = prefix;
+    reader->prefix_len = prefix_len;
+}
+
+// Receive exactly len bytes, draining any request-line leftovers first
+static inline int frame_recv_all(struct frame_reader *reader, void *buf, size_t len) {
+    char *p = buf;
+    if (reader->prefix_len > 0) {
+        size_t take = len < reader->prefix_len ? len : reader->prefix_len;
+        memcpy(p, reader->prefix, take);
+        reader->prefix += take;
+        reader->prefix_len -= take;
+        p += take;
+        len -= take;
+    }
+    while (len > 0) {
+        ssize_t n = recv(reader->sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static inline ssize_t frame_fail(struct frame_reader *reader, enum frame_status status) {
+    reader->status = status;
+    return -1;
+}
+
+// Read the next frame. Returns the payload length (> 0), 0 once the trailer has been verified,
+// or -1 with reader->status describing the failure. If raw is non-NULL the frame exactly as it
+// arrived (header included) is left in raw[0..*raw_len) so that it can be relayed unchanged;
+// raw must hold FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD bytes and buf is then ignored. A
+// validator or encoding frame is kept in reader->validator or reader->encoding; in raw mode it is
+// returned like a payload (so a relay passes it on), otherwise the frame after it is read. A body
+// has at most one validator frame and at most one encoding frame, the latter before any data;
+// anything else is a protocol error.
+static inline ssize_t frame_read_raw(struct frame_reader *reader, void *buf, unsigned char *raw, size_t *raw_len) {
+    if (reader->done) return 0;
+
+    unsigned char local[FRAME_HEADER_SIZE + FRAME_TRAILER_SIZE];
+    unsigned char *header = raw ? raw : local;
+    uint32_t length, crc;
+    for (;;) {
+        if (frame_recv_all(reader, header, FRAME_HEADER_SIZE) < 0) return frame_fail(reader, FRAME_IO_ERROR);
+        length = frame_get_u32(header);
+        crc = frame_get_u32(header + 4);
+
+        if (length & FRAME_VALIDATOR_FLAG) {
+            size_t len = length & ~(FRAME_VALIDATOR_FLAG | FRAME_ERROR_FLAG);
+            if (reader->validator_seen || len >= sizeof(reader->validator)) return frame_fail(reader, FRAME_PROTOCOL_ERROR);
+            if (frame_recv_all(reader, reader->validator, len) < 0) return frame_fail(reader, FRAME_IO_ERROR);
+            reader->validator[len] = '\0';
+            reader->validator_seen = 1;
+            if (raw) {
+                memcpy(raw + FRAME_HEADER_SIZE, reader->validator, len);
+                *raw_len = FRAME_HEADER_SIZE + len;
+            }
+            if (length & FRAME_ERROR_FLAG) return frame_fail(reader, FRAME_NOT_MODIFIED);
+            if (raw) return (ssize_t)*raw_len;
+            continue;
+        }
+
+        if ((length & (FRAME_ENCODING_FLAG | FRAME_ERROR_FLAG)) == FRAME_ENCODING_FLAG) {
+            size_t len = length & ~FRAME_ENCODING_FLAG;
+            if (reader->encoding_seen || reader->total > 0 || len >= sizeof(reader->encoding)) {
+                return frame_fail(reader, FRAME_PROTOCOL_ERROR);
+            }
+            if (frame_recv_all(reader, reader->encoding, len) < 0) return frame_fail(reader, FRAME_IO_ERROR);
+            reader->encoding[len] = '\0';
+            reader->encoding_seen = 1;
+            if (raw) {
+                memcpy(raw + FRAME_HEADER_SIZE, reader->encoding, len);
+                *raw_len = FRAME_HEADER_SIZE + len;
+                return (ssize_t)*raw_len;
+            }
+            continue;
+        }
+        break;
+    }
+
+    if (length & FRAME_ERROR_FLAG) {
+        size_t len = length & ~FRAME_ERROR_FLAG;
+        if (len >= sizeof(reader->message)) return frame_fail(reader, FRAME_PROTOCOL_ERROR);
+        if (frame_recv_all(reader, reader->message, len) < 0) return frame_fail(reader, FRAME_IO_ERROR);
+        reader->message[len] = '\0';
+        if (raw) {
+            memcpy(raw + FRAME_HEADER_SIZE, reader->message, len);
+            *raw_len = FRAME_HEADER_SIZE + len;
+        }
+        return frame_fail(reader, FRAME_REMOTE_ERROR);
+    }
+
+    if (length == 0) {
+        unsigned char *trailer = header + FRAME_HEADER_SIZE;
+        if (frame_recv_all(reader, trailer, FRAME_TRAILER_SIZE) < 0) return frame_fail(reader, FRAME_IO_ERROR);
+        uint64_t total = ((uint64_t)frame_get_u32(trailer) << 32) | frame_get_u32(trailer + 4);
+        uint32_t digest = frame_get_u32(trailer + 8);
+        if (raw) *raw_len = FRAME_HEADER_SIZE + FRAME_TRAILER_SIZE;
+        if (total != reader->total) return frame_fail(reader, FRAME_LENGTH_MISMATCH);
+        if (digest != reader->crc) return frame_fail(reader, FRAME_CRC_MISMATCH);
+        reader->done = 1;
+        return 0;
+    }
+
+    if (length > FRAME_MAX_PAYLOAD) return frame_fail(reader, FRAME_PROTOCOL_ERROR);
+    unsigned char *payload = raw ? raw + FRAME_HEADER_SIZE : buf;
+    if (frame_recv_all(reader, payload, length) < 0) return frame_fail(reader, FRAME_IO_ERROR);
+    reader->crc = crc32c_update(reader->crc, payload, length);
+    reader->total += length;
+    if (raw) *raw_len = FRAME_HEADER_SIZE + length;
+    if (reader->crc != crc) return frame_fail(reader, FRAME_CRC_MISMATCH);
+    return length;
+}
+
+// Read the next payload into buf (FRAME_MAX_PAYLOAD bytes); see frame_read_raw()
+static inline ssize_t frame_read(struct frame_reader *reader, void *buf) {
+    return frame_read_raw(reader, buf, NULL, NULL);
+}
+
+// Human-readable description of a failed read
+static inline const char *frame_status_text(const struct frame_reader *reader) {
+    switch (reader->status) {
+    case FRAME_OK: return "ok";
+    case FRAME_IO_ERROR: return "connection closed before the transfer completed";
+    case FRAME_CRC_MISMATCH: return "CRC32C checksum mismatch";
+    case FRAME_LENGTH_MISMATCH: return "length mismatch";
+    case FRAME_REMOTE_ERROR: return reader->message;
+    case FRAME_PROTOCOL_ERROR: return "malformed frame";
+    case FRAME_NOT_MODIFIED: return "not modified";
+    }
+    return "unknown error";
+}
+
+#endif
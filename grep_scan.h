@@ -0,0 +1,427 @@
+#ifndef GREP_SCAN_H
+#define GREP_SCAN_H
+
+// Server-side content search used by the `grep` command in Smain and Stext.
+//
+// Stored files are memory-mapped (compressed ones decoded first, see seekable.h) and scanned in
+// parallel by a small pool of threads, one file at a time per thread. Literal patterns are located with a SIMD first/last-byte filter (AVX2
+// when the CPU has it, SSE2 otherwise). Regular expressions use POSIX regexec() on only the lines
+// that contain the pattern's longest required literal, so most of the input is rejected by the
+// SIMD kernel. Each matching line is reported as "path:line:snippet".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "seekable.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GREP_HAVE_X86 1
+#endif
+
+#define GREP_PATTERN_MAX 256
+#define GREP_SNIPPET_MAX 200   // Longest part of a matching line sent back
+#define GREP_MAX_THREADS 16
+
+struct grep_pattern {
+    char literal[GREP_PATTERN_MAX];  // Substring every match must contain (may be empty for regexes)
+    size_t literal_len;
+    int is_regex;
+    regex_t regex;
+};
+
+// Characters that make a pattern a regular expression rather than a literal
+static inline int grep_is_meta(char c) {
+    return c != '\0' && strchr(".[]()*+?{}|^$\\", c) != NULL;
+}
+
+// Last character of the bracket expression starting at open ("[...]"): a ']' right after the
+// '[' or '[^' is a member, as are the '[:', '[.' and '[=' forms inside
+static inline const char *grep_bracket_end(const char *open) {
+    const char *p = open + 1;
+    if (*p == '^') p++;
+    if (*p == ']') p++;
+    while (*p && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char kind = p[1];
+            const char *close = p + 2;
+            while (*close && !(close[0] == kind && close[1] == ']')) close++;
+            if (*close) {
+                p = close + 2;
+                continue;
+            }
+        }
+        p++;
+    }
+    return *p ? p : p - 1;
+}
+
+// Compile a pattern. Plain strings are searched literally; anything with regex metacharacters
+// is compiled as a POSIX extended regex, and its longest run of required literal characters is
+// kept as a prefilter. Returns 0 on success, -1 if the regex does not compile.
+static inline int grep_pattern_compile(struct grep_pattern *pattern, const char *text) {
+    memset(pattern, 0, sizeof(*pattern));
+
+    int has_meta = 0;
+    for (const char *p = text; *p; p++) {
+        if (grep_is_meta(*p)) has_meta = 1;
+    }
+    if (!has_meta) {
+        snprintf(pattern->literal, sizeof(pattern->literal), "%s", text);
+        pattern->literal_len = strlen(pattern->literal);
+        return 0;
+    }
+
+    if (regcomp(&pattern->regex, text, REG_EXTENDED | REG_NOSUB | REG_NEWLINE) != 0) {
+        return -1;
+    }
+    pattern->is_regex = 1;
+
+    // Alternation means no single literal is required
+    if (strchr(text, '|')) {
+        return 0;
+    }
+
+    // Find the longest run of adjacent literal characters outside any group. A group may be made
+    // optional or repeated by what follows it, so its contents never count, and brackets, \w-style
+    // escapes, anchors and interval bounds all end a run.
+    char run[GREP_PATTERN_MAX];
+    size_t run_len = 0;
+    int group_depth = 0;
+    for (const char *p = text; *p; p++) {
+        char c = *p;
+        int literal = 0;
+        if (c == '\\' && p[1]) {
+            c = *++p;
+            literal = !isalnum((unsigned char)c);  // \w, \s, \b, \1 ... are classes or anchors
+        } else if (c == '[') {
+            p = grep_bracket_end(p);
+        } else if (c == '{') {
+            const char *close = strchr(p, '}');
+            if (close) p = close;
+        } else if (c == '(') {
+            group_depth++;
+        } else if (c == ')') {
+            if (group_depth > 0) group_depth--;
+        } else if (!grep_is_meta(c)) {
+            literal = 1;
+        }
+
+        // A literal followed by ?, * or { may be absent from a match; one followed by + is there
+        // but may repeat, so nothing after it is adjacent
+        char next = p[1];
+        if (literal && group_depth == 0 && next != '?' && next != '*' && next != '{' && run_len + 1 < sizeof(run)) {
+            run[run_len++] = c;
+            if (run_len > pattern->literal_len) {
+                memcpy(pattern->literal, run, run_len);
+                pattern->literal_len = run_len;
+                pattern->literal[run_len] = '\0';
+            }
+            if (next == '+') run_len = 0;
+        } else {
+            run_len = 0;
+        }
+    }
+    return 0;
+}
+
+static inline void grep_pattern_free(struct grep_pattern *pattern) {
+    if (pattern->is_regex) regfree(&pattern->regex);
+}
+
+#ifdef GREP_HAVE_X86
+// Compare the first and last needle bytes against 32 candidate positions at once; only
+// positions where both agree are verified with memcmp
+__attribute__((target("avx2")))
+static const char *grep_find_avx2(const char *hay, size_t n, const char *needle, size_t m) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return i < n ? memmem(hay + i, n - i, needle, m) : NULL;
+}
+
+// Same filter 16 positions at a time with SSE2, which every x86-64 CPU has
+static const char *grep_find_sse2(const char *hay, size_t n, const char *needle, size_t m) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return i < n ? memmem(hay + i, n - i, needle, m) : NULL;
+}
+#endif
+
+// Find the first occurrence of needle in hay
+static inline const char *grep_find(const char *hay, size_t n, const char *needle, size_t m) {
+    if (m == 0) return hay;
+    if (m > n) return NULL;
+    if (m == 1) return memchr(hay, needle[0], n);
+#ifdef GREP_HAVE_X86
+    static int use_avx2 = -1;
+    if (use_avx2 < 0) use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return use_avx2 ? grep_find_avx2(hay, n, needle, m) : grep_find_sse2(hay, n, needle, m);
+#else
+    return memmem(hay, n, needle, m);
+#endif
+}
+
+// Growable output buffer for one file's matches
+struct grep_output {
+    char *data;
+    size_t len, cap;
+};
+
+static inline void grep_output_append(struct grep_output *out, const char *data, size_t len) {
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : 4096;
+        while (cap < out->len + len) cap *= 2;
+        char *grown = realloc(out->data, cap);
+        if (!grown) return;
+        out->data = grown;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+static inline int grep_line_matches(const struct grep_pattern *pattern, const char *line, size_t len) {
+    if (!pattern->is_regex) return 1;
+    regmatch_t range = { .rm_so = 0, .rm_eo = (regoff_t)len };
+    return regexec(&pattern->regex, line, 1, &range, REG_STARTEND) == 0;
+}
+
+// Scan one memory-mapped file, appending "label:line:snippet" records for every matching line.
+// Returns the number of matching lines.
+static inline size_t grep_scan_buffer(const struct grep_pattern *pattern, const char *data, size_t size,
+                                      const char *label, struct grep_output *out) {
+    size_t matches = 0, line_number = 1;
+    const char *counted = data;  // Newlines before this point are already in line_number
+    const char *end = data + size;
+    const char *pos = data;
+
+    while (pos < end) {
+        // Jump to the next occurrence of the required literal, or walk line by line without one
+        const char *hit = pattern->literal_len ? grep_find(pos, end - pos, pattern->literal, pattern->literal_len) : pos;
+        if (!hit) break;
+
+        const char *line_start = hit;
+        while (line_start > pos && line_start[-1] != '\n') line_start--;
+        const char *line_end = memchr(hit, '\n', end - hit);
+        if (!line_end) line_end = end;
+
+        if (grep_line_matches(pattern, line_start, line_end - line_start)) {
+            for (const char *p = counted; (p = memchr(p, '\n', line_start - p)) != NULL; p++) line_number++;
+            counted = line_start;
+
+            char prefix[4096 + 32];
+            size_t snippet_len = line_end - line_start;
+            if (snippet_len > GREP_SNIPPET_MAX) snippet_len = GREP_SNIPPET_MAX;
+            int prefix_len = snprintf(prefix, sizeof(prefix), "%s:%zu:", label, line_number);
+            if (prefix_len >= (int)sizeof(prefix)) prefix_len = sizeof(prefix) - 1;
+            grep_output_append(out, prefix, prefix_len);
+            grep_output_append(out, line_start, snippet_len);
+            grep_output_append(out, "\n", 1);
+            matches++;
+        }
+        pos = line_end + 1;
+    }
+    return matches;
+}
+
+// Shared state of one parallel scan
+struct grep_job {
+    const struct grep_pattern *pattern;
+    char **paths;          // Paths relative to root_fd
+    size_t count;
+    size_t next;           // Next file to claim, guarded by lock
+    const char *label;     // Prefix shown before each relative path, e.g. "stext"
+    int root_fd;
+    int out_fd;
+    pthread_mutex_t *output_lock;  // Serializes writes to out_fd (may be shared with other producers)
+    pthread_mutex_t lock;
+    size_t matches;
+    int failed;            // Set once the receiver has gone away
+};
+
+// Collect the relative paths of all regular files under dir_fd ending in ext
+static inline void grep_collect_files(int dir_fd, const char *prefix, const char *ext, char ***paths, size_t *count, size_t *cap) {
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return;
+    }
+    size_t ext_len = strlen(ext);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char path[4096];
+        if (snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "", entry->d_name) >= (int)sizeof(path)) continue;
+        int is_dir = entry->d_type == DT_DIR;
+        int is_file = entry->d_type == DT_REG;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            is_dir = S_ISDIR(st.st_mode);
+            is_file = S_ISREG(st.st_mode);
+        }
+
+        if (is_dir) {
+            int child = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (child >= 0) grep_collect_files(child, path, ext, paths, count, cap);
+        } else if (is_file) {
+            size_t len = strlen(entry->d_name);
+            if (len < ext_len || strcmp(entry->d_name + len - ext_len, ext) != 0) continue;
+            if (*count == *cap) {
+                size_t grown_cap = *cap ? *cap * 2 : 256;
+                char **grown = realloc(*paths, grown_cap * sizeof(char *));
+                if (!grown) break;
+                *paths = grown;
+                *cap = grown_cap;
+            }
+            (*paths)[(*count)++] = strdup(path);
+        }
+    }
+    closedir(dir);
+}
+
+static inline int grep_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static inline void *grep_worker(void *arg) {
+    struct grep_job *job = arg;
+    struct grep_output out = { 0 };
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        size_t index = job->next++;
+        int stop = job->failed;
+        pthread_mutex_unlock(&job->lock);
+        if (stop || index >= job->count) break;
+
+        int fd = openat(job->root_fd, job->paths[index], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            continue;
+        }
+        size_t size;
+        const char *data = seekable_map(fd, st.st_size, &size);
+        close(fd);
+        if (data == MAP_FAILED) continue;
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+
+        char label[4096];
+        snprintf(label, sizeof(label), "%s/%s", job->label, job->paths[index]);
+        size_t found = grep_scan_buffer(job->pattern, data, size, label, &out);
+        munmap((void *)data, size);
+
+        // Stream results as soon as a file has matches, keeping the lines of one file together
+        if (found > 0) {
+            pthread_mutex_lock(job->output_lock);
+            int failed = grep_write_all(job->out_fd, out.data, out.len) < 0;
+            pthread_mutex_unlock(job->output_lock);
+            out.len = 0;
+            if (failed) {
+                pthread_mutex_lock(&job->lock);
+                job->failed = 1;
+                pthread_mutex_unlock(&job->lock);
+            }
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->matches += found;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    free(out.data);
+    return NULL;
+}
+
+// Scan the given files (relative to root_fd) in parallel and stream matching lines to out_fd,
+// labelled "label/relative/path:line:snippet". Returns the number of matching lines.
+static inline size_t grep_scan_paths(int root_fd, char **paths, size_t count, const char *label,
+                                     const struct grep_pattern *pattern, int out_fd, pthread_mutex_t *output_lock) {
+    struct grep_job job = {
+        .pattern = pattern, .paths = paths, .count = count, .next = 0, .label = label,
+        .root_fd = root_fd, .out_fd = out_fd, .output_lock = output_lock, .matches = 0, .failed = 0,
+    };
+    pthread_mutex_init(&job.lock, NULL);
+
+    // One worker per core, but never more workers than files
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = cores > 0 ? (size_t)cores : 1;
+    if (workers > GREP_MAX_THREADS) workers = GREP_MAX_THREADS;
+    if (workers > job.count) workers = job.count;
+
+    pthread_t threads[GREP_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 1; i < workers; i++) {
+        if (pthread_create(&threads[started], NULL, grep_worker, &job) == 0) started++;
+    }
+    if (job.count > 0) grep_worker(&job);  // The calling thread works too
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    return job.matches;
+}
+
+// Search every file ending in ext under root and stream matching lines to out_fd.
+// Returns the number of matching lines.
+static inline size_t grep_scan_tree(const char *root, const char *ext, const char *label,
+                                    const struct grep_pattern *pattern, int out_fd, pthread_mutex_t *output_lock) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return 0;
+
+    char **paths = NULL;
+    size_t count = 0, cap = 0;
+    grep_collect_files(dup(root_fd), "", ext, &paths, &count, &cap);
+    size_t matches = grep_scan_paths(root_fd, paths, count, label, pattern, out_fd, output_lock);
+
+    for (size_t i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    close(root_fd);
+    return matches;
+}
+
+#endif
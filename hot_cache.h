@@ -0,0 +1,373 @@
+#ifndef HOT_CACHE_H
+#define HOT_CACHE_H
+
+// Memory cache of the most requested files, shared by a sub-server's forked children.
+//
+// The parent creates the cache before it starts accepting: a memfd arena of HOT_CACHE_BYTES
+// holding file contents, and a MAP_SHARED table describing them, guarded by a process-shared,
+// robust lock like the scheduler's. Every child inherits both, so a file cached by one child is
+// a hit for all of them. A hit is answered from the arena with sendfile(), without resolving,
+// opening or reading the file; conditional requests are answered from the size and mtime kept
+// with it.
+//
+// Space in the arena is handed out in order, wrapping at the end, like a log. Whether a file is
+// worth the space is decided TinyLFU-style: every lookup counts towards the file in a count-min
+// sketch of recent popularity (halved every HOT_SKETCH_SAMPLE lookups so that it follows changes
+// in what is hot), and a file is only admitted if it is more popular than every file it would
+// overwrite. A popular file in the way is skipped over and kept, up to HOT_CACHE_PROBES times.
+//
+// Entries are invalidated by the handlers that change files (upload and delete). A file read in
+// while a change was under way is not admitted, so the cache never serves an older version than
+// the one on disk. Build with -DHOT_CACHE_BYTES=0 to turn the cache off.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#ifndef HOT_CACHE_BYTES
+#define HOT_CACHE_BYTES (64 << 20)              // Size of the arena of file contents
+#endif
+#ifndef HOT_CACHE_MAX_FILE
+#define HOT_CACHE_MAX_FILE (HOT_CACHE_BYTES / 8)  // Larger files are always read from disk
+#endif
+#define HOT_CACHE_ENTRIES 1024
+#define HOT_CACHE_KEY_MAX 256
+#define HOT_CACHE_PROBES 4                      // Popular entries skipped over before giving up
+#define HOT_SKETCH_ROWS 4
+#define HOT_SKETCH_WIDTH 4096                   // Counters per row, a power of two
+#define HOT_SKETCH_MAX 15
+#define HOT_SKETCH_SAMPLE (HOT_CACHE_ENTRIES * 10)
+
+enum hot_entry_state {
+    HOT_ENTRY_FREE = 0,
+    HOT_ENTRY_FILLING,     // Being read in; not yet served
+    HOT_ENTRY_READY,
+    HOT_ENTRY_DEAD,        // Invalidated, but still being sent by a child or read in
+};
+
+struct hot_entry {
+    int state;
+    int pins;                  // Children sending from it; its space is not reused until 0, so
+                               // a child that dies mid-send keeps it until it is invalidated
+    uint64_t hash;
+    uint64_t id;               // Tells a refilled slot from the one a filler started on
+    char key[HOT_CACHE_KEY_MAX];
+    off_t offset;              // Where the contents are in the arena
+    off_t size;
+    struct timespec mtime;
+    int compressed;            // Stored compressed (see seekable.h)
+};
+
+struct hot_cache {
+    pthread_mutex_t lock;
+    int fd;                    // The arena, a memfd
+    unsigned char *arena;      // Mapped before the first fork, so at the same address everywhere
+    off_t head;                // Where the next file goes
+    uint64_t next_id;
+    uint64_t changes;          // Invalidations so far, so a filler can tell it raced one
+    uint32_t sketch_count;
+    uint8_t sketch[HOT_SKETCH_ROWS][HOT_SKETCH_WIDTH];
+    struct hot_entry entries[HOT_CACHE_ENTRIES];
+    unsigned long long lookups;
+    unsigned long long hits;
+    unsigned long long bytes_saved;     // Sent from memory instead of read from disk
+    unsigned long long admitted;
+    unsigned long long rejected;        // Not popular enough to displace what is cached
+};
+
+// What a lookup found; the entry stays pinned until hot_cache_release()
+struct hot_cache_hit {
+    int fd;
+    off_t offset;
+    off_t size;
+    struct timespec mtime;
+    int compressed;
+    int slot;
+};
+
+// Create the shared cache; returns NULL (no caching) if it is turned off or cannot be set up
+static inline struct hot_cache *hot_cache_create(const char *name) {
+    if (HOT_CACHE_BYTES <= 0) return NULL;
+    struct hot_cache *cache = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) return NULL;
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = memfd_create(name, MFD_CLOEXEC);
+    if (cache->fd < 0 || ftruncate(cache->fd, HOT_CACHE_BYTES) != 0 ||
+        (cache->arena = mmap(NULL, HOT_CACHE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0)) == MAP_FAILED) {
+        if (cache->fd >= 0) close(cache->fd);
+        munmap(cache, sizeof(*cache));
+        return NULL;
+    }
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    return cache;
+}
+
+static inline void hot_cache_lock(struct hot_cache *cache) {
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+        // A child died holding the lock; the table is only changed in whole steps, so it is usable
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+// The key a stored file is cached under: its path below the storage directory, without leading,
+// repeated or "./" separators, so every spelling of a path names the same entry
+static inline void hot_cache_key(const char *path, char *key, size_t key_size) {
+    size_t len = 0;
+    for (const char *p = path; *p && len + 1 < key_size; p++) {
+        if (*p == '/' && (len == 0 || key[len - 1] == '/')) continue;
+        if (*p == '.' && p[1] == '/' && (len == 0 || key[len - 1] == '/')) {
+            p++;
+            continue;
+        }
+        key[len++] = *p;
+    }
+    key[len] = '\0';
+}
+
+static inline uint64_t hot_cache_hash(const char *key) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (; *key; key++) hash = (hash ^ (unsigned char)*key) * 1099511628211ULL;
+    return hash;
+}
+
+// The sketch counter for row of a key's hash
+static inline uint8_t *hot_sketch_counter(struct hot_cache *cache, int row, uint64_t hash) {
+    uint64_t mixed = (hash ^ (hash >> 29)) * (0x9e3779b97f4a7c15ULL + 2 * (uint64_t)row);
+    return &cache->sketch[row][(mixed >> 40) & (HOT_SKETCH_WIDTH - 1)];
+}
+
+// Estimated recent lookups of a key; called with the lock held
+static inline int hot_sketch_estimate(struct hot_cache *cache, uint64_t hash) {
+    int estimate = HOT_SKETCH_MAX;
+    for (int row = 0; row < HOT_SKETCH_ROWS; row++) {
+        int count = *hot_sketch_counter(cache, row, hash);
+        if (count < estimate) estimate = count;
+    }
+    return estimate;
+}
+
+// Count a lookup of a key, ageing the whole sketch once it has seen a full sample; called with
+// the lock held
+static inline void hot_sketch_add(struct hot_cache *cache, uint64_t hash) {
+    int estimate = hot_sketch_estimate(cache, hash);
+    for (int row = 0; row < HOT_SKETCH_ROWS; row++) {
+        uint8_t *counter = hot_sketch_counter(cache, row, hash);
+        if (*counter == estimate && *counter < HOT_SKETCH_MAX) (*counter)++;
+    }
+    if (++cache->sketch_count >= HOT_SKETCH_SAMPLE) {
+        for (int row = 0; row < HOT_SKETCH_ROWS; row++) {
+            for (int i = 0; i < HOT_SKETCH_WIDTH; i++) cache->sketch[row][i] >>= 1;
+        }
+        cache->sketch_count /= 2;
+    }
+}
+
+// The slot holding a key in the given state, or -1; called with the lock held
+static inline int hot_cache_find(struct hot_cache *cache, uint64_t hash, const char *key, int state) {
+    for (int i = 0; i < HOT_CACHE_ENTRIES; i++) {
+        struct hot_entry *entry = &cache->entries[i];
+        if (entry->state == state && entry->hash == hash && strcmp(entry->key, key) == 0) return i;
+    }
+    return -1;
+}
+
+// Look a stored file up, counting the lookup towards its popularity. A file stored compressed
+// only counts as a hit if the requester takes it that way (accept_compressed). Returns 0 with the
+// entry pinned, or -1 on a miss.
+static inline int hot_cache_lookup(struct hot_cache *cache, const char *path, int accept_compressed, struct hot_cache_hit *hit) {
+    if (!cache) return -1;
+    char key[HOT_CACHE_KEY_MAX];
+    hot_cache_key(path, key, sizeof(key));
+    uint64_t hash = hot_cache_hash(key);
+    hot_cache_lock(cache);
+    cache->lookups++;
+    hot_sketch_add(cache, hash);
+    int slot = hot_cache_find(cache, hash, key, HOT_ENTRY_READY);
+    if (slot >= 0 && cache->entries[slot].compressed && !accept_compressed) slot = -1;
+    if (slot >= 0) {
+        struct hot_entry *entry = &cache->entries[slot];
+        entry->pins++;
+        cache->hits++;
+        hit->fd = cache->fd;
+        hit->offset = entry->offset;
+        hit->size = entry->size;
+        hit->mtime = entry->mtime;
+        hit->compressed = entry->compressed;
+        hit->slot = slot;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return slot >= 0 ? 0 : -1;
+}
+
+// Unpin an entry; called with the lock held
+static inline void hot_cache_unpin(struct hot_cache *cache, int slot) {
+    struct hot_entry *entry = &cache->entries[slot];
+    if (--entry->pins == 0 && entry->state == HOT_ENTRY_DEAD) entry->state = HOT_ENTRY_FREE;
+}
+
+// Done with a hit, of which sent bytes went to the requester
+static inline void hot_cache_release(struct hot_cache *cache, struct hot_cache_hit *hit, off_t sent) {
+    hot_cache_lock(cache);
+    cache->bytes_saved += sent;
+    hot_cache_unpin(cache, hit->slot);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Counters shared by every child, for the hit ratio and the disk reads saved
+struct hot_cache_stats {
+    unsigned long long lookups;
+    unsigned long long hits;
+    unsigned long long bytes_saved;
+    unsigned long long admitted;
+    unsigned long long rejected;
+};
+
+// Take a consistent copy of the counters; returns -1 if there is no cache
+static inline int hot_cache_stats(struct hot_cache *cache, struct hot_cache_stats *stats) {
+    if (!cache) return -1;
+    hot_cache_lock(cache);
+    stats->lookups = cache->lookups;
+    stats->hits = cache->hits;
+    stats->bytes_saved = cache->bytes_saved;
+    stats->admitted = cache->admitted;
+    stats->rejected = cache->rejected;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+// Invalidations so far; take this before opening a file that may be admitted
+static inline uint64_t hot_cache_changes(struct hot_cache *cache) {
+    if (!cache) return 0;
+    hot_cache_lock(cache);
+    uint64_t changes = cache->changes;
+    pthread_mutex_unlock(&cache->lock);
+    return changes;
+}
+
+// Drop a stored file that has been replaced or deleted
+static inline void hot_cache_invalidate(struct hot_cache *cache, const char *path) {
+    if (!cache) return;
+    char key[HOT_CACHE_KEY_MAX];
+    hot_cache_key(path, key, sizeof(key));
+    uint64_t hash = hot_cache_hash(key);
+    hot_cache_lock(cache);
+    cache->changes++;
+    for (int i = 0; i < HOT_CACHE_ENTRIES; i++) {
+        struct hot_entry *entry = &cache->entries[i];
+        if ((entry->state == HOT_ENTRY_READY || entry->state == HOT_ENTRY_FILLING) &&
+            entry->hash == hash && strcmp(entry->key, key) == 0) {
+            // A filling entry's space is still being written; its filler frees it
+            int busy = entry->pins > 0 || entry->state == HOT_ENTRY_FILLING;
+            entry->state = busy ? HOT_ENTRY_DEAD : HOT_ENTRY_FREE;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Find room for size bytes at the head of the arena for a file estimated to be looked up
+// frequency times, evicting less popular entries in the way. Returns a free slot for it, or -1 if
+// it is not admitted. Called with the lock held.
+static inline int hot_cache_make_room(struct hot_cache *cache, off_t size, int frequency) {
+    for (int probe = 0; probe < HOT_CACHE_PROBES; probe++) {
+        if (cache->head + size > HOT_CACHE_BYTES) cache->head = 0;
+        off_t start = cache->head, end = start + size;
+
+        // Everything overlapping [start, end) would be overwritten
+        int blocker = -1, blocker_frequency = -1;
+        for (int i = 0; i < HOT_CACHE_ENTRIES; i++) {
+            struct hot_entry *entry = &cache->entries[i];
+            if (entry->state == HOT_ENTRY_FREE || entry->offset >= end || entry->offset + entry->size <= start) continue;
+            int busy = entry->pins > 0 || entry->state != HOT_ENTRY_READY;
+            int victim_frequency = busy ? HOT_SKETCH_MAX + 1 : hot_sketch_estimate(cache, entry->hash);
+            if (victim_frequency >= frequency && victim_frequency > blocker_frequency) {
+                blocker = i;
+                blocker_frequency = victim_frequency;
+            }
+        }
+        if (blocker >= 0) {
+            // Keep the more popular file and try the space after it
+            cache->head = cache->entries[blocker].offset + cache->entries[blocker].size;
+            continue;
+        }
+
+        int slot = -1;
+        for (int i = 0; i < HOT_CACHE_ENTRIES; i++) {
+            struct hot_entry *entry = &cache->entries[i];
+            if (entry->state != HOT_ENTRY_FREE && entry->offset < end && entry->offset + entry->size > start) {
+                entry->state = HOT_ENTRY_FREE;
+            }
+            if (entry->state == HOT_ENTRY_FREE && slot < 0) slot = i;
+        }
+        if (slot >= 0) cache->head = end;
+        return slot;
+    }
+    return -1;
+}
+
+// Offer a file just opened for a request to the cache. since is what hot_cache_changes() said
+// before the file was opened; if anything was invalidated after that the file may be an old
+// version and is not admitted.
+static inline void hot_cache_insert(struct hot_cache *cache, const char *path, int fd, off_t size,
+                                    const struct timespec *mtime, int compressed, uint64_t since) {
+    if (!cache || size <= 0 || size > HOT_CACHE_MAX_FILE) return;
+    char key[HOT_CACHE_KEY_MAX];
+    hot_cache_key(path, key, sizeof(key));
+    if (strlen(key) + 1 >= sizeof(key)) return;
+    uint64_t hash = hot_cache_hash(key);
+
+    hot_cache_lock(cache);
+    int slot = -1;
+    if (cache->changes == since && hot_cache_find(cache, hash, key, HOT_ENTRY_READY) < 0 &&
+        hot_cache_find(cache, hash, key, HOT_ENTRY_FILLING) < 0) {
+        slot = hot_cache_make_room(cache, size, hot_sketch_estimate(cache, hash));
+        if (slot < 0) cache->rejected++;
+    }
+    uint64_t id = 0;
+    struct hot_entry *entry = slot >= 0 ? &cache->entries[slot] : NULL;
+    if (entry) {
+        id = ++cache->next_id;
+        entry->state = HOT_ENTRY_FILLING;
+        entry->pins = 0;
+        entry->id = id;
+        entry->hash = hash;
+        snprintf(entry->key, sizeof(entry->key), "%s", key);
+        entry->offset = cache->head - size;
+        entry->size = size;
+        entry->mtime = *mtime;
+        entry->compressed = compressed;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (!entry) return;
+
+    // Read the file in without the lock; nobody serves or reuses a filling entry
+    off_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, cache->arena + entry->offset + done, size - done, done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+
+    hot_cache_lock(cache);
+    if (entry->state == HOT_ENTRY_FILLING && entry->id == id) {
+        entry->state = done == size ? HOT_ENTRY_READY : HOT_ENTRY_FREE;
+        if (entry->state == HOT_ENTRY_READY) cache->admitted++;
+    } else if (entry->state == HOT_ENTRY_DEAD && entry->id == id && entry->pins == 0) {
+        entry->state = HOT_ENTRY_FREE;     // Invalidated while it was being read in
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Asynchronous logging for Smain and the sub-servers.
+//
+// LOG_DEBUG, LOG_INFO, LOG_WARN and LOG_ERROR take printf-style arguments, format the message
+// into the calling thread's ring of LOG_RING_SLOTS records and return: they never take a lock or
+// make a system call. A background thread started by log_start() drains all rings every
+// LOG_FLUSH_MS and writes each batch with a single writev(), debug and info messages to stdout,
+// warnings and errors to stderr. When a ring is full the message is dropped and counted, and the
+// flusher reports how many were lost, so a burst of logging can never hold up a transfer.
+//
+// Messages below LOG_LEVEL are compiled out; their arguments are still type-checked but never
+// evaluated. The default is LOG_LEVEL_INFO; build with -DLOG_LEVEL=LOG_LEVEL_DEBUG to also get
+// per-file and per-command debugging output.
+//
+// A ring belongs to one thread at a time. When its thread exits the ring is handed on to the
+// next new thread, so Smain's thread per connection does not keep adding rings. Rings are
+// drained before every fork(); a forked child calls log_start() again for a flusher of its own,
+// and anything still buffered is written when the process exits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#define LOG_RING_SLOTS 128      // Messages a thread can have waiting for the flusher
+#define LOG_RECORD_MAX 248      // Longer messages are truncated
+#define LOG_FLUSH_MS 20
+#define LOG_BATCH 64            // Messages per writev()
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { if (0) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { if (0) log_write(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do { if (0) log_write(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#endif
+#define LOG_ERROR(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+struct log_record {
+    unsigned short len;
+    unsigned char to_stderr;
+    char text[LOG_RECORD_MAX];
+};
+
+struct log_ring {
+    struct log_record records[LOG_RING_SLOTS];
+    unsigned long head;         // Next record to fill; advanced only by the owning thread
+    unsigned long tail;         // Next record to write out; advanced only by the flusher
+    unsigned long taken;        // End of the flusher's current batch
+    unsigned long dropped;      // Messages lost to a full ring; counted by the owning thread
+    unsigned long reported;     // Part of dropped the flusher has already reported
+    int owned;                  // Set while a thread is writing to this ring
+    struct log_ring *next;
+};
+
+static struct log_ring *log_rings;      // Only ever grows, so the flusher can walk it without a lock
+static __thread struct log_ring *log_thread_ring;
+static pthread_key_t log_ring_key;      // Hands the ring back when its thread exits
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t log_flush_lock = PTHREAD_MUTEX_INITIALIZER;  // Serializes flushes; writers never take it
+static unsigned long long log_dropped_total;
+
+static inline void log_release_ring(void *ring) {
+    __atomic_store_n(&((struct log_ring *)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static inline void log_create_key(void) {
+    pthread_key_create(&log_ring_key, log_release_ring);
+}
+
+// First message from this thread: take over a ring left by a finished thread, or add a new one
+static inline struct log_ring *log_claim_ring(void) {
+    pthread_once(&log_key_once, log_create_key);
+    struct log_ring *ring;
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring) return NULL;
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(log_ring_key, ring);
+    log_thread_ring = ring;
+    return ring;
+}
+
+__attribute__((format(printf, 2, 3)))
+static inline void log_write(int level, const char *format, ...) {
+    int saved_errno = errno;  // For %m, which claiming a ring could otherwise clobber
+    struct log_ring *ring = log_thread_ring ? log_thread_ring : log_claim_ring();
+    if (!ring) return;
+
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_record *record = &ring->records[head % LOG_RING_SLOTS];
+    va_list args;
+    va_start(args, format);
+    errno = saved_errno;
+    int len = vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    if (len < 0) return;
+    if (len >= (int)sizeof(record->text)) {
+        len = sizeof(record->text) - 1;
+        record->text[len - 1] = '\n';
+    }
+    record->len = len;
+    record->to_stderr = level >= LOG_LEVEL_WARN;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Write a whole batch, picking up after short writes
+static inline void log_writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Write out everything buffered so far. Caller holds log_flush_lock.
+static inline void log_drain(void) {
+    int saved_errno = errno;
+    struct log_ring *rings = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    int more = 1;
+    while (more) {
+        // Gather up to a batch per stream across all rings, write it, then free the slots
+        struct iovec batch[2][LOG_BATCH];
+        int count[2] = { 0, 0 };
+        more = 0;
+        for (struct log_ring *ring = rings; ring; ring = ring->next) {
+            unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            for (ring->taken = ring->tail; ring->taken != head; ring->taken++) {
+                struct log_record *record = &ring->records[ring->taken % LOG_RING_SLOTS];
+                if (count[record->to_stderr] == LOG_BATCH) {
+                    more = 1;
+                    break;
+                }
+                batch[record->to_stderr][count[record->to_stderr]++] = (struct iovec){ record->text, record->len };
+            }
+        }
+        log_writev_all(STDOUT_FILENO, batch[0], count[0]);
+        log_writev_all(STDERR_FILENO, batch[1], count[1]);
+        for (struct log_ring *ring = rings; ring; ring = ring->next) {
+            __atomic_store_n(&ring->tail, ring->taken, __ATOMIC_RELEASE);
+        }
+    }
+
+    for (struct log_ring *ring = rings; ring; ring = ring->next) {
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped == ring->reported) continue;
+        char line[64];
+        int len = snprintf(line, sizeof(line), "Log buffer full, dropped %lu messages\n", dropped - ring->reported);
+        if (write(STDERR_FILENO, line, len) < 0) {
+            // Nowhere left to report it
+        }
+        __atomic_fetch_add(&log_dropped_total, dropped - ring->reported, __ATOMIC_RELAXED);
+        ring->reported = dropped;
+    }
+    errno = saved_errno;
+}
+
+static inline void log_flush(void) {
+    pthread_mutex_lock(&log_flush_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_flush_lock);
+}
+
+// Messages lost to full rings so far, for the stats command
+static inline unsigned long long log_dropped(void) {
+    return __atomic_load_n(&log_dropped_total, __ATOMIC_RELAXED);
+}
+
+// Around fork(): write out what is buffered, so the child does not print it a second time, and
+// make sure the child does not inherit the flush lock mid-flush
+static inline void log_before_fork(void) {
+    pthread_mutex_lock(&log_flush_lock);
+    log_drain();
+}
+
+static inline void log_after_fork(void) {
+    pthread_mutex_unlock(&log_flush_lock);
+}
+
+static inline void *log_flusher(void *arg) {
+    (void)arg;
+    struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+    while (1) {
+        nanosleep(&interval, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+// Start the flusher thread. Call once at startup, and again in a forked child, which inherits
+// the rings but not the thread.
+static inline void log_start(void) {
+    static int registered;  // atexit and atfork handlers carry over into forked children
+    if (!registered) {
+        registered = 1;
+        atexit(log_flush);
+        pthread_atfork(log_before_fork, log_after_fork, log_after_fork);
+    }
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, log_flusher, NULL) != 0) {
+        // Without a flusher, messages are still written when the process exits
+        LOG_ERROR("Failed to start log flusher\n");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+#endif
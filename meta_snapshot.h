@@ -0,0 +1,617 @@
+#ifndef META_SNAPSHOT_H
+#define META_SNAPSHOT_H
+
+// Metadata snapshot of a stored tree, so that display and dtar after a restart do not have to
+// walk it.
+//
+// Each tree (smain/, stext/, spdf/) keeps two files at its root:
+//   .meta.snap  immutable base: entry table sorted by path (size, mtime, CRC32C) and the paths,
+//               laid out so it can be memory-mapped and used without parsing
+//   .meta.log   append-only journal of put and remove records, one write() each, written as
+//               uploads and deletes change the tree
+// A reader maps the base and replays the journal over it (struct meta_view). Writers append
+// under a shared flock() on the journal. Folding the journal into a new base takes the lock
+// exclusively, so a reader holding it shared always sees a base and the journal that goes with
+// it. Records carry a checksum: the bytes of a write cut short by a crash are skipped, and the
+// next compaction drops them.
+//
+// Nothing is walked at startup. meta_snapshot_reconcile() walks the tree in the background at
+// idle I/O priority, takes whatever changed while the server was down (or behind its back) and
+// writes a new base. A tree that has never been reconciled has no base, and callers walk it as
+// before. Digests are the CRC32C of the contents as uploaded. The reconciler does not read files,
+// so one it finds changed has no digest (META_HAS_CRC clear) until it is uploaded again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "crc32c.h"
+
+#define META_SNAPSHOT_FILE ".meta.snap"
+#define META_JOURNAL_FILE ".meta.log"
+#define META_MAGIC "MSN1"
+#define META_COMPACT_BYTES (4 * 1024 * 1024)  // Journal size at which a writer folds it into the base
+#define META_RECONCILE_ATTEMPTS 3              // Walks tried while writers keep compacting underneath
+#define META_PATH_MAX 4096
+
+#define META_OP_PUT 'P'
+#define META_OP_REMOVE 'R'
+#define META_HAS_CRC 1                         // The entry's crc is the digest of its contents
+
+struct meta_header {
+    char magic[4];
+    uint32_t entry_count;
+    uint64_t entries_offset;   // struct meta_entry[entry_count], sorted by path
+    uint64_t strings_offset;   // NUL-terminated paths relative to the tree root
+    uint64_t file_size;
+};
+
+struct meta_entry {
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t crc;
+    uint32_t path;             // Offset of the path from strings_offset
+    uint32_t flags;
+};
+
+// Journal record as stored, followed by path_len bytes of path
+struct meta_record {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t path_len;
+    uint32_t crc;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t check;            // CRC32C of the record (with check 0) and its path
+};
+
+// A path the journal mentions and the latest change to it
+struct meta_change {
+    struct meta_change *next;  // Hash chain
+    char op;
+    struct meta_entry entry;   // After a put; entry.path is unused
+    char path[];
+};
+
+struct meta_view {
+    const uint8_t *base;       // Mapped base, NULL if the tree has none yet
+    size_t base_size;
+    ino_t base_ino;
+    const struct meta_header *header;
+    const struct meta_entry *entries;
+    const char *strings;
+    struct meta_change **buckets;
+    size_t bucket_count;       // Power of two
+    size_t records;            // Journal records replayed
+    off_t journal_bytes;       // Length of the journal's valid prefix
+    int damaged;               // Records in the journal are separated by bytes that do not check out
+};
+
+// A file's path and metadata, for writing a base
+struct meta_item {
+    const char *path;
+    struct meta_entry entry;
+};
+
+struct meta_reconcile_stats {
+    size_t files;
+    size_t added;
+    size_t changed;
+    size_t removed;
+};
+
+// FNV-1a, for the change table
+static inline uint64_t meta_hash(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline int meta_journal_open(const char *root) {
+    char path[META_PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/%s", root, META_JOURNAL_FILE);
+    return open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static inline void meta_entry_from_stat(struct meta_entry *entry, const struct stat *st, int have_crc, uint32_t crc) {
+    memset(entry, 0, sizeof(*entry));
+    entry->size = st->st_size;
+    entry->mtime_sec = st->st_mtim.tv_sec;
+    entry->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+    entry->crc = have_crc ? crc : 0;
+    entry->flags = have_crc ? META_HAS_CRC : 0;
+}
+
+// Whether path lies below prefix ("" for the whole tree), which has prefix_len bytes
+static inline int meta_under(const char *path, const char *prefix, size_t prefix_len) {
+    return prefix_len == 0 || (strncmp(path, prefix, prefix_len) == 0 && path[prefix_len] == '/');
+}
+
+static inline const char *meta_base_path(const struct meta_view *view, size_t i) {
+    return view->strings + view->entries[i].path;
+}
+
+// Map the base at root; view->header stays NULL if there is none or it does not check out
+static inline void meta_view_map_base(struct meta_view *view, const char *root) {
+    char path[META_PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/%s", root, META_SNAPSHOT_FILE);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct meta_header)) {
+        const uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        const struct meta_header *header = (const struct meta_header *)base;
+        if (base != MAP_FAILED && memcmp(header->magic, META_MAGIC, 4) == 0 && header->file_size == (uint64_t)st.st_size &&
+            header->entries_offset + (uint64_t)header->entry_count * sizeof(struct meta_entry) <= header->strings_offset &&
+            header->strings_offset <= header->file_size) {
+            view->base = base;
+            view->base_size = st.st_size;
+            view->base_ino = st.st_ino;
+            view->header = header;
+            view->entries = (const struct meta_entry *)(base + header->entries_offset);
+            view->strings = (const char *)(base + header->strings_offset);
+        } else if (base != MAP_FAILED) {
+            munmap((void *)base, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+static inline uint32_t meta_record_check(const struct meta_record *record, const char *path) {
+    struct meta_record copy = *record;
+    copy.check = 0;
+    return crc32c_update(crc32c_update(0, &copy, sizeof(copy)), path, copy.path_len);
+}
+
+static inline struct meta_change **meta_view_slot(const struct meta_view *view, const char *path) {
+    struct meta_change **slot = &view->buckets[meta_hash(path) & (view->bucket_count - 1)];
+    while (*slot && strcmp((*slot)->path, path) != 0) slot = &(*slot)->next;
+    return slot;
+}
+
+// Replay the journal open on fd from offset from on, keeping the latest change to each path
+static inline void meta_view_replay(struct meta_view *view, int fd, off_t from) {
+    struct stat st;
+    view->journal_bytes = from;
+    if (fstat(fd, &st) != 0 || st.st_size <= from) {
+        if (!view->buckets && (view->buckets = calloc(1, sizeof(*view->buckets)))) view->bucket_count = 1;
+        return;
+    }
+    size_t len = st.st_size - from;
+    char *data = malloc(len);
+    size_t got = 0;
+    while (data && got < len) {
+        ssize_t n = pread(fd, data + got, len - got, from + got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+
+    // Records average well over 32 bytes, so this keeps the chains short
+    size_t bucket_count = 1;
+    while (bucket_count < got / 32) bucket_count *= 2;
+    view->buckets = calloc(bucket_count, sizeof(*view->buckets));
+    view->bucket_count = view->buckets ? bucket_count : 0;
+
+    size_t offset = 0, valid_end = 0;
+    while (data && view->buckets && offset + sizeof(struct meta_record) <= got) {
+        struct meta_record record;
+        memcpy(&record, data + offset, sizeof(record));
+        const char *path = data + offset + sizeof(record);
+        if (offset + sizeof(record) + record.path_len > got || record.path_len == 0 ||
+            (record.op != META_OP_PUT && record.op != META_OP_REMOVE) || meta_record_check(&record, path) != record.check) {
+            // Left by a write cut short: look for the next record that checks out. A record
+            // still being written is at the end, and the next reader gets it whole.
+            offset++;
+            continue;
+        }
+        if (offset != valid_end) view->damaged = 1;
+        offset += sizeof(record) + record.path_len;
+        valid_end = offset;
+
+        char key[META_PATH_MAX];
+        if (record.path_len >= sizeof(key)) continue;
+        memcpy(key, path, record.path_len);
+        key[record.path_len] = '\0';
+        struct meta_change **slot = meta_view_slot(view, key);
+        if (!*slot) {
+            struct meta_change *change = malloc(sizeof(*change) + record.path_len + 1);
+            if (!change) break;
+            change->next = NULL;
+            memcpy(change->path, key, record.path_len + 1);
+            *slot = change;
+        }
+        (*slot)->op = record.op;
+        memset(&(*slot)->entry, 0, sizeof((*slot)->entry));
+        (*slot)->entry.size = record.size;
+        (*slot)->entry.mtime_sec = record.mtime_sec;
+        (*slot)->entry.mtime_nsec = record.mtime_nsec;
+        (*slot)->entry.crc = record.crc;
+        (*slot)->entry.flags = record.flags;
+        view->records++;
+    }
+    view->journal_bytes = from + valid_end;
+    free(data);
+}
+
+static inline void meta_view_close(struct meta_view *view) {
+    for (size_t i = 0; i < view->bucket_count; i++) {
+        struct meta_change *change = view->buckets[i];
+        while (change) {
+            struct meta_change *next = change->next;
+            free(change);
+            change = next;
+        }
+    }
+    free(view->buckets);
+    if (view->base) munmap((void *)view->base, view->base_size);
+    memset(view, 0, sizeof(*view));
+}
+
+// Index of the first base entry whose path is not below key (strcmp order)
+static inline size_t meta_base_lower_bound(const struct meta_view *view, const char *key) {
+    size_t low = 0, high = view->header ? view->header->entry_count : 0;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (strcmp(meta_base_path(view, mid), key) < 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// The entry for path, or NULL if the tree does not have it
+static inline const struct meta_entry *meta_view_find(const struct meta_view *view, const char *path) {
+    struct meta_change *change = view->bucket_count ? *meta_view_slot(view, path) : NULL;
+    if (change) return change->op == META_OP_PUT ? &change->entry : NULL;
+    size_t i = meta_base_lower_bound(view, path);
+    if (view->header && i < view->header->entry_count && strcmp(meta_base_path(view, i), path) == 0) {
+        return &view->entries[i];
+    }
+    return NULL;
+}
+
+// Every file of the view below prefix ("" for all). The paths point into the view. Returns the
+// number of items, with *items to be freed by the caller.
+static inline size_t meta_view_items(const struct meta_view *view, const char *prefix, struct meta_item **items) {
+    size_t prefix_len = strlen(prefix);
+    while (prefix_len > 0 && prefix[prefix_len - 1] == '/') prefix_len--;
+    size_t changes = 0;
+    for (size_t i = 0; i < view->bucket_count; i++) {
+        for (struct meta_change *change = view->buckets[i]; change; change = change->next) changes++;
+    }
+
+    // The base is sorted, so the entries below prefix are one run starting at "<prefix>/"
+    char key[META_PATH_MAX + 2];
+    snprintf(key, sizeof(key), "%.*s%s", (int)prefix_len, prefix, prefix_len ? "/" : "");
+    size_t first = meta_base_lower_bound(view, key), last = first;
+    while (view->header && last < view->header->entry_count && meta_under(meta_base_path(view, last), prefix, prefix_len)) last++;
+
+    size_t count = 0;
+    *items = malloc((last - first + changes + 1) * sizeof(**items));
+    if (!*items) return 0;
+    for (size_t i = first; i < last; i++) {
+        const char *path = meta_base_path(view, i);
+        if (view->bucket_count && *meta_view_slot(view, path)) continue;
+        (*items)[count].path = path;
+        (*items)[count++].entry = view->entries[i];
+    }
+    for (size_t i = 0; i < view->bucket_count; i++) {
+        for (struct meta_change *change = view->buckets[i]; change; change = change->next) {
+            if (change->op != META_OP_PUT || !meta_under(change->path, prefix, prefix_len)) continue;
+            (*items)[count].path = change->path;
+            (*items)[count++].entry = change->entry;
+        }
+    }
+    return count;
+}
+
+static inline int meta_item_compare(const void *a, const void *b) {
+    return strcmp(((const struct meta_item *)a)->path, ((const struct meta_item *)b)->path);
+}
+
+// Write items as the new base of the tree at root, sorting them by path. Call with the journal
+// locked exclusively. Returns 0 on success.
+static inline int meta_write_base(const char *root, struct meta_item *items, size_t count) {
+    qsort(items, count, sizeof(*items), meta_item_compare);
+    struct meta_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, META_MAGIC, 4);
+    header.entry_count = (uint32_t)count;
+    header.entries_offset = sizeof(header);
+    header.strings_offset = header.entries_offset + (uint64_t)count * sizeof(struct meta_entry);
+    uint64_t strings_len = 0;
+    for (size_t i = 0; i < count; i++) strings_len += strlen(items[i].path) + 1;
+    header.file_size = header.strings_offset + strings_len;
+    if (strings_len > UINT32_MAX) return -1;
+
+    char temp_path[META_PATH_MAX + 32], base_path[META_PATH_MAX + 16];
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d", root, META_SNAPSHOT_FILE, (int)getpid());
+    snprintf(base_path, sizeof(base_path), "%s/%s", root, META_SNAPSHOT_FILE);
+    FILE *out = fopen(temp_path, "wb");
+    if (!out) return -1;
+    fwrite(&header, sizeof(header), 1, out);
+    uint32_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct meta_entry entry = items[i].entry;
+        entry.path = offset;
+        offset += (uint32_t)strlen(items[i].path) + 1;
+        fwrite(&entry, sizeof(entry), 1, out);
+    }
+    for (size_t i = 0; i < count; i++) fwrite(items[i].path, 1, strlen(items[i].path) + 1, out);
+    int failed = fflush(out) != 0 || ferror(out) != 0 || fsync(fileno(out)) != 0;
+    failed |= fclose(out) != 0;
+    if (!failed && rename(temp_path, base_path) != 0) failed = 1;
+    if (failed) unlink(temp_path);
+    return failed ? -1 : 0;
+}
+
+// Fold the journal into a new base and empty it. Only a tree that already has a base is
+// compacted: until the first reconcile, the journal alone does not describe the tree.
+static inline int meta_snapshot_compact(const char *root) {
+    int fd = meta_journal_open(root);
+    if (fd < 0) return -1;
+    flock(fd, LOCK_EX);
+    struct meta_view view;
+    memset(&view, 0, sizeof(view));
+    meta_view_map_base(&view, root);
+    int result = -1;
+    if (view.header) {
+        meta_view_replay(&view, fd, 0);
+        struct meta_item *items;
+        size_t count = meta_view_items(&view, "", &items);
+        if (items) {
+            result = meta_write_base(root, items, count);
+            free(items);
+        }
+        if (result == 0 && ftruncate(fd, 0) != 0) result = -1;
+    }
+    meta_view_close(&view);
+    close(fd);
+    return result;
+}
+
+// Open a view of the tree at root: its base with the journal replayed over it. Returns 0, or
+// -1 if the tree has no base yet; either way the view is to be closed.
+static inline int meta_view_open(struct meta_view *view, const char *root) {
+    memset(view, 0, sizeof(*view));
+    int fd = meta_journal_open(root);
+    if (fd >= 0) flock(fd, LOCK_SH);
+    meta_view_map_base(view, root);
+    if (fd >= 0) {
+        meta_view_replay(view, fd, 0);
+        close(fd);
+    }
+    if (view->damaged && view->header) meta_snapshot_compact(root);
+    return view->header ? 0 : -1;
+}
+
+// Collect the paths of the files below prefix ("" for all) as grep_collect_files() does, without
+// walking the tree. Returns -1, collecting nothing, if the tree has no base yet.
+static inline int meta_snapshot_paths(const char *root, const char *prefix, char ***paths, size_t *path_count) {
+    struct meta_view view;
+    *paths = NULL;
+    *path_count = 0;
+    if (meta_view_open(&view, root) < 0) {
+        meta_view_close(&view);
+        return -1;
+    }
+    struct meta_item *items;
+    size_t count = meta_view_items(&view, prefix, &items);
+    *paths = malloc((count + 1) * sizeof(char *));
+    for (size_t i = 0; *paths && i < count; i++) {
+        if (((*paths)[*path_count] = strdup(items[i].path)) != NULL) (*path_count)++;
+    }
+    free(items);
+    meta_view_close(&view);
+    return 0;
+}
+
+// Journal a change to root/path: '+' if it was stored (its contents having CRC32C crc if
+// have_crc is set), '-' if it was removed
+static inline void meta_snapshot_note(const char *root, const char *path, char op, int have_crc, uint32_t crc) {
+    char full_path[META_PATH_MAX * 2];
+    snprintf(full_path, sizeof(full_path), "%s/%s", root, path);
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= META_PATH_MAX) return;
+    struct stat st;
+    int stored = op == '+' && stat(full_path, &st) == 0 && S_ISREG(st.st_mode);
+
+    struct meta_record record;
+    memset(&record, 0, sizeof(record));
+    record.op = stored ? META_OP_PUT : META_OP_REMOVE;
+    record.path_len = (uint16_t)path_len;
+    if (stored) {
+        struct meta_entry entry;
+        meta_entry_from_stat(&entry, &st, have_crc, crc);
+        record.flags = (uint8_t)entry.flags;
+        record.crc = entry.crc;
+        record.size = entry.size;
+        record.mtime_sec = entry.mtime_sec;
+        record.mtime_nsec = entry.mtime_nsec;
+    }
+    record.check = meta_record_check(&record, path);
+    char buffer[sizeof(record) + META_PATH_MAX];
+    memcpy(buffer, &record, sizeof(record));
+    memcpy(buffer + sizeof(record), path, path_len);
+
+    int fd = meta_journal_open(root);
+    if (fd < 0) return;
+    flock(fd, LOCK_SH);
+    if (write(fd, buffer, sizeof(record) + path_len) != (ssize_t)(sizeof(record) + path_len)) {
+        perror("Failed to journal metadata change");
+    }
+    int compact = fstat(fd, &st) == 0 && st.st_size > META_COMPACT_BYTES;
+    close(fd);
+    if (compact) meta_snapshot_compact(root);
+}
+
+// Growable list of the files found by a walk
+struct meta_walk {
+    struct meta_item *items;
+    size_t count, cap;
+    int failed;
+};
+
+// Add every regular file ending in suffix below dir_fd (path prefix, "" for the root) to walk
+static inline void meta_walk_dir(int dir_fd, const char *prefix, const char *suffix, struct meta_walk *walk) {
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return;
+    }
+    size_t suffix_len = strlen(suffix);
+    struct dirent *entry;
+    while (!walk->failed && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[META_PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "", entry->d_name) >= (int)sizeof(path)) continue;
+        size_t len = strlen(entry->d_name);
+        int wanted = len > suffix_len && strcmp(entry->d_name + len - suffix_len, suffix) == 0;
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && !wanted)) {
+            int child = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child >= 0) meta_walk_dir(child, path, suffix, walk);
+            continue;
+        }
+        struct stat st;
+        if (!wanted || fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            int child = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child >= 0) meta_walk_dir(child, path, suffix, walk);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+        if (walk->count == walk->cap) {
+            size_t cap = walk->cap ? walk->cap * 2 : 1024;
+            struct meta_item *grown = realloc(walk->items, cap * sizeof(*grown));
+            if (!grown) {
+                walk->failed = 1;
+                break;
+            }
+            walk->items = grown;
+            walk->cap = cap;
+        }
+        struct meta_item *item = &walk->items[walk->count];
+        if (!(item->path = strdup(path))) {
+            walk->failed = 1;
+            break;
+        }
+        meta_entry_from_stat(&item->entry, &st, 0, 0);
+        walk->count++;
+    }
+    closedir(dir);
+}
+
+static inline void meta_walk_free(struct meta_walk *walk) {
+    for (size_t i = 0; i < walk->count; i++) free((char *)walk->items[i].path);
+    free(walk->items);
+}
+
+// Walk the tree at root for files ending in suffix and make its base match what is there,
+// keeping the digests of files that have not changed. Meant for a background thread or
+// process: the walk runs at idle I/O priority, and uploads and deletes made meanwhile are
+// journaled as usual and win over what the walk saw. Returns 0 on success.
+static inline int meta_snapshot_reconcile(const char *root, const char *suffix, struct meta_reconcile_stats *stats) {
+    // IOPRIO_WHO_PROCESS for the calling thread, class IOPRIO_CLASS_IDLE
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+    memset(stats, 0, sizeof(*stats));
+    mkdir(root, 0755);
+    for (int attempt = 0; attempt < META_RECONCILE_ATTEMPTS; attempt++) {
+        struct meta_view before;
+        meta_view_open(&before, root);
+        int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct meta_walk walk = { 0 };
+        if (root_fd >= 0) meta_walk_dir(root_fd, "", suffix, &walk);
+        if (root_fd < 0 || walk.failed) {
+            meta_walk_free(&walk);
+            meta_view_close(&before);
+            return -1;
+        }
+
+        // Compare with what the tree was thought to hold
+        memset(stats, 0, sizeof(*stats));
+        stats->files = walk.count;
+        size_t matched = 0;
+        for (size_t i = 0; i < walk.count; i++) {
+            struct meta_entry *entry = &walk.items[i].entry;
+            const struct meta_entry *known = meta_view_find(&before, walk.items[i].path);
+            if (!known) {
+                stats->added++;
+                continue;
+            }
+            matched++;
+            if (known->size == entry->size && known->mtime_sec == entry->mtime_sec && known->mtime_nsec == entry->mtime_nsec) {
+                entry->crc = known->crc;
+                entry->flags = known->flags;
+            } else {
+                stats->changed++;
+            }
+        }
+        struct meta_item *known_items;
+        size_t known_count = meta_view_items(&before, "", &known_items);
+        free(known_items);
+        stats->removed = known_count > matched ? known_count - matched : 0;
+
+        // Changes journaled since the view was taken are newer than the walk. If a writer has
+        // compacted them into the base in the meantime, they cannot be told apart: walk again.
+        int fd = meta_journal_open(root);
+        if (fd < 0) {
+            meta_walk_free(&walk);
+            meta_view_close(&before);
+            return -1;
+        }
+        flock(fd, LOCK_EX);
+        struct meta_view since;
+        memset(&since, 0, sizeof(since));
+        meta_view_map_base(&since, root);
+        struct stat journal;
+        int moved = since.base_ino != before.base_ino || fstat(fd, &journal) != 0 || journal.st_size < before.journal_bytes;
+        int result = -1;
+        if (!moved) {
+            meta_view_replay(&since, fd, before.journal_bytes);
+            qsort(walk.items, walk.count, sizeof(*walk.items), meta_item_compare);
+            size_t changes = 0;
+            for (size_t i = 0; i < since.bucket_count; i++) {
+                for (struct meta_change *change = since.buckets[i]; change; change = change->next) changes++;
+            }
+            struct meta_item *items = malloc((walk.count + changes + 1) * sizeof(*items));
+            if (items) {
+                size_t count = 0;
+                for (size_t i = 0; i < walk.count; i++) {
+                    if (since.bucket_count && *meta_view_slot(&since, walk.items[i].path)) continue;
+                    items[count++] = walk.items[i];
+                }
+                for (size_t i = 0; i < since.bucket_count; i++) {
+                    for (struct meta_change *change = since.buckets[i]; change; change = change->next) {
+                        if (change->op != META_OP_PUT) continue;
+                        items[count].path = change->path;
+                        items[count++].entry = change->entry;
+                    }
+                }
+                result = meta_write_base(root, items, count);
+                free(items);
+            }
+            if (result == 0 && ftruncate(fd, 0) != 0) result = -1;
+        }
+        meta_view_close(&since);
+        close(fd);
+        meta_walk_free(&walk);
+        meta_view_close(&before);
+        if (!moved) return result;
+    }
+    return -1;
+}
+
+#endif
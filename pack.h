@@ -0,0 +1,481 @@
+#ifndef PACK_H
+#define PACK_H
+
+// Pack store for the small files in Smain's smain/ tree.
+//
+// Built with -DPACK_MAX_FILE_SIZE=N (0, the default, leaves it off), Smain does not give an
+// uploaded .c file of at most N bytes a file of its own. Its contents are appended to the current
+// segment, .pack/segment.<n>, and .pack/index journals where they went: one record per change,
+// either a put (segment, offset, length, CRC32C, mtime) or a remove. At startup the journal is
+// replayed into an in-memory table keyed by the path relative to the tree root. A file is either
+// packed or loose, never both: packing a file deletes any loose copy and storing a loose one drops
+// the packed entry, so readers look in the pack first and then in the tree.
+//
+// Segments are only ever appended to. A read gets its own descriptor for the segment together with
+// the entry's offset and length, which stays valid whatever happens to the store afterwards. Removed
+// and replaced entries leave dead bytes behind; once a sealed segment is more than
+// PACK_COMPACT_DEAD_PERCENT dead, its live entries are copied into the current segment and it is
+// deleted. The journal is rewritten from the table when it holds far more records than live entries.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifndef PACK_MAX_FILE_SIZE
+#define PACK_MAX_FILE_SIZE 0                    // Largest file packed, 0 = pack store off
+#endif
+#define PACK_DIR ".pack"
+#define PACK_INDEX_FILE "index"
+#define PACK_SEGMENT_SIZE (64 * 1024 * 1024)    // A segment is sealed once it reaches this size
+#define PACK_COMPACT_DEAD_PERCENT 50
+#define PACK_JOURNAL_SLACK 4096                 // Journal records allowed beyond twice the live entries
+#define PACK_PATH_MAX 4096
+
+#define PACK_OP_PUT 'P'
+#define PACK_OP_REMOVE 'R'
+
+// Journal record as stored, followed by path_len bytes of path
+struct pack_record {
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t path_len;
+    uint32_t segment;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t crc;
+    int64_t mtime;
+};
+
+struct pack_entry {
+    char *path;
+    uint32_t segment;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t crc;
+    int64_t mtime;
+    struct pack_entry *next;    // Hash chain
+};
+
+struct pack_segment {
+    int fd;                     // -1 once the segment has been compacted away
+    uint64_t size;
+    uint64_t dead;              // Bytes no entry refers to any more
+};
+
+struct pack_store {
+    pthread_mutex_t lock;
+    int dir_fd;                 // -1 when the store is off or could not be opened
+    int index_fd;
+    struct pack_entry **buckets;
+    size_t bucket_count;
+    size_t count;               // Live entries
+    uint64_t live_bytes;
+    struct pack_segment *segments;
+    uint32_t segment_count;
+    uint32_t active;            // Segment new entries are appended to
+    size_t journal_records;
+    unsigned long long compactions;
+};
+
+// Where a packed file's contents are. fd is the caller's to close.
+struct pack_location {
+    int fd;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t crc;
+    int64_t mtime;
+};
+
+// One entry of a listing, ordered by position in the store so reading them in turn is sequential.
+// Items from the same segment share fd; pack_list_free() closes them.
+struct pack_item {
+    char *path;
+    int fd;
+    uint32_t segment;
+    uint64_t offset;
+    uint32_t length;
+    int64_t mtime;
+};
+
+static inline uint64_t pack_hash(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path; path++) hash = (hash ^ (unsigned char)*path) * 0x100000001b3ULL;
+    return hash;
+}
+
+static inline struct pack_entry **pack_slot(struct pack_store *pack, const char *path) {
+    struct pack_entry **slot = &pack->buckets[pack_hash(path) & (pack->bucket_count - 1)];
+    while (*slot && strcmp((*slot)->path, path) != 0) slot = &(*slot)->next;
+    return slot;
+}
+
+static inline int pack_grow_table(struct pack_store *pack) {
+    size_t bucket_count = pack->bucket_count ? pack->bucket_count * 2 : 1024;
+    struct pack_entry **buckets = calloc(bucket_count, sizeof(*buckets));
+    if (!buckets) return -1;
+    for (size_t i = 0; i < pack->bucket_count; i++) {
+        struct pack_entry *entry = pack->buckets[i];
+        while (entry) {
+            struct pack_entry *next = entry->next;
+            size_t b = pack_hash(entry->path) & (bucket_count - 1);
+            entry->next = buckets[b];
+            buckets[b] = entry;
+            entry = next;
+        }
+    }
+    free(pack->buckets);
+    pack->buckets = buckets;
+    pack->bucket_count = bucket_count;
+    return 0;
+}
+
+static inline int pack_open_segment(struct pack_store *pack, uint32_t segment, int create) {
+    if (segment >= pack->segment_count) {
+        uint32_t segment_count = segment + 16;
+        struct pack_segment *segments = realloc(pack->segments, segment_count * sizeof(*segments));
+        if (!segments) return -1;
+        for (uint32_t i = pack->segment_count; i < segment_count; i++) {
+            segments[i] = (struct pack_segment){ .fd = -1 };
+        }
+        pack->segments = segments;
+        pack->segment_count = segment_count;
+    }
+    struct pack_segment *seg = &pack->segments[segment];
+    if (seg->fd >= 0) return 0;
+
+    char name[32];
+    snprintf(name, sizeof(name), "segment.%06u", segment);
+    seg->fd = openat(pack->dir_fd, name, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    struct stat st;
+    if (seg->fd < 0 || fstat(seg->fd, &st) != 0) return -1;
+    seg->size = st.st_size;
+    seg->dead = 0;
+    return 0;
+}
+
+// Account for an entry's bytes no longer being referenced
+static inline void pack_forget(struct pack_store *pack, const struct pack_entry *entry) {
+    if (entry->segment < pack->segment_count) pack->segments[entry->segment].dead += entry->length;
+    pack->live_bytes -= entry->length;
+}
+
+// Apply a put or remove to the table (journal replay and live updates alike)
+static inline int pack_apply(struct pack_store *pack, const struct pack_record *record, const char *path) {
+    if (pack->count >= pack->bucket_count && pack_grow_table(pack) < 0) return -1;
+    struct pack_entry **slot = pack_slot(pack, path);
+    struct pack_entry *entry = *slot;
+    if (record->op == PACK_OP_REMOVE) {
+        if (entry) {
+            pack_forget(pack, entry);
+            *slot = entry->next;
+            free(entry->path);
+            free(entry);
+            pack->count--;
+        }
+        return 0;
+    }
+
+    if (entry) {
+        pack_forget(pack, entry);
+    } else {
+        entry = calloc(1, sizeof(*entry));
+        if (!entry || !(entry->path = strdup(path))) {
+            free(entry);
+            return -1;
+        }
+        *slot = entry;
+        pack->count++;
+    }
+    entry->segment = record->segment;
+    entry->offset = record->offset;
+    entry->length = record->length;
+    entry->crc = record->crc;
+    entry->mtime = record->mtime;
+    pack->live_bytes += record->length;
+    return 0;
+}
+
+static inline int pack_journal(struct pack_store *pack, const struct pack_record *record, const char *path) {
+    struct iovec iov[2] = { { (void *)record, sizeof(*record) }, { (void *)path, record->path_len } };
+    ssize_t expected = sizeof(*record) + record->path_len;
+    if (writev(pack->index_fd, iov, 2) != expected) return -1;
+    pack->journal_records++;
+    return 0;
+}
+
+// Replace the journal with one put record per live entry
+static inline void pack_rewrite_journal(struct pack_store *pack) {
+    int fd = openat(pack->dir_fd, PACK_INDEX_FILE ".new", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return;
+    }
+    int failed = 0;
+    for (size_t b = 0; b < pack->bucket_count && !failed; b++) {
+        for (struct pack_entry *entry = pack->buckets[b]; entry && !failed; entry = entry->next) {
+            struct pack_record record = {
+                .op = PACK_OP_PUT, .path_len = strlen(entry->path), .segment = entry->segment,
+                .offset = entry->offset, .length = entry->length, .crc = entry->crc, .mtime = entry->mtime,
+            };
+            failed = fwrite(&record, sizeof(record), 1, out) != 1 || fwrite(entry->path, record.path_len, 1, out) != 1;
+        }
+    }
+    failed |= fflush(out) != 0 || fsync(fileno(out)) != 0;
+    fclose(out);
+    if (failed || renameat(pack->dir_fd, PACK_INDEX_FILE ".new", pack->dir_fd, PACK_INDEX_FILE) != 0) {
+        unlinkat(pack->dir_fd, PACK_INDEX_FILE ".new", 0);
+        return;
+    }
+    int index_fd = openat(pack->dir_fd, PACK_INDEX_FILE, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (index_fd < 0) return;
+    close(pack->index_fd);
+    pack->index_fd = index_fd;
+    pack->journal_records = pack->count;
+}
+
+// Open (creating if need be) the store under root and replay its journal. Returns -1 and leaves
+// the store off if it cannot be opened.
+static inline int pack_open(struct pack_store *pack, const char *root) {
+    memset(pack, 0, sizeof(*pack));
+    pthread_mutex_init(&pack->lock, NULL);
+    pack->dir_fd = -1;
+    pack->index_fd = -1;
+
+    char dir[PACK_PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/%s", root, PACK_DIR);
+    mkdir(root, 0755);
+    mkdir(dir, 0755);
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0 || pack_grow_table(pack) < 0) {
+        if (dir_fd >= 0) close(dir_fd);
+        return -1;
+    }
+    pack->dir_fd = dir_fd;
+
+    // Replay the journal; a torn record at the end (a crash mid-append) ends it
+    int index_fd = openat(dir_fd, PACK_INDEX_FILE, O_RDONLY | O_CLOEXEC);
+    FILE *in = index_fd >= 0 ? fdopen(index_fd, "r") : NULL;
+    off_t valid_end = 0;
+    if (in) {
+        struct pack_record record;
+        char path[PACK_PATH_MAX];
+        while (fread(&record, sizeof(record), 1, in) == 1 && record.path_len > 0 && record.path_len < sizeof(path) &&
+               fread(path, record.path_len, 1, in) == 1) {
+            path[record.path_len] = '\0';
+            pack->journal_records++;
+            valid_end = ftello(in);
+            if (record.op == PACK_OP_PUT) {
+                // Entries whose data never made it to the segment are skipped
+                if (pack_open_segment(pack, record.segment, 0) < 0 ||
+                    record.offset + record.length > pack->segments[record.segment].size) {
+                    continue;
+                }
+                if (record.segment >= pack->active) pack->active = record.segment;
+            }
+            if (record.op == PACK_OP_PUT || record.op == PACK_OP_REMOVE) pack_apply(pack, &record, path);
+        }
+        fclose(in);
+    } else if (index_fd >= 0) {
+        close(index_fd);
+    }
+
+    pack->index_fd = openat(dir_fd, PACK_INDEX_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (pack->index_fd < 0 || ftruncate(pack->index_fd, valid_end) != 0 || pack_open_segment(pack, pack->active, 1) < 0) {
+        close(dir_fd);
+        pack->dir_fd = -1;
+        return -1;
+    }
+
+    // Bytes in a segment that no entry covers (replaced, removed or never journaled) are dead
+    for (uint32_t s = 0; s < pack->segment_count; s++) pack->segments[s].dead = pack->segments[s].size;
+    for (size_t b = 0; b < pack->bucket_count; b++) {
+        for (struct pack_entry *entry = pack->buckets[b]; entry; entry = entry->next) {
+            pack->segments[entry->segment].dead -= entry->length;
+        }
+    }
+    return 0;
+}
+
+static inline int pack_enabled(const struct pack_store *pack) {
+    return PACK_MAX_FILE_SIZE > 0 && pack->dir_fd >= 0;
+}
+
+// Append data to the current segment, starting a new one when it is full, and say where it went
+static inline int pack_append(struct pack_store *pack, const void *data, uint32_t length, uint32_t *segment, uint64_t *offset) {
+    if (pack->segments[pack->active].size + length > PACK_SEGMENT_SIZE && pack->segments[pack->active].size > 0) {
+        if (pack_open_segment(pack, pack->active + 1, 1) < 0) return -1;
+        pack->active++;
+    }
+    struct pack_segment *seg = &pack->segments[pack->active];
+    const char *p = data;
+    uint32_t written = 0;
+    while (written < length) {
+        ssize_t n = pwrite(seg->fd, p + written, length - written, seg->size + written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        written += n;
+    }
+    *segment = pack->active;
+    *offset = seg->size;
+    seg->size += length;
+    return 0;
+}
+
+static inline void pack_maybe_compact(struct pack_store *pack, uint32_t segment);
+
+// Store a file's contents under path, replacing any earlier version
+static inline int pack_put(struct pack_store *pack, const char *path, const void *data, uint32_t length, uint32_t crc) {
+    size_t path_len = strlen(path);
+    if (!pack_enabled(pack) || path_len == 0 || path_len >= PACK_PATH_MAX) return -1;
+
+    pthread_mutex_lock(&pack->lock);
+    struct pack_entry *old = *pack_slot(pack, path);
+    uint32_t old_segment = old ? old->segment : 0;
+    struct pack_record record = { .op = PACK_OP_PUT, .path_len = path_len, .length = length, .crc = crc, .mtime = time(NULL) };
+    int result = -1;
+    if (pack_append(pack, data, length, &record.segment, &record.offset) == 0 &&
+        pack_journal(pack, &record, path) == 0 && pack_apply(pack, &record, path) == 0) {
+        result = 0;
+        if (old) pack_maybe_compact(pack, old_segment);
+    }
+    pthread_mutex_unlock(&pack->lock);
+    return result;
+}
+
+// Drop path from the store. Returns 1 if it was packed, 0 if not, -1 on error.
+static inline int pack_remove(struct pack_store *pack, const char *path) {
+    size_t path_len = strlen(path);
+    if (!pack_enabled(pack) || path_len == 0 || path_len >= PACK_PATH_MAX) return 0;
+
+    pthread_mutex_lock(&pack->lock);
+    struct pack_entry *entry = *pack_slot(pack, path);
+    int result = 0;
+    if (entry) {
+        uint32_t segment = entry->segment;
+        struct pack_record record = { .op = PACK_OP_REMOVE, .path_len = path_len };
+        result = pack_journal(pack, &record, path) == 0 && pack_apply(pack, &record, path) == 0 ? 1 : -1;
+        if (result == 1) pack_maybe_compact(pack, segment);
+    }
+    pthread_mutex_unlock(&pack->lock);
+    return result;
+}
+
+// Find path; on success fills in where its contents are, with a descriptor of its own
+static inline int pack_lookup(struct pack_store *pack, const char *path, struct pack_location *location) {
+    if (!pack_enabled(pack)) return -1;
+    pthread_mutex_lock(&pack->lock);
+    struct pack_entry *entry = *pack_slot(pack, path);
+    int result = -1;
+    if (entry) {
+        location->fd = fcntl(pack->segments[entry->segment].fd, F_DUPFD_CLOEXEC, 0);
+        location->offset = entry->offset;
+        location->length = entry->length;
+        location->crc = entry->crc;
+        location->mtime = entry->mtime;
+        result = location->fd >= 0 ? 0 : -1;
+    }
+    pthread_mutex_unlock(&pack->lock);
+    return result;
+}
+
+static inline int pack_item_compare(const void *a, const void *b) {
+    const struct pack_item *x = a, *y = b;
+    if (x->segment != y->segment) return x->segment < y->segment ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// List every packed file in store order. Returns the number of items (0 if there are none or
+// memory runs out); free them with pack_list_free().
+static inline size_t pack_list(struct pack_store *pack, struct pack_item **items_out) {
+    *items_out = NULL;
+    if (!pack_enabled(pack)) return 0;
+    pthread_mutex_lock(&pack->lock);
+    struct pack_item *items = malloc((pack->count + 1) * sizeof(*items));
+    int *fds = malloc(pack->segment_count * sizeof(int));
+    size_t count = 0;
+    if (items && fds) {
+        for (uint32_t s = 0; s < pack->segment_count; s++) fds[s] = -1;
+        for (size_t b = 0; b < pack->bucket_count; b++) {
+            for (struct pack_entry *entry = pack->buckets[b]; entry; entry = entry->next) {
+                int *fd = &fds[entry->segment];
+                if (*fd < 0) *fd = fcntl(pack->segments[entry->segment].fd, F_DUPFD_CLOEXEC, 0);
+                char *path = *fd >= 0 ? strdup(entry->path) : NULL;
+                if (!path) continue;
+                items[count++] = (struct pack_item){ path, *fd, entry->segment, entry->offset, entry->length, entry->mtime };
+            }
+        }
+    }
+    pthread_mutex_unlock(&pack->lock);
+    free(fds);
+    if (count > 0) qsort(items, count, sizeof(*items), pack_item_compare);
+    *items_out = items;
+    return count;
+}
+
+static inline void pack_list_free(struct pack_item *items, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (i + 1 == count || items[i + 1].fd != items[i].fd) close(items[i].fd);
+        free(items[i].path);
+    }
+    free(items);
+}
+
+// Move the live entries of a sealed segment into the current one and delete it. Caller holds the lock.
+static inline void pack_compact(struct pack_store *pack, uint32_t segment) {
+    struct pack_segment *seg = &pack->segments[segment];
+    char *buffer = malloc(PACK_MAX_FILE_SIZE > 0 ? PACK_MAX_FILE_SIZE : 1);
+    int moved_all = buffer != NULL;
+    for (size_t b = 0; b < pack->bucket_count && moved_all; b++) {
+        for (struct pack_entry *entry = pack->buckets[b]; entry && moved_all; entry = entry->next) {
+            if (entry->segment != segment) continue;
+            struct pack_record record = {
+                .op = PACK_OP_PUT, .path_len = strlen(entry->path), .length = entry->length,
+                .crc = entry->crc, .mtime = entry->mtime,
+            };
+            moved_all = entry->length <= PACK_MAX_FILE_SIZE &&
+                        pread(seg->fd, buffer, entry->length, entry->offset) == (ssize_t)entry->length &&
+                        pack_append(pack, buffer, entry->length, &record.segment, &record.offset) == 0 &&
+                        pack_journal(pack, &record, entry->path) == 0;
+            if (moved_all) {
+                seg->dead += entry->length;
+                entry->segment = record.segment;
+                entry->offset = record.offset;
+            }
+        }
+    }
+    free(buffer);
+    if (!moved_all || fdatasync(pack->segments[pack->active].fd) != 0) return;
+
+    // Readers that already hold a descriptor for the segment keep reading it until they close it
+    char name[32];
+    snprintf(name, sizeof(name), "segment.%06u", segment);
+    pack_rewrite_journal(pack);
+    unlinkat(pack->dir_fd, name, 0);
+    close(seg->fd);
+    seg->fd = -1;
+    seg->size = seg->dead = 0;
+    pack->compactions++;
+}
+
+// After an entry in segment was replaced or removed: compact the segment if it is mostly dead,
+// and rewrite the journal if it has grown far beyond the live entries. Caller holds the lock.
+static inline void pack_maybe_compact(struct pack_store *pack, uint32_t segment) {
+    struct pack_segment *seg = &pack->segments[segment];
+    if (segment != pack->active && seg->fd >= 0 && seg->size > 0 &&
+        seg->dead * 100 >= seg->size * PACK_COMPACT_DEAD_PERCENT) {
+        pack_compact(pack, segment);
+    }
+    if (pack->journal_records > pack->count * 2 + PACK_JOURNAL_SLACK) pack_rewrite_journal(pack);
+}
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+// Fair-share transfer scheduler used by Smain and the sub-servers.
+//
+// Every outgoing file body is a flow. Before a flow sends a chunk it asks the scheduler for one
+// of SCHED_SLOTS send slots and gives it back once the chunk is on the wire, so only a handful
+// of chunks are ever being pushed at once. When flows are waiting for a slot the next one is
+// picked by deficit round robin: each visit adds SCHED_QUANTUM times the flow's class weight to
+// its deficit, and a flow is served once its deficit covers the chunk. Interactive flows weigh
+// SCHED_WEIGHT_INTERACTIVE, bulk flows (dtar, or anything that has sent SCHED_BULK_AFTER bytes)
+// weigh 1, so a small dfile gets the next slot instead of queueing behind a multi-GB archive,
+// while a lone bulk transfer still gets every slot.
+//
+// Optionally each client address is also limited to SCHED_CLIENT_RATE bytes per second by a
+// token bucket (0, the default, disables this; build with -DSCHED_CLIENT_RATE=... to enable).
+//
+// The state lives in a MAP_SHARED mapping with process-shared, robust locks, so the forking
+// sub-servers create it once before accepting and every child schedules against the same table.
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#define SCHED_MAX_FLOWS 64
+#define SCHED_SLOTS 4                       // Chunks allowed on the wire at once
+#define SCHED_QUANTUM 16384                 // Deficit added per round, times the class weight
+#define SCHED_WEIGHT_INTERACTIVE 4
+#define SCHED_WEIGHT_BULK 1
+#define SCHED_BULK_AFTER (8 * 1024 * 1024)  // Long transfers are demoted to bulk
+#define SCHED_MAX_CLIENTS 64
+#ifndef SCHED_CLIENT_RATE
+#define SCHED_CLIENT_RATE 0                 // Bytes per second per client address, 0 = unlimited
+#endif
+#define SCHED_CLIENT_BURST (4 * 1024 * 1024)
+
+enum sched_class {
+    SCHED_INTERACTIVE = 0,
+    SCHED_BULK = 1,
+};
+
+struct sched_flow {
+    int in_use;
+    pid_t owner;            // Process that opened the flow, to reclaim flows of crashed children
+    int class;
+    int waiting;            // Asked for a slot and not yet granted
+    int granted;            // Holds a slot
+    int64_t deficit;
+    size_t request;         // Size of the chunk waiting to be sent
+    uint64_t sent;
+    uint32_t client_addr;   // IPv4 address in network order, 0 if not rate limited
+};
+
+struct sched_client {
+    uint32_t addr;
+    double tokens;
+    struct timespec refilled;
+    unsigned long last_used;
+};
+
+struct transfer_sched {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int free_slots;
+    int cursor;             // Deficit round robin position
+    unsigned long clock;
+    struct sched_flow flows[SCHED_MAX_FLOWS];
+    struct sched_client clients[SCHED_MAX_CLIENTS];
+};
+
+static inline double sched_seconds_between(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Create the shared scheduler state; returns NULL (no scheduling) if it cannot be set up
+static inline struct transfer_sched *sched_create(void) {
+    struct transfer_sched *sched = mmap(NULL, sizeof(*sched), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sched == MAP_FAILED) return NULL;
+    memset(sched, 0, sizeof(*sched));
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sched->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->changed, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    sched->free_slots = SCHED_SLOTS;
+    return sched;
+}
+
+// Release everything a flow holds; called with the lock held
+static inline void sched_drop_flow(struct transfer_sched *sched, struct sched_flow *flow) {
+    if (flow->granted) sched->free_slots++;
+    memset(flow, 0, sizeof(*flow));
+}
+
+static inline void sched_lock(struct transfer_sched *sched) {
+    if (pthread_mutex_lock(&sched->lock) == EOWNERDEAD) {
+        // A sub-server child died holding the lock; its flows are reclaimed in sched_open()
+        pthread_mutex_consistent(&sched->lock);
+    }
+}
+
+// Hand free slots to waiting flows in deficit round robin order; called with the lock held
+static inline void sched_dispatch(struct transfer_sched *sched) {
+    int granted_any = 0;
+    while (sched->free_slots > 0) {
+        int waiting = 0;
+        for (int i = 0; i < SCHED_MAX_FLOWS; i++) waiting += sched->flows[i].waiting;
+        if (waiting == 0) break;
+
+        // Visit flows in turn, topping up deficits until one can afford its chunk
+        for (;;) {
+            struct sched_flow *flow = &sched->flows[sched->cursor];
+            sched->cursor = (sched->cursor + 1) % SCHED_MAX_FLOWS;
+            if (!flow->waiting) continue;
+            flow->deficit += (int64_t)SCHED_QUANTUM *
+                             (flow->class == SCHED_BULK ? SCHED_WEIGHT_BULK : SCHED_WEIGHT_INTERACTIVE);
+            if (flow->deficit >= (int64_t)flow->request) {
+                flow->deficit -= flow->request;
+                flow->waiting = 0;
+                flow->granted = 1;
+                sched->free_slots--;
+                granted_any = 1;
+                break;
+            }
+        }
+    }
+    if (granted_any) pthread_cond_broadcast(&sched->changed);
+}
+
+// Register a transfer. client_addr (network order) selects the token bucket, 0 for none.
+// Returns NULL when no scheduler is set up or the flow table is full; the transfer then
+// simply runs unscheduled.
+static inline struct sched_flow *sched_open(struct transfer_sched *sched, int class, uint32_t client_addr) {
+    if (!sched) return NULL;
+    sched_lock(sched);
+    struct sched_flow *found = NULL;
+    for (int i = 0; i < SCHED_MAX_FLOWS; i++) {
+        struct sched_flow *flow = &sched->flows[i];
+        if (flow->in_use && flow->owner != getpid() && kill(flow->owner, 0) != 0 && errno == ESRCH) {
+            sched_drop_flow(sched, flow);
+        }
+        if (!flow->in_use && !found) found = flow;
+    }
+    if (found) {
+        found->in_use = 1;
+        found->owner = getpid();
+        found->class = class;
+        found->client_addr = client_addr;
+    }
+    sched_dispatch(sched);
+    pthread_mutex_unlock(&sched->lock);
+    return found;
+}
+
+static inline void sched_close(struct transfer_sched *sched, struct sched_flow *flow) {
+    if (!sched || !flow) return;
+    sched_lock(sched);
+    sched_drop_flow(sched, flow);
+    sched_dispatch(sched);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Wait until the client's token bucket holds len bytes, then take them
+static inline void sched_throttle(struct transfer_sched *sched, struct sched_flow *flow, size_t len) {
+    const double rate = SCHED_CLIENT_RATE;
+    if (rate <= 0 || flow->client_addr == 0) return;
+    for (;;) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sched_lock(sched);
+
+        // Find the client's bucket, recycling the least recently used one if it has none
+        struct sched_client *bucket = &sched->clients[0];
+        for (int i = 0; i < SCHED_MAX_CLIENTS; i++) {
+            if (sched->clients[i].addr == flow->client_addr) {
+                bucket = &sched->clients[i];
+                break;
+            }
+            if (sched->clients[i].last_used < bucket->last_used) bucket = &sched->clients[i];
+        }
+        if (bucket->addr != flow->client_addr) {
+            bucket->addr = flow->client_addr;
+            bucket->tokens = SCHED_CLIENT_BURST;
+            bucket->refilled = now;
+        }
+        bucket->last_used = ++sched->clock;
+
+        bucket->tokens += sched_seconds_between(&bucket->refilled, &now) * rate;
+        if (bucket->tokens > SCHED_CLIENT_BURST) bucket->tokens = SCHED_CLIENT_BURST;
+        bucket->refilled = now;
+        double shortfall = len - bucket->tokens;
+        if (shortfall <= 0) {
+            bucket->tokens -= len;
+            pthread_mutex_unlock(&sched->lock);
+            return;
+        }
+        pthread_mutex_unlock(&sched->lock);
+
+        double wait = shortfall / rate;
+        struct timespec pause = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        nanosleep(&pause, NULL);
+    }
+}
+
+// Block until the flow may send a chunk of len bytes; pair with sched_release()
+static inline void sched_acquire(struct transfer_sched *sched, struct sched_flow *flow, size_t len) {
+    if (!sched || !flow) return;
+    sched_throttle(sched, flow, len);
+
+    sched_lock(sched);
+    if (flow->class == SCHED_INTERACTIVE && flow->sent >= SCHED_BULK_AFTER) {
+        flow->class = SCHED_BULK;
+    }
+    flow->request = len;
+    flow->waiting = 1;
+    sched_dispatch(sched);
+    while (!flow->granted) {
+        // Time out now and then so that slots leaked by a crashed child are noticed
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += 1;
+        if (pthread_cond_timedwait(&sched->changed, &sched->lock, &deadline) == EOWNERDEAD) {
+            pthread_mutex_consistent(&sched->lock);
+        }
+        if (!flow->granted && sched->free_slots == 0) {
+            for (int i = 0; i < SCHED_MAX_FLOWS; i++) {
+                struct sched_flow *other = &sched->flows[i];
+                if (other->in_use && other->owner != getpid() && kill(other->owner, 0) != 0 && errno == ESRCH) {
+                    sched_drop_flow(sched, other);
+                }
+            }
+            sched_dispatch(sched);
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+static inline void sched_release(struct transfer_sched *sched, struct sched_flow *flow, size_t sent) {
+    if (!sched || !flow) return;
+    sched_lock(sched);
+    flow->granted = 0;
+    flow->sent += sent;
+    sched->free_slots++;
+    sched_dispatch(sched);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+#endif
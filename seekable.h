@@ -0,0 +1,359 @@
+#ifndef SEEKABLE_H
+#define SEEKABLE_H
+
+// Seekable compressed storage for the .c files in smain/ and the .txt files in stext/.
+//
+// Built with -DSEEKABLE_MIN_FILE_SIZE=N (0, the default, leaves it off), Smain and Stext compress
+// an uploaded file of at least N bytes before committing it. The file keeps its name; its
+// contents become a header, a frame index and the file cut into SEEKABLE_FRAME_SIZE pieces, each
+// compressed on its own as a raw deflate stream:
+//   header  magic[8] | u32 frame size | u32 frame count | u64 size | u32 CRC32C | u32 0
+//   index   u64 end offset of each frame within the stored file
+//   frames  one after another, from the end of the index on
+// Integers are big-endian, and size and CRC32C are those of the original contents. A file that
+// does not shrink by at least an eighth is kept as it was.
+//
+// Every reader recognises the magic, whether or not this server compresses, so a tree may hold
+// both kinds. A client that sends "accept-encoding=deflate-seekable" is sent the stored bytes as
+// they are, after an encoding frame (see frame.h), and decodes them itself; any other reader is
+// given the original contents, decoded a frame at a time. The index lets a read start at any
+// frame, so a range costs only the frames it touches.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "crc32c.h"
+#include "frame.h"
+
+#ifndef SEEKABLE_MIN_FILE_SIZE
+#define SEEKABLE_MIN_FILE_SIZE 0              // Smallest file compressed, 0 = compression off
+#endif
+#define SEEKABLE_MAGIC "\x89SKZ\r\n\x1a\n"
+#define SEEKABLE_MAGIC_SIZE 8
+#define SEEKABLE_HEADER_SIZE 32
+#define SEEKABLE_FRAME_SIZE FRAME_MAX_PAYLOAD  // One decoded frame fills one wire frame
+#define SEEKABLE_LEVEL 6
+#define SEEKABLE_ENCODING "deflate-seekable"
+#define SEEKABLE_ACCEPT_ENCODING "accept-encoding="
+
+// How a sender treats a stored file that may be compressed
+enum seekable_mode {
+    SEEKABLE_RAW,           // Send the stored bytes without looking (archives, packed files)
+    SEEKABLE_DECODE,        // Send the original contents
+    SEEKABLE_PASS_THROUGH,  // Send a compressed file as stored; the receiver decodes it
+};
+
+struct seekable_info {
+    uint64_t size;          // Of the original contents
+    uint32_t crc;           // CRC32C of the original contents
+    uint32_t frame_size;
+    uint32_t frame_count;
+    uint64_t *ends;         // End offset of each frame in the stored file
+    off_t data_start;       // Where the first frame starts
+};
+
+static inline uint64_t seekable_get_u64(const unsigned char *p) {
+    return ((uint64_t)frame_get_u32(p) << 32) | frame_get_u32(p + 4);
+}
+
+static inline void seekable_put_u64(unsigned char *p, uint64_t v) {
+    frame_put_u32(p, (uint32_t)(v >> 32));
+    frame_put_u32(p + 4, (uint32_t)v);
+}
+
+// Whether a request argument accepts the stored encoding
+static inline int seekable_accepts(const char *argument) {
+    return strcmp(argument, SEEKABLE_ACCEPT_ENCODING SEEKABLE_ENCODING) == 0;
+}
+
+// Check a header against the stored file's size and, if it describes a seekable file, fill in
+// everything but the index. Returns 1 if it does, 0 if the file is stored as it is.
+static inline int seekable_parse_header(const unsigned char *header, uint64_t stored_size, struct seekable_info *info) {
+    if (stored_size < SEEKABLE_HEADER_SIZE || memcmp(header, SEEKABLE_MAGIC, SEEKABLE_MAGIC_SIZE) != 0) return 0;
+    info->frame_size = frame_get_u32(header + 8);
+    info->frame_count = frame_get_u32(header + 12);
+    info->size = seekable_get_u64(header + 16);
+    info->crc = frame_get_u32(header + 24);
+    info->ends = NULL;
+    if (info->frame_size == 0 || info->frame_size > SEEKABLE_FRAME_SIZE) return 0;
+    if (info->frame_count != (info->size + info->frame_size - 1) / info->frame_size) return 0;
+    info->data_start = SEEKABLE_HEADER_SIZE + (off_t)info->frame_count * 8;
+    return (uint64_t)info->data_start <= stored_size;
+}
+
+// Check the index: frames follow each other, none is larger than deflate could make it, and the
+// last one ends the file
+static inline int seekable_check_index(const struct seekable_info *info, uint64_t stored_size) {
+    uint64_t start = info->data_start;
+    for (uint32_t i = 0; i < info->frame_count; i++) {
+        if (info->ends[i] <= start || info->ends[i] - start > compressBound(info->frame_size)) return 0;
+        start = info->ends[i];
+    }
+    return start == stored_size;
+}
+
+// Read the header and index of a stored file of stored_size bytes. Returns 1 if it is a seekable
+// compressed file (release info with seekable_release()), 0 if it is stored as it is.
+static inline int seekable_probe(int fd, uint64_t stored_size, struct seekable_info *info) {
+    unsigned char header[SEEKABLE_HEADER_SIZE];
+    if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        !seekable_parse_header(header, stored_size, info)) {
+        return 0;
+    }
+    size_t index_size = (size_t)info->frame_count * 8;
+    unsigned char *index = malloc(index_size ? index_size : 1);
+    info->ends = malloc((info->frame_count ? info->frame_count : 1) * sizeof(uint64_t));
+    int valid = index && info->ends && pread(fd, index, index_size, SEEKABLE_HEADER_SIZE) == (ssize_t)index_size;
+    for (uint32_t i = 0; valid && i < info->frame_count; i++) info->ends[i] = seekable_get_u64(index + 8 * (size_t)i);
+    free(index);
+    if (!valid || !seekable_check_index(info, stored_size)) {
+        free(info->ends);
+        info->ends = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static inline void seekable_release(struct seekable_info *info) {
+    free(info->ends);
+    info->ends = NULL;
+}
+
+static inline off_t seekable_frame_start(const struct seekable_info *info, uint32_t index) {
+    return index == 0 ? info->data_start : (off_t)info->ends[index - 1];
+}
+
+static inline uint32_t seekable_frame_length(const struct seekable_info *info, uint32_t index) {
+    uint64_t left = info->size - (uint64_t)index * info->frame_size;
+    return left < info->frame_size ? (uint32_t)left : info->frame_size;
+}
+
+// Inflate one compressed frame into out, which must take exactly length bytes
+static inline int seekable_inflate(const unsigned char *in, size_t in_len, unsigned char *out, uint32_t length) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK) return -1;
+    z.next_in = (unsigned char *)in;
+    z.avail_in = in_len;
+    z.next_out = out;
+    z.avail_out = length;
+    int result = inflate(&z, Z_FINISH);
+    int complete = result == Z_STREAM_END && z.avail_out == 0 && z.avail_in == 0;
+    inflateEnd(&z);
+    return complete ? 0 : -1;
+}
+
+// Decode frame index of a stored file into out (info->frame_size bytes), reading the compressed
+// frame into scratch (compressBound(info->frame_size) bytes). Returns its length, or -1.
+static inline ssize_t seekable_read_frame(int fd, const struct seekable_info *info, uint32_t index,
+                                          unsigned char *out, unsigned char *scratch) {
+    off_t start = seekable_frame_start(info, index);
+    size_t stored = info->ends[index] - start;
+    size_t done = 0;
+    while (done < stored) {
+        ssize_t n = pread(fd, scratch + done, stored - done, start + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    uint32_t length = seekable_frame_length(info, index);
+    return seekable_inflate(scratch, stored, out, length) == 0 ? (ssize_t)length : -1;
+}
+
+// Copy len bytes of the original contents, starting at offset, into buf. Only the frames the
+// range touches are read. Returns 0, or -1 if the range is not all there or a frame is damaged.
+static inline int seekable_pread(int fd, const struct seekable_info *info, void *buf, size_t len, uint64_t offset) {
+    if (offset > info->size || len > info->size - offset) return -1;
+    unsigned char *frame = malloc(info->frame_size);
+    unsigned char *scratch = malloc(compressBound(info->frame_size));
+    int failed = !frame || !scratch;
+    unsigned char *p = buf;
+    while (!failed && len > 0) {
+        uint32_t index = offset / info->frame_size;
+        size_t skip = offset - (uint64_t)index * info->frame_size;
+        ssize_t length = seekable_read_frame(fd, info, index, frame, scratch);
+        if (length < 0) {
+            failed = 1;
+            break;
+        }
+        size_t take = (size_t)length - skip < len ? (size_t)length - skip : len;
+        memcpy(p, frame + skip, take);
+        p += take;
+        offset += take;
+        len -= take;
+    }
+    free(frame);
+    free(scratch);
+    return failed ? -1 : 0;
+}
+
+// Send size bytes of the original contents, from offset on, as frames. Returns -1 if the writer
+// failed, or if a frame could not be read (writer->failed is then still clear).
+static inline int seekable_write_range(struct frame_writer *writer, int fd, const struct seekable_info *info,
+                                       uint64_t offset, uint64_t size) {
+    if (offset > info->size || size > info->size - offset) return -1;
+    unsigned char *frame = malloc(info->frame_size);
+    unsigned char *scratch = malloc(compressBound(info->frame_size));
+    int failed = !frame || !scratch;
+    while (!failed && size > 0) {
+        uint32_t index = offset / info->frame_size;
+        size_t skip = offset - (uint64_t)index * info->frame_size;
+        ssize_t length = seekable_read_frame(fd, info, index, frame, scratch);
+        if (length < 0) {
+            failed = 1;
+            break;
+        }
+        size_t take = (size_t)length - skip < size ? (size_t)length - skip : size;
+        if (frame_write(writer, frame + skip, take) < 0) failed = 1;
+        offset += take;
+        size -= take;
+    }
+    free(frame);
+    free(scratch);
+    return failed ? -1 : 0;
+}
+
+// Map a stored file's original contents for reading, whichever way it is stored. The mapping is
+// released with munmap(data, *size) either way: a plain file is mapped as it is, a compressed one
+// decoded into anonymous memory. Returns MAP_FAILED if it cannot be mapped or a frame is damaged.
+static inline void *seekable_map(int fd, size_t stored_size, size_t *size) {
+    unsigned char *stored = mmap(NULL, stored_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    struct seekable_info info = { 0 };
+    *size = stored_size;
+    if (stored == MAP_FAILED || !seekable_parse_header(stored, stored_size, &info)) return stored;
+
+    info.ends = malloc((info.frame_count ? info.frame_count : 1) * sizeof(uint64_t));
+    for (uint32_t i = 0; info.ends && i < info.frame_count; i++) {
+        info.ends[i] = seekable_get_u64(stored + SEEKABLE_HEADER_SIZE + 8 * (size_t)i);
+    }
+    unsigned char *data = MAP_FAILED;
+    if (info.ends && seekable_check_index(&info, stored_size) && info.size > 0) {
+        data = mmap(NULL, info.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    for (uint32_t i = 0; data != MAP_FAILED && i < info.frame_count; i++) {
+        off_t start = seekable_frame_start(&info, i);
+        if (seekable_inflate(stored + start, info.ends[i] - start, data + (size_t)i * info.frame_size,
+                             seekable_frame_length(&info, i)) < 0) {
+            munmap(data, info.size);
+            data = MAP_FAILED;
+        }
+    }
+    munmap(stored, stored_size);
+    seekable_release(&info);
+    *size = info.size;
+    return data;
+}
+
+// Decode a received compressed file into out_fd, checking the original contents' CRC32C. Returns
+// 0 with their size and CRC32C, or -1 if the file is not seekable or does not decode to a match.
+static inline int seekable_decode_fd(int in_fd, int out_fd, uint64_t *size, uint32_t *crc) {
+    struct stat st;
+    struct seekable_info info = { 0 };
+    if (fstat(in_fd, &st) != 0 || !seekable_probe(in_fd, st.st_size, &info)) return -1;
+    unsigned char *frame = malloc(info.frame_size);
+    unsigned char *scratch = malloc(compressBound(info.frame_size));
+    uint32_t sum = 0;
+    int failed = !frame || !scratch;
+    for (uint32_t i = 0; !failed && i < info.frame_count; i++) {
+        ssize_t length = seekable_read_frame(in_fd, &info, i, frame, scratch);
+        if (length < 0 || write(out_fd, frame, length) != length) {
+            failed = 1;
+            break;
+        }
+        sum = crc32c_update(sum, frame, length);
+    }
+    free(frame);
+    free(scratch);
+    failed = failed || sum != info.crc;
+    *size = info.size;
+    *crc = sum;
+    seekable_release(&info);
+    return failed ? -1 : 0;
+}
+
+// Compress the file name in dir_fd in place, if compression is on and the file is large enough
+// to be worth it. A file that already starts with the magic is always wrapped, even with
+// compression off, so that readers cannot mistake its contents for a compressed file. The
+// compressed copy is written next to it and renamed over it. Returns 1 if the file is now
+// compressed, 0 if it was left as it was.
+static inline int seekable_compress_at(int dir_fd, const char *name) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    unsigned char magic[SEEKABLE_MAGIC_SIZE];
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    int wrap = pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && memcmp(magic, SEEKABLE_MAGIC, sizeof(magic)) == 0;
+    if (!wrap && (SEEKABLE_MIN_FILE_SIZE <= 0 || st.st_size < SEEKABLE_MIN_FILE_SIZE)) {
+        close(fd);
+        return 0;
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    char temp_name[4096];
+    snprintf(temp_name, sizeof(temp_name), "%s.z", name);
+    uint32_t frame_count = (st.st_size + SEEKABLE_FRAME_SIZE - 1) / SEEKABLE_FRAME_SIZE;
+    size_t head_size = SEEKABLE_HEADER_SIZE + (size_t)frame_count * 8;
+    unsigned char *head = calloc(1, head_size);
+    unsigned char *out = malloc(compressBound(SEEKABLE_FRAME_SIZE));
+    int out_fd = head && out ? openat(dir_fd, temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    int failed = out_fd < 0 || deflateInit2(&z, SEEKABLE_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK;
+    uint32_t crc = 0;
+    off_t end = head_size;
+    for (uint32_t i = 0; !failed && i < frame_count; i++) {
+        size_t offset = (size_t)i * SEEKABLE_FRAME_SIZE;
+        size_t length = st.st_size - offset < SEEKABLE_FRAME_SIZE ? st.st_size - offset : SEEKABLE_FRAME_SIZE;
+        crc = crc32c_update(crc, data + offset, length);
+        deflateReset(&z);
+        z.next_in = data + offset;
+        z.avail_in = length;
+        z.next_out = out;
+        z.avail_out = compressBound(SEEKABLE_FRAME_SIZE);
+        size_t compressed = compressBound(SEEKABLE_FRAME_SIZE);
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+            failed = 1;
+            break;
+        }
+        compressed -= z.avail_out;
+        for (size_t written = 0; !failed && written < compressed;) {
+            ssize_t n = pwrite(out_fd, out + written, compressed - written, end + written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) failed = 1;
+            else written += n;
+        }
+        end += compressed;
+        seekable_put_u64(head + SEEKABLE_HEADER_SIZE + 8 * (size_t)i, end);
+        // Give up as soon as it is clear the file will not shrink enough
+        if (!wrap && end > st.st_size - st.st_size / 8) failed = 1;
+    }
+    if (out_fd >= 0) deflateEnd(&z);
+    munmap(data, st.st_size);
+
+    memcpy(head, SEEKABLE_MAGIC, SEEKABLE_MAGIC_SIZE);
+    frame_put_u32(head + 8, SEEKABLE_FRAME_SIZE);
+    frame_put_u32(head + 12, frame_count);
+    seekable_put_u64(head + 16, st.st_size);
+    frame_put_u32(head + 24, crc);
+    if (!failed && pwrite(out_fd, head, head_size, 0) != (ssize_t)head_size) failed = 1;
+    if (out_fd >= 0 && close(out_fd) != 0) failed = 1;
+    free(head);
+    free(out);
+    if (!failed && renameat(dir_fd, temp_name, dir_fd, name) == 0) return 1;
+    if (out_fd >= 0) unlinkat(dir_fd, temp_name, 0);
+    return 0;
+}
+
+#endif
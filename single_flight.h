@@ -0,0 +1,373 @@
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+// Coalescing of identical concurrent requests (dfile, dtar and display) in Smain.
+//
+// A request for a key nobody else is fetching runs its handler directly on the client's socket,
+// as it would without coalescing (so sendfile() and kernel TLS still apply), and only leaves a
+// placeholder under its key. A second identical request that finds the placeholder starts a
+// flight: the usual handler runs once more, on a thread of its own, writing its reply into one
+// end of a socketpair exactly as it would write to a client. The reply is read into a ring of the last FLIGHT_BUFFER bytes, from which every connection that
+// asked for the same key sends at its own pace. Whichever of them has caught up reads the next
+// chunk in, so a flight moves as fast as its fastest client and nobody waits for the slower ones.
+// Further requests join the flight for as long as the ring still holds the first byte of the
+// reply; the ring, socketpair and thread are only paid for once there is someone to share with.
+//
+// A connection that falls more than FLIGHT_BUFFER behind has lost bytes it still needs. It falls
+// back to a stream of its own: the handler runs again for it alone, and the part of the reply it
+// has already sent is skipped once its CRC32C has been checked against what went out. A reply
+// that came out differently the second time (the tree changed in between) ends the connection
+// short, which the client reports as a failed transfer.
+//
+// Flights are only joined while nothing has changed since they started. Smain brackets every
+// request that can change a tree with flight_change_begin() and flight_change_end(); flights
+// started before or during a change are not joined, so a client never gets an older version of
+// a file than one it was told has been stored. Build with -DFLIGHT_BUFFER=0 to turn this off.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "crc32c.h"
+#include "frame.h"
+#include "sched.h"
+
+#ifndef FLIGHT_BUFFER
+#define FLIGHT_BUFFER (8 << 20)   // Bytes of a reply kept for the connections sharing it
+#endif
+#define FLIGHT_CHUNK 65536        // Bytes read from the producer or sent to a client at a time
+#define FLIGHT_KEY_MAX 1280
+
+// Runs the request (a copy of what was given to flight_serve()) with its reply going to sock
+typedef void (*flight_producer)(void *request, int sock);
+
+struct flight_table;
+
+struct flight {
+    struct flight *next;          // In the table while it can be joined
+    struct flight_table *table;   // Whose lock guards this flight
+    char key[FLIGHT_KEY_MAX];
+    flight_producer produce;
+    void *request;
+    int source;                   // Our end of the producer's socketpair, -1 for a placeholder
+    int sink;                     // The producer's end
+    char *ring;                   // NULL for the placeholder of a request running directly
+    uint64_t produced;            // Bytes of the reply read in so far
+    int listed;
+    int reading;                  // A connection is reading the next chunk in
+    int done, failed;             // The reply has ended, failed if it could not be read
+    int consumers;                // Connections sending the reply
+    int producing;                // The producer thread has not finished
+    pthread_cond_t moved;         // Broadcast when bytes arrive or the reply ends
+};
+
+struct flight_table {
+    pthread_mutex_t lock;
+    struct flight *head;
+    int changing;                      // Requests that may be changing a tree right now
+    unsigned long long direct;         // Requests run on their own socket, with no flight
+    unsigned long long started;        // Flights started for a request
+    unsigned long long joined;         // Requests served from another request's flight
+    unsigned long long fell_back;      // Connections that fell behind and made their own stream
+    unsigned long long diverged;       // Of those, streams that did not repeat what was sent
+};
+
+static inline void flight_table_init(struct flight_table *table) {
+    memset(table, 0, sizeof(*table));
+    pthread_mutex_init(&table->lock, NULL);
+}
+
+// Take a flight out of the table so that no more requests join it; called with the lock held
+static inline void flight_unlist(struct flight_table *table, struct flight *flight) {
+    if (!flight->listed) return;
+    for (struct flight **p = &table->head; *p; p = &(*p)->next) {
+        if (*p == flight) {
+            *p = flight->next;
+            break;
+        }
+    }
+    flight->listed = 0;
+}
+
+// Free a flight once neither a connection nor its producer uses it; called with the lock held
+static inline void flight_release(struct flight *flight) {
+    if (flight->consumers > 0 || flight->producing) return;
+    if (flight->source >= 0) close(flight->source);
+    pthread_cond_destroy(&flight->moved);
+    free(flight->ring);
+    free(flight->request);
+    free(flight);
+}
+
+// A change to a tree is about to start: no flight started so far may be joined again
+static inline void flight_change_begin(struct flight_table *table) {
+    pthread_mutex_lock(&table->lock);
+    while (table->head) flight_unlist(table, table->head);
+    table->changing++;
+    pthread_mutex_unlock(&table->lock);
+}
+
+static inline void flight_change_end(struct flight_table *table) {
+    pthread_mutex_lock(&table->lock);
+    table->changing--;
+    pthread_mutex_unlock(&table->lock);
+}
+
+static inline void *flight_producer_main(void *arg) {
+    struct flight *flight = arg;
+    flight->produce(flight->request, flight->sink);
+    close(flight->sink);
+    pthread_mutex_t *lock = &flight->table->lock;
+    pthread_mutex_lock(lock);
+    flight->producing = 0;
+    flight_release(flight);
+    pthread_mutex_unlock(lock);
+    return NULL;
+}
+
+// The listed flight or placeholder for key, the most recent first; called with the lock held
+static inline struct flight *flight_find(struct flight_table *table, const char *key) {
+    struct flight *flight = table->head;
+    while (flight && strcmp(flight->key, key) != 0) flight = flight->next;
+    return flight;
+}
+
+static inline void flight_list(struct flight_table *table, struct flight *flight, const char *key) {
+    snprintf(flight->key, sizeof(flight->key), "%s", key);
+    flight->next = table->head;
+    table->head = flight;
+    flight->listed = 1;
+}
+
+// List a placeholder for a request about to run directly on its client's socket, so that an
+// identical request arriving meanwhile knows to start a flight; called with the lock held
+static inline struct flight *flight_lead(struct flight_table *table, const char *key) {
+    struct flight *flight = calloc(1, sizeof(*flight));
+    if (!flight) return NULL;
+    flight->table = table;
+    flight->source = flight->sink = -1;
+    flight->consumers = 1;
+    pthread_cond_init(&flight->moved, NULL);
+    flight_list(table, flight, key);
+    return flight;
+}
+
+// Start a flight for request with one consumer, listing it under key unless key is NULL. Called
+// with the lock held; returns NULL if the socketpair or the producer thread cannot be set up.
+static inline struct flight *flight_start(struct flight_table *table, const char *key, flight_producer produce,
+                                          const void *request, size_t request_size) {
+    struct flight *flight = calloc(1, sizeof(*flight));
+    if (!flight) return NULL;
+    int pair[2];
+    flight->request = malloc(request_size);
+    flight->ring = malloc(FLIGHT_BUFFER);
+    if (!flight->request || !flight->ring || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        free(flight->request);
+        free(flight->ring);
+        free(flight);
+        return NULL;
+    }
+    memcpy(flight->request, request, request_size);
+    flight->table = table;
+    flight->source = pair[0];
+    flight->sink = pair[1];
+    flight->produce = produce;
+    flight->consumers = 1;
+    flight->producing = 1;
+    pthread_cond_init(&flight->moved, NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int created = pthread_create(&thread, &attr, flight_producer_main, flight) == 0;
+    pthread_attr_destroy(&attr);
+    if (!created) {
+        close(flight->sink);
+        flight->producing = flight->consumers = 0;
+        flight_release(flight);
+        return NULL;
+    }
+    if (key) flight_list(table, flight, key);
+    return flight;
+}
+
+// Whether a request for key would join a flight already under way
+static inline int flight_joinable(struct flight_table *table, const char *key) {
+    pthread_mutex_lock(&table->lock);
+    struct flight *flight = flight_find(table, key);
+    int joinable = flight && flight->ring;
+    pthread_mutex_unlock(&table->lock);
+    return joinable;
+}
+
+// Join the flight for key, start one if a request for key is running directly, or otherwise list
+// a placeholder for this request (*direct is set, and the caller runs it on its own socket).
+// NULL if none of these can be done.
+static inline struct flight *flight_join(struct flight_table *table, const char *key, flight_producer produce,
+                                         const void *request, size_t request_size, int *direct) {
+    *direct = 0;
+    pthread_mutex_lock(&table->lock);
+    struct flight *flight = table->changing ? NULL : flight_find(table, key);
+    if (flight && flight->ring) {
+        flight->consumers++;
+        table->joined++;
+    } else if (flight) {
+        flight = flight_start(table, key, produce, request, request_size);
+        if (flight) table->started++;
+    } else if (!table->changing) {
+        flight = flight_lead(table, key);
+        *direct = flight != NULL;
+        if (flight) table->direct++;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return flight;
+}
+
+// Stop sending a flight's reply. The last connection to leave stops the producer too, if it is
+// still running, by shutting the socketpair down under it.
+static inline void flight_leave(struct flight_table *table, struct flight *flight) {
+    pthread_mutex_lock(&table->lock);
+    if (--flight->consumers == 0) {
+        flight_unlist(table, flight);
+        if (!flight->done) shutdown(flight->source, SHUT_RDWR);
+    }
+    flight_release(flight);
+    pthread_mutex_unlock(&table->lock);
+}
+
+// Read the next chunk of the reply into the ring; called with the lock held, which is dropped
+// while reading
+static inline void flight_read_chunk(struct flight_table *table, struct flight *flight, char *chunk) {
+    flight->reading = 1;
+    pthread_mutex_unlock(&table->lock);
+    ssize_t n;
+    while ((n = read(flight->source, chunk, FLIGHT_CHUNK)) < 0 && errno == EINTR);
+    pthread_mutex_lock(&table->lock);
+    flight->reading = 0;
+    if (n > 0) {
+        size_t at = flight->produced % FLIGHT_BUFFER;
+        size_t first = (size_t)n < FLIGHT_BUFFER - at ? (size_t)n : FLIGHT_BUFFER - at;
+        memcpy(flight->ring + at, chunk, first);
+        memcpy(flight->ring, chunk + first, n - first);
+        flight->produced += n;
+        // The first byte is gone, so later requests must start a flight of their own
+        if (flight->produced > FLIGHT_BUFFER) flight_unlist(table, flight);
+    } else {
+        flight->done = 1;
+        flight->failed = n < 0;
+    }
+    pthread_cond_broadcast(&flight->moved);
+}
+
+// Send a flight's reply to sock from the start, except that the first skip bytes are only
+// checked against skip_crc. Returns 0 once the whole reply is sent, 1 if the connection fell
+// more than FLIGHT_BUFFER behind, with *sent and *crc covering what it did send, or -1 if the
+// reply or the connection failed.
+static inline int flight_relay(struct flight_table *table, struct flight *flight, int sock, uint64_t skip, uint32_t skip_crc,
+                               struct transfer_sched *sched, int sched_class, uint32_t client_addr,
+                               uint64_t *sent, uint32_t *crc) {
+    char *chunk = malloc(FLIGHT_CHUNK);
+    if (!chunk) return -1;
+    struct sched_flow *flow = sched_open(sched, sched_class, client_addr);
+    uint64_t pos = 0;
+    uint32_t sum = 0;
+    int result;
+    pthread_mutex_lock(&table->lock);
+    for (;;) {
+        if (pos < flight->produced) {
+            if (flight->produced - pos > FLIGHT_BUFFER) {
+                result = 1;
+                break;
+            }
+            size_t at = pos % FLIGHT_BUFFER;
+            size_t len = flight->produced - pos;
+            if (len > FLIGHT_CHUNK) len = FLIGHT_CHUNK;
+            if (len > FLIGHT_BUFFER - at) len = FLIGHT_BUFFER - at;
+            memcpy(chunk, flight->ring + at, len);
+            pthread_mutex_unlock(&table->lock);
+
+            // What this connection has already sent must come out the same again
+            size_t skipped = pos < skip ? (skip - pos < len ? skip - pos : len) : 0;
+            sum = crc32c_update(sum, chunk, skipped);
+            int diverged = skipped > 0 && pos + skipped == skip && sum != skip_crc;
+            int failed = diverged;
+            if (!failed && skipped < len) {
+                struct iovec iov = { chunk + skipped, len - skipped };
+                if (flow) frame_wait_writable(sock);
+                sched_acquire(sched, flow, iov.iov_len);
+                failed = frame_sendv(sock, &iov, 1) < 0;
+                sched_release(sched, flow, iov.iov_len);
+                sum = crc32c_update(sum, chunk + skipped, len - skipped);
+            }
+            pthread_mutex_lock(&table->lock);
+            if (diverged) table->diverged++;
+            if (failed) {
+                result = -1;
+                break;
+            }
+            pos += len;
+            continue;
+        }
+        if (flight->done) {
+            result = flight->failed || pos < skip ? -1 : 0;
+            break;
+        }
+        if (flight->reading) {
+            pthread_cond_wait(&flight->moved, &table->lock);
+        } else {
+            flight_read_chunk(table, flight, chunk);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+    sched_close(sched, flow);
+    free(chunk);
+    *sent = pos;
+    *crc = sum;
+    return result;
+}
+
+// Send the reply to a request: directly if no identical request is in progress, otherwise through
+// a flight for key, joining it or starting it. A connection that falls behind is given a stream of
+// its own. Returns -1 if nothing was sent because no flight could be set up (or coalescing is off,
+// or a tree is changing); the caller then runs the request itself.
+static inline int flight_serve(struct flight_table *table, const char *key, flight_producer produce, const void *request,
+                               size_t request_size, int sock, struct transfer_sched *sched, int sched_class, uint32_t client_addr) {
+    if (FLIGHT_BUFFER <= 0 || strlen(key) >= FLIGHT_KEY_MAX) return -1;
+    int direct;
+    struct flight *flight = flight_join(table, key, produce, request, request_size, &direct);
+    if (!flight) return -1;
+    if (direct) {
+        produce((void *)request, sock);
+        pthread_mutex_lock(&table->lock);
+        flight_unlist(table, flight);
+        flight->consumers = 0;
+        flight_release(flight);
+        pthread_mutex_unlock(&table->lock);
+        return 0;
+    }
+    uint64_t sent;
+    uint32_t crc;
+    int result = flight_relay(table, flight, sock, 0, 0, sched, sched_class, client_addr, &sent, &crc);
+    flight_leave(table, flight);
+    if (result != 1) return 0;
+
+    pthread_mutex_lock(&table->lock);
+    table->fell_back++;
+    flight = sent > 0 ? flight_start(table, NULL, produce, request, request_size) : NULL;
+    pthread_mutex_unlock(&table->lock);
+    if (sent == 0) {
+        // Nothing went out yet, so the request can simply be run for this connection
+        produce((void *)request, sock);
+    } else if (flight) {
+        flight_relay(table, flight, sock, sent, crc, sched, sched_class, client_addr, &sent, &crc);
+        flight_leave(table, flight);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,434 @@
+#ifndef TAR_STREAM_H
+#define TAR_STREAM_H
+
+// Tar archives built in process and sent straight into a framed transfer, with no temporary file.
+//
+// Members are POSIX ustar entries. A name too long for the ustar name and prefix fields is
+// preceded by a GNU long-name entry, which GNU tar and bsdtar both understand. Headers and small
+// members are gathered in a FRAME_MAX_PAYLOAD staging buffer and sent a frame at a time, so an
+// archive of many small files costs a few large sends. Members larger than TAR_INLINE_MAX go out
+// from their file with frame_write_file_range(), which uses sendfile().
+//
+// Several threads may add members to one stream once it has a lock (tar_stream_set_lock()): each
+// whole member is written under it, so members from different sources interleave but never
+// split. tar_stream_add_tree() opens the next TAR_READAHEAD files ahead of the one being sent and
+// asks the kernel to start reading them in. A compressed file (see seekable.h) is added with its
+// original contents, decoded as it is sent.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "frame.h"
+#include "seekable.h"
+
+#define TAR_BLOCK 512
+#define TAR_INLINE_MAX (16 * 1024)   // Larger members skip the staging buffer
+#define TAR_READAHEAD 8              // Files opened and read ahead of the member being sent
+#define TAR_READAHEAD_BYTES (1024 * 1024)  // Of each, beyond which the kernel's own readahead takes over
+#define TAR_NAME_MAX 4096
+#define TAR_MERGE_BUFFER (1024 * 1024)     // Members up to this size are gathered before being merged
+
+struct tar_stream {
+    struct frame_writer *writer;
+    char *buffer;           // FRAME_MAX_PAYLOAD bytes waiting to be framed
+    size_t len;
+    int failed;
+    unsigned long long members;
+    pthread_mutex_t *lock;  // Held for each whole member when several threads share the stream
+};
+
+static inline int tar_stream_init(struct tar_stream *stream, struct frame_writer *writer) {
+    stream->writer = writer;
+    stream->buffer = malloc(FRAME_MAX_PAYLOAD);
+    stream->len = 0;
+    stream->failed = stream->buffer == NULL;
+    stream->members = 0;
+    stream->lock = NULL;
+    return stream->failed ? -1 : 0;
+}
+
+static inline void tar_stream_set_lock(struct tar_stream *stream, pthread_mutex_t *lock) {
+    stream->lock = lock;
+}
+
+static inline void tar_stream_lock(struct tar_stream *stream) {
+    if (stream->lock) pthread_mutex_lock(stream->lock);
+}
+
+static inline void tar_stream_unlock(struct tar_stream *stream) {
+    if (stream->lock) pthread_mutex_unlock(stream->lock);
+}
+
+// Ask the kernel to start reading the first part of an upcoming member
+static inline void tar_readahead(int fd, off_t offset, off_t size) {
+    posix_fadvise(fd, offset, size < TAR_READAHEAD_BYTES ? size : TAR_READAHEAD_BYTES, POSIX_FADV_WILLNEED);
+}
+
+static inline int tar_stream_flush(struct tar_stream *stream) {
+    if (stream->len > 0 && !stream->failed && frame_write(stream->writer, stream->buffer, stream->len) < 0) {
+        stream->failed = 1;
+    }
+    stream->len = 0;
+    return stream->failed ? -1 : 0;
+}
+
+// Room for len more bytes in the staging buffer, flushing it first if need be
+static inline char *tar_stream_reserve(struct tar_stream *stream, size_t len) {
+    if (stream->failed) return NULL;
+    if (stream->len + len > FRAME_MAX_PAYLOAD && tar_stream_flush(stream) < 0) return NULL;
+    char *p = stream->buffer + stream->len;
+    stream->len += len;
+    return p;
+}
+
+static inline void tar_stream_write(struct tar_stream *stream, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0 && !stream->failed) {
+        size_t chunk = len < FRAME_MAX_PAYLOAD ? len : FRAME_MAX_PAYLOAD;
+        char *dest = tar_stream_reserve(stream, chunk);
+        if (!dest) return;
+        memcpy(dest, p, chunk);
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+// Zero fill to the end of the member's last block
+static inline void tar_stream_pad(struct tar_stream *stream, uint64_t size) {
+    size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    char *dest = padding ? tar_stream_reserve(stream, padding) : NULL;
+    if (dest) memset(dest, 0, padding);
+}
+
+// Value of a numeric header field, or -1 if it holds none. Besides octal digits this takes the
+// GNU base-256 form (high bit of the first byte set, big-endian binary after it) that tar uses
+// for values too large for the digits, such as the size of a member of 8 GiB or more.
+static inline int64_t tar_octal_value(const char *field, size_t width) {
+    int64_t value = 0;
+    int digits = 0;
+    if ((unsigned char)field[0] == 0x80) {
+        for (size_t i = 1; i < width; i++) {
+            if (value >> 55) return -1;
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+    const char *p = field, *end = field + width;
+    while (p < end && *p == ' ') p++;
+    for (; p < end && *p != '\0' && *p != ' '; p++, digits++) {
+        if (*p < '0' || *p > '7') return -1;
+        value = value * 8 + (*p - '0');
+    }
+    return digits ? value : -1;
+}
+
+// Data size recorded in a member header, or -1 if the field is not octal
+static inline int64_t tar_header_size(const char *block) {
+    return tar_octal_value(block + 124, 12);
+}
+
+// Whether a header block's checksum matches; the all-zero end-of-archive block does not
+static inline int tar_header_valid(const char *block) {
+    int64_t recorded = tar_octal_value(block + 148, 8);
+    unsigned checksum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) checksum += (i >= 148 && i < 156) ? ' ' : (unsigned char)block[i];
+    return recorded >= 0 && (unsigned)recorded == checksum;
+}
+
+// The member name from a header: the ustar prefix and name fields joined
+static inline void tar_header_name(const char *block, char *name, size_t size) {
+    if (memcmp(block + 257, "ustar", 5) == 0 && block[345] != '\0') {
+        snprintf(name, size, "%.155s/%.100s", block + 345, block);
+    } else {
+        snprintf(name, size, "%.100s", block);
+    }
+}
+
+// The "path" record of pax extended header data (NUL-terminated), if it has one. Returns 1 if
+// found.
+static inline int tar_pax_path(const char *data, size_t len, char *path, size_t size) {
+    const char *p = data, *end = data + len;
+    while (p < end) {
+        char *after;
+        unsigned long record_len = strtoul(p, &after, 10);
+        if (record_len == 0 || record_len > (size_t)(end - p) || *after != ' ') return 0;
+        const char *key = after + 1, *record_end = p + record_len;
+        if (record_end - key > 5 && memcmp(key, "path=", 5) == 0) {
+            snprintf(path, size, "%.*s", (int)(record_end - key - 6), key + 5);
+            return 1;
+        }
+        p = record_end;
+    }
+    return 0;
+}
+
+// Write a numeric header field: width - 1 octal digits and a NUL, or GNU base-256 when the value
+// has more bits than the digits hold (a size field's 11 digits end at 8 GiB)
+static inline void tar_octal(char *field, size_t width, uint64_t value) {
+    if (3 * (width - 1) < 64 && value >> (3 * (width - 1)) != 0) {
+        memset(field, 0, width);
+        field[0] = (char)0x80;
+        for (size_t i = width - 1; i > 0 && value; i--, value >>= 8) field[i] = (char)(value & 0xff);
+        return;
+    }
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; i--, value >>= 3) field[i - 1] = (char)('0' + (value & 7));
+}
+
+// Where to split a name longer than 100 bytes into the ustar prefix (155) and name (100)
+// fields, or NULL if it cannot be
+static inline const char *tar_name_split(const char *name, size_t len) {
+    for (const char *slash = strchr(name, '/'); slash; slash = strchr(slash + 1, '/')) {
+        if (slash - name <= 155 && len - (slash - name) - 1 <= 100) return slash;
+    }
+    return NULL;
+}
+
+static inline void tar_header(char *block, const char *name, uint64_t size, int64_t mtime, char type) {
+    memset(block, 0, TAR_BLOCK);
+    size_t len = strlen(name);
+    const char *split = len > 100 ? tar_name_split(name, len) : NULL;
+    if (split) {
+        memcpy(block + 345, name, split - name);
+        memcpy(block, split + 1, len - (split - name) - 1);
+    } else {
+        memcpy(block, name, len < 100 ? len : 100);
+    }
+    tar_octal(block + 100, 8, type == '5' ? 0755 : 0644);
+    tar_octal(block + 108, 8, 0);
+    tar_octal(block + 116, 8, 0);
+    tar_octal(block + 124, 12, size);
+    tar_octal(block + 136, 12, mtime > 0 ? (uint64_t)mtime : 0);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+
+    memset(block + 148, ' ', 8);
+    unsigned checksum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) checksum += (unsigned char)block[i];
+    snprintf(block + 148, 8, "%06o", checksum);
+}
+
+// Start a member of the given size; its data must follow, then tar_stream_pad()
+static inline void tar_stream_member(struct tar_stream *stream, const char *name, uint64_t size, int64_t mtime) {
+    size_t len = strlen(name);
+    if (len > 100 && !tar_name_split(name, len)) {
+        char *block = tar_stream_reserve(stream, TAR_BLOCK);
+        if (!block) return;
+        tar_header(block, "././@LongLink", len + 1, 0, 'L');
+        tar_stream_write(stream, name, len + 1);
+        tar_stream_pad(stream, len + 1);
+    }
+    char *block = tar_stream_reserve(stream, TAR_BLOCK);
+    if (!block) return;
+    tar_header(block, name, size, mtime, '0');
+    stream->members++;
+}
+
+// Add size bytes of fd, starting at offset, as the member name
+static inline int tar_stream_add_file(struct tar_stream *stream, const char *name, int fd, off_t offset, off_t size, int64_t mtime) {
+    tar_stream_lock(stream);
+    if (stream->failed) {
+        tar_stream_unlock(stream);
+        return -1;
+    }
+    tar_stream_member(stream, name, size, mtime);
+    if (size <= TAR_INLINE_MAX) {
+        char *dest = tar_stream_reserve(stream, size);
+        off_t done = 0;
+        while (dest && done < size) {
+            ssize_t n = pread(fd, dest + done, size - done, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        // A file that shrank under us is padded out to the size already announced
+        if (dest && done < size) memset(dest + done, 0, size - done);
+    } else if (tar_stream_flush(stream) == 0 && frame_write_file_range(stream->writer, fd, offset, size) < 0) {
+        stream->failed = 1;
+    }
+    tar_stream_pad(stream, size);
+    int failed = stream->failed;
+    tar_stream_unlock(stream);
+    return failed ? -1 : 0;
+}
+
+// Add the original contents of a compressed file as the member name. A small one is decoded
+// straight into the staging buffer, a larger one sent a frame at a time.
+static inline int tar_stream_add_seekable(struct tar_stream *stream, const char *name, int fd,
+                                          const struct seekable_info *info, int64_t mtime) {
+    tar_stream_lock(stream);
+    if (stream->failed) {
+        tar_stream_unlock(stream);
+        return -1;
+    }
+    tar_stream_member(stream, name, info->size, mtime);
+    if (info->size <= TAR_INLINE_MAX) {
+        char *dest = tar_stream_reserve(stream, info->size);
+        // A damaged file is padded out to the size already announced
+        if (dest && seekable_pread(fd, info, dest, info->size, 0) < 0) memset(dest, 0, info->size);
+    } else if (tar_stream_flush(stream) == 0 && seekable_write_range(stream->writer, fd, info, 0, info->size) < 0) {
+        stream->failed = 1;
+    }
+    tar_stream_pad(stream, info->size);
+    int failed = stream->failed;
+    tar_stream_unlock(stream);
+    return failed ? -1 : 0;
+}
+
+// Add the files at paths, relative to root_fd, as members named "<label>/<path>". While one is
+// sent, the next TAR_READAHEAD are already open and being read in.
+static inline int tar_stream_add_tree(struct tar_stream *stream, int root_fd, char *const *paths, size_t count, const char *label) {
+    int ahead[TAR_READAHEAD];
+    size_t opened = 0, i;
+    char name[TAR_NAME_MAX];
+    for (i = 0; i < count && !stream->failed; i++) {
+        for (; opened < count && opened < i + TAR_READAHEAD; opened++) {
+            int fd = openat(root_fd, paths[opened], O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd >= 0 && fstat(fd, &st) == 0) tar_readahead(fd, 0, st.st_size);
+            ahead[opened % TAR_READAHEAD] = fd;
+        }
+
+        int fd = ahead[i % TAR_READAHEAD];
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            snprintf(name, sizeof(name), "%s/%s", label, paths[i]);
+            struct seekable_info info = { 0 };
+            if (seekable_probe(fd, st.st_size, &info)) {
+                tar_stream_add_seekable(stream, name, fd, &info, st.st_mtime);
+                seekable_release(&info);
+            } else {
+                tar_stream_add_file(stream, name, fd, 0, st.st_size, st.st_mtime);
+            }
+        }
+        if (fd >= 0) close(fd);
+    }
+    for (; i < opened; i++) {
+        if (ahead[i % TAR_READAHEAD] >= 0) close(ahead[i % TAR_READAHEAD]);
+    }
+    return stream->failed ? -1 : 0;
+}
+
+// Send whatever is still staged without ending the archive, for a stream of members that is
+// merged into another archive
+static inline int tar_stream_close(struct tar_stream *stream) {
+    tar_stream_flush(stream);
+    free(stream->buffer);
+    stream->buffer = NULL;
+    return stream->failed ? -1 : 0;
+}
+
+// Splits a member stream from another server (see tar_stream_close()) back into whole members and
+// adds each to a shared stream. A member is gathered until it is complete, so a slow source does
+// not hold the stream while the rest of it arrives; one larger than TAR_MERGE_BUFFER is sent on
+// as it arrives, holding the stream's lock until it ends.
+struct tar_member_reader {
+    struct tar_stream *stream;
+    char header[TAR_BLOCK];
+    size_t header_len;      // Bytes of the current header block received
+    uint64_t data_left;     // Bytes of the current header's data and padding still to come
+    int continued;          // The current header names the next one (GNU 'L'/'K', pax 'x')
+    char *member;           // The current member as gathered so far
+    size_t member_len;
+    int locked;             // Sending a large member straight through
+    unsigned long long members;
+};
+
+static inline int tar_member_reader_init(struct tar_member_reader *reader, struct tar_stream *stream) {
+    memset(reader, 0, sizeof(*reader));
+    reader->stream = stream;
+    reader->member = malloc(TAR_MERGE_BUFFER);
+    return reader->member ? 0 : -1;
+}
+
+// Add member bytes, switching to sending them straight through once the buffer is full
+static inline int tar_member_append(struct tar_member_reader *reader, const char *data, size_t len) {
+    struct tar_stream *stream = reader->stream;
+    if (!reader->locked && reader->member_len + len > TAR_MERGE_BUFFER) {
+        tar_stream_lock(stream);
+        reader->locked = 1;
+        tar_stream_write(stream, reader->member, reader->member_len);
+        reader->member_len = 0;
+    }
+    if (reader->locked) {
+        tar_stream_write(stream, data, len);
+        return stream->failed ? -1 : 0;
+    }
+    memcpy(reader->member + reader->member_len, data, len);
+    reader->member_len += len;
+    return 0;
+}
+
+// The current member is complete: add it to the stream in one piece
+static inline int tar_member_commit(struct tar_member_reader *reader) {
+    struct tar_stream *stream = reader->stream;
+    if (!reader->locked) tar_stream_lock(stream);
+    if (!reader->locked) tar_stream_write(stream, reader->member, reader->member_len);
+    int failed = stream->failed;
+    if (!failed) stream->members++;
+    tar_stream_unlock(stream);
+    reader->locked = 0;
+    reader->member_len = 0;
+    reader->members++;
+    return failed ? -1 : 0;
+}
+
+// Feed the next bytes of the member stream. Returns -1 if it is malformed or the shared stream
+// has failed.
+static inline int tar_member_reader_feed(struct tar_member_reader *reader, const char *data, size_t len) {
+    while (len > 0) {
+        if (reader->data_left > 0) {
+            size_t take = len < reader->data_left ? len : reader->data_left;
+            if (tar_member_append(reader, data, take) < 0) return -1;
+            data += take;
+            len -= take;
+            reader->data_left -= take;
+            if (reader->data_left == 0 && !reader->continued && tar_member_commit(reader) < 0) return -1;
+            continue;
+        }
+
+        size_t take = TAR_BLOCK - reader->header_len;
+        if (take > len) take = len;
+        memcpy(reader->header + reader->header_len, data, take);
+        reader->header_len += take;
+        data += take;
+        len -= take;
+        if (reader->header_len < TAR_BLOCK) break;
+        reader->header_len = 0;
+
+        int64_t size = tar_header_size(reader->header);
+        if (size < 0) return -1;
+        char type = reader->header[156];
+        reader->continued = type == 'L' || type == 'K' || type == 'x';
+        reader->data_left = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        if (tar_member_append(reader, reader->header, TAR_BLOCK) < 0) return -1;
+        if (reader->data_left == 0 && !reader->continued && tar_member_commit(reader) < 0) return -1;
+    }
+    return 0;
+}
+
+// Finish reading a member stream. Returns -1 if it stopped part way through a member; the
+// shared stream has then been marked failed, since part of that member may already be in it.
+static inline int tar_member_reader_end(struct tar_member_reader *reader) {
+    int partial = reader->header_len > 0 || reader->data_left > 0 || reader->member_len > 0 || reader->locked;
+    if (reader->locked) {
+        reader->stream->failed = 1;
+        tar_stream_unlock(reader->stream);
+        reader->locked = 0;
+    }
+    free(reader->member);
+    reader->member = NULL;
+    return partial ? -1 : 0;
+}
+
+// Write the end-of-archive blocks and send whatever is still staged
+static inline int tar_stream_finish(struct tar_stream *stream) {
+    char *end = tar_stream_reserve(stream, 2 * TAR_BLOCK);
+    if (end) memset(end, 0, 2 * TAR_BLOCK);
+    return tar_stream_close(stream);
+}
+
+#endif
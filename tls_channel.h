@@ -0,0 +1,482 @@
+#ifndef TLS_CHANNEL_H
+#define TLS_CHANNEL_H
+
+// TLS 1.3 for the TCP connections between client24s, Smain and the sub-servers.
+//
+// The handshake is done in user space with OpenSSL. Once it is done, record encryption is handed
+// to the kernel (kTLS, through OpenSSL's SSL_OP_ENABLE_KTLS) and the OpenSSL state is freed: the
+// connection is an ordinary socket again, and send(), recv(), sendfile() and splice() all work on
+// it with the kernel encrypting in place, so the zero-copy paths stay zero-copy. Unix-domain
+// connections between co-located servers are only reachable by their owner and stay plaintext.
+//
+// Whether the kernel offers kTLS at all is checked once, in tls_channel_init(), by attaching the
+// "tls" upper-layer protocol to a loopback connection. Where it cannot be attached (no tls module)
+// offload is never attempted, and the program can say so when it starts (tls_channel_user_space_only()).
+// If the kernel cannot take a connection over (no tls module, a cipher it does not offer, or
+// records OpenSSL has already buffered), the caller gets one end of a socket pair instead, and
+// a pump thread moves bytes between it and the TLS connection with SSL_read()/SSL_write(). That
+// costs a copy and a thread, but callers cannot tell the difference.
+//
+// Neither side sends close_notify: a connection ends with a TCP FIN, as a kTLS socket closed by
+// its owner does. A truncated body is still caught by the frame trailer (see frame.h).
+//
+// Servers present TLS_CERT_FILE with TLS_KEY_FILE; clients verify the server against
+// TLS_CA_FILE and the address they connected to. A self-signed certificate for 127.0.0.1 is
+// enough for loopback testing (see README.md). Build with -DTLS_ENABLED=1 -lssl -lcrypto; with
+// TLS_ENABLED 0, the default, every function leaves the socket as it is.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifndef TLS_ENABLED
+#define TLS_ENABLED 0
+#endif
+
+#ifndef TLS_CERT_FILE
+#define TLS_CERT_FILE "server.crt"
+#endif
+
+#ifndef TLS_KEY_FILE
+#define TLS_KEY_FILE "server.key"
+#endif
+
+#ifndef TLS_CA_FILE
+#define TLS_CA_FILE "server.crt"       // Self-signed: the certificate is its own authority
+#endif
+
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+#define TLS_PUMP_BUFFER 65536
+
+// Which ends of connections a program takes, for tls_channel_init()
+#define TLS_ROLE_SERVER 1
+#define TLS_ROLE_CLIENT 2
+
+#if TLS_ENABLED
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31                     // Not in every libc's netinet/tcp.h
+#endif
+
+// A connection the kernel did not take over, served by a pump thread
+struct tls_pump {
+    struct tls_pump *next;
+    SSL *ssl;
+    int net_fd;                // The TCP connection
+    int app_fd;                // The caller's end of the socket pair
+    ino_t app_ino;             // Tells the caller's end from a later descriptor with its number
+    int pump_fd;               // The pump's end
+    int closing;               // The caller closed its end and wants nothing more
+    int waiting;               // tls_channel_close() is waiting and frees the pump
+    int finished;
+    unsigned char to_app[TLS_PUMP_BUFFER];   // Decrypted, not yet taken by the caller
+    unsigned char to_net[TLS_PUMP_BUFFER];   // From the caller, not yet encrypted and sent
+};
+
+static struct {
+    SSL_CTX *server;
+    SSL_CTX *client;
+    int no_offload;            // Keep every connection in user space (for comparisons)
+    int no_kernel_tls;         // The kernel cannot take records over, so offload is not tried
+    int probed;
+    pthread_mutex_t lock;      // Guards pumps
+    pthread_cond_t finished;
+    struct tls_pump *pumps;
+    unsigned long long kernel_connections;
+    unsigned long long user_connections;
+} tls_channel = { .lock = PTHREAD_MUTEX_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER };
+
+static __thread char tls_channel_error[256];
+
+// Why the last call on this thread failed
+static inline const char *tls_channel_last_error(void) {
+    return tls_channel_error[0] ? tls_channel_error : "unknown error";
+}
+
+static inline void tls_channel_fail(const char *what) {
+    unsigned long code = ERR_get_error();
+    if (code) {
+        char reason[200];
+        ERR_error_string_n(code, reason, sizeof(reason));
+        snprintf(tls_channel_error, sizeof(tls_channel_error), "%s: %s", what, reason);
+    } else {
+        snprintf(tls_channel_error, sizeof(tls_channel_error), "%s%s%s", what, errno ? ": " : "", errno ? strerror(errno) : "");
+    }
+    ERR_clear_error();
+}
+
+static inline SSL_CTX *tls_channel_context(int server) {
+    SSL_CTX *ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    if (!ctx) return NULL;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (server) {
+        // Session tickets would arrive after the handshake, as records a kTLS socket cannot read
+        SSL_CTX_set_num_tickets(ctx, 0);
+        if (SSL_CTX_use_certificate_chain_file(ctx, TLS_CERT_FILE) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, TLS_KEY_FILE, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+    } else {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+        if (SSL_CTX_load_verify_locations(ctx, TLS_CA_FILE, NULL) != 1) {
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+// Whether the "tls" upper-layer protocol can be attached to a TCP connection, which is what
+// OpenSSL's offload needs. Tried on a connection to a loopback listener that is never accepted.
+static inline int tls_channel_probe_kernel(void) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(address);
+    int available = listener >= 0 && sock >= 0 && bind(listener, (struct sockaddr *)&address, len) == 0 &&
+                    listen(listener, 1) == 0 && getsockname(listener, (struct sockaddr *)&address, &len) == 0 &&
+                    connect(sock, (struct sockaddr *)&address, len) == 0 &&
+                    setsockopt(sock, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    if (sock >= 0) close(sock);
+    if (listener >= 0) close(listener);
+    return available;
+}
+
+// Load the certificate, key or authority the roles need; call before accepting or forking.
+// Returns -1 if they cannot be loaded.
+static inline int tls_channel_init(int roles) {
+    if (!tls_channel.probed) {
+        tls_channel.no_kernel_tls = !tls_channel_probe_kernel();
+        tls_channel.probed = 1;
+    }
+    errno = 0;
+    if ((roles & TLS_ROLE_SERVER) && !tls_channel.server && !(tls_channel.server = tls_channel_context(1))) {
+        tls_channel_fail("cannot load " TLS_CERT_FILE " and " TLS_KEY_FILE);
+        return -1;
+    }
+    if ((roles & TLS_ROLE_CLIENT) && !tls_channel.client && !(tls_channel.client = tls_channel_context(0))) {
+        tls_channel_fail("cannot load " TLS_CA_FILE);
+        return -1;
+    }
+    return 0;
+}
+
+// Keep (1) or stop keeping (0) new connections in user space even where the kernel could
+// take them over
+static inline void tls_channel_set_user_space(int user_space) {
+    tls_channel.no_offload = user_space;
+}
+
+// Whether the kernel was found unable to encrypt records, so every connection is pumped
+static inline int tls_channel_user_space_only(void) {
+    return tls_channel.no_kernel_tls;
+}
+
+// Connections so far whose records the kernel handles, and those pumped in user space
+static inline void tls_channel_counts(unsigned long long *kernel, unsigned long long *user) {
+    pthread_mutex_lock(&tls_channel.lock);
+    *kernel = tls_channel.kernel_connections;
+    *user = tls_channel.user_connections;
+    pthread_mutex_unlock(&tls_channel.lock);
+}
+
+// A peer that hangs up must not raise SIGPIPE through OpenSSL's writes: SIGPIPE stays blocked
+// on the thread while it talks TLS, and one raised meanwhile is discarded
+static inline void tls_channel_block_sigpipe(sigset_t *saved) {
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, saved);
+}
+
+static inline void tls_channel_restore_sigpipe(const sigset_t *saved) {
+    sigset_t pipe_set, pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigpending(&pending);
+    if (sigismember(&pending, SIGPIPE) && !sigismember(saved, SIGPIPE)) {
+        struct timespec none = { 0, 0 };
+        sigtimedwait(&pipe_set, NULL, &none);
+    }
+    pthread_sigmask(SIG_SETMASK, saved, NULL);
+}
+
+static inline void tls_channel_set_timeout(int sock, int ms) {
+    struct timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static inline void tls_pump_finish(struct tls_pump *pump) {
+    SSL_free(pump->ssl);
+    close(pump->net_fd);
+    close(pump->pump_fd);
+    pthread_mutex_lock(&tls_channel.lock);
+    for (struct tls_pump **p = &tls_channel.pumps; *p; p = &(*p)->next) {
+        if (*p == pump) {
+            *p = pump->next;
+            break;
+        }
+    }
+    pump->finished = 1;
+    int waiting = pump->waiting;
+    pthread_cond_broadcast(&tls_channel.finished);
+    pthread_mutex_unlock(&tls_channel.lock);
+    if (!waiting) free(pump);
+}
+
+// Move bytes both ways between the caller's end of the socket pair and the TLS connection until
+// both directions have ended, or the caller has closed its end
+static inline void *tls_pump_main(void *arg) {
+    struct tls_pump *pump = arg;
+    sigset_t saved;
+    tls_channel_block_sigpipe(&saved);
+    fcntl(pump->net_fd, F_SETFL, fcntl(pump->net_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(pump->pump_fd, F_SETFL, fcntl(pump->pump_fd, F_GETFL) | O_NONBLOCK);
+
+    unsigned char *to_app = pump->to_app, *to_net = pump->to_net;
+    size_t to_app_len = 0, to_app_off = 0, to_net_len = 0, to_net_off = 0;
+    int net_done = 0, app_done = 0, app_shut = 0, net_shut = 0, failed = 0;
+    while (!failed) {
+        short net_events = 0, app_events = 0;
+        int progress = 1;
+        while (progress && !failed) {
+            progress = 0;
+            if (to_app_len == 0 && !net_done) {
+                int n = SSL_read(pump->ssl, to_app, TLS_PUMP_BUFFER);
+                if (n > 0) {
+                    to_app_len = n;
+                    to_app_off = 0;
+                    progress = 1;
+                } else {
+                    int error = SSL_get_error(pump->ssl, n);
+                    if (error == SSL_ERROR_WANT_READ) net_events |= POLLIN;
+                    else if (error == SSL_ERROR_WANT_WRITE) net_events |= POLLOUT;
+                    else net_done = progress = 1;
+                }
+            }
+            if (to_app_off < to_app_len) {
+                ssize_t n = send(pump->pump_fd, to_app + to_app_off, to_app_len - to_app_off, MSG_NOSIGNAL);
+                if (n > 0) {
+                    to_app_off += n;
+                    progress = 1;
+                    if (to_app_off == to_app_len) to_app_len = to_app_off = 0;
+                } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    app_events |= POLLOUT;
+                } else {
+                    failed = 1;    // The caller is gone
+                }
+            }
+            if (net_done && to_app_len == 0 && !app_shut) {
+                shutdown(pump->pump_fd, SHUT_WR);
+                app_shut = 1;
+            }
+
+            if (to_net_len == 0 && !app_done) {
+                ssize_t n = recv(pump->pump_fd, to_net, TLS_PUMP_BUFFER, 0);
+                if (n > 0) {
+                    to_net_len = n;
+                    to_net_off = 0;
+                    progress = 1;
+                } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    app_events |= POLLIN;
+                } else {
+                    app_done = progress = 1;
+                }
+            }
+            if (to_net_off < to_net_len) {
+                int n = SSL_write(pump->ssl, to_net + to_net_off, to_net_len - to_net_off);
+                if (n > 0) {
+                    to_net_off += n;
+                    progress = 1;
+                    if (to_net_off == to_net_len) to_net_len = to_net_off = 0;
+                } else {
+                    int error = SSL_get_error(pump->ssl, n);
+                    if (error == SSL_ERROR_WANT_WRITE) net_events |= POLLOUT;
+                    else if (error == SSL_ERROR_WANT_READ) net_events |= POLLIN;
+                    else failed = 1;
+                }
+            }
+            if (app_done && to_net_len == 0 && !net_shut) {
+                shutdown(pump->net_fd, SHUT_WR);
+                net_shut = 1;
+            }
+        }
+
+        pthread_mutex_lock(&tls_channel.lock);
+        int closing = pump->closing;
+        pthread_mutex_unlock(&tls_channel.lock);
+        if (failed || (app_shut && net_shut) || (closing && net_shut)) break;
+
+        struct pollfd fds[2] = { { pump->net_fd, net_events, 0 }, { pump->pump_fd, app_events, 0 } };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+    }
+
+    tls_channel_restore_sigpipe(&saved);
+    tls_pump_finish(pump);
+    return NULL;
+}
+
+// Hand a connection whose handshake is done to the kernel, or to a pump thread if the kernel
+// cannot take it. Returns the descriptor the caller is to use, or -1.
+static inline int tls_channel_finish(SSL *ssl, int sock) {
+    tls_channel_set_timeout(sock, 0);
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl)) {
+        // The kernel has the keys and sequence numbers; OpenSSL is not needed any more
+        SSL_free(ssl);
+        pthread_mutex_lock(&tls_channel.lock);
+        tls_channel.kernel_connections++;
+        pthread_mutex_unlock(&tls_channel.lock);
+        return sock;
+    }
+
+    struct tls_pump *pump = calloc(1, sizeof(*pump));
+    int pair[2];
+    if (!pump || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        tls_channel_fail("cannot set up a user-space TLS pump");
+        free(pump);
+        SSL_free(ssl);
+        close(sock);
+        return -1;
+    }
+    struct stat st;
+    fstat(pair[0], &st);
+    pump->ssl = ssl;
+    pump->net_fd = sock;
+    pump->app_fd = pair[0];
+    pump->app_ino = st.st_ino;
+    pump->pump_fd = pair[1];
+
+    pthread_mutex_lock(&tls_channel.lock);
+    pump->next = tls_channel.pumps;
+    tls_channel.pumps = pump;
+    tls_channel.user_connections++;
+    pthread_mutex_unlock(&tls_channel.lock);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int started = pthread_create(&thread, &attr, tls_pump_main, pump) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started) {
+        tls_channel_fail("cannot start a user-space TLS pump");
+        close(pair[0]);
+        tls_pump_finish(pump);
+        return -1;
+    }
+    return pair[0];
+}
+
+static inline int tls_channel_handshake(SSL_CTX *ctx, int sock, const char *host) {
+    errno = 0;
+    SSL *ssl = ctx ? SSL_new(ctx) : NULL;
+    if (!ssl) {
+        tls_channel_fail(ctx ? "cannot start a TLS session" : "TLS is not initialised");
+        close(sock);
+        return -1;
+    }
+    if (tls_channel.no_offload || tls_channel.no_kernel_tls) SSL_clear_options(ssl, SSL_OP_ENABLE_KTLS);
+    SSL_set_fd(ssl, sock);
+    if (host) {
+        struct in_addr address;
+        if (inet_pton(AF_INET, host, &address) == 1) X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+        else SSL_set1_host(ssl, host);
+    }
+
+    sigset_t saved;
+    tls_channel_block_sigpipe(&saved);
+    tls_channel_set_timeout(sock, TLS_HANDSHAKE_TIMEOUT_MS);
+    int result = host ? SSL_connect(ssl) : SSL_accept(ssl);
+    tls_channel_restore_sigpipe(&saved);
+    if (result != 1) {
+        tls_channel_fail("TLS handshake failed");
+        SSL_free(ssl);
+        close(sock);
+        return -1;
+    }
+    return tls_channel_finish(ssl, sock);
+}
+
+// Run the server side of the handshake on an accepted connection. Returns the descriptor to
+// use from now on, or -1 (with sock closed).
+static inline int tls_channel_accept(int sock) {
+    return tls_channel_handshake(tls_channel.server, sock, NULL);
+}
+
+// Run the client side of the handshake with the server at host. Returns the descriptor to use
+// from now on, or -1 (with sock closed).
+static inline int tls_channel_connect(int sock, const char *host) {
+    return tls_channel_handshake(tls_channel.client, sock, host);
+}
+
+// The pump serving a descriptor, or NULL; called with the lock held
+static inline struct tls_pump *tls_channel_pump(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+    for (struct tls_pump *pump = tls_channel.pumps; pump; pump = pump->next) {
+        if (pump->app_fd == fd && pump->app_ino == st.st_ino) return pump;
+    }
+    return NULL;
+}
+
+// The TCP connection behind a descriptor, for getpeername() and the like
+static inline int tls_channel_network_fd(int fd) {
+    pthread_mutex_lock(&tls_channel.lock);
+    struct tls_pump *pump = tls_channel_pump(fd);
+    int net_fd = pump ? pump->net_fd : fd;
+    pthread_mutex_unlock(&tls_channel.lock);
+    return net_fd;
+}
+
+// Close a connection, waiting until a pump has passed on everything written to it. A plain
+// close() works too, but a process about to exit must use this so nothing is lost.
+static inline void tls_channel_close(int fd) {
+    pthread_mutex_lock(&tls_channel.lock);
+    struct tls_pump *pump = tls_channel_pump(fd);
+    if (pump) {
+        pump->closing = 1;
+        pump->waiting = 1;
+    }
+    pthread_mutex_unlock(&tls_channel.lock);
+    close(fd);
+    if (!pump) return;
+
+    pthread_mutex_lock(&tls_channel.lock);
+    while (!pump->finished) pthread_cond_wait(&tls_channel.finished, &tls_channel.lock);
+    pthread_mutex_unlock(&tls_channel.lock);
+    free(pump);
+}
+
+#else
+
+static inline const char *tls_channel_last_error(void) { return "TLS is not built in"; }
+static inline int tls_channel_init(int roles) { (void)roles; return 0; }
+static inline void tls_channel_set_user_space(int user_space) { (void)user_space; }
+static inline int tls_channel_user_space_only(void) { return 0; }
+static inline void tls_channel_counts(unsigned long long *kernel, unsigned long long *user) { *kernel = *user = 0; }
+static inline int tls_channel_accept(int sock) { return sock; }
+static inline int tls_channel_connect(int sock, const char *host) { (void)host; return sock; }
+static inline int tls_channel_network_fd(int fd) { return fd; }
+static inline void tls_channel_close(int fd) { close(fd); }
+
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Request tracing across Smain and the sub-servers.
+//
+// Smain gives one request in TRACE_SAMPLE_EVERY a 64-bit trace id (build with
+// -DTRACE_SAMPLE_EVERY=N; 0, the default, turns tracing off) and appends " trace=<hex id>" to
+// every message it sends to Stext or Spdf on that request's behalf, so the sub-server traces the
+// same request. While a request is traced, each thread records spans (receive, parse, file system
+// lookups, connects, first and last byte from a sub-server, sends to the client) into its own
+// ring of TRACE_RING_SIZE entries; only the owning thread touches it, so recording takes no lock.
+// When the request is done the thread appends its spans to TRACE_FILE with a single write.
+//
+// TRACE_FILE is a Chrome trace / Perfetto JSON array of complete ("X") events tagged with the
+// trace id; the closing bracket is left off, which both viewers accept. Timestamps come from
+// CLOCK_MONOTONIC, so servers sharing a working directory on one host line up on one timeline.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#ifndef TRACE_SAMPLE_EVERY
+#define TRACE_SAMPLE_EVERY 0                // Trace one request in N, 0 = never
+#endif
+#define TRACE_RING_SIZE 64                  // Spans kept per thread and request; older ones are overwritten
+#define TRACE_FILE "trace.json"
+#define TRACE_TAG " trace="
+
+struct trace_span {
+    const char *name;       // Must be a string literal or otherwise outlive the request
+    uint64_t start_us;
+    uint64_t end_us;
+};
+
+struct trace_ring {
+    uint64_t id;            // Trace id of the current request, 0 when it is not traced
+    unsigned count;         // Spans recorded; the ring holds the last TRACE_RING_SIZE
+    struct trace_span spans[TRACE_RING_SIZE];
+    char tag[32];           // TRACE_TAG suffix for messages to sub-servers
+};
+
+static __thread struct trace_ring trace_ring;
+
+static inline uint64_t trace_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Decide whether a new request is traced; returns its trace id, or 0
+static inline uint64_t trace_sample(void) {
+#if TRACE_SAMPLE_EVERY > 0
+    static unsigned long requests;
+    unsigned long request = __atomic_fetch_add(&requests, 1, __ATOMIC_RELAXED);
+    if (request % TRACE_SAMPLE_EVERY != 0) return 0;
+
+    // Unique enough across processes and restarts; mixed so ids do not look sequential
+    uint64_t id = trace_now_us() ^ ((uint64_t)getpid() << 40) ^ request;
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return id ? id : 1;
+#else
+    return 0;
+#endif
+}
+
+// Start recording spans for a request on this thread (id 0: not traced)
+static inline void trace_begin(uint64_t id) {
+    trace_ring.id = id;
+    trace_ring.count = 0;
+    if (id) snprintf(trace_ring.tag, sizeof(trace_ring.tag), TRACE_TAG "%016llx", (unsigned long long)id);
+    else trace_ring.tag[0] = '\0';
+}
+
+static inline uint64_t trace_current(void) {
+    return trace_ring.id;
+}
+
+// Suffix to append to a message for a sub-server: " trace=<id>", or "" when not tracing
+static inline const char *trace_tag(void) {
+    return trace_ring.tag;
+}
+
+// Trace id carried by a request argument of the form "trace=<id>", or 0 if it is not one
+static inline uint64_t trace_tag_value(const char *argument) {
+    if (strncmp(argument, TRACE_TAG + 1, strlen(TRACE_TAG) - 1) != 0) return 0;
+    return strtoull(argument + strlen(TRACE_TAG) - 1, NULL, 16);
+}
+
+// Record a span that started at start_us and ends now
+static inline void trace_span(const char *name, uint64_t start_us) {
+    if (!trace_ring.id) return;
+    struct trace_span *span = &trace_ring.spans[trace_ring.count++ % TRACE_RING_SIZE];
+    span->name = name;
+    span->start_us = start_us;
+    span->end_us = trace_now_us();
+}
+
+// Append this thread's spans to TRACE_FILE and stop tracing. process_name labels the process
+// in the viewer.
+static inline void trace_flush(const char *process_name) {
+    if (!trace_ring.id) return;
+    int fd = open(TRACE_FILE, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        // First writer: publish the file with its opening bracket already in place
+        char temp_path[64];
+        snprintf(temp_path, sizeof(temp_path), TRACE_FILE ".%d.%lu", (int)getpid(), (unsigned long)syscall(SYS_gettid));
+        int temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (temp_fd >= 0) {
+            if (write(temp_fd, "[\n", 2) == 2) link(temp_path, TRACE_FILE);
+            close(temp_fd);
+            unlink(temp_path);
+        }
+        fd = open(TRACE_FILE, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        trace_begin(0);
+        return;
+    }
+
+    static pid_t named_pid;
+    int pid = getpid();
+    long tid = syscall(SYS_gettid);
+    unsigned first = trace_ring.count > TRACE_RING_SIZE ? trace_ring.count - TRACE_RING_SIZE : 0;
+    char buffer[(TRACE_RING_SIZE + 1) * 256];
+    size_t len = 0;
+    if (__atomic_exchange_n(&named_pid, pid, __ATOMIC_RELAXED) != pid) {
+        len += snprintf(buffer, sizeof(buffer),
+                        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                        pid, process_name);
+    }
+    for (unsigned i = first; i < trace_ring.count && len < sizeof(buffer); i++) {
+        const struct trace_span *span = &trace_ring.spans[i % TRACE_RING_SIZE];
+        len += snprintf(buffer + len, sizeof(buffer) - len,
+                        "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%ld,"
+                        "\"args\":{\"trace\":\"%016llx\"}},\n",
+                        span->name, (unsigned long long)span->start_us,
+                        (unsigned long long)(span->end_us - span->start_us), pid, tid,
+                        (unsigned long long)trace_ring.id);
+    }
+    if (len > sizeof(buffer)) len = sizeof(buffer);
+    if (write(fd, buffer, len) < 0) perror("Failed to write trace");
+    close(fd);
+    trace_begin(0);
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+// Local transport between Smain and co-located sub-servers.
+//
+// Besides their TCP port, Stext and Spdf listen on a Unix-domain socket. Smain tries that socket
+// first and falls back to TCP, so remote sub-servers keep working. Over the Unix socket a
+// sub-server can also answer OPEN requests by passing Smain an open descriptor (SCM_RIGHTS) for
+// the file, which Smain then sends to the client itself with sendfile() instead of relaying every
+// byte through a second socket.
+//
+// Descriptor replies are a single line, "OK <size> <offset> <mtime seconds> <mtime nanoseconds>\n"
+// with the descriptor attached, or "ERROR <message>\n" without one. The contents are the size bytes
+// at offset, so a sub-server can hand over its hot cache's arena as well as a stored file; the
+// mtime is the file's, for answering conditional requests. A descriptor into the arena is only
+// valid until Smain hangs up, so Smain closes the connection once it has sent the file.
+//
+// TCP connections to a sub-server are secured with TLS when it is built in (see tls_channel.h).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tls_channel.h"
+
+#define TRANSPORT_REPLY_MAX 256
+
+// Connect to a sub-server, preferring its Unix-domain socket. *is_local reports which was used.
+static inline int transport_connect(const char *socket_path, const char *server_ip, int server_port, int *is_local) {
+    *is_local = 0;
+    if (socket_path) {
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un local_addr = { .sun_family = AF_UNIX };
+        snprintf(local_addr.sun_path, sizeof(local_addr.sun_path), "%s", socket_path);
+        if (sock >= 0 && connect(sock, (struct sockaddr *)&local_addr, sizeof(local_addr)) == 0) {
+            *is_local = 1;
+            return sock;
+        }
+        if (sock >= 0) close(sock);
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    struct sockaddr_in serv_addr = { .sin_family = AF_INET, .sin_port = htons(server_port) };
+    inet_pton(AF_INET, server_ip, &serv_addr.sin_addr);
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return tls_channel_connect(sock, server_ip);
+}
+
+// Bind and listen on a Unix-domain socket, replacing a stale one left by an earlier run.
+// Only the owner may connect. Returns -1 if the socket cannot be set up.
+static inline int transport_listen_local(const char *socket_path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    struct sockaddr_un local_addr = { .sun_family = AF_UNIX };
+    snprintf(local_addr.sun_path, sizeof(local_addr.sun_path), "%s", socket_path);
+    unlink(socket_path);
+    mode_t old_mask = umask(077);
+    int bound = bind(sock, (struct sockaddr *)&local_addr, sizeof(local_addr));
+    umask(old_mask);
+    if (bound < 0 || listen(sock, SOMAXCONN) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Send an "OK" reply carrying fd
+static inline int transport_send_fd(int sock, int fd, off_t offset, off_t size, const struct timespec *mtime) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "OK %lld %lld %lld %ld\n", (long long)size, (long long)offset,
+                       (long long)mtime->tv_sec, mtime->tv_nsec);
+    struct iovec iov = { line, (size_t)len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+static inline int transport_send_error(int sock, const char *message) {
+    char line[TRANSPORT_REPLY_MAX];
+    int len = snprintf(line, sizeof(line), "ERROR %s\n", message);
+    return send(sock, line, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+// Receive a descriptor reply. Returns the descriptor (and where its contents are, and their
+// mtime), or -1 with the sub-server's message, or a description of what went wrong, in message.
+static inline int transport_recv_fd(int sock, off_t *offset, off_t *size, struct timespec *mtime, char *message, size_t message_size) {
+    char line[TRANSPORT_REPLY_MAX];
+    struct iovec iov = { line, sizeof(line) - 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (n <= 0) {
+        snprintf(message, message_size, "Sub-server closed the connection.");
+        return -1;
+    }
+    line[n] = '\0';
+    char *newline = strchr(line, '\n');
+    if (newline) *newline = '\0';
+
+    int fd = -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    long long announced, at, seconds;
+    long nanoseconds;
+    if (fd >= 0 && sscanf(line, "OK %lld %lld %lld %ld", &announced, &at, &seconds, &nanoseconds) == 4) {
+        *size = announced;
+        *offset = at;
+        mtime->tv_sec = seconds;
+        mtime->tv_nsec = nanoseconds;
+        return fd;
+    }
+    if (fd >= 0) close(fd);
+    snprintf(message, message_size, "%s", strncmp(line, "ERROR ", 6) == 0 ? line + 6 : "Unexpected reply from sub-server.");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,461 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+// Persistent trigram index behind the `search` command in Smain and Stext.
+//
+// Each indexed tree (smain/, stext/) keeps two files at its root:
+//   .trigram.idx  immutable base: file table, sorted trigram table and delta/varint coded
+//                 posting lists, laid out so it can be memory-mapped and used without parsing
+//   .trigram.log  append-only journal of "+ path" / "- path" lines written when ufile or
+//                 rmfile change a file
+// A query intersects the posting lists of every trigram in the pattern's required literal,
+// drops base entries the journal says have changed since, adds the journal's new or rewritten
+// files, and verifies the remaining candidates with the grep scanner. Without a required literal
+// of at least 3 bytes nothing narrows the search and every file is scanned. The base is rebuilt,
+// and the journal rotated, when it is missing or the journal passes TRIGRAM_LOG_REBUILD entries.
+
+#include "grep_scan.h"
+#include <errno.h>
+#include <time.h>
+
+#define TRIGRAM_INDEX_FILE ".trigram.idx"
+#define TRIGRAM_LOG_FILE ".trigram.log"
+#define TRIGRAM_MAGIC "TGI1"
+#define TRIGRAM_LOG_REBUILD 1024
+
+static pthread_mutex_t trigram_build_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct trigram_header {
+    char magic[4];
+    uint32_t doc_count;
+    uint32_t trigram_count;
+    uint32_t reserved;
+    uint64_t docs_offset;      // uint32_t string table offset of each document's path
+    uint64_t trigrams_offset;  // struct trigram_entry[trigram_count], sorted by trigram
+    uint64_t postings_offset;  // Varint-coded gaps between ascending document ids
+    uint64_t strings_offset;   // NUL-terminated paths relative to the tree root
+    uint64_t file_size;
+};
+
+struct trigram_entry {
+    uint32_t trigram;
+    uint32_t doc_count;
+    uint64_t postings;  // Offset of this posting list from postings_offset
+};
+
+// One path mentioned in the journal and the last operation recorded for it
+struct trigram_change {
+    char *path;
+    char op;
+};
+
+// Growable byte buffer used while building the index
+struct trigram_bytes {
+    uint8_t *data;
+    size_t len, cap;
+};
+
+static inline int trigram_bytes_reserve(struct trigram_bytes *bytes, size_t extra) {
+    if (bytes->len + extra <= bytes->cap) return 0;
+    size_t cap = bytes->cap ? bytes->cap : 4096;
+    while (cap < bytes->len + extra) cap *= 2;
+    uint8_t *grown = realloc(bytes->data, cap);
+    if (!grown) return -1;
+    bytes->data = grown;
+    bytes->cap = cap;
+    return 0;
+}
+
+static inline int trigram_put_varint(struct trigram_bytes *bytes, uint32_t value) {
+    if (trigram_bytes_reserve(bytes, 5) < 0) return -1;
+    while (value >= 0x80) {
+        bytes->data[bytes->len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes->data[bytes->len++] = (uint8_t)value;
+    return 0;
+}
+
+static inline int trigram_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static inline uint32_t trigram_at(const unsigned char *p) {
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+// Record that a file under root was added/rewritten ('+') or deleted ('-')
+static inline void trigram_index_note_change(const char *root, const char *relative_path, char op) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, TRIGRAM_LOG_FILE);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    char line[4096 + 4];
+    int len = snprintf(line, sizeof(line), "%c %s\n", op, relative_path);
+    if (len > 0 && len < (int)sizeof(line) && write(fd, line, len) != len) {
+        perror("Failed to journal index change");
+    }
+    close(fd);
+}
+
+// Build the base index for every file ending in ext under root and rotate the journal.
+// Returns 0 on success.
+static inline int trigram_index_build(const char *root, const char *ext) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return -1;
+
+    // Rotate the journal first: changes made while the tree is walked land in a fresh one
+    char log_path[4096], old_log_path[4096], temp_path[4096], index_path[4096];
+    snprintf(log_path, sizeof(log_path), "%s/%s", root, TRIGRAM_LOG_FILE);
+    snprintf(old_log_path, sizeof(old_log_path), "%s/%s.%d", root, TRIGRAM_LOG_FILE, (int)getpid());
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d", root, TRIGRAM_INDEX_FILE, (int)getpid());
+    snprintf(index_path, sizeof(index_path), "%s/%s", root, TRIGRAM_INDEX_FILE);
+    if (rename(log_path, old_log_path) != 0 && errno != ENOENT) {
+        perror("Failed to rotate index journal");
+    }
+
+    char **paths = NULL;
+    size_t doc_count = 0, cap = 0;
+    grep_collect_files(dup(root_fd), "", ext, &paths, &doc_count, &cap);
+
+    // Gather (trigram, document) pairs, deduplicating trigrams within a document with a 2^24-bit set
+    uint8_t *seen = calloc(1 << 21, 1);
+    uint32_t *doc_trigrams = NULL;
+    size_t doc_trigrams_cap = 0;
+    uint64_t *pairs = NULL;
+    size_t pair_count = 0, pair_cap = 0;
+    int failed = seen == NULL;
+
+    for (size_t d = 0; d < doc_count && !failed; d++) {
+        int fd = openat(root_fd, paths[d], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < 3) {
+            close(fd);
+            continue;
+        }
+        size_t size;
+        const unsigned char *data = seekable_map(fd, st.st_size, &size);
+        close(fd);
+        if (data == MAP_FAILED) continue;
+
+        size_t unique = 0;
+        for (size_t i = 0; i + 3 <= size; i++) {
+            uint32_t t = trigram_at(data + i);
+            if (seen[t >> 3] & (1 << (t & 7))) continue;
+            seen[t >> 3] |= 1 << (t & 7);
+            if (unique == doc_trigrams_cap) {
+                doc_trigrams_cap = doc_trigrams_cap ? doc_trigrams_cap * 2 : 4096;
+                uint32_t *grown = realloc(doc_trigrams, doc_trigrams_cap * sizeof(uint32_t));
+                if (!grown) {
+                    failed = 1;
+                    break;
+                }
+                doc_trigrams = grown;
+            }
+            doc_trigrams[unique++] = t;
+        }
+        munmap((void *)data, size);
+
+        if (!failed && pair_count + unique > pair_cap) {
+            while (pair_cap < pair_count + unique) pair_cap = pair_cap ? pair_cap * 2 : 65536;
+            uint64_t *grown = realloc(pairs, pair_cap * sizeof(uint64_t));
+            if (!grown) failed = 1;
+            else pairs = grown;
+        }
+        for (size_t i = 0; i < unique; i++) {
+            uint32_t t = doc_trigrams[i];
+            seen[t >> 3] &= ~(1 << (t & 7));
+            if (!failed) pairs[pair_count++] = ((uint64_t)t << 32) | (uint32_t)d;
+        }
+    }
+    free(seen);
+    free(doc_trigrams);
+
+    // Sorting by (trigram, document) lays out every posting list in ascending id order
+    if (!failed) qsort(pairs, pair_count, sizeof(uint64_t), trigram_compare_u64);
+
+    struct trigram_bytes entries = { 0 }, postings = { 0 }, strings = { 0 };
+    uint32_t *doc_offsets = calloc(doc_count + 1, sizeof(uint32_t));
+    uint32_t trigram_count = 0;
+    failed |= doc_offsets == NULL;
+    for (size_t i = 0; i < pair_count && !failed;) {
+        struct trigram_entry entry = { .trigram = (uint32_t)(pairs[i] >> 32), .doc_count = 0, .postings = postings.len };
+        uint32_t previous = 0;
+        for (; i < pair_count && (uint32_t)(pairs[i] >> 32) == entry.trigram; i++) {
+            uint32_t doc = (uint32_t)pairs[i];
+            failed |= trigram_put_varint(&postings, doc - previous) < 0;
+            previous = doc;
+            entry.doc_count++;
+        }
+        failed |= trigram_bytes_reserve(&entries, sizeof(entry)) < 0;
+        if (!failed) {
+            memcpy(entries.data + entries.len, &entry, sizeof(entry));
+            entries.len += sizeof(entry);
+            trigram_count++;
+        }
+    }
+    for (size_t d = 0; d < doc_count && !failed; d++) {
+        size_t len = strlen(paths[d]) + 1;
+        failed |= trigram_bytes_reserve(&strings, len) < 0;
+        if (!failed) {
+            doc_offsets[d] = (uint32_t)strings.len;
+            memcpy(strings.data + strings.len, paths[d], len);
+            strings.len += len;
+        }
+    }
+    free(pairs);
+
+    // Write the sections in order and swap the new base in atomically
+    struct trigram_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRIGRAM_MAGIC, 4);
+    header.doc_count = (uint32_t)doc_count;
+    header.trigram_count = trigram_count;
+    header.docs_offset = sizeof(header);
+    header.trigrams_offset = header.docs_offset + (uint64_t)doc_count * sizeof(uint32_t);
+    header.postings_offset = header.trigrams_offset + entries.len;
+    header.strings_offset = header.postings_offset + postings.len;
+    header.file_size = header.strings_offset + strings.len;
+
+    if (!failed) {
+        FILE *out = fopen(temp_path, "wb");
+        failed = out == NULL;
+        if (out) {
+            fwrite(&header, sizeof(header), 1, out);
+            fwrite(doc_offsets, sizeof(uint32_t), doc_count, out);
+            fwrite(entries.data, 1, entries.len, out);
+            fwrite(postings.data, 1, postings.len, out);
+            fwrite(strings.data, 1, strings.len, out);
+            failed = ferror(out) != 0;
+            failed |= fclose(out) != 0;
+        }
+        if (!failed && rename(temp_path, index_path) != 0) failed = 1;
+        if (failed) unlink(temp_path);
+    }
+    unlink(old_log_path);
+
+    free(doc_offsets);
+    free(entries.data);
+    free(postings.data);
+    free(strings.data);
+    for (size_t d = 0; d < doc_count; d++) free(paths[d]);
+    free(paths);
+    close(root_fd);
+    return failed ? -1 : 0;
+}
+
+// Load the journal, keeping only the most recent operation per path.
+// Returns the number of journal lines read (including superseded ones).
+static inline size_t trigram_load_log(const char *root, struct trigram_change **changes, size_t *change_count) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, TRIGRAM_LOG_FILE);
+    *changes = NULL;
+    *change_count = 0;
+    FILE *log = fopen(path, "r");
+    if (!log) return 0;
+
+    size_t lines = 0, cap = 0;
+    char line[4096 + 4];
+    while (fgets(line, sizeof(line), log)) {
+        size_t len = strlen(line);
+        if (len < 3 || line[len - 1] != '\n' || line[1] != ' ') continue;  // Skip a half-written tail
+        line[len - 1] = '\0';
+        lines++;
+
+        size_t i;
+        for (i = 0; i < *change_count; i++) {
+            if (strcmp((*changes)[i].path, line + 2) == 0) break;
+        }
+        if (i == *change_count) {
+            if (*change_count == cap) {
+                cap = cap ? cap * 2 : 64;
+                struct trigram_change *grown = realloc(*changes, cap * sizeof(**changes));
+                if (!grown) break;
+                *changes = grown;
+            }
+            (*changes)[i].path = strdup(line + 2);
+            (*change_count)++;
+        }
+        (*changes)[i].op = line[0];
+    }
+    fclose(log);
+    return lines;
+}
+
+// Decode a posting list of count ids
+static inline void trigram_decode(const uint8_t *p, uint32_t count, uint32_t *ids) {
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t value = 0;
+        int shift = 0;
+        while (*p & 0x80) {
+            value |= (uint32_t)(*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        value |= (uint32_t)*p++ << shift;
+        previous += value;
+        ids[i] = previous;
+    }
+}
+
+// Keep only the ids present in both sorted lists; returns the new length of ids
+static inline size_t trigram_intersect(uint32_t *ids, size_t count, const uint32_t *other, size_t other_count) {
+    size_t kept = 0, j = 0;
+    for (size_t i = 0; i < count && j < other_count; i++) {
+        while (j < other_count && other[j] < ids[i]) j++;
+        if (j < other_count && other[j] == ids[i]) ids[kept++] = ids[i];
+    }
+    return kept;
+}
+
+static inline const struct trigram_entry *trigram_lookup(const struct trigram_entry *entries, uint32_t count, uint32_t trigram) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (entries[mid].trigram < trigram) low = mid + 1;
+        else high = mid;
+    }
+    return low < count && entries[low].trigram == trigram ? &entries[low] : NULL;
+}
+
+// Scan every file ending in ext under root_fd, as grep does; *candidates_out receives the count
+static inline size_t trigram_full_scan(int root_fd, const char *ext, const char *label, const struct grep_pattern *pattern,
+                                       int out_fd, pthread_mutex_t *output_lock, size_t *candidates_out) {
+    char **paths = NULL;
+    size_t count = 0, cap = 0;
+    grep_collect_files(dup(root_fd), "", ext, &paths, &count, &cap);
+    size_t matches = grep_scan_paths(root_fd, paths, count, label, pattern, out_fd, output_lock);
+    *candidates_out = count;
+    for (size_t i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    return matches;
+}
+
+// Answer a search over the tree at root using the index, streaming verified matches to out_fd
+// exactly as grep does. Returns the number of matching lines; *candidates_out receives the
+// number of files that had to be opened. A pattern without a required literal of at least one
+// trigram, or a base index that cannot be read, falls back to scanning every file.
+static inline size_t trigram_index_search(const char *root, const char *ext, const char *label,
+                                          const struct grep_pattern *pattern, int out_fd,
+                                          pthread_mutex_t *output_lock, size_t *candidates_out) {
+    *candidates_out = 0;
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return 0;
+    if (pattern->literal_len < 3) {
+        size_t matches = trigram_full_scan(root_fd, ext, label, pattern, out_fd, output_lock, candidates_out);
+        close(root_fd);
+        return matches;
+    }
+
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s/%s", root, TRIGRAM_INDEX_FILE);
+    struct trigram_change *changes;
+    size_t change_count;
+    // One rebuild at a time: threads of a process share the temporary file names
+    pthread_mutex_lock(&trigram_build_lock);
+    size_t log_lines = trigram_load_log(root, &changes, &change_count);
+    if (access(index_path, F_OK) != 0 || log_lines > TRIGRAM_LOG_REBUILD) {
+        for (size_t i = 0; i < change_count; i++) free(changes[i].path);
+        free(changes);
+        trigram_index_build(root, ext);
+        trigram_load_log(root, &changes, &change_count);
+    }
+    pthread_mutex_unlock(&trigram_build_lock);
+
+    // Map the base index; a missing or damaged base simply contributes no candidates
+    const uint8_t *base = NULL;
+    size_t base_size = 0;
+    const struct trigram_header *header = NULL;
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct trigram_header)) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            base = NULL;
+        } else {
+            base_size = st.st_size;
+            header = (const struct trigram_header *)base;
+            if (memcmp(header->magic, TRIGRAM_MAGIC, 4) != 0 || header->file_size != base_size) header = NULL;
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (!header) {
+        for (size_t i = 0; i < change_count; i++) free(changes[i].path);
+        free(changes);
+        if (base) munmap((void *)base, base_size);
+        size_t matches = trigram_full_scan(root_fd, ext, label, pattern, out_fd, output_lock, candidates_out);
+        close(root_fd);
+        return matches;
+    }
+
+    // Intersect the posting lists of the literal's trigrams, rarest first
+    uint32_t *ids = NULL;
+    size_t id_count = 0;
+    const struct trigram_entry *entries = (const struct trigram_entry *)(base + header->trigrams_offset);
+    const struct trigram_entry *lists[GREP_PATTERN_MAX];
+    size_t list_count = 0;
+    int missing = 0;
+    for (size_t i = 0; i + 3 <= pattern->literal_len && !missing; i++) {
+        const struct trigram_entry *entry = trigram_lookup(entries, header->trigram_count,
+                                                           trigram_at((const unsigned char *)pattern->literal + i));
+        if (!entry) missing = 1;
+        else lists[list_count++] = entry;
+    }
+    for (size_t i = 1; i < list_count; i++) {
+        for (size_t j = i; j > 0 && lists[j]->doc_count < lists[j - 1]->doc_count; j--) {
+            const struct trigram_entry *swap = lists[j];
+            lists[j] = lists[j - 1];
+            lists[j - 1] = swap;
+        }
+    }
+
+    if (!missing) {
+        ids = malloc((lists[0]->doc_count + 1) * sizeof(uint32_t));
+        uint32_t *other = malloc((header->doc_count + 1) * sizeof(uint32_t));
+        if (ids && other) {
+            const uint8_t *postings = base + header->postings_offset;
+            trigram_decode(postings + lists[0]->postings, lists[0]->doc_count, ids);
+            id_count = lists[0]->doc_count;
+            for (size_t i = 1; i < list_count && id_count > 0; i++) {
+                trigram_decode(postings + lists[i]->postings, lists[i]->doc_count, other);
+                id_count = trigram_intersect(ids, id_count, other, lists[i]->doc_count);
+            }
+        } else {
+            id_count = 0;
+        }
+        free(other);
+    }
+
+    // Candidates: base hits the journal has not touched, plus every file the journal (re)added
+    char **candidates = malloc((id_count + change_count + 1) * sizeof(char *));
+    size_t candidate_count = 0;
+    if (candidates) {
+        const uint32_t *doc_offsets = (const uint32_t *)(base + header->docs_offset);
+        for (size_t i = 0; i < id_count; i++) {
+            char *path = (char *)(base + header->strings_offset + doc_offsets[ids[i]]);
+            int touched = 0;
+            for (size_t c = 0; c < change_count && !touched; c++) {
+                touched = strcmp(changes[c].path, path) == 0;
+            }
+            if (!touched) candidates[candidate_count++] = path;
+        }
+        for (size_t c = 0; c < change_count; c++) {
+            if (changes[c].op == '+') candidates[candidate_count++] = changes[c].path;
+        }
+    }
+
+    size_t matches = grep_scan_paths(root_fd, candidates, candidate_count, label, pattern, out_fd, output_lock);
+    *candidates_out = candidate_count;
+
+    free(candidates);
+    free(ids);
+    for (size_t i = 0; i < change_count; i++) free(changes[i].path);
+    free(changes);
+    if (base) munmap((void *)base, base_size);
+    close(root_fd);
+    return matches;
+}
+
+#endif
@@ -0,0 +1,362 @@
+#ifndef UPLOAD_SESSION_H
+#define UPLOAD_SESSION_H
+
+// Resumable upload sessions for Smain's udeclare and uchunk commands.
+//
+// A client declares a file (name, destination, size, chunk size and whole-file CRC32C) and then
+// sends its chunks in any order, over as many connections at once as it likes. The session is
+// named by the FNV-1a hash of the declaration, so a client that lost its connection, or was
+// restarted, gets the same session back by declaring the same file again, and is told which
+// chunks are still missing.
+//
+// A session is two files in UPLOAD_SESSION_DIR: "<id>.data", the file being assembled at its
+// full size, and "<id>.map", a header followed by every chunk's CRC32C and a bitmap of the
+// chunks held. Each connection maps the map with MAP_SHARED and sets bits atomically, so chunks
+// of one session can be written in parallel. A bit is set only once the chunk's bytes and
+// CRC32C are on disk: after a crash the map may have forgotten a chunk, but never claims one it
+// does not have. When the last bit is set one connection wins the commit claim, checks the chunk
+// checksums joined together against the declared CRC32C and moves the file into place. The claim
+// names its owner's pid and start time, so a claim left by a server that died while committing
+// is taken over by the next connection to find the session complete.
+// Sessions nobody has touched for UPLOAD_SESSION_TTL seconds are removed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+
+#define UPLOAD_SESSION_DIR ".uploads"
+#define UPLOAD_SESSION_MIN_CHUNK (64 * 1024)
+#define UPLOAD_SESSION_MAX_CHUNK (64 * 1024 * 1024)
+#define UPLOAD_SESSION_MAX_CHUNKS (1 << 20)
+#ifndef UPLOAD_SESSION_TTL
+#define UPLOAD_SESSION_TTL (7 * 24 * 3600)
+#endif
+#define UPLOAD_SESSION_ID_LEN 16
+#define UPLOAD_SESSION_NAME_MAX 256
+#define UPLOAD_SESSION_PATH_MAX 1024
+#define UPLOAD_SESSION_MAGIC 0x55534553  // "USES"
+
+// Start of the map, followed by uint32_t chunk_crc[chunks] and the bitmap of chunks held
+struct upload_session_header {
+    uint32_t magic;
+    uint32_t chunk_size;
+    uint64_t size;
+    uint32_t chunks;
+    uint32_t crc;                // Declared CRC32C of the whole file
+    uint64_t committer;          // Process committing the file (see upload_session_owner), 0 if none
+    char filename[UPLOAD_SESSION_NAME_MAX];
+    char destination[UPLOAD_SESSION_PATH_MAX];
+};
+
+struct upload_session {
+    char id[UPLOAD_SESSION_ID_LEN + 1];
+    struct upload_session_header *header;
+    uint32_t *chunk_crc;
+    unsigned char *bitmap;
+    size_t map_size;
+    int data_fd;
+};
+
+static int upload_session_dir_fd = -1;
+static pthread_once_t upload_session_dir_once = PTHREAD_ONCE_INIT;
+
+static void upload_session_open_dir(void) {
+    if (mkdir(UPLOAD_SESSION_DIR, 0700) < 0 && errno != EEXIST) return;
+    upload_session_dir_fd = open(UPLOAD_SESSION_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// The session directory below the working directory, created on first use; -1 if unusable
+static inline int upload_session_dir(void) {
+    pthread_once(&upload_session_dir_once, upload_session_open_dir);
+    return upload_session_dir_fd;
+}
+
+static inline uint32_t upload_session_chunk_count(uint64_t size, uint32_t chunk_size) {
+    return (uint32_t)((size + chunk_size - 1) / chunk_size);
+}
+
+static inline size_t upload_session_map_size(uint32_t chunks) {
+    return sizeof(struct upload_session_header) + (size_t)chunks * sizeof(uint32_t) + (chunks + 7) / 8;
+}
+
+// Bytes in a chunk: chunk_size, except for a shorter last one
+static inline uint32_t upload_session_chunk_length(const struct upload_session *session, uint32_t index) {
+    uint64_t offset = (uint64_t)index * session->header->chunk_size;
+    uint64_t left = session->header->size - offset;
+    return left < session->header->chunk_size ? (uint32_t)left : session->header->chunk_size;
+}
+
+// Why a declaration cannot become a session, or NULL if it can
+static inline const char *upload_session_check(const char *filename, const char *destination, uint64_t size, uint32_t chunk_size) {
+    if (strlen(filename) >= UPLOAD_SESSION_NAME_MAX || strlen(destination) >= UPLOAD_SESSION_PATH_MAX) return "name too long";
+    if (filename[0] == '\0' || strstr(filename, "..") != NULL) return "invalid file name";
+    if (chunk_size < UPLOAD_SESSION_MIN_CHUNK || chunk_size > UPLOAD_SESSION_MAX_CHUNK) return "unsupported chunk size";
+    if (size == 0 || upload_session_chunk_count(size, chunk_size) > UPLOAD_SESSION_MAX_CHUNKS) return "unsupported file size";
+    return NULL;
+}
+
+// Session id for a declaration
+static inline void upload_session_id(const char *filename, const char *destination, uint64_t size, uint32_t chunk_size,
+                                     uint32_t crc, char id[UPLOAD_SESSION_ID_LEN + 1]) {
+    char declaration[UPLOAD_SESSION_NAME_MAX + UPLOAD_SESSION_PATH_MAX + 64];
+    snprintf(declaration, sizeof(declaration), "%s\n%s\n%llu\n%u\n%08x", filename, destination,
+             (unsigned long long)size, chunk_size, crc);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *p = declaration; *p; p++) hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+    snprintf(id, UPLOAD_SESSION_ID_LEN + 1, "%016llx", (unsigned long long)hash);
+}
+
+static inline int upload_session_valid_id(const char *id) {
+    if (strlen(id) != UPLOAD_SESSION_ID_LEN) return 0;
+    return strspn(id, "0123456789abcdef") == UPLOAD_SESSION_ID_LEN;
+}
+
+// Open the session named id. Opening it counts as activity, so it is not swept meanwhile.
+// Returns 0, or -1 if there is no such session.
+static inline int upload_session_open(struct upload_session *session, const char *id) {
+    int dir_fd = upload_session_dir();
+    if (dir_fd < 0 || !upload_session_valid_id(id)) return -1;
+    char name[UPLOAD_SESSION_ID_LEN + 8];
+    snprintf(name, sizeof(name), "%s.map", id);
+    int map_fd = openat(dir_fd, name, O_RDWR | O_CLOEXEC);
+    if (map_fd < 0) return -1;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(map_fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct upload_session_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+    }
+    futimens(map_fd, NULL);
+    close(map_fd);
+    if (map == MAP_FAILED) return -1;
+    struct upload_session_header *header = map;
+    if (header->magic != UPLOAD_SESSION_MAGIC || header->chunks == 0 || header->chunks > UPLOAD_SESSION_MAX_CHUNKS ||
+        upload_session_map_size(header->chunks) != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), "%s.data", id);
+    session->data_fd = openat(dir_fd, name, O_RDWR | O_CLOEXEC);
+    if (session->data_fd < 0) {
+        // The file was committed or swept; the map is on its way out too
+        if (errno == ENOENT) {
+            snprintf(name, sizeof(name), "%s.map", id);
+            unlinkat(dir_fd, name, 0);
+        }
+        munmap(map, st.st_size);
+        return -1;
+    }
+    snprintf(session->id, sizeof(session->id), "%s", id);
+    session->header = header;
+    session->chunk_crc = (uint32_t *)(header + 1);
+    session->bitmap = (unsigned char *)(session->chunk_crc + header->chunks);
+    session->map_size = st.st_size;
+    return 0;
+}
+
+static inline void upload_session_close(struct upload_session *session) {
+    if (session->header) munmap(session->header, session->map_size);
+    if (session->data_fd >= 0) close(session->data_fd);
+    session->header = NULL;
+    session->data_fd = -1;
+}
+
+// Open the session for a declaration (see upload_session_check()), creating it the first time.
+// The map is written under a temporary name and linked into place, so a connection declaring the
+// same file at the same moment either finds the finished map or creates its own and loses the
+// race to link it. Returns 0, or -1 with errno set.
+static inline int upload_session_declare(struct upload_session *session, const char *filename, const char *destination,
+                                         uint64_t size, uint32_t chunk_size, uint32_t crc) {
+    char id[UPLOAD_SESSION_ID_LEN + 1];
+    upload_session_id(filename, destination, size, chunk_size, crc, id);
+    if (upload_session_open(session, id) == 0) return 0;
+    int dir_fd = upload_session_dir();
+    if (dir_fd < 0) return -1;
+
+    char name[UPLOAD_SESSION_ID_LEN + 8], temp_name[UPLOAD_SESSION_ID_LEN + 48];
+    static unsigned long temp_id;
+    snprintf(name, sizeof(name), "%s.data", id);
+    int data_fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (data_fd < 0) return -1;
+    int failed = ftruncate(data_fd, size) != 0;
+    close(data_fd);
+
+    struct upload_session_header header = { .magic = UPLOAD_SESSION_MAGIC, .chunk_size = chunk_size, .size = size,
+                                            .chunks = upload_session_chunk_count(size, chunk_size), .crc = crc };
+    snprintf(header.filename, sizeof(header.filename), "%s", filename);
+    snprintf(header.destination, sizeof(header.destination), "%s", destination);
+    snprintf(temp_name, sizeof(temp_name), "%s.map.%d.%lu", id, (int)getpid(), __atomic_add_fetch(&temp_id, 1, __ATOMIC_RELAXED));
+    int map_fd = failed ? -1 : openat(dir_fd, temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (map_fd < 0) return -1;
+    failed = ftruncate(map_fd, upload_session_map_size(header.chunks)) != 0 ||
+             pwrite(map_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fsync(map_fd) != 0;
+    close(map_fd);
+    snprintf(name, sizeof(name), "%s.map", id);
+    if (!failed && linkat(dir_fd, temp_name, dir_fd, name, 0) != 0 && errno != EEXIST) failed = 1;
+    unlinkat(dir_fd, temp_name, 0);
+    if (failed) return -1;
+    return upload_session_open(session, id);
+}
+
+static inline int upload_session_has(const struct upload_session *session, uint32_t index) {
+    return (__atomic_load_n(&session->bitmap[index / 8], __ATOMIC_ACQUIRE) >> (index % 8)) & 1;
+}
+
+static inline uint32_t upload_session_held(const struct upload_session *session) {
+    uint32_t held = 0;
+    for (size_t i = 0; i < (session->header->chunks + 7) / 8; i++) {
+        held += __builtin_popcount(__atomic_load_n(&session->bitmap[i], __ATOMIC_ACQUIRE));
+    }
+    return held;
+}
+
+// Record a chunk whose bytes have been written to the data file, syncing them and its CRC32C
+// before its bit is set. Returns 1 if the session now holds every chunk, 0 if not, -1 if the
+// chunk could not be made durable.
+static inline int upload_session_mark(struct upload_session *session, uint32_t index, uint32_t crc) {
+    if (fdatasync(session->data_fd) != 0) return -1;
+    session->chunk_crc[index] = crc;
+    long page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t page = (uintptr_t)&session->chunk_crc[index] & ~(uintptr_t)(page_size - 1);
+    if (msync((void *)page, (uintptr_t)&session->chunk_crc[index] + sizeof(uint32_t) - page, MS_SYNC) != 0) return -1;
+    __atomic_fetch_or(&session->bitmap[index / 8], (unsigned char)(1u << (index % 8)), __ATOMIC_ACQ_REL);
+    return upload_session_held(session) == session->header->chunks;
+}
+
+// Start time of a process in clock ticks since boot, the 22nd field of /proc/<pid>/stat; 0 if unknown
+static inline uint64_t upload_session_process_start(pid_t pid) {
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    stat[n] = '\0';
+    // The command name may contain spaces; the fields after it start with the third
+    char *p = strrchr(stat, ')');
+    for (int field = 2; field < 22 && p; field++) p = strchr(p + 1, ' ');
+    return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+// Owner of a claim: the pid, with the low 32 bits of its start time above it so that a reused
+// pid is not mistaken for the process that made the claim
+static inline uint64_t upload_session_owner(pid_t pid) {
+    return (upload_session_process_start(pid) << 32) | (uint32_t)pid;
+}
+
+// Whether the process that made a claim is still running (this one always is)
+static inline int upload_session_owner_alive(uint64_t owner) {
+    pid_t pid = (pid_t)(uint32_t)owner;
+    if (pid == getpid()) return 1;
+    if (pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH)) return 0;
+    return upload_session_owner(pid) == owner;
+}
+
+// Claim the right to commit a complete session; only one connection gets it. A claim whose owner
+// has died is taken over.
+static inline int upload_session_claim(struct upload_session *session) {
+    uint64_t owner = __atomic_load_n(&session->header->committer, __ATOMIC_ACQUIRE);
+    if (owner != 0 && upload_session_owner_alive(owner)) return 0;
+    return __atomic_compare_exchange_n(&session->header->committer, &owner, upload_session_owner(getpid()), 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Give the claim back after a commit that can be tried again
+static inline void upload_session_release(struct upload_session *session) {
+    __atomic_store_n(&session->header->committer, 0, __ATOMIC_RELEASE);
+}
+
+// Whether the chunks' CRC32Cs, joined in order, give the declared whole-file CRC32C
+static inline int upload_session_verify(const struct upload_session *session) {
+    const struct upload_session_header *header = session->header;
+    uint32_t chunk_op[32], last_op[32];
+    crc32c_zeros_operator(chunk_op, header->chunk_size);
+    crc32c_zeros_operator(last_op, upload_session_chunk_length(session, header->chunks - 1));
+    uint32_t crc = session->chunk_crc[0];
+    for (uint32_t i = 1; i < header->chunks; i++) {
+        crc = crc32c_combine(crc, session->chunk_crc[i], i == header->chunks - 1 ? last_op : chunk_op);
+    }
+    return crc == header->crc;
+}
+
+// The chunks still missing as ranges, "0-9,12,15-20", cut short with "..." if they do not fit
+static inline void upload_session_missing(const struct upload_session *session, char *out, size_t out_size) {
+    size_t len = 0;
+    out[0] = '\0';
+    uint32_t chunks = session->header->chunks;
+    for (uint32_t i = 0; i < chunks; i++) {
+        if (upload_session_has(session, i)) continue;
+        uint32_t last = i;
+        while (last + 1 < chunks && !upload_session_has(session, last + 1)) last++;
+        char range[32];
+        int n = last > i ? snprintf(range, sizeof(range), "%s%u-%u", len ? "," : "", i, last)
+                         : snprintf(range, sizeof(range), "%s%u", len ? "," : "", i);
+        if (len + n + 4 >= out_size) {
+            snprintf(out + len, out_size - len, "%s...", len ? "," : "");
+            return;
+        }
+        memcpy(out + len, range, n + 1);
+        len += n;
+        i = last;
+    }
+    if (len == 0) snprintf(out, out_size, "none");
+}
+
+// Path of a session's data file relative to the working directory, to rename it into place
+static inline void upload_session_data_path(const char *id, char *out, size_t out_size) {
+    snprintf(out, out_size, "%s/%s.data", UPLOAD_SESSION_DIR, id);
+}
+
+// Delete a session's files (the data file may already have been moved into place)
+static inline void upload_session_remove(const char *id) {
+    int dir_fd = upload_session_dir();
+    if (dir_fd < 0 || !upload_session_valid_id(id)) return;
+    char name[UPLOAD_SESSION_ID_LEN + 8];
+    snprintf(name, sizeof(name), "%s.map", id);
+    unlinkat(dir_fd, name, 0);
+    snprintf(name, sizeof(name), "%s.data", id);
+    unlinkat(dir_fd, name, 0);
+}
+
+// Delete the files of sessions untouched for UPLOAD_SESSION_TTL, and leftovers of interrupted
+// declarations
+static inline void upload_session_sweep(void) {
+    int dir_fd = upload_session_dir();
+    int scan_fd = dir_fd < 0 ? -1 : dup(dir_fd);
+    DIR *dir = scan_fd < 0 ? NULL : fdopendir(scan_fd);
+    if (!dir) {
+        if (scan_fd >= 0) close(scan_fd);
+        return;
+    }
+    time_t cutoff = time(NULL) - UPLOAD_SESSION_TTL;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (entry->d_name[0] == '.' || fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (!S_ISREG(st.st_mode) || st.st_mtime >= cutoff) continue;
+        // A data file goes with its map; one whose map is gone is a leftover
+        const char *dot = strchr(entry->d_name, '.');
+        if (dot && strcmp(dot, ".data") == 0) {
+            char map_name[NAME_MAX + 1];
+            snprintf(map_name, sizeof(map_name), "%.*s.map", (int)(dot - entry->d_name), entry->d_name);
+            if (fstatat(dir_fd, map_name, &st, 0) == 0 && st.st_mtime >= cutoff) continue;
+        }
+        unlinkat(dir_fd, entry->d_name, 0);
+    }
+    closedir(dir);
+}
+
+#endif
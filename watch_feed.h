@@ -0,0 +1,499 @@
+#ifndef WATCH_FEED_H
+#define WATCH_FEED_H
+
+// Change feed behind the `watch` command.
+//
+// Stext and Spdf follow their trees with inotify (struct tree_watch): one watch per directory,
+// added as directories appear, so a change costs one event and an idle tree costs nothing. Each
+// reports "<op> <path>" lines to Smain over a single NOTIFY connection, op being '+' (created),
+// '~' (modified), '-' (deleted) or '!' (events were lost, re-list the tree). Created and
+// modified are told apart by the set of files the watcher knows about, since a file renamed
+// over an existing one looks the same to inotify either way.
+//
+// Smain collects those lines and its own changes to the .c tree in a struct watch_feed. Changes
+// to one path within WATCH_COALESCE_MS are merged (create then modify is a create, create then
+// delete is nothing) before they get sequence numbers and go into a ring of the last
+// WATCH_HISTORY events, from which every subscriber reads at its own pace. Sequence numbers
+// start from the time Smain started, so a position from before a restart is always older than
+// the ring and the subscriber is told to resync instead of silently missing changes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define WATCH_HISTORY 4096              // Published events kept for subscribers to catch up from
+#define WATCH_COALESCE_MS 50            // Changes to a path within this window become one event
+#define WATCH_PENDING_BUCKETS 1024
+#define WATCH_PENDING_MAX 65536         // Pending paths that force an early flush
+#define WATCH_PATH_MAX 4096
+#define WATCH_DIR_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                        IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// Name of a change for subscribers
+static inline const char *watch_op_name(char op) {
+    switch (op) {
+    case '+': return "create";
+    case '~': return "modify";
+    case '-': return "delete";
+    default: return "resync";
+    }
+}
+
+// FNV-1a, for the file set and the pending table
+static inline uint64_t watch_hash(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// A path in a chained hash table, used for the files a tree_watch knows and the changes a
+// watch_feed has pending
+struct watch_name {
+    struct watch_name *next;        // Next in the bucket
+    struct watch_name *order_next;  // Next pending change, in arrival order
+    char op;
+    char path[];
+};
+
+struct watch_name_table {
+    struct watch_name **buckets;
+    size_t bucket_count;            // Power of two
+    size_t count;
+};
+
+static inline int watch_table_init(struct watch_name_table *table, size_t bucket_count) {
+    table->buckets = calloc(bucket_count, sizeof(*table->buckets));
+    table->bucket_count = bucket_count;
+    table->count = 0;
+    return table->buckets ? 0 : -1;
+}
+
+static inline struct watch_name **watch_table_slot(struct watch_name_table *table, const char *path) {
+    struct watch_name **slot = &table->buckets[watch_hash(path) & (table->bucket_count - 1)];
+    while (*slot && strcmp((*slot)->path, path) != 0) slot = &(*slot)->next;
+    return slot;
+}
+
+// Double the buckets once the chains average two names
+static inline void watch_table_grow(struct watch_name_table *table) {
+    if (table->count < table->bucket_count * 2) return;
+    size_t bucket_count = table->bucket_count * 2;
+    struct watch_name **buckets = calloc(bucket_count, sizeof(*buckets));
+    if (!buckets) return;
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        struct watch_name *name = table->buckets[i];
+        while (name) {
+            struct watch_name *next = name->next;
+            struct watch_name **slot = &buckets[watch_hash(name->path) & (bucket_count - 1)];
+            name->next = *slot;
+            *slot = name;
+            name = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = bucket_count;
+}
+
+// Find path, adding it (with op 0) if create is set and it is missing
+static inline struct watch_name *watch_table_get(struct watch_name_table *table, const char *path, int create) {
+    struct watch_name **slot = watch_table_slot(table, path);
+    if (*slot || !create) return *slot;
+    size_t len = strlen(path);
+    struct watch_name *name = malloc(sizeof(*name) + len + 1);
+    if (!name) return NULL;
+    name->next = NULL;
+    name->order_next = NULL;
+    name->op = 0;
+    memcpy(name->path, path, len + 1);
+    *slot = name;
+    table->count++;
+    watch_table_grow(table);
+    return name;
+}
+
+// Unlink path from its bucket and return it for the caller to free, or NULL if it is missing
+static inline struct watch_name *watch_table_take(struct watch_name_table *table, const char *path) {
+    struct watch_name **slot = watch_table_slot(table, path);
+    struct watch_name *name = *slot;
+    if (name) {
+        *slot = name->next;
+        table->count--;
+    }
+    return name;
+}
+
+static inline void watch_table_free(struct watch_name_table *table) {
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        struct watch_name *name = table->buckets[i];
+        while (name) {
+            struct watch_name *next = name->next;
+            free(name);
+            name = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    table->count = 0;
+}
+
+// An inotify watch over every directory below root, reporting files ending in suffix
+struct tree_watch {
+    int fd;                         // inotify descriptor
+    char root[WATCH_PATH_MAX];
+    const char *suffix;
+    char **dirs;                    // Directory below root (relative, "" for root) by watch descriptor
+    int dir_count;
+    struct watch_name_table files;  // Relative paths of the files known to exist
+};
+
+// Called for every change with its op and path relative to the root
+typedef void (*tree_watch_emit)(void *context, char op, const char *path);
+
+static inline int tree_watch_wanted(const struct tree_watch *watch, const char *name) {
+    size_t len = strlen(name), suffix_len = strlen(watch->suffix);
+    return len > suffix_len && strcmp(name + len - suffix_len, watch->suffix) == 0 && !strchr(name, '\n');
+}
+
+static inline void tree_watch_join(char *out, size_t out_size, const char *dir, const char *name) {
+    snprintf(out, out_size, "%s%s%s", dir, dir[0] ? "/" : "", name);
+}
+
+// Note a file as existing. Returns the op to report: '+' if it is new, '~' if it was known.
+static inline char tree_watch_saw_file(struct tree_watch *watch, const char *path) {
+    size_t before = watch->files.count;
+    watch_table_get(&watch->files, path, 1);
+    return watch->files.count > before ? '+' : '~';
+}
+
+static inline int tree_watch_forget_file(struct tree_watch *watch, const char *path) {
+    struct watch_name *name = watch_table_take(&watch->files, path);
+    if (!name) return 0;
+    free(name);
+    return 1;
+}
+
+// Watch a directory (relative to the root) and everything below it. The files found are
+// reported as created when emit is set: they may have appeared before the watch was in place.
+static inline void tree_watch_add_dir(struct tree_watch *watch, const char *relative, tree_watch_emit emit, void *context) {
+    char full[WATCH_PATH_MAX * 2];
+    snprintf(full, sizeof(full), "%s%s%s", watch->root, relative[0] ? "/" : "", relative);
+    int wd = inotify_add_watch(watch->fd, full, WATCH_DIR_MASK);
+    if (wd < 0) return;
+    if (wd >= watch->dir_count) {
+        int count = wd + 64;
+        char **dirs = realloc(watch->dirs, count * sizeof(*dirs));
+        if (!dirs) return;
+        memset(dirs + watch->dir_count, 0, (count - watch->dir_count) * sizeof(*dirs));
+        watch->dirs = dirs;
+        watch->dir_count = count;
+    }
+    free(watch->dirs[wd]);
+    watch->dirs[wd] = strdup(relative);
+
+    DIR *dir = opendir(full);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[WATCH_PATH_MAX];
+        tree_watch_join(child, sizeof(child), relative, entry->d_name);
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            char child_full[WATCH_PATH_MAX * 2];
+            tree_watch_join(child_full, sizeof(child_full), watch->root, child);
+            is_dir = lstat(child_full, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            tree_watch_add_dir(watch, child, emit, context);
+        } else if (tree_watch_wanted(watch, entry->d_name)) {
+            char op = tree_watch_saw_file(watch, child);
+            if (emit && op == '+') emit(context, op, child);
+        }
+    }
+    closedir(dir);
+}
+
+// Start watching root. The initial walk is the only pass over the whole tree.
+static inline int tree_watch_open(struct tree_watch *watch, const char *root, const char *suffix) {
+    memset(watch, 0, sizeof(*watch));
+    snprintf(watch->root, sizeof(watch->root), "%s", root);
+    watch->suffix = suffix;
+    watch->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watch->fd < 0 || watch_table_init(&watch->files, 1024) < 0) return -1;
+    mkdir(root, 0755);
+    tree_watch_add_dir(watch, "", NULL, NULL);
+    return watch->dirs ? 0 : -1;
+}
+
+// Report the files below a directory that moved away, which inotify says nothing more about
+static inline void tree_watch_drop_dir(struct tree_watch *watch, const char *relative, tree_watch_emit emit, void *context) {
+    size_t len = strlen(relative);
+    for (size_t i = 0; i < watch->files.bucket_count; i++) {
+        struct watch_name **slot = &watch->files.buckets[i];
+        while (*slot) {
+            struct watch_name *name = *slot;
+            if (strncmp(name->path, relative, len) == 0 && name->path[len] == '/') {
+                emit(context, '-', name->path);
+                *slot = name->next;
+                watch->files.count--;
+                free(name);
+            } else {
+                slot = &name->next;
+            }
+        }
+    }
+}
+
+// Read the events waiting on the inotify descriptor and report them. Returns 0, or -1 if the
+// watch has failed.
+static inline int tree_watch_read(struct tree_watch *watch, tree_watch_emit emit, void *context) {
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(watch->fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(*event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                emit(context, '!', "");
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= watch->dir_count || !watch->dirs[event->wd]) continue;
+            if (event->mask & IN_IGNORED) {
+                free(watch->dirs[event->wd]);
+                watch->dirs[event->wd] = NULL;
+                continue;
+            }
+            if (!event->len) continue;
+
+            char path[WATCH_PATH_MAX];
+            tree_watch_join(path, sizeof(path), watch->dirs[event->wd], event->name);
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    tree_watch_add_dir(watch, path, emit, context);
+                } else if (event->mask & IN_MOVED_FROM) {
+                    tree_watch_drop_dir(watch, path, emit, context);
+                }
+                continue;
+            }
+            if (!tree_watch_wanted(watch, event->name)) continue;
+            if (event->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                emit(context, tree_watch_saw_file(watch, path), path);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (tree_watch_forget_file(watch, path)) emit(context, '-', path);
+            }
+        }
+    }
+    return len < 0 && errno != EAGAIN && errno != EINTR ? -1 : 0;
+}
+
+static inline void tree_watch_close(struct tree_watch *watch) {
+    if (watch->fd >= 0) close(watch->fd);
+    for (int i = 0; i < watch->dir_count; i++) free(watch->dirs[i]);
+    free(watch->dirs);
+    watch_table_free(&watch->files);
+}
+
+// Lines on their way from a sub-server's watch to Smain
+struct tree_watch_lines {
+    int sock;
+    int failed;
+    size_t len;
+    char data[64 * 1024];
+};
+
+static inline void tree_watch_lines_flush(struct tree_watch_lines *lines) {
+    size_t sent = 0;
+    while (!lines->failed && sent < lines->len) {
+        ssize_t n = send(lines->sock, lines->data + sent, lines->len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) lines->failed = 1;
+        else sent += n;
+    }
+    lines->len = 0;
+}
+
+static inline void tree_watch_lines_emit(void *context, char op, const char *path) {
+    struct tree_watch_lines *lines = context;
+    if (sizeof(lines->data) - lines->len < strlen(path) + 4) tree_watch_lines_flush(lines);
+    lines->len += snprintf(lines->data + lines->len, sizeof(lines->data) - lines->len, "%c %s\n", op, path);
+}
+
+// Serve a NOTIFY request: say "ready" once the tree is being watched, then send its changes as
+// they happen until the peer hangs up. Returns -1 if the tree could not be watched.
+static inline int tree_watch_stream(int sock, const char *root, const char *suffix) {
+    struct tree_watch watch;
+    if (tree_watch_open(&watch, root, suffix) < 0) {
+        tree_watch_close(&watch);
+        return -1;
+    }
+
+    struct tree_watch_lines lines = { .sock = sock };
+    lines.len = snprintf(lines.data, sizeof(lines.data), "ready\n");
+    tree_watch_lines_flush(&lines);
+    struct pollfd fds[2] = { { watch.fd, POLLIN, 0 }, { sock, POLLIN, 0 } };
+    while (!lines.failed) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // The peer sends nothing after its request, so anything readable means it has gone
+        if (fds[1].revents) break;
+        if (fds[0].revents && tree_watch_read(&watch, tree_watch_lines_emit, &lines) < 0) break;
+        tree_watch_lines_flush(&lines);
+    }
+    tree_watch_close(&watch);
+    return 0;
+}
+
+// A published change
+struct watch_event {
+    uint64_t seq;
+    char op;
+    char *path;
+};
+
+struct watch_feed {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;            // Broadcast when events are published
+    pthread_cond_t noted;              // Signalled when a change arrives with nothing pending
+    uint64_t next_seq;                 // Sequence number the next event will get
+    uint64_t first_seq;                // Oldest sequence number still in the ring
+    struct watch_event ring[WATCH_HISTORY];
+    struct watch_name_table pending;   // Changes not yet published, merged per path
+    struct watch_name *pending_head;   // The same, in arrival order
+    struct watch_name **pending_tail;
+    int lost;                          // A source lost events; publish a resync with the next flush
+    unsigned long long published;      // Events given a sequence number
+    unsigned long long coalesced;      // Changes merged into an earlier one or cancelled out
+};
+
+static inline int watch_feed_init(struct watch_feed *feed) {
+    memset(feed, 0, sizeof(*feed));
+    pthread_mutex_init(&feed->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&feed->changed, &attr);
+    pthread_cond_init(&feed->noted, NULL);
+    pthread_condattr_destroy(&attr);
+    feed->next_seq = feed->first_seq = (uint64_t)time(NULL) << 20;
+    feed->pending_tail = &feed->pending_head;
+    return watch_table_init(&feed->pending, WATCH_PENDING_BUCKETS);
+}
+
+// What a pending change and a newer one to the same path amount to; 0 if they cancel out
+static inline char watch_merge(char older, char newer) {
+    if (older == '+') return newer == '-' ? 0 : '+';
+    if (older == '-') return newer == '-' ? '-' : '~';
+    if (older == '~') return newer == '-' ? '-' : '~';
+    return newer;  // Cancelled earlier: the path starts afresh
+}
+
+static inline void watch_feed_publish(struct watch_feed *feed, char op, const char *path) {
+    struct watch_event *event = &feed->ring[feed->next_seq % WATCH_HISTORY];
+    if (feed->next_seq - feed->first_seq == WATCH_HISTORY) feed->first_seq++;
+    free(event->path);
+    event->seq = feed->next_seq++;
+    feed->published++;
+    event->op = op;
+    event->path = strdup(path);
+    if (!event->path) event->op = '!';
+}
+
+// Give the pending changes sequence numbers and wake the subscribers. Call with the lock held.
+static inline void watch_feed_flush_locked(struct watch_feed *feed) {
+    if (!feed->pending_head && !feed->lost) return;
+    struct watch_name *name = feed->pending_head;
+    while (name) {
+        struct watch_name *next = name->order_next;
+        watch_table_take(&feed->pending, name->path);
+        if (name->op) watch_feed_publish(feed, name->op, name->path);
+        free(name);
+        name = next;
+    }
+    feed->pending_head = NULL;
+    feed->pending_tail = &feed->pending_head;
+    if (feed->lost) {
+        watch_feed_publish(feed, '!', "");
+        feed->lost = 0;
+    }
+    pthread_cond_broadcast(&feed->changed);
+}
+
+static inline void watch_feed_flush(struct watch_feed *feed) {
+    pthread_mutex_lock(&feed->lock);
+    watch_feed_flush_locked(feed);
+    pthread_mutex_unlock(&feed->lock);
+}
+
+// Record a change, merging it with a pending change to the same path. '!' marks lost events.
+static inline void watch_feed_note(struct watch_feed *feed, char op, const char *path) {
+    pthread_mutex_lock(&feed->lock);
+    if (!feed->pending_head && !feed->lost) pthread_cond_signal(&feed->noted);
+    if (op == '!') {
+        feed->lost = 1;
+    } else {
+        size_t before = feed->pending.count;
+        struct watch_name *name = watch_table_get(&feed->pending, path, 1);
+        if (!name) {
+            feed->lost = 1;
+        } else if (feed->pending.count > before) {
+            name->op = op;
+            *feed->pending_tail = name;
+            feed->pending_tail = &name->order_next;
+        } else {
+            name->op = watch_merge(name->op, op);
+            feed->coalesced++;
+        }
+        if (feed->pending.count >= WATCH_PENDING_MAX) watch_feed_flush_locked(feed);
+    }
+    pthread_mutex_unlock(&feed->lock);
+}
+
+// One round of the flusher: wait for a change, give the burst it may start WATCH_COALESCE_MS to
+// settle, then publish it. An idle feed costs nothing.
+static inline void watch_feed_flush_next(struct watch_feed *feed) {
+    pthread_mutex_lock(&feed->lock);
+    while (!feed->pending_head && !feed->lost) pthread_cond_wait(&feed->noted, &feed->lock);
+    pthread_mutex_unlock(&feed->lock);
+    struct timespec window = { 0, WATCH_COALESCE_MS * 1000000L };
+    nanosleep(&window, NULL);
+    watch_feed_flush(feed);
+}
+
+// Format the events from *cursor on into out as "<seq> <op> <path>" lines, advancing *cursor
+// past those that fit. Returns the bytes written, or -1 if *cursor has already left the ring
+// (or never was in it), in which case the subscriber has to resync. Call with the lock held.
+static inline ssize_t watch_feed_format_locked(const struct watch_feed *feed, uint64_t *cursor, char *out, size_t out_size) {
+    if (*cursor < feed->first_seq || *cursor > feed->next_seq) return -1;
+    size_t used = 0;
+    while (*cursor < feed->next_seq) {
+        const struct watch_event *event = &feed->ring[*cursor % WATCH_HISTORY];
+        const char *path = event->op != '!' && event->path ? event->path : "";
+        int n = snprintf(out + used, out_size - used, "%llu %s%s%s\n", (unsigned long long)event->seq,
+                         watch_op_name(event->op), path[0] ? " " : "", path);
+        if (n < 0 || (size_t)n >= out_size - used) break;
+        used += n;
+        (*cursor)++;
+    }
+    return used;
+}
+
+#endif